@@ -32,6 +32,10 @@ Ethernet Pinout:
 
 //general --------------------------------
 #define SERIAL_BAUD   115200
+// Uncomment to be the radio of the Pi gateway on the USB serial port, instead of publishing over
+// Ethernet; see piGateway/serialrfm69.h. The debug output must then stay off.
+//#define SERIAL_MODEM
+#define MODEM_BAUD    500000 // exact with a 16 MHz crystal
 #if 0
 #define DEBUG1(expression)  Serial.print(expression)
 #define DEBUG2(expression, arg)  Serial.print(expression, arg)
@@ -44,6 +48,7 @@ Ethernet Pinout:
 //RFM69  ----------------------------------
 #include <RFM69.h>
 #include <SPI.h>
+#include <util/atomic.h>
 #define NODEID        1    //unique for each node on same network
 #define NETWORKID     101  //the same on all nodes that talk to each other
 #define FREQUENCY   RF69_433MHZ
@@ -53,9 +58,12 @@ Ethernet Pinout:
 #define IS_RFM69HW    //uncomment only for RFM69HW! Leave out if you have RFM69W!
 #define ACK_TIME      30 // max # of ms to wait for an ack
 #define RFM69_SS  8
-RFM69 radio(RFM69_SS);
 bool promiscuousMode = false; //set to 'true' to sniff all packets on the same network
 
+//use LED for indicating MQTT connection status, or the modem configured.
+int led = 13;
+
+#ifndef SERIAL_MODEM
 #include <Ethernet.h>
 
 //Ethernet
@@ -73,14 +81,13 @@ EthernetClient ethClient;
 PubSubClient client(server, 1883, callback, ethClient);
 #define MQTT_CLIENT_ID "arduinoClient"
 #define MQTT_RETRY 500
-int sendMQTT = 0;
-
-void MQTTSendInt(PubSubClient* _client, int node, int sensor, int var, int val);
-void MQTTSendULong(PubSubClient* _client, int node, int sensor, int var, unsigned long val);
-void MQTTSendFloat(PubSubClient* _client, int node, int sensor, int var, float val);
+#define MQTT_RETRY_MAX 30000      // the delay between two attempts doubles up to it
+#define MQTT_CONNECT_TIMEOUT 500  // ms for the TCP connection, an attempt blocks no longer
+#define MQTT_SOCKET_TIMEOUT 1     // s for the broker to answer
 
-//use LED for indicating MQTT connection status.
-int led = 13;
+boolean MQTTSendInt(PubSubClient* _client, int node, int sensor, int var, int val);
+boolean MQTTSendULong(PubSubClient* _client, int node, int sensor, int var, unsigned long val);
+boolean MQTTSendFloat(PubSubClient* _client, int node, int sensor, int var, float val);
 
 typedef struct {		
   int                   nodeID; 
@@ -90,22 +97,51 @@ typedef struct {
   float			var3_float;	
 } 
 Payload;
-Payload theData;
 
-volatile struct 
-{
-  int                   nodeID;
-  int			sensorID;		
-  unsigned long         var1_usl;
-  float                 var2_float;
-  float			var3_float;		//
-  int                   var4_int;
-} 
-SensorNode;
+// Frames received, queued in SRAM by the radio interrupt --------
+// The readings wait here while the broker cannot be reached, and are published in order once it
+// is back. When the queue is full, the new readings are dropped: the interrupt never touches the
+// readings being published.
+#define READING_QUEUE 16
+#define ACK_QUEUE 4
+typedef struct {
+  Payload data;
+  int rssi;
+}
+QueuedReading;
+
+// The library reads a frame in its interrupt handler, then stops listening until receiveDone()
+// is called. Here the handler queues the reading, and the node to acknowledge, and listens again
+// at once. The Ethernet library holds the radio interrupt during its SPI transactions.
+class QueuedRFM69 :
+public RFM69 {
+public:
+  QueuedRFM69(byte slaveSelectPin) : RFM69(slaveSelectPin) {}
+  boolean Peek(QueuedReading *reading);  // the oldest reading, false if none
+  void Pop();
+  boolean NextAck(byte *node);           // the next node waiting for its ACK
+  void SendAck(byte node);
+  unsigned int lost;                     // readings dropped, the queue being full
+  unsigned int invalid;                  // frames not matching the Payload struct
+
+protected:
+  void interruptHandler();
+
+private:
+  QueuedReading readings[READING_QUEUE];
+  volatile byte readingHead;
+  volatile byte readingCount;
+  byte acks[ACK_QUEUE];
+  volatile byte ackHead;
+  volatile byte ackCount;
+};
+
+QueuedRFM69 radio(RFM69_SS);
 
 void setup() 
 {
   Serial.begin(SERIAL_BAUD); 
+  pinMode(led, OUTPUT);
 
   //Ethernet -------------------------
   //Ethernet.begin(mac, ip);
@@ -127,10 +163,9 @@ void setup()
   DEBUGLN1();
 
   // Mosquitto ------------------------------
-  while (client.connect(MQTT_CLIENT_ID) != 1) {
-    DEBUGLN1("Error connecting to MQTT");
-    delay(MQTT_RETRY);
-  }
+  // connected by loop(), the readings received meanwhile are queued
+  ethClient.setConnectionTimeout(MQTT_CONNECT_TIMEOUT);
+  client.setSocketTimeout(MQTT_SOCKET_TIMEOUT);
 
   //RFM69 ---------------------------
   radio.initialize(FREQUENCY,NODEID,NETWORKID);
@@ -139,6 +174,7 @@ void setup()
 #endif
   radio.encrypt(ENCRYPTKEY);
   radio.promiscuous(promiscuousMode);
+  radio.receiveDone();  // out of standby: the frames come through interruptHandler() from now on
   char buff[50];
   sprintf(buff, "\nListening at %d Mhz...", FREQUENCY==RF69_433MHZ ? 433 : FREQUENCY==RF69_868MHZ ? 868 : 915);
   DEBUGLN1(buff);
@@ -146,157 +182,174 @@ void setup()
   DEBUGLN1("setup complete");
 }  // end of setup
 
-byte ackCount=0;
-long watchdogInterval = 2000;
-long watchdog = 0;
-
-void loop() {
-
-  // calling client.loop too often block the system at some point quite early (~up to 5 loop)
-  // Here is a temporized call to it on a regular interval
-  // This need to be as fast as the fastest sensor received
-  if (millis() > watchdog) {
-    //    Serial.print("loop "); 
-    //    Serial.println(millis());
-    watchdog += watchdogInterval;
-    //client.loop needs to run every iteration.  Previous version did not.  Big opps.
-    client.loop();
+/////////////////////////////
+// Radio
+/////////////////////////////
+void QueuedRFM69::interruptHandler() {
+  RFM69::interruptHandler();
+  // reset by the library when the frame is not for this gateway
+  if (PAYLOADLEN == 0)
+    return;
+  if (DATALEN != sizeof(Payload)) {
+    invalid++;
   }
-
-  if (radio.receiveDone()) {
-    DEBUG1('[');
-    DEBUG2(radio.SENDERID, DEC);
-    DEBUG1("] ");
-    if (promiscuousMode) {
-      DEBUG1("to [");
-      DEBUG2(radio.TARGETID, DEC);
-      DEBUG1("] ");
-    }
-    DEBUGLN1();
-
-    if (radio.DATALEN != sizeof(Payload))
-      Serial.println(F("Invalid payload received, not matching Payload struct!"));
-    else {
-      theData = *(Payload*)radio.DATA; //assume radio.DATA actually contains our struct and not something else
-
-      //save it for i2c:
-      SensorNode.nodeID = theData.nodeID;
-      SensorNode.sensorID = theData.sensorID;
-      SensorNode.var1_usl = theData.var1_usl;
-      SensorNode.var2_float = theData.var2_float;
-      SensorNode.var3_float = theData.var3_float;
-      SensorNode.var4_int = radio.RSSI;
-
-      DEBUG1("Received Device ID = ");
-      DEBUGLN1(SensorNode.sensorID);  
-      DEBUG1 ("    Time = ");
-      DEBUGLN1 (SensorNode.var1_usl);
-      DEBUG1 ("    var2_float ");
-      DEBUGLN1 (SensorNode.var2_float);
-      DEBUG1 ("    var3_float ");
-      DEBUGLN1 (SensorNode.var3_float);
-      DEBUG1 ("    RSSI ");
-      DEBUGLN1 (SensorNode.var4_int);
-
-      sendMQTT = 1;
+  else if (readingCount < READING_QUEUE) {
+    QueuedReading *r = &readings[(readingHead + readingCount) % READING_QUEUE];
+    r->data = *(Payload*)DATA;
+    r->rssi = RSSI;
+    readingCount++;
+    // only a reading kept is acknowledged, and only when sent to this gateway: otherwise
+    // the node sends it again, or logs it
+    if (ACK_REQUESTED && TARGETID == _address && TARGETID != RF69_BROADCAST_ADDR && ackCount < ACK_QUEUE) {
+      acks[(ackHead + ackCount) % ACK_QUEUE] = SENDERID;
+      ackCount++;
     }
+  }
+  else {
+    lost++;
+  }
+  receiveBegin();
+}
 
+boolean QueuedRFM69::Peek(QueuedReading *reading) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (readingCount == 0)
+      return false;
+    *reading = readings[readingHead];
+  }
+  return true;
+}
 
-    if (radio.ACK_REQUESTED)
-    {
-      byte theNodeID = radio.SENDERID;
-      radio.sendACK();
-
-      // When a node requests an ACK, respond to the ACK
-      // and also send a packet requesting an ACK (every 3rd one only)
-      // This way both TX/RX NODE functions are tested on 1 end at the GATEWAY
-      if (ackCount++%3==0)
-      {
-        //Serial.print(" Pinging node ");
-        //Serial.print(theNodeID);
-        //Serial.print(" - ACK...");
-        //delay(3); //need this when sending right after reception .. ?
-        //if (radio.sendWithRetry(theNodeID, "ACK TEST", 8, 0))  // 0 = only 1 attempt, no retries
-        //  Serial.print("ok!");
-        //else Serial.print("nothing");
-      }
-    }//end if radio.ACK_REQESTED
-  } //end if radio.receive
-
-  if (sendMQTT == 1) {
-    DEBUGLN1("starting MQTT send");
-
-    if (!client.connected()) {
-      while (client.connect(MQTT_CLIENT_ID) != 1)
-      {
-        digitalWrite(led, LOW);
-        DEBUGLN1("Error connecting to MQTT");
-        delay(500);
-        digitalWrite(led, HIGH);
-      }
-      client.publish("outTopic","hello world");
-    } 
+void QueuedRFM69::Pop() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    readingHead = (readingHead + 1) % READING_QUEUE;
+    readingCount--;
+  }
+}
 
-    digitalWrite(led, HIGH);
+boolean QueuedRFM69::NextAck(byte *node) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (ackCount == 0)
+      return false;
+    *node = acks[ackHead];
+    ackHead = (ackHead + 1) % ACK_QUEUE;
+    ackCount--;
+  }
+  return true;
+}
 
-    int varnum;
-    char buff_topic[6];
-    char buff_message[12];      
+void QueuedRFM69::SendAck(byte node) {
+  unsigned long start = millis();
+  while (!canSend() && millis() - start < RF69_CSMA_LIMIT_MS)
+    receiveDone();
+  sendFrame(node, "", 0, false, true);
+  receiveDone();  // listen again
+}
 
-    /*
-      //send var1_usl
-     varnum = 2;
-     buff_topic[6];
-     buff_message[12];
-     sprintf(buff_topic, "%02d%01d%01d", SensorNode.nodeID, SensorNode.sensorID, varnum);
-     Serial.println(buff_topic);
-     dtostrf (SensorNode.var1_usl, 10, 1, buff_message);
-     client.publish(buff_topic, buff_message);
-     */
+/////////////////////////////
+// MQTT
+/////////////////////////////
+// The broker is connected again in the background, one attempt at a time, with a delay doubled on
+// each failure. An attempt blocks for the socket timeouts at most, the radio interrupt still
+// queues the frames received meanwhile.
+unsigned long mqttRetryDelay = MQTT_RETRY;
+unsigned long mqttNextAttempt = 0;
+
+void mqttMaintain() {
+  if (client.connected()) {
+    client.loop();
+    return;
+  }
+  digitalWrite(led, LOW);
+  if ((long)(millis() - mqttNextAttempt) < 0)
+    return;
 
-    //send var1_usl
-    MQTTSendULong(&client, SensorNode.nodeID, SensorNode.sensorID, 1, SensorNode.var1_usl);
+  if (client.connect(MQTT_CLIENT_ID)) {
+    DEBUGLN1("MQTT connected");
+    digitalWrite(led, HIGH);
+    mqttRetryDelay = MQTT_RETRY;
+    client.publish("outTopic","hello world");
+  }
+  else {
+    DEBUGLN1("Error connecting to MQTT");
+    mqttNextAttempt = millis() + mqttRetryDelay;
+    mqttRetryDelay = min(mqttRetryDelay * 2, (unsigned long)MQTT_RETRY_MAX);
+  }
+}
 
+// false if the connection was lost on the way, the reading is then published again
+boolean publishReading(QueuedReading *reading) {
+  Payload *data = &reading->data;
+  DEBUG1("Received Device ID = ");
+  DEBUGLN1(data->sensorID);  
+  DEBUG1 ("    Time = ");
+  DEBUGLN1 (data->var1_usl);
+  DEBUG1 ("    var2_float ");
+  DEBUGLN1 (data->var2_float);
+  DEBUG1 ("    var3_float ");
+  DEBUGLN1 (data->var3_float);
+  DEBUG1 ("    RSSI ");
+  DEBUGLN1 (reading->rssi);
+
+  //send var1_usl
+  return MQTTSendULong(&client, data->nodeID, data->sensorID, 1, data->var1_usl)
     //send var2_float
-    MQTTSendFloat(&client, SensorNode.nodeID, SensorNode.sensorID, 2, SensorNode.var2_float);
-
+    && MQTTSendFloat(&client, data->nodeID, data->sensorID, 2, data->var2_float)
     //send var3_float
-    MQTTSendFloat(&client, SensorNode.nodeID, SensorNode.sensorID, 3, SensorNode.var3_float);
-
+    && MQTTSendFloat(&client, data->nodeID, data->sensorID, 3, data->var3_float)
     //send var4_int, RSSI
-    MQTTSendInt(&client, SensorNode.nodeID, SensorNode.sensorID, 4, SensorNode.var4_int);
+    && MQTTSendInt(&client, data->nodeID, data->sensorID, 4, reading->rssi);
+}
 
-    sendMQTT = 0;
-    DEBUGLN1("finished MQTT send");
-    digitalWrite(led, LOW);
-  }//end if sendMQTT
+void loop() {
+  // DHCP lease renewal
+  Ethernet.maintain();
+
+  // every turn, or connect again when its time has come
+  mqttMaintain();
+
+  // the nodes wait for their ACK
+  byte node;
+  while (radio.NextAck(&node)) {
+    DEBUG1("ACK to [");
+    DEBUG2(node, DEC);
+    DEBUGLN1("]");
+    radio.SendAck(node);
+  }
+
+  // one reading per turn, the connection keeps being serviced
+  QueuedReading reading;
+  if (client.connected() && radio.Peek(&reading)) {
+    if (publishReading(&reading))
+      radio.Pop();
+  }
 }//end loop
 
-void MQTTSendInt(PubSubClient* _client, int node, int sensor, int var, int val) {
+boolean MQTTSendInt(PubSubClient* _client, int node, int sensor, int var, int val) {
   char buff_topic[6];
   char buff_message[7];
 
   sprintf(buff_topic, "%02d%01d%01d", node, sensor, var);
   sprintf(buff_message, "%04d%", val);
-  _client->publish(buff_topic, buff_message);
+  return _client->publish(buff_topic, buff_message);
 }
 
-void MQTTSendULong(PubSubClient* _client, int node, int sensor, int var, unsigned long val) {
+boolean MQTTSendULong(PubSubClient* _client, int node, int sensor, int var, unsigned long val) {
   char buff_topic[6];
   char buff_message[12];
 
   sprintf(buff_topic, "%02d%01d%01d", node, sensor, var);
   sprintf(buff_message, "%u", val);
-  _client->publish(buff_topic, buff_message);
+  return _client->publish(buff_topic, buff_message);
 }
 
-void MQTTSendFloat(PubSubClient* _client, int node, int sensor, int var, float val) {
+boolean MQTTSendFloat(PubSubClient* _client, int node, int sensor, int var, float val) {
   char buff_topic[6];
   char buff_message[12];
 
   sprintf(buff_topic, "%02d%01d%01d", node, sensor, var);
   dtostrf (val, 2, 1, buff_message);
-  _client->publish(buff_topic, buff_message);
+  return _client->publish(buff_topic, buff_message);
 }
 
 // Handing of Mosquitto messages
@@ -304,8 +357,345 @@ void callback(char* topic, byte* payload, unsigned int length) {
   // handle message arrived
   DEBUGLN1(F("Mosquitto Callback"));
 }
+#endif // SERIAL_MODEM
+
+/////////////////////////////
+// Serial modem
+/////////////////////////////
+#ifdef SERIAL_MODEM
+// The Pi gateway decodes and publishes, this is only its radio; piGateway/serialrfm69.h gives the
+// protocol. The radio interrupt queues the frames, the loop sends them to the host in batches, COBS
+// encoded. The loop never waits on the serial port: it writes what the transmit buffer takes, and
+// keeps reading the commands of the host, which would overflow the 64 bytes receive buffer otherwise.
+#include <util/crc16.h>
+
+#define MODEM_VERSION 1
+#define MODEM_HELLO 'H'
+#define MODEM_FRAMES 'F'
+#define MODEM_CONFIGURE 'C'
+#define MODEM_TRANSMIT 'T'
+#define MODEM_FLAG_HIGH_POWER 0x01
+#define MODEM_FLAG_PROMISCUOUS 0x02
+#define MODEM_FLAG_AUTO_ACK 0x04
+#define MODEM_FLAG_ENCRYPT 0x08
+#define MODEM_FRAMES_HEADER 8       // type, done, lost, time
+#define MODEM_RECORD_HEADER 9       // length, sender, target, CTL, RSSI, time
+#define MODEM_QUEUE 8               // frames waiting for the serial port
+#define MODEM_ACKS 4                // nodes waiting for their ACK
+#define MODEM_BATCH 200             // bytes of a batch, before encoding
+#define MODEM_COMMAND 72            // largest command, COBS encoded
+#define MODEM_HELLO_INTERVAL 1000   // until the host configures the radio
+#define MODEM_CSMA_LIMIT 100        // ms waiting for a clear channel, the host waits 500 ms for a command
+
+typedef struct {
+  byte len;
+  byte sender;
+  byte target;
+  byte ctl;
+  int8_t rssi;
+  unsigned long time;   // micros() at the reception
+  byte data[RF69_MAX_DATA_LEN];
+}
+ModemFrame;
+
+class ModemRFM69 :
+public RFM69 {
+public:
+  ModemRFM69(byte slaveSelectPin) : RFM69(slaveSelectPin) {}
+  boolean Peek(ModemFrame **frame);   // the oldest frame, left in the queue until Pop()
+  void Pop();
+  boolean NextAck(byte *node);
+  void Transmit(byte node, byte ctl, const void *data, byte len);
+  unsigned int Lost();
+  boolean autoAck;                    // answer the ACK requests without the host
+
+protected:
+  void interruptHandler();
+
+private:
+  ModemFrame frames[MODEM_QUEUE];
+  volatile byte head;
+  volatile byte count;
+  volatile unsigned int lost;         // frames dropped, the queue being full; wraps, as on the wire
+  byte acks[MODEM_ACKS];
+  volatile byte ackHead;
+  volatile byte ackCount;
+};
+
+ModemRFM69 radio(RFM69_SS);
+boolean configured = false;
+byte commandsDone = 0;                // tells the host it can send the next command
+boolean doneDue = false;              // a batch is sent, even without frame
+unsigned long lastHello = 0;
+
+void ModemRFM69::interruptHandler() {
+  RFM69::interruptHandler();
+  // reset by the library when the frame is not for this gateway
+  if (PAYLOADLEN == 0)
+    return;
+  if (autoAck && ACK_REQUESTED && TARGETID == _address && ackCount < MODEM_ACKS) {
+    acks[(ackHead + ackCount) % MODEM_ACKS] = SENDERID;
+    ackCount++;
+  }
+  if (count < MODEM_QUEUE) {
+    ModemFrame *f = &frames[(head + count) % MODEM_QUEUE];
+    f->len = DATALEN;
+    f->sender = SENDERID;
+    f->target = TARGETID;
+    f->ctl = (ACK_RECEIVED ? RFM69_CTL_SENDACK : 0) | (ACK_REQUESTED ? RFM69_CTL_REQACK : 0);
+    f->rssi = RSSI;
+    f->time = micros();
+    memcpy(f->data, (const void*)DATA, DATALEN);
+    count++;
+  }
+  else {
+    lost++;
+  }
+  receiveBegin();
+}
 
+boolean ModemRFM69::Peek(ModemFrame **frame) {
+  // the interrupt only writes behind the frames queued
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (count == 0)
+      return false;
+    *frame = &frames[head];
+  }
+  return true;
+}
 
+void ModemRFM69::Pop() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    head = (head + 1) % MODEM_QUEUE;
+    count--;
+  }
+}
+
+boolean ModemRFM69::NextAck(byte *node) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (ackCount == 0)
+      return false;
+    *node = acks[ackHead];
+    ackHead = (ackHead + 1) % MODEM_ACKS;
+    ackCount--;
+  }
+  return true;
+}
+
+unsigned int ModemRFM69::Lost() {
+  unsigned int n;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n = lost;
+  }
+  return n;
+}
+
+void ModemRFM69::Transmit(byte node, byte ctl, const void *data, byte len) {
+  unsigned long start = millis();
+  while (!canSend() && millis() - start < MODEM_CSMA_LIMIT)
+    receiveDone();
+  sendFrame(node, data, len, ctl & RFM69_CTL_REQACK, ctl & RFM69_CTL_SENDACK);
+  receiveDone();  // listen again
+}
+
+// Packet to the host, COBS encoded on the fly -------
+byte out[MODEM_BATCH + MODEM_BATCH / 254 + 6];
+byte outLen = 0;
+byte outSent = 0;
+byte codeAt;
+byte code;
+uint16_t outCrc;
+
+void putRaw(byte b) {
+  if (b == 0) {
+    out[codeAt] = code;
+    codeAt = outLen++;
+    code = 1;
+    return;
+  }
+  out[outLen++] = b;
+  if (++code == 0xFF) {
+    out[codeAt] = code;
+    codeAt = outLen++;
+    code = 1;
+  }
+}
+
+void put(byte b) {
+  outCrc = _crc_ccitt_update(outCrc, b);
+  putRaw(b);
+}
+
+void put32(unsigned long v) {
+  for (byte i = 0; i < 4; i++) {
+    put(v & 0xFF);
+    v >>= 8;
+  }
+}
+
+void packetStart(byte type) {
+  outLen = 1;
+  outSent = 0;
+  codeAt = 0;
+  code = 1;
+  outCrc = 0xFFFF;
+  put(type);
+}
+
+void packetEnd() {
+  uint16_t crc = outCrc;
+  putRaw(crc & 0xFF);
+  putRaw(crc >> 8);
+  out[codeAt] = code;
+  out[outLen++] = 0;
+}
 
+// true once the whole packet is in the transmit buffer
+boolean flushOut() {
+  while (outSent < outLen) {
+    int room = Serial.availableForWrite();
+    if (room <= 0)
+      return false;
+    byte n = min(room, outLen - outSent);
+    Serial.write(out + outSent, n);
+    outSent += n;
+  }
+  return true;
+}
+
+// As many frames as fit in a batch: one packet for several frames when they come faster than
+// the serial port takes them
+void sendBatch() {
+  ModemFrame *f;
+  if (!radio.Peek(&f) && !doneDue)
+    return;
+  packetStart(MODEM_FRAMES);
+  put(commandsDone);
+  unsigned int lost = radio.Lost();
+  put(lost & 0xFF);
+  put(lost >> 8);
+  put32(micros());
+  int size = MODEM_FRAMES_HEADER;
+  while (radio.Peek(&f) && size + MODEM_RECORD_HEADER + f->len <= MODEM_BATCH) {
+    put(f->len);
+    put(f->sender);
+    put(f->target);
+    put(f->ctl);
+    put(f->rssi);
+    put32(f->time);
+    for (byte i = 0; i < f->len; i++)
+      put(f->data[i]);
+    size += MODEM_RECORD_HEADER + f->len;
+    radio.Pop();
+  }
+  packetEnd();
+  doneDue = false;
+}
+
+void sendHello() {
+  packetStart(MODEM_HELLO);
+  put(MODEM_VERSION);
+  packetEnd();
+  lastHello = millis();
+}
 
+// Commands of the host ------------------------------
+byte in[MODEM_COMMAND];
+byte inLen = 0;
+boolean inOverflow = false;
+
+// in place, -1 for an invalid packet
+int cobsDecode(byte *buf, int len) {
+  int i = 0;
+  int o = 0;
+  while (i < len) {
+    byte c = buf[i++];
+    if (c == 0 || i + c - 1 > len)
+      return -1;
+    for (byte k = 1; k < c; k++)
+      buf[o++] = buf[i++];
+    if (c < 0xFF && i < len)
+      buf[o++] = 0;
+  }
+  return o;
+}
 
+void runCommand(byte *p, int len) {
+  switch (p[0]) {
+  case MODEM_CONFIGURE:
+    if (len < 21)
+      break;
+    radio.initialize(p[1], p[2], p[3]);
+    if (p[4] & MODEM_FLAG_HIGH_POWER)
+      radio.setHighPower();
+    radio.encrypt((p[4] & MODEM_FLAG_ENCRYPT) ? (const char*)p + 5 : 0);
+    radio.promiscuous(p[4] & MODEM_FLAG_PROMISCUOUS);
+    radio.autoAck = p[4] & MODEM_FLAG_AUTO_ACK;
+    radio.receiveDone();  // initialize() leaves the radio in standby
+    configured = true;
+    digitalWrite(led, HIGH);
+    break;
+  case MODEM_TRANSMIT:
+    // not before the radio is set up
+    if (len < 3 || !configured)
+      break;
+    radio.Transmit(p[1], p[2], p + 3, min(len - 3, RF69_MAX_DATA_LEN));
+    break;
+  }
+  // counted even when ignored, the host is waiting for it
+  commandsDone++;
+  doneDue = true;
+}
+
+void readCommands() {
+  while (Serial.available()) {
+    byte b = Serial.read();
+    if (b != 0) {
+      if (inLen < sizeof(in))
+        in[inLen++] = b;
+      else
+        inOverflow = true;
+      continue;
+    }
+    int len = inOverflow ? -1 : cobsDecode(in, inLen);
+    inLen = 0;
+    inOverflow = false;
+    if (len < 3)
+      continue;
+    uint16_t crc = 0xFFFF;
+    for (int i = 0; i < len - 2; i++)
+      crc = _crc_ccitt_update(crc, in[i]);
+    // a damaged command is never counted, the host takes it as lost
+    if (crc == (in[len - 2] | (uint16_t)in[len - 1] << 8))
+      runCommand(in, len - 2);
+  }
+}
+
+void setup() {
+  Serial.begin(MODEM_BAUD);
+  pinMode(led, OUTPUT);
+  digitalWrite(led, LOW);
+  // the radio is set up by the host
+  sendHello();
+}
+
+void loop() {
+  readCommands();
+
+  // the nodes wait for their ACK
+  byte node;
+  while (radio.NextAck(&node))
+    radio.Transmit(node, RFM69_CTL_SENDACK, "", 0);
+
+  // the next packet once the previous one is in the transmit buffer
+  if (flushOut()) {
+    if (!configured) {
+      if (millis() - lastHello > MODEM_HELLO_INTERVAL)
+        sendHello();
+    }
+    else
+      sendBatch();
+    flushOut();
+  }
+}
+#endif // SERIAL_MODEM
@@ -37,6 +37,7 @@
 //RFM69  --------------------------------------------------------------------------------------------------
 #include <RFM69.h>
 #include <SPI.h>
+#include <util/atomic.h>
 #define NODEID        13    //unique for each node on same network
 #define NETWORKID     101  //the same on all nodes that talk to each other
 #define GATEWAYID     1
@@ -63,10 +64,118 @@ typedef struct {
 Payload;
 Payload theData;
 
+// compact readings, decoded by the piGateway only: comment out with the Arduino Gateway
+#define COMPACT_PAYLOAD
+
+// see piGateway/compact.h for the format
+#define COMPACT_MARKER 0xFF   // the first byte of a Payload is the node ID: from 0xFC up, never a node ID, a marker
+#define COMPACT_VAR1 0x01
+#define COMPACT_VAR2 0x02
+#define COMPACT_VAR3 0x04
+#define COMPACT_KEY  0x80
+#define COMPACT_SCALE 100     // var2 and var3 sent in hundredths
+#define COMPACT_KEY_INTERVAL 16  // absolute values at least every 16 readings
+#define COMPACT_MAX_RECORD 18  // sensor, flags, sequence and 3 varints of 5 bytes
+
+// state of the compact encoding of a sensor
+typedef struct {
+  byte seq;             // sequence of the last reading sent
+  byte sinceKey;        // readings sent since the last absolute one
+  boolean synced;       // the last reading was acknowledged, the next one can be a delta
+  unsigned long var1;   // last reading acknowledged
+  long var2;
+  long var3;
+  unsigned long next1;  // reading waiting for its ACK
+  long next2;
+  long next3;
+} 
+CompactSensor;
+CompactSensor statSensor;
+CompactSensor dhtSensor;
+
+// group commands, see piGateway/group.h: one broadcast frame for every node of a group
+#define GROUP_MARKER  0xFD    // a reserved node ID, as COMPACT_MARKER
+#define GROUP_COMMAND 'C'
+#define GROUP_ANSWER  'A'
+#define GROUP_HEADER  18      // marker, type, group, sequence, sensor, var1, var2, var3, count of the nodes to answer
+#define GROUP_SLOT    10      // ms per answer, in the order of the nodes listed
+#define GROUP_COPIES  2000    // ms during which the copies of a command are not applied again
+const byte groups[] = { 1 };  // groups of this node, set on the gateway with NWC_GROUPS
+byte groupSequence[sizeof(groups)];            // last command applied, for each group
+unsigned long groupTime[sizeof(groups)];
+
+// relay role, for a mains powered node: see piGateway/relay.h. Always listening, the node answers
+// the ACKs and forwards the frames of the nodes the gateway gives it, and hands them its messages
+//#define RELAY_NODE
+#define RELAY_MARKER  0xFC    // a reserved node ID, as COMPACT_MARKER
+#define RELAY_UPLINK  'U'     // node, hops, RSSI, then the frame of the node
+#define RELAY_REPORT  'R'     // entries of the table, count, then ID and RSSI of each node heard
+#define RELAY_DOWNLINK 'D'    // node, hops, then the frame for the node
+#define RELAY_TABLE   'T'     // count, then ID and next hop of each node served
+#define RELAY_UPLINK_HEADER 5
+#define RELAY_DOWNLINK_HEADER 4
+#define RELAY_TABLE_MAX 29
+#define RELAY_HEARD   24      // nodes in a report
+#define RELAY_RECENT  16      // frames remembered against the copies
+#define RELAY_DUPLICATE 2000  // ms during which a copy is not forwarded
+#define RELAY_QUEUE   3       // frames waiting to be forwarded
+#define RELAY_REPORT_INTERVAL 60000
+
+// readings waiting to share a frame
+#define FRAME_READINGS 3      // (RF69_MAX_DATA_LEN - 1) / COMPACT_MAX_RECORD, always fit
+#define FRAME_WINDOW 100      // max # of ms a DHT reading waits for others
+#define ACK_RETRIES 2         // frames sent again when the ACK does not come in ACK_TIME
+typedef struct {
+  CompactSensor *sensor;
+  byte deviceID;
+  byte fields;
+  unsigned long var1;
+  float var2;
+  float var3;
+} 
+QueuedReading;
+
+// frames received, queued by the radio interrupt
+#ifdef RELAY_NODE
+#define RX_FRAMES 5           // the frames of every node around
+#else
+#define RX_FRAMES 3
+#endif
+#define RX_ACK_REQUESTED 0x01
+#define RX_ACK_RECEIVED 0x02
+typedef struct {
+  byte sender;
+  byte target;
+  byte flags;
+  byte length;
+  int rssi;
+  byte data[RF69_MAX_DATA_LEN];
+} 
+RxFrame;
+
+// The library reads a frame in its interrupt handler, then stops listening until receiveDone()
+// is called. Here the handler copies the frame to a small ring and listens again at once: the
+// frames arriving while loop() is busy are kept, and handled in order.
+class QueuedRFM69 : 
+public RFM69 {
+public:
+  boolean Receive(RxFrame *frame);  // the oldest frame received, false if none
+  void SendAck(byte node, byte from = NODEID);  // from another ID for a relay, answering for the gateway
+  unsigned int lost;                // frames dropped, the ring being full
+
+protected:
+  void interruptHandler();
+
+private:
+  RxFrame frames[RX_FRAMES];
+  volatile byte head;
+  volatile byte count;
+};
+
 char buff[20];
 byte sendSize=0;
 boolean requestACK = false;
-RFM69 radio;
+QueuedRFM69 radio;
 
 //end RFM69 ------------------------------------------
 
@@ -92,17 +201,146 @@ dht DHT;
 // 7 = 1371, 1372, 1373 PWM for led
 
 
-// timings
-unsigned long temperature_time;
-
 unsigned long frameSent = 0;
 unsigned long ackMissed = 0;
 unsigned long ackReceived = 0;
-boolean statOut;
 
 // Anarduino led is on pin D9
 int led = 9;
 
+/////////////////////////////
+// Scheduler
+/////////////////////////////
+// Each task runs when its deadline is reached, and schedules its next run itself. No task waits,
+// so loop() turns in a few ms at most, and a frame received is handled at once.
+#define MAX_TASKS 6
+
+class Active {
+public:
+  void Start();                     // first run as soon as possible
+  virtual void Run() = 0;
+  static void RunDue();             // run every task whose deadline is reached
+
+protected:
+  void Schedule(unsigned long delay) { ScheduleAt(millis() + delay); }
+  void ScheduleAt(unsigned long time);
+  void ScheduleBefore(unsigned long time);  // unless already scheduled earlier
+  static boolean Before(unsigned long a, unsigned long b) { return (long)(a - b) < 0; }
+  static boolean Due(unsigned long time) { return !Before(millis(), time); }
+
+private:
+  boolean scheduled;
+  unsigned long nextTime;
+
+  static Active *tasks[MAX_TASKS];
+  static byte taskCount;
+};
+
+// the heartbeat of the node
+class Blinker : 
+public Active {
+public:
+  void Run();
+
+private:
+#define BLINK_INTERVAL 1000
+#define BLINK_ON 100
+  boolean on;
+};
+
+// temperature and humidity, device 6
+class Thermometer : 
+public Active {
+public:
+  void Run();
+};
+
+// the readings queued, sent in one frame; the ACK is waited for without blocking
+class Sender : 
+public Active {
+public:
+  void Queue(CompactSensor *sensor, byte deviceID, byte fields, unsigned long var1, float var2, float var3, unsigned long maxDelay);
+  void AckReceived();
+  boolean Waiting() { return waiting; }
+  void Run();
+
+private:
+  void SendFrame();
+  void Transmit();
+  void Done(boolean acked);
+  QueuedReading queued[FRAME_READINGS];
+  byte queuedCount;
+  unsigned long sendTime;       // when the queued readings can wait no more
+  byte frame[RF69_MAX_DATA_LEN];  // the frame waiting for its ACK
+  byte length;
+  byte tries;
+  boolean waiting;
+  CompactSensor *inFlight[FRAME_READINGS];  // the sensors of that frame
+  byte inFlightCount;
+};
+
+// the answer to a group command, in the slot of the node
+class GroupAnswer : 
+public Active {
+public:
+  void Answer(byte group, byte sequence, unsigned long delay);
+  void Run();
+
+private:
+  byte frame[4];
+  boolean pending;
+};
+
+#ifdef RELAY_NODE
+// a frame to forward, waiting for the ACK of the next hop
+typedef struct {
+  byte to;
+  boolean asGateway;    // to a node, which only takes the messages of the gateway
+  byte length;
+  byte data[RF69_MAX_DATA_LEN];
+} 
+RelayFrame;
+
+// forwards the frames of the nodes it serves, one at a time, and reports the nodes it hears
+class Relay : 
+public Active {
+public:
+  boolean Handle(RxFrame *rx);        // true when the frame was for the relay role
+  boolean AckReceived(RxFrame *rx);   // true when the ACK was for the frame forwarded
+  boolean Waiting() { return waiting; }
+  void Run();
+
+private:
+  void Heard(byte node, int rssi);
+  boolean FirstCopy(byte origin, const byte *data, byte length);
+  byte NextHop(byte node);            // 0 when not served
+  boolean Forward(byte to, boolean asGateway, const byte *header, byte headerLength, const byte *data, byte length);
+  void Report();
+  byte tableNode[RELAY_TABLE_MAX];
+  byte tableNext[RELAY_TABLE_MAX];
+  byte tableCount;
+  byte heardNode[RELAY_HEARD];
+  int heardRssi[RELAY_HEARD];         // average, in dBm
+  unsigned long heardTime[RELAY_HEARD];
+  unsigned int recentHash[RELAY_RECENT];
+  unsigned long recentTime[RELAY_RECENT];
+  byte recentNext;
+  RelayFrame queue[RELAY_QUEUE];
+  byte queueCount;
+  boolean waiting;
+  byte tries;
+  unsigned long reportTime;
+};
+#endif
+
+Blinker blinker;
+Thermometer thermometer;
+Sender sender;
+GroupAnswer groupAnswer;
+#ifdef RELAY_NODE
+Relay relay;
+#endif
+
 void setup()
 {
   Serial.begin(SERIAL_BAUD);          //  setup serial
@@ -120,173 +358,612 @@ void setup()
   theData.nodeID = NODEID;  //this node id should be the same for all devices in this node
   //end RFM--------------------------------------------
 
-  //initialize times
-  temperature_time = millis();
-  
   pinMode(led, OUTPUT);
   pinMode(REDPIN, OUTPUT);
   pinMode(BLUEPIN, OUTPUT);
   pinMode(GREENPIN, OUTPUT);
+
+  blinker.Start();
+  thermometer.Start();
+  sender.Start();
+  groupAnswer.Start();
+#ifdef RELAY_NODE
+  radio.promiscuous(true);  // the frames of the nodes served go to the gateway
+  relay.Start();
+#endif
+  // the statistics go with the first temperature
+  sender.Queue(&statSensor, 1, COMPACT_VAR1 | COMPACT_VAR2 | COMPACT_VAR3, millis(), frameSent, ackMissed, TEMP_INTERVAL + FRAME_WINDOW);
 }
 
-long blinkInterval = 1000;
-long blinkNext = 0;
+#ifdef COMPACT_PAYLOAD
+byte putVarint(byte *p, unsigned long v) {
+  byte n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
 
-void loop()
-{
-  if (millis() > blinkNext)
-  {
-    digitalWrite(led, HIGH);   // turn the LED on (HIGH is the voltage level)
-    delay(100);               // wait for a second
-    digitalWrite(led, LOW);    // turn the LED off by making the voltage LOW
-    blinkNext = millis() + blinkInterval;
-  }
-  
-  //check for any received packets
-  if (radio.receiveDone())
-  {
-    Serial.print('[');Serial.print(radio.SENDERID, DEC);Serial.print("] ");
-    if (radio.DATALEN == 8) { // ACK TEST
-      for (byte i = 0; i < radio.DATALEN; i++)
-        DEBUG1((char)radio.DATA[i]);
-    }
-    else if(radio.DATALEN == sizeof(Payload)) {
-      for (byte i = 0; i < radio.DATALEN; i++) {
-        DEBUG2((char)radio.DATA[i], HEX);
-        DEBUG1(".");
-      }
-      DEBUGLN1();
-      theData = *(Payload*)radio.DATA; //assume radio.DATA actually contains our struct and not something else
-
-      DEBUG1("Received Device ID = ");
-      DEBUGLN1(theData.deviceID);  
-      DEBUG1 ("    Time = ");
-      DEBUGLN1 (theData.var1_usl);
-      DEBUG1 ("    var2_float ");
-      DEBUGLN1 (theData.var2_float);
-      DEBUG1 ("    var3_float ");
-      DEBUGLN1 (theData.var3_float);
-      
-      if (theData.deviceID == 7) {
-        digitalWrite(BLUEPIN, theData.var1_usl == 0 ? LOW : HIGH);
-        digitalWrite(REDPIN, theData.var2_float == 0 ? LOW : HIGH);
-        digitalWrite(GREENPIN, theData.var3_float == 0 ? LOW : HIGH);
-      }
-    }
-    else {
-      Serial.print("Invalid data ");
-      for (byte i = 0; i < radio.DATALEN; i++) {
-        DEBUG2((char)radio.DATA[i], HEX);
-        DEBUG1(".");
-      }
-    }
+unsigned long zigzag(long v) {
+  return ((unsigned long)v << 1) ^ (unsigned long)(v >> 31);
+}
 
-    DEBUG1("   [RX_RSSI:");DEBUG1(radio.RSSI);DEBUG1("]");
+// one reading, as absolute values or as deltas from the last one acknowledged
+byte compactEncode(byte *p, CompactSensor *s, byte sensorID, byte fields, unsigned long var1, float var2, float var3) {
+  s->next1 = var1;
+  s->next2 = lround(var2 * COMPACT_SCALE);
+  s->next3 = lround(var3 * COMPACT_SCALE);
+  s->seq++;
+  boolean key = !s->synced || ++s->sinceKey >= COMPACT_KEY_INTERVAL;
+  if (key)
+    s->sinceKey = 0;
+
+  byte n = 0;
+  p[n++] = sensorID;
+  p[n++] = fields | (key ? COMPACT_KEY : 0);
+  p[n++] = s->seq;
+  if (fields & COMPACT_VAR1)
+    n += putVarint(p + n, key ? s->next1 : zigzag(s->next1 - s->var1));
+  if (fields & COMPACT_VAR2)
+    n += putVarint(p + n, zigzag(key ? s->next2 : s->next2 - s->var2));
+  if (fields & COMPACT_VAR3)
+    n += putVarint(p + n, zigzag(key ? s->next3 : s->next3 - s->var3));
+  return n;
+}
 
-    if (radio.ACKRequested())
-    {
-      radio.sendACK();
-      DEBUG1(" - ACK sent");
-    }
-    DEBUGLN1();
+// the gateway only knows the readings it acknowledged
+void compactAcked(CompactSensor *s, boolean acked) {
+  s->synced = acked;
+  if (acked) {
+    s->var1 = s->next1;
+    s->var2 = s->next2;
+    s->var3 = s->next3;
   }
-  
-  if (frameSent%20 == 0) {
-    //send data
-    theData.deviceID = 1;
-    theData.var1_usl = millis();
-    theData.var2_float = frameSent;
-    theData.var3_float = ackMissed;
-    frameSent++;
-    if (radio.sendWithRetry(GATEWAYID, (const void*)(&theData), sizeof(theData))) {
-      ackReceived++;
-      DEBUGLN1("ACK received");
-    } else {
-      ackMissed++;
+}
+#endif
+
+/////////////////////////////
+// Radio
+/////////////////////////////
+void QueuedRFM69::interruptHandler() {
+  RFM69::interruptHandler();
+  // reset by the library when the frame is not for this node
+  if (PAYLOADLEN == 0)
+    return;
+  if (count < RX_FRAMES) {
+    RxFrame *f = &frames[(head + count) % RX_FRAMES];
+    f->sender = SENDERID;
+    f->target = TARGETID;
+    f->flags = (ACK_REQUESTED ? RX_ACK_REQUESTED : 0) | (ACK_RECEIVED ? RX_ACK_RECEIVED : 0);
+    f->length = DATALEN;
+    f->rssi = RSSI;
+    memcpy(f->data, (const void *)DATA, DATALEN);
+    count++;
+  }
+  else {
+    lost++;
+  }
+  receiveBegin();
+}
+
+boolean QueuedRFM69::Receive(RxFrame *frame) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (count == 0)
+      return false;
+    *frame = frames[head];
+    head = (head + 1) % RX_FRAMES;
+    count--;
+  }
+  return true;
+}
+
+void QueuedRFM69::SendAck(byte node, byte from) {
+  unsigned long start = millis();
+  while (!canSend() && millis() - start < RF69_CSMA_LIMIT_MS)
+    receiveDone();
+  setAddress(from);
+  sendFrame(node, "", 0, false, true);
+  setAddress(NODEID);
+  receiveDone();  // listen again
+}
+
+// a command of the gateway, to this node or to one of its groups
+void applyCommand(int deviceID, unsigned long var1, float var2, float var3) {
+  DEBUG1("Received Device ID = ");
+  DEBUGLN1(deviceID);  
+  DEBUG1 ("    Time = ");
+  DEBUGLN1 (var1);
+  DEBUG1 ("    var2_float ");
+  DEBUGLN1 (var2);
+  DEBUG1 ("    var3_float ");
+  DEBUGLN1 (var3);
+
+  if (deviceID == 7) {
+    digitalWrite(BLUEPIN, var1 == 0 ? LOW : HIGH);
+    digitalWrite(REDPIN, var2 == 0 ? LOW : HIGH);
+    digitalWrite(GREENPIN, var3 == 0 ? LOW : HIGH);
+  }
+}
+
+// a broadcast command, applied once by the members of the group however many copies come,
+// answered in the slot of the node when it is listed
+void handleGroup(RxFrame *rx) {
+  byte *p = rx->data;
+  if (rx->sender != GATEWAYID || p[1] != GROUP_COMMAND || rx->length < GROUP_HEADER + p[GROUP_HEADER - 1])
+    return;
+  byte g = 0;
+  while (g < sizeof(groups) && groups[g] != p[2])
+    g++;
+  if (g == sizeof(groups))
+    return;
+
+  if (p[3] != groupSequence[g] || millis() - groupTime[g] > GROUP_COPIES) {
+    unsigned long var1;
+    float var2, var3;
+    memcpy(&var1, p + 5, 4);
+    memcpy(&var2, p + 9, 4);
+    memcpy(&var3, p + 13, 4);
+    DEBUG1("Group ");DEBUG1(p[2]);DEBUG1(" ");
+    applyCommand(p[4], var1, var2, var3);
+    groupSequence[g] = p[3];
+  }
+  groupTime[g] = millis();
+
+  for (byte i = 0; i < p[GROUP_HEADER - 1]; i++) {
+    if (p[GROUP_HEADER + i] == NODEID) {
+      groupAnswer.Answer(p[2], p[3], (i + 1) * GROUP_SLOT);
+      break;
     }
   }
+}
 
-  if (frameSent%10 == 0) {
-    if (statOut == 0) {
-      statOut = 1;
-      DEBUG1("Frames ");
-      DEBUG1(frameSent);
-      DEBUG1(" missed: ");
-      DEBUG1(ackMissed);
-      DEBUG1(" ACKnowledge: ");
-      DEBUG1(ackReceived);
+// a frame from the ring: an ACK, a ping from the gateway, or a downlink command
+void handleFrame(RxFrame *rx) {
+  if (rx->flags & RX_ACK_RECEIVED) {
+#ifdef RELAY_NODE
+    if (relay.AckReceived(rx))
+      return;
+#endif
+    if (rx->sender == GATEWAYID && rx->target == NODEID)
+      sender.AckReceived();
+    return;
+  }
+  if ((rx->flags & RX_ACK_REQUESTED) && rx->target == NODEID) {
+    radio.SendAck(rx->sender);
+  }
+#ifdef RELAY_NODE
+  if (relay.Handle(rx))
+    return;
+#endif
+  // heard in promiscuous mode
+  if (rx->target != NODEID && rx->target != RF69_BROADCAST_ADDR)
+    return;
+  if (rx->length >= GROUP_HEADER && rx->data[0] == GROUP_MARKER) {
+    handleGroup(rx);
+    return;
+  }
+
+  DEBUG1('[');DEBUG2(rx->sender, DEC);DEBUG1("] ");
+  if (rx->length == 8) { // ACK TEST
+    for (byte i = 0; i < rx->length; i++)
+      DEBUG1((char)rx->data[i]);
+  }
+  else if (rx->length == sizeof(Payload)) {
+    Payload command = *(Payload*)rx->data;
+    applyCommand(command.deviceID, command.var1_usl, command.var2_float, command.var3_float);
+  }
+  else {
+    DEBUG1("Invalid data ");
+    for (byte i = 0; i < rx->length; i++) {
+      DEBUG2(rx->data[i], HEX);
+      DEBUG1(".");
     }
-  } else { statOut = 0; }
-  
-  unsigned long time_passed = 0;
+  }
+  DEBUG1("   [RX_RSSI:");DEBUG1(rx->rssi);DEBUGLN1("]");
+}
+
+// scheduler ----------------------------------------
+Active *Active::tasks[MAX_TASKS];
+byte Active::taskCount;
+
+void Active::Start() {
+  tasks[taskCount++] = this;
+  Schedule(0);
+}
+
+void Active::ScheduleAt(unsigned long time) {
+  nextTime = time;
+  scheduled = true;
+}
+
+void Active::ScheduleBefore(unsigned long time) {
+  if (!scheduled || Before(time, nextTime))
+    ScheduleAt(time);
+}
 
-  //===================================================================
-  //device #6
-  //temperature / humidity
-  time_passed = millis() - temperature_time;
-  if (time_passed < 0) {
-    temperature_time = millis();
+void Active::RunDue() {
+  for (byte i = 0; i < taskCount; i++) {
+    Active *task = tasks[i];
+    if (task->scheduled && Due(task->nextTime)) {
+      task->scheduled = false;
+      task->Run();
+    }
   }
+}
+
+/////////////////////////////
+// Tasks
+/////////////////////////////
+void Blinker::Run() {
+  on = !on;
+  digitalWrite(led, on ? HIGH : LOW);
+  Schedule(on ? BLINK_ON : BLINK_INTERVAL - BLINK_ON);
+}
+
+void Thermometer::Run() {
+  // about 5 ms, the DHT22 protocol
+  int chk = DHT.read21(DHTPIN);
 
-  if (time_passed > TEMP_INTERVAL) {
-    int chk = DHT.read21(DHTPIN);
-    
   switch (chk)
-    {
-    case DHTLIB_OK:
-        DEBUG1("OK,\t");
-        break;
-    case DHTLIB_ERROR_CHECKSUM:
-        DEBUG1("Checksum error,\t");
-        break;
-    case DHTLIB_ERROR_TIMEOUT:
-        DEBUG1("Time out error,\t");
-        break;
-    case DHTLIB_ERROR_CONNECT:
-        Serial.print("Connect error,\t");
-        break;
-    case DHTLIB_ERROR_ACK_L:
-        DEBUG1("Ack Low error,\t");
-        break;
-    case DHTLIB_ERROR_ACK_H:
-        DEBUG1("Ack High error,\t");
-        break;
-    default:
-        DEBUG1("Unknown error,\t");
-        break;
+  {
+  case DHTLIB_OK:
+    DEBUG1("OK,\t");
+    break;
+  case DHTLIB_ERROR_CHECKSUM:
+    DEBUG1("Checksum error,\t");
+    break;
+  case DHTLIB_ERROR_TIMEOUT:
+    DEBUG1("Time out error,\t");
+    break;
+  case DHTLIB_ERROR_CONNECT:
+    DEBUG1("Connect error,\t");
+    break;
+  case DHTLIB_ERROR_ACK_L:
+    DEBUG1("Ack Low error,\t");
+    break;
+  case DHTLIB_ERROR_ACK_H:
+    DEBUG1("Ack High error,\t");
+    break;
+  default:
+    DEBUG1("Unknown error,\t");
+    break;
+  }
+
+  double h = DHT.humidity;
+  // Read temperature as Celsius
+  double t = DHT.temperature;
+
+  DEBUG1("Humidity=");
+  DEBUG1(h);
+  DEBUG1("   Temp=");
+  DEBUG1(t);
+  DEBUGLN1("°C");
+
+  //send data
+  sender.Queue(&dhtSensor, 6, COMPACT_VAR1 | COMPACT_VAR2 | COMPACT_VAR3, millis(), t, h, FRAME_WINDOW);
+  Schedule(TEMP_INTERVAL);
+}
+
+// queue a reading for at most maxDelay ms, a newer reading of the same sensor replaces it
+void Sender::Queue(CompactSensor *sensor, byte deviceID, byte fields, unsigned long var1, float var2, float var3, unsigned long maxDelay) {
+  byte i;
+  for (i = 0; i < queuedCount && queued[i].sensor != sensor; i++)
+    ;
+  if (i == FRAME_READINGS) {
+    if (waiting)
+      return;  // more sensors than FRAME_READINGS, and a frame in the air
+    SendFrame();
+    i = 0;
+  }
+  if (i == queuedCount) {
+    if (queuedCount == 0 || Before(millis() + maxDelay, sendTime))
+      sendTime = millis() + maxDelay;
+    queuedCount++;
+  }
+  queued[i].sensor = sensor;
+  queued[i].deviceID = deviceID;
+  queued[i].fields = fields;
+  queued[i].var1 = var1;
+  queued[i].var2 = var2;
+  queued[i].var3 = var3;
+  // while waiting for an ACK, the queue is looked at once it is over
+  if (!waiting)
+    ScheduleBefore(sendTime);
+}
+
+// the queued readings as a new frame, in one frame when compact
+void Sender::SendFrame() {
+#ifdef COMPACT_PAYLOAD
+  length = 0;
+  frame[length++] = COMPACT_MARKER;
+  for (byte i = 0; i < queuedCount; i++) {
+    QueuedReading *q = &queued[i];
+    length += compactEncode(frame + length, q->sensor, q->deviceID, q->fields, q->var1, q->var2, q->var3);
+    inFlight[i] = q->sensor;
+  }
+  inFlightCount = queuedCount;
+  queuedCount = 0;
+#else
+  // the Arduino gateway only knows the Payload struct, one frame per reading
+  theData.deviceID = queued[0].deviceID;
+  theData.var1_usl = queued[0].var1;
+  theData.var2_float = queued[0].var2;
+  theData.var3_float = queued[0].var3;
+  memcpy(frame, &theData, sizeof(theData));
+  length = sizeof(theData);
+  for (byte i = 1; i < queuedCount; i++)
+    queued[i - 1] = queued[i];
+  queuedCount--;
+  inFlightCount = 0;
+#endif
+  tries = 0;
+  Transmit();
+}
+
+void Sender::Transmit() {
+  radio.send(GATEWAYID, frame, length, true);
+  radio.receiveDone();  // listen for the ACK
+  tries++;
+  waiting = true;
+  Schedule(ACK_TIME);
+}
+
+void GroupAnswer::Answer(byte group, byte sequence, unsigned long delay) {
+  frame[0] = GROUP_MARKER;
+  frame[1] = GROUP_ANSWER;
+  frame[2] = group;
+  frame[3] = sequence;
+  pending = true;
+  Schedule(delay);
+}
+
+void GroupAnswer::Run() {
+  if (!pending)
+    return;
+  pending = false;
+  radio.send(GATEWAYID, frame, sizeof(frame), false);
+  radio.receiveDone();
+}
+
+void Sender::Done(boolean acked) {
+  waiting = false;
+#ifdef COMPACT_PAYLOAD
+  for (byte i = 0; i < inFlightCount; i++)
+    compactAcked(inFlight[i], acked);
+#endif
+  frameSent++;
+  if (acked) {
+    ackReceived++;
+    DEBUGLN1(" ACK received");
+  }
+  else {
+    ackMissed++;
+  }
+
+  if (frameSent%20 == 0) {
+    //send data, along with the next temperature
+    Queue(&statSensor, 1, COMPACT_VAR1 | COMPACT_VAR2 | COMPACT_VAR3, millis(), frameSent, ackMissed, TEMP_INTERVAL + FRAME_WINDOW);
+  }
+  if (frameSent%10 == 0) {
+    DEBUG1("Frames ");
+    DEBUG1(frameSent);
+    DEBUG1(" missed: ");
+    DEBUG1(ackMissed);
+    DEBUG1(" ACKnowledge: ");
+    DEBUGLN1(ackReceived);
+  }
+}
+
+void Sender::AckReceived() {
+  if (!waiting)
+    return;
+  Done(true);
+  Schedule(0);  // on to the readings queued meanwhile
+}
+
+void Sender::Run() {
+  if (waiting) {
+    // no ACK in ACK_TIME
+    if (tries <= ACK_RETRIES) {
+      Transmit();
+      return;
     }
-    
-    double h = DHT.humidity;
-    // Read temperature as Celsius
-    double t = DHT.temperature;
-
-    DEBUG1("Humidity=");
-    DEBUG1(h);
-    DEBUG1("   Temp=");
-    DEBUG1(t);
-    DEBUG1("°C");
-    temperature_time = millis();
-
-    //send data
-    theData.deviceID = 6;
-    theData.var1_usl = millis();
-    theData.var2_float = t;
-    theData.var3_float = h;
-    frameSent++;
-    if (radio.sendWithRetry(GATEWAYID, (const void*)(&theData), sizeof(theData))) {
-      ackReceived++;
-      DEBUGLN1(" ACK received");
-    } else {
-      ackMissed++;
+    Done(false);
+  }
+  if (queuedCount == 0)
+    return;
+#ifdef RELAY_NODE
+  // both wait for an ACK of the gateway, one at a time
+  if (relay.Waiting()) {
+    Schedule(ACK_TIME);
+    return;
+  }
+#endif
+  if (Due(sendTime))
+    SendFrame();
+  else
+    ScheduleAt(sendTime);
+}
+
+#ifdef RELAY_NODE
+// the average RSSI of every node heard, reported to the gateway
+void Relay::Heard(byte node, int rssi) {
+  byte oldest = 0;
+  for (byte i = 0; i < RELAY_HEARD; i++) {
+    if (heardTime[i] != 0 && heardNode[i] == node) {
+      heardRssi[i] += (rssi - heardRssi[i]) / 5;
+      heardTime[i] = millis();
+      return;
     }
-    delay(100);
+    if (heardTime[i] == 0 || Before(heardTime[i], heardTime[oldest]))
+      oldest = i;
   }
-}//end loop
+  heardNode[oldest] = node;
+  heardRssi[oldest] = rssi;
+  heardTime[oldest] = millis();
+}
+
+// false for a copy of a frame forwarded in the last RELAY_DUPLICATE ms
+boolean Relay::FirstCopy(byte origin, const byte *data, byte length) {
+  unsigned int hash = 2166 + origin;
+  for (byte i = 0; i < length; i++)
+    hash = hash * 31 + data[i];
+  for (byte i = 0; i < RELAY_RECENT; i++)
+    if (recentTime[i] != 0 && recentHash[i] == hash && millis() - recentTime[i] <= RELAY_DUPLICATE)
+      return false;
+  recentHash[recentNext] = hash;
+  recentTime[recentNext] = millis();
+  recentNext = (recentNext + 1) % RELAY_RECENT;
+  return true;
+}
 
+byte Relay::NextHop(byte node) {
+  for (byte i = 0; i < tableCount; i++)
+    if (tableNode[i] == node)
+      return tableNext[i];
+  return 0;
+}
 
+// false when the queue is full, or the frame too long once wrapped
+boolean Relay::Forward(byte to, boolean asGateway, const byte *header, byte headerLength, const byte *data, byte length) {
+  if (queueCount == RELAY_QUEUE || headerLength + length > RF69_MAX_DATA_LEN)
+    return false;
+  RelayFrame *f = &queue[queueCount++];
+  f->to = to;
+  f->asGateway = asGateway;
+  memcpy(f->data, header, headerLength);
+  memcpy(f->data + headerLength, data, length);
+  f->length = headerLength + length;
+  if (!waiting)
+    Schedule(0);
+  return true;
+}
 
+boolean Relay::Handle(RxFrame *rx) {
+  byte *p = rx->data;
+  // the gateway, or a relay in its name
+  if (rx->sender != GATEWAYID)
+    Heard(rx->sender, rx->rssi);
+
+  if (rx->target == GATEWAYID && rx->sender != NODEID && NextHop(rx->sender) == rx->sender) {
+    // a node served, its ACK answered in the name of the gateway once the frame is queued:
+    // without it, the node sends again, or keeps the reading
+    boolean queued = queueCount < RELAY_QUEUE;
+    if (rx->length >= RELAY_UPLINK_HEADER && p[0] == RELAY_MARKER && p[1] == RELAY_UPLINK) {
+      // from a relay further away, one more hop
+      if (queued && FirstCopy(p[2], p + RELAY_UPLINK_HEADER, rx->length - RELAY_UPLINK_HEADER)) {
+        p[3]++;
+        queued = Forward(GATEWAYID, false, p, rx->length, NULL, 0);
+      }
+    }
+    else {
+      queued = queued && rx->length + RELAY_UPLINK_HEADER <= RF69_MAX_DATA_LEN;
+      if (queued && FirstCopy(rx->sender, p, rx->length)) {
+        byte header[RELAY_UPLINK_HEADER] = { RELAY_MARKER, RELAY_UPLINK, rx->sender, 1, (byte)rx->rssi };
+        queued = Forward(GATEWAYID, false, header, sizeof(header), p, rx->length);
+      }
+    }
+    if (queued && (rx->flags & RX_ACK_REQUESTED))
+      radio.SendAck(rx->sender, GATEWAYID);
+    return true;
+  }
+  if (rx->target != NODEID || rx->length < 3 || p[0] != RELAY_MARKER)
+    return false;
+
+  if (p[1] == RELAY_DOWNLINK && rx->length >= RELAY_DOWNLINK_HEADER) {
+    byte next = NextHop(p[2]);
+    if (next == p[2])
+      Forward(next, true, NULL, 0, p + RELAY_DOWNLINK_HEADER, rx->length - RELAY_DOWNLINK_HEADER);
+    else if (next != 0) {
+      p[3]++;
+      Forward(next, false, p, rx->length, NULL, 0);
+    }
+  }
+  else if (p[1] == RELAY_TABLE && rx->length >= 3 + 2 * p[2] && p[2] <= RELAY_TABLE_MAX) {
+    tableCount = p[2];
+    for (byte i = 0; i < tableCount; i++) {
+      tableNode[i] = p[3 + 2 * i];
+      tableNext[i] = p[4 + 2 * i];
+    }
+    DEBUG1("Relay table ");DEBUGLN1(tableCount);
+  }
+  return true;
+}
 
+boolean Relay::AckReceived(RxFrame *rx) {
+  if (!waiting)
+    return false;
+  RelayFrame *f = &queue[0];
+  if (rx->sender != f->to || rx->target != (f->asGateway ? GATEWAYID : NODEID))
+    return false;
+  waiting = false;
+  queueCount--;
+  for (byte i = 0; i < queueCount; i++)
+    queue[i] = queue[i + 1];
+  Schedule(0);
+  return true;
+}
 
+// the nodes heard lately, and the size of the table, which tells the gateway when it was lost
+void Relay::Report() {
+  byte frame[4 + 2 * RELAY_HEARD] = { RELAY_MARKER, RELAY_REPORT, tableCount, 0 };
+  for (byte i = 0; i < RELAY_HEARD; i++) {
+    if (heardTime[i] == 0 || millis() - heardTime[i] > 3 * RELAY_REPORT_INTERVAL)
+      continue;
+    frame[4 + 2 * frame[3]] = heardNode[i];
+    frame[5 + 2 * frame[3]] = (byte)heardRssi[i];
+    frame[3]++;
+  }
+  Forward(GATEWAYID, false, frame, 4 + 2 * frame[3], NULL, 0);
+}
 
+void Relay::Run() {
+  if (waiting) {
+    // no ACK in ACK_TIME
+    if (tries <= ACK_RETRIES) {
+      tries++;
+    }
+    else {
+      waiting = false;
+      queueCount--;
+      for (byte i = 0; i < queueCount; i++)
+        queue[i] = queue[i + 1];
+    }
+  }
+  if (Due(reportTime)) {
+    reportTime = millis() + RELAY_REPORT_INTERVAL;
+    Report();
+  }
+  if (queueCount == 0) {
+    ScheduleAt(reportTime);
+    return;
+  }
+  // the ACK of the gateway would not tell which frame it is for
+  if (sender.Waiting()) {
+    Schedule(ACK_TIME);
+    return;
+  }
+  if (!waiting)
+    tries = 1;
+  RelayFrame *f = &queue[0];
+  if (f->asGateway)
+    radio.setAddress(GATEWAYID);
+  radio.send(f->to, f->data, f->length, true);
+  radio.setAddress(NODEID);
+  radio.receiveDone();  // listen for the ACK
+  waiting = true;
+  Schedule(ACK_TIME);
+}
+#endif
 
+void loop()
+{
+  // the frames received first, a downlink command is applied within a few ms
+  RxFrame rx;
+  while (radio.Receive(&rx))
+    handleFrame(&rx);
 
+  Active::RunDue();
+}//end loop
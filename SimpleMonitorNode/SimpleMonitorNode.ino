@@ -18,8 +18,8 @@
 // Radio
 #include <RFM69.h>          // get it here https://www.github.com/lowpowerlab/rfm69
 
-// FOTA
-//#include <WirelessHEX.h>  //get it here: https://github.com/LowPowerLab/WirelessProgramming/tree/master/WirelessHEX69
+// FOTA, the image is copied by DualOptiboot: https://github.com/LowPowerLab/DualOptiboot
+#include <avr/wdt.h>
 
 // DHT - temperature sensor
 #include <dht.h>            //get it here: http://arduino.cc/playground/Main/DHTLib
@@ -71,6 +71,7 @@
 #define DEVICE_CLASS_B  // Device will send data and then wait CLASS_B_DELAY second before putting rasio to sleep
 //#define DEVICE_CLASS_C  // Device will keep it radio on all the tile
 #define CLASS_B_DELAY  FIVESECONDS
+#define FRAME_WINDOW  ONESECOND  // max time a reading waits for others, to share a radio wake-up
 
 //struct for wireless data transmission
 typedef struct {
@@ -83,6 +84,46 @@ typedef struct {
 Payload;
 Payload theData;
 
+// compact readings, decoded by the piGateway only: comment out with the Arduino Gateway
+#define COMPACT_PAYLOAD
+
+// see piGateway/compact.h for the format
+#define COMPACT_MARKER 0xFF   // the first byte of a Payload is the node ID: from 0xFC up, never a node ID, a marker
+#define COMPACT_VAR1 0x01
+#define COMPACT_VAR2 0x02
+#define COMPACT_VAR3 0x04
+#define COMPACT_AGE  0x08
+#define COMPACT_KEY  0x80
+#define COMPACT_SCALE 100     // var2 and var3 sent in hundredths
+#define COMPACT_KEY_INTERVAL 16  // absolute values at least every 16 readings
+#define COMPACT_MAX_RECORD 18  // sensor, flags, sequence and 3 varints of 5 bytes
+
+// state of the compact encoding of a sensor
+typedef struct {
+  byte seq;             // sequence of the last reading sent
+  byte sinceKey;        // readings sent since the last absolute one
+  boolean synced;       // the last reading was acknowledged, the next one can be a delta
+  unsigned long var1;   // last reading acknowledged
+  long var2;
+  long var3;
+  unsigned long next1;  // reading waiting for its ACK
+  long next2;
+  long next3;
+}
+CompactSensor;
+
+// a reading waiting to share a frame
+typedef struct {
+  CompactSensor *sensor;
+  byte deviceID;
+  byte fields;
+  unsigned long var1;
+  float var2;
+  float var3;
+  unsigned long time;  // millis() when queued
+}
+QueuedReading;
+
 char buff[20];
 byte sendSize = 0;
 boolean requestACK = false;
@@ -251,9 +292,508 @@ byte Sleepy::loseSomeTime (word msecs) {
 }
 
 
+/////////////////////////////
+// RTC alarm
+/////////////////////////////
+// The long sleeps are timed by the alarm 0 of the MCP7940 instead of chained watchdog periods:
+// a single wake-up, on the first second of the RTC at or after the deadline. millis() is then set
+// from the RTC, against the alarm which last woke the node, so the time lost by the watchdog sleeps
+// and the wake-ups by other interrupts is caught up.
+// The alarm pulls the MFP pin low, until its flag is cleared.
+#define RTC_ADDRESS     0x6F
+#define RTC_SEC         0x00
+#define RTC_WKDAY       0x03
+#define RTC_CONTROL     0x07
+#define RTC_ALM0SEC     0x0A
+#define RTC_ALM0WKDAY   0x0D
+#define RTC_OSCRUN      0x20  // in RTC_WKDAY
+#define RTC_SQWEN       0x40  // in RTC_CONTROL
+#define RTC_ALM0EN      0x10  // in RTC_CONTROL
+#define RTC_ALM0IF      0x08  // in RTC_ALM0WKDAY
+#define RTC_ALMMSK_ALL  0x70  // seconds, minutes, hour, day of week, date and month match
+#define RTC_MIN_SLEEP   2000L  // shorter sleeps are left to the watchdog
+#define RTC_MAX_SLEEP   TENMINUTES
+
+class RtcSleep {
+public:
+  static void Begin();                      // no alarm left by a previous run
+  static void Sleep(unsigned long msecs);   // at most a second late
+
+private:
+  static time_t Read(byte *wkday);
+  static void SetAlarm(time_t time, byte wkday);
+  static byte ReadRegister(byte reg);
+  static void WriteRegister(byte reg, byte value);
+  static void AlarmInterrupt();
+
+  static time_t base;                 // RTC time of the last alarm, 0 until one woke the node
+  static unsigned long millisBase;    // millis() at that time
+  static volatile boolean fired;
+};
+
+time_t RtcSleep::base;
+unsigned long RtcSleep::millisBase;
+volatile boolean RtcSleep::fired;
+
+static byte bcd2dec(byte value) {
+  return (value >> 4) * 10 + (value & 0x0F);
+}
+
+static byte dec2bcd(byte value) {
+  return (value / 10) << 4 | value % 10;
+}
+
+byte RtcSleep::ReadRegister(byte reg) {
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(reg);
+  Wire.endTransmission();
+  Wire.requestFrom((uint8_t)RTC_ADDRESS, (uint8_t)1);
+  return Wire.read();
+}
+
+void RtcSleep::WriteRegister(byte reg, byte value) {
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(reg);
+  Wire.write(value);
+  Wire.endTransmission();
+}
+
+// the RTC is in 24 hours mode, its day of week is only kept for the alarm
+time_t RtcSleep::Read(byte *wkday) {
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(RTC_SEC);
+  Wire.endTransmission();
+  Wire.requestFrom((uint8_t)RTC_ADDRESS, (uint8_t)7);
+  tmElements_t tm;
+  tm.Second = bcd2dec(Wire.read() & 0x7F);
+  tm.Minute = bcd2dec(Wire.read() & 0x7F);
+  tm.Hour = bcd2dec(Wire.read() & 0x3F);
+  *wkday = Wire.read();
+  tm.Day = bcd2dec(Wire.read() & 0x3F);
+  tm.Month = bcd2dec(Wire.read() & 0x1F);
+  tm.Year = bcd2dec(Wire.read()) + 30;  // from 2000, to from 1970
+  return makeTime(tm);
+}
+
+void RtcSleep::SetAlarm(time_t time, byte wkday) {
+  tmElements_t tm;
+  breakTime(time, tm);
+  Wire.beginTransmission(RTC_ADDRESS);
+  Wire.write(RTC_ALM0SEC);
+  Wire.write(dec2bcd(tm.Second));
+  Wire.write(dec2bcd(tm.Minute));
+  Wire.write(dec2bcd(tm.Hour));
+  Wire.write(RTC_ALMMSK_ALL | wkday);  // active low, the flag cleared
+  Wire.write(dec2bcd(tm.Day));
+  Wire.write(dec2bcd(tm.Month));
+  Wire.endTransmission();
+  WriteRegister(RTC_CONTROL, (ReadRegister(RTC_CONTROL) & ~RTC_SQWEN) | RTC_ALM0EN);
+}
+
+void RtcSleep::AlarmInterrupt() {
+  // the level stays low until the flag is cleared
+  detachInterrupt(digitalPinToInterrupt(RTC_INT));
+  fired = true;
+}
+
+void RtcSleep::Begin() {
+  WriteRegister(RTC_CONTROL, ReadRegister(RTC_CONTROL) & ~RTC_ALM0EN);
+  WriteRegister(RTC_ALM0WKDAY, ReadRegister(RTC_ALM0WKDAY) & ~RTC_ALM0IF);
+  base = 0;
+}
+
+void RtcSleep::Sleep(unsigned long msecs) {
+  byte wkday;
+  time_t now = Read(&wkday);
+  unsigned long start = millis();
+  if (!(wkday & RTC_OSCRUN)) {
+    // no RTC to wake up the node
+    Sleepy::loseSomeTime(min(msecs, 0xFFFFUL));
+    return;
+  }
+  msecs = min(msecs, RTC_MAX_SLEEP);
+
+  // ms already elapsed in the current second of the RTC, a guess until an alarm woke the node
+  unsigned long fraction = base != 0 ? (start - millisBase) % 1000 : 500;
+  time_t alarm = now + (fraction + msecs + 999) / 1000;
+  byte days = alarm / SECS_PER_DAY - now / SECS_PER_DAY;
+  SetAlarm(alarm, ((wkday & 0x07) - 1 + days) % 7 + 1);
+
+  // only a level interrupt wakes up from power down
+  fired = false;
+  attachInterrupt(digitalPinToInterrupt(RTC_INT), AlarmInterrupt, LOW);
+  Sleepy::powerDown();
+  if (!fired) {
+    detachInterrupt(digitalPinToInterrupt(RTC_INT));
+  }
+  WriteRegister(RTC_CONTROL, ReadRegister(RTC_CONTROL) & ~RTC_ALM0EN);
+  WriteRegister(RTC_ALM0WKDAY, ReadRegister(RTC_ALM0WKDAY) & ~RTC_ALM0IF);
+
+  unsigned long time;
+  if (fired) {
+    // exactly on a second of the RTC
+    time = base != 0 ? millisBase + (alarm - base) * 1000 : start - fraction + (alarm - now) * 1000;
+    base = alarm;
+    millisBase = time;
+  }
+  else {
+    // woken by another interrupt, somewhere in the current second
+    time = start - fraction + (Read(&wkday) - now) * 1000 + 500;
+  }
+  extern volatile unsigned long timer0_millis;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    timer0_millis = time;
+  }
+}
+
+
+/////////////////////////////
+// Flash log
+/////////////////////////////
+// The readings not acknowledged are kept in a circular log in the SPI flash, until the gateway
+// can be reached again. The log is written in sequence over all its sectors, so they all wear
+// evenly. The slot at the head is always erased: the next sector is erased when the head enters it,
+// dropping its oldest readings if the log is full.
+// A record is programmed once when written, and its state byte once more when sent, never erased.
+#define LOG_START     0x20000L  // the first 128KB are left for a wireless programming image
+#define LOG_SECTORS   96        // up to 0x80000, the end of a 4Mbit flash
+#define LOG_SECTOR    4096L
+#define LOG_RECORD    32
+#define LOG_SECTOR_SLOTS  (LOG_SECTOR / LOG_RECORD)
+#define LOG_SLOTS     (LOG_SECTORS * LOG_SECTOR_SLOTS)
+#define LOG_EMPTY     0xFF
+#define LOG_WRITTEN   0x7E
+#define LOG_SENT      0x00
+
+typedef struct {
+  byte state;
+  byte deviceID;
+  byte fields;
+  byte reserved;
+  unsigned long time;  // millis() of the reading
+  unsigned long var1;
+  float var2;
+  float var3;
+  byte padding[LOG_RECORD - 20];
+}
+LogRecord;
+
+class FlashLog {
+public:
+  boolean Begin();                          // find the head and the tail left by the previous run
+  void Append(const QueuedReading *reading);
+  byte Peek(LogRecord *records, byte max);  // the oldest readings, not removed
+  void Consume(byte sent);                  // remove the oldest readings, once sent
+  boolean Empty() { return count == 0; }
+  boolean Previous(byte i) { return i < previousLeft; }  // the reading i of Peek() is from before the last reset
+  // sequence of the reading i of Peek(), from its slot: the same after a reset, so a frame the gateway
+  // received before it is dropped as a copy, and unique among 256 readings, LOG_SLOTS being a multiple of 256
+  byte Sequence(byte i) { return (tail + i) % LOG_SLOTS; }
+  unsigned long lost;                       // readings dropped by a full log
+
+private:
+  boolean ready;
+  unsigned int head;                        // next slot written
+  unsigned int tail;                        // oldest slot not sent
+  unsigned int count;                       // readings not sent, from the tail to the head
+  unsigned int previousLeft;                // readings left from before the reset, their time is unknown
+
+  static unsigned long Address(unsigned int slot) { return LOG_START + (unsigned long)slot * LOG_RECORD; }
+  static unsigned int Next(unsigned int slot) { return slot + 1 == LOG_SLOTS ? 0 : slot + 1; }
+  static byte State(unsigned int slot) { return flash.readByte(Address(slot)); }
+  void EraseSector(unsigned int slot);
+};
+
+boolean FlashLog::Begin() {
+  flash.wakeup();
+  // the head follows the last record written, everything is empty after it in its sector
+  byte previous = State(LOG_SLOTS - 1);
+  boolean found = false;
+  boolean corrupt = false;
+  head = 0;
+  for (unsigned int slot = 0; slot < LOG_SLOTS && !corrupt; slot++) {
+    byte state = State(slot);
+    if (state != LOG_EMPTY && state != LOG_WRITTEN && state != LOG_SENT)
+      corrupt = true;
+    if (previous != LOG_EMPTY && state == LOG_EMPTY) {
+      head = slot;
+      found = true;
+    }
+    previous = state;
+  }
+  if (corrupt || (!found && State(0) != LOG_EMPTY)) {
+    // never used as a log, start afresh
+    for (unsigned int slot = 0; slot < LOG_SLOTS; slot += LOG_SECTOR_SLOTS)
+      EraseSector(slot);
+    head = 0;
+  }
+
+  // the oldest readings not sent follow the head
+  tail = head;
+  count = 0;
+  for (unsigned int slot = Next(head); slot != head; slot = Next(slot)) {
+    if (State(slot) == LOG_WRITTEN) {
+      if (count++ == 0)
+        tail = slot;
+    }
+  }
+  previousLeft = count;
+  flash.sleep();
+  ready = true;
+  return count > 0;
+}
+
+void FlashLog::EraseSector(unsigned int slot) {
+  flash.blockErase4K(Address(slot));
+  while (flash.busy())
+    ;
+}
+
+void FlashLog::Append(const QueuedReading *reading) {
+  if (!ready)
+    return;
+  LogRecord record;
+  memset(&record, 0, sizeof(record));
+  record.state = LOG_WRITTEN;
+  record.deviceID = reading->deviceID;
+  record.fields = reading->fields;
+  record.time = reading->time;
+  record.var1 = reading->var1;
+  record.var2 = reading->var2;
+  record.var3 = reading->var3;
+
+  flash.wakeup();
+  flash.writeBytes(Address(head), &record, sizeof(record));
+  head = Next(head);
+  count++;
+  if (head % LOG_SECTOR_SLOTS == 0) {
+    // the head enters the next sector: the oldest readings there are lost
+    while (count > 0 && tail / LOG_SECTOR_SLOTS == head / LOG_SECTOR_SLOTS) {
+      lost++;
+      if (previousLeft > 0)
+        previousLeft--;
+      tail = Next(tail);
+      count--;
+    }
+    EraseSector(head);
+  }
+  if (count == 0)
+    tail = head;
+  flash.sleep();
+}
+
+byte FlashLog::Peek(LogRecord *records, byte max) {
+  if (!ready)
+    return 0;
+  byte read = 0;
+  flash.wakeup();
+  for (unsigned int slot = tail; read < this->count && read < max; slot = Next(slot))
+    flash.readBytes(Address(slot), &records[read++], sizeof(LogRecord));
+  flash.sleep();
+  return read;
+}
+
+void FlashLog::Consume(byte sent) {
+  flash.wakeup();
+  for (; sent > 0 && count > 0; sent--) {
+    flash.writeByte(Address(tail), LOG_SENT);
+    tail = Next(tail);
+    count--;
+    if (previousLeft > 0)
+      previousLeft--;
+  }
+  flash.sleep();
+}
+
+FlashLog flashLog;
+
+/////////////////////////////
+// Wireless programming
+/////////////////////////////
+// The gateway sends a new firmware in blocks, written in the SPI flash behind the header the
+// DualOptiboot bootloader looks for. The blocks of a window come without radio ACK, the last one
+// asks for the status: the first block missing, and a bitmap of the 32 following ones, so only the
+// lost blocks are sent again. Once the image is complete and its CRC right, the header is written
+// and the node resets into the bootloader, which copies the image. See piGateway/fota.h for the frames.
+#define FOTA_MARKER   0xFE  // a reserved node ID, as COMPACT_MARKER
+#define FOTA_START    'S'
+#define FOTA_DATA     'D'
+#define FOTA_POLL     'P'   // data, asking for the status
+#define FOTA_QUERY    'Q'
+#define FOTA_END      'E'
+#define FOTA_STATUS   'A'
+#define FOTA_VERIFIED 'V'
+#define FOTA_OK       0
+#define FOTA_TOO_BIG  1
+#define FOTA_BAD_CRC  2
+#define FOTA_IMAGE    10        // after "FLXIMG:", the length of the image and ':'
+#define FOTA_MAX_SIZE 31744L    // 32KB less the bootloader, well below LOG_START
+#define FOTA_BLOCK    56
+#define FOTA_TIMEOUT  THIRTYSECONDS  // a transfer silent for longer lets the radio sleep again
+
+class Fota {
+public:
+  boolean Receive(const byte *data, byte length);  // false if not a frame of a transfer
+  boolean Busy() { return transfer != 0 && (long)(millis() - lastTime) < FOTA_TIMEOUT; }
+
+private:
+  void Reply(byte type, byte id, byte result);
+  boolean Verify();
+  byte transfer;          // ID given by the gateway, 0 if none
+  unsigned long size;
+  unsigned long crc;
+  unsigned int blocks;
+  unsigned int base;      // first block missing
+  unsigned long bitmap;   // blocks received after it, bit 0 for base + 1
+  unsigned long lastTime; // last frame of the transfer
+};
+
+static unsigned long get32(const byte *p) {
+  return p[0] | (unsigned int)p[1] << 8 | (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+boolean Fota::Receive(const byte *data, byte length) {
+  if (length < 3 || data[0] != FOTA_MARKER)
+    return false;
+  byte id = data[2];
+  if (id == transfer)
+    lastTime = millis();
+
+  switch (data[1]) {
+  case FOTA_START:
+    if (length < 11)
+      break;
+    // the same ID again resumes the transfer, the blocks received are kept
+    if (id != transfer) {
+      unsigned long newSize = get32(data + 3);
+      if (newSize == 0 || newSize > FOTA_MAX_SIZE) {
+        transfer = 0;
+        Reply(FOTA_STATUS, id, FOTA_TOO_BIG);
+        break;
+      }
+      transfer = id;
+      size = newSize;
+      crc = get32(data + 7);
+      blocks = (size + FOTA_BLOCK - 1) / FOTA_BLOCK;
+      base = 0;
+      bitmap = 0;
+      lastTime = millis();
+      DEBUG1("FOTA start ");
+      DEBUGLN1(size);
+      flash.wakeup();
+      for (unsigned long address = 0; address < FOTA_IMAGE + size; address += LOG_SECTOR) {
+        flash.blockErase4K(address);
+        while (flash.busy())
+          ;
+      }
+      flash.sleep();
+    }
+    Reply(FOTA_STATUS, id, FOTA_OK);
+    break;
+
+  case FOTA_DATA:
+  case FOTA_POLL:
+    if (id != transfer || length < 6)
+      break;
+    {
+      unsigned int block = data[3] | (unsigned int)data[4] << 8;
+      // a block sent again after a lost status is not programmed twice
+      if (block < blocks && block >= base && block - base <= 32
+        && (block == base || !(bitmap & (1UL << (block - base - 1))))) {
+        flash.wakeup();
+        flash.writeBytes(FOTA_IMAGE + (unsigned long)block * FOTA_BLOCK, data + 5, length - 5);
+        flash.sleep();
+        if (block == base) {
+          base++;
+          while (bitmap & 1) {
+            bitmap >>= 1;
+            base++;
+          }
+          bitmap >>= 1;
+        }
+        else {
+          bitmap |= 1UL << (block - base - 1);
+        }
+      }
+    }
+    if (data[1] == FOTA_POLL)
+      Reply(FOTA_STATUS, id, FOTA_OK);
+    break;
+
+  case FOTA_QUERY:
+    if (id == transfer)
+      Reply(FOTA_STATUS, id, FOTA_OK);
+    break;
+
+  case FOTA_END:
+    if (id != transfer || base != blocks)
+      break;
+    if (!Verify()) {
+      DEBUGLN1("FOTA bad CRC");
+      transfer = 0;
+      Reply(FOTA_VERIFIED, id, FOTA_BAD_CRC);
+      break;
+    }
+    flash.wakeup();
+    flash.writeBytes(0, "FLXIMG:", 7);
+    flash.writeByte(7, size >> 8);
+    flash.writeByte(8, size);
+    flash.writeByte(9, ':');
+    flash.sleep();
+    Reply(FOTA_VERIFIED, id, FOTA_OK);
+    DEBUGLN1("FOTA done, restarting");
+    DEBUGFLUSH();
+    // the bootloader finds the header, and copies the image
+    wdt_enable(WDTO_15MS);
+    while (1)
+      ;
+  }
+  return true;
+}
+
+void Fota::Reply(byte type, byte id, byte result) {
+  byte frame[10] = { FOTA_MARKER, type, id, result, lowByte(base), highByte(base),
+    (byte)bitmap, (byte)(bitmap >> 8), (byte)(bitmap >> 16), (byte)(bitmap >> 24) };
+  delay(3); // Pause needed when sending right after receiving
+  radio.send(GATEWAYID, frame, type == FOTA_VERIFIED ? 4 : sizeof(frame));
+}
+
+// CRC-32 of the image in the flash, as computed by the gateway
+boolean Fota::Verify() {
+  unsigned long value = 0xFFFFFFFF;
+  byte buffer[32];
+  flash.wakeup();
+  for (unsigned long offset = 0; offset < size; offset += sizeof(buffer)) {
+    byte len = size - offset < sizeof(buffer) ? size - offset : sizeof(buffer);
+    flash.readBytes(FOTA_IMAGE + offset, buffer, len);
+    for (byte i = 0; i < len; i++) {
+      value ^= buffer[i];
+      for (byte b = 0; b < 8; b++)
+        value = (value >> 1) ^ (0xEDB88320UL & -(value & 1));
+    }
+  }
+  flash.sleep();
+  return ~value == crc;
+}
+
+Fota fota;
+
+/////////////////////////////
+// Scheduler
+/////////////////////////////
+// The tasks waiting for a deadline are kept in a min-heap, the earliest on top.
+// Only the tasks due are run, each one schedules its next run itself, or none.
+// The deadlines are compared by difference, so they survive the millis() wrap-around
+#define MAX_TASKS  8
+#define NOT_SCHEDULED  0xFF
+
 class Active {
 public:
-  virtual unsigned long Run() = 0;
+  Active() : heapIndex(NOT_SCHEDULED) {}
+  virtual void Run() = 0;
+  void Start();                         // first run, in the Init state, as soon as possible
+  static void RunDue();                 // run every task whose deadline is reached
+  static unsigned long TimeToNext();    // ms until the earliest deadline, FOREVER if none
 
 protected:
   typedef enum {
@@ -261,25 +801,55 @@ protected:
   }
   ActiveState;
   ActiveState State;
+
+  void Schedule(unsigned long delay) { ScheduleAt(millis() + delay); }
+  void ScheduleAt(unsigned long time);
+  void ScheduleBefore(unsigned long time);  // unless already scheduled earlier
+  void Suspend();                       // no deadline, until scheduled again
+  static boolean Before(unsigned long a, unsigned long b) { return (long)(a - b) < 0; }
+  static boolean Due(unsigned long time) { return !Before(millis(), time); }
+
+private:
   unsigned long NextTime;
+  byte heapIndex;
+
+  static Active *heap[MAX_TASKS];
+  static byte heapCount;
+  static void Place(Active *task, byte i);
+  static void SiftUp(byte i);
+  static void SiftDown(byte i);
+  static void Remove(byte i);
 };
 
 class RadioActive :
 public Active {
 public:
-  void SendData(const uint8_t node, const void *data, const uint8_t length);
+  boolean SendData(const uint8_t node, const void *data, const uint8_t length);
+  void QueueReading(CompactSensor *sensor, byte deviceID, byte fields, unsigned long var1, float var2, float var3, unsigned long maxDelay);
   int ReceiveData();
-  unsigned long Run();
+  void Run();
 
 private:
+#define RADIO_POLL  16  // ms between two checks of the radio while it is on, a watchdog period
+#define BACKFILL_INTERVAL  FIVESECONDS  // between two frames of logged readings
+#define BACKFILL_READINGS  2  // a logged reading also carries its age, up to 23 bytes
+  void SendQueued();
+  void SendBackfill();
   boolean active;
+  unsigned long offTime;  // when the radio can go back to sleep
+  boolean linkUp;         // the last frame was acknowledged
+  unsigned long backfillTime;  // next frame of logged readings
+#define FRAME_READINGS 3  // (RF69_MAX_DATA_LEN - 1) / COMPACT_MAX_RECORD, always fit
+  QueuedReading queued[FRAME_READINGS];
+  byte queuedCount;
+  unsigned long sendTime;  // when the queued readings can wait no more
 };
 
 class Led :
 public Active {
 public:
   void RequestBlink(int blinkRequested);
-  unsigned long Run();
+  void Run();
 
 private:
   int remainingBlink;
@@ -289,7 +859,7 @@ private:
 class DHT :
 public Active {
 public:
-  unsigned long Run();
+  void Run();
 private:
 #define DHTTYPE DHT22   // DHT 22 (AM2302) white one
 #define TEMP_READ_DELAY  ONEMINUTE
@@ -301,16 +871,18 @@ private:
   double h;
   double t;
   int chk;
+  CompactSensor compact;
 };
 
 class Battery :
 public Active {
 public:
-  unsigned long Run();
+  void Run();
 private:
   #define BATT_READ_DELAY  FIVEMINUTES
   #define BATTPIN A0     			// digital pin we're connected to
   float volts;
+  CompactSensor compact;
 };
 
 
@@ -320,17 +892,274 @@ Battery battery;
 RadioActive radioSend;
 
 
+/////////////////////////////
+// Scheduler
+/////////////////////////////
+Active *Active::heap[MAX_TASKS];
+byte Active::heapCount = 0;
+
+void Active::Place(Active *task, byte i) {
+  heap[i] = task;
+  task->heapIndex = i;
+}
+
+void Active::SiftUp(byte i) {
+  Active *task = heap[i];
+  while (i > 0) {
+    byte parent = (i - 1) / 2;
+    if (!Before(task->NextTime, heap[parent]->NextTime))
+      break;
+    Place(heap[parent], i);
+    i = parent;
+  }
+  Place(task, i);
+}
+
+void Active::SiftDown(byte i) {
+  Active *task = heap[i];
+  for (;;) {
+    byte child = 2 * i + 1;
+    if (child >= heapCount)
+      break;
+    if (child + 1 < heapCount && Before(heap[child + 1]->NextTime, heap[child]->NextTime))
+      child++;
+    if (!Before(heap[child]->NextTime, task->NextTime))
+      break;
+    Place(heap[child], i);
+    i = child;
+  }
+  Place(task, i);
+}
+
+void Active::Remove(byte i) {
+  heap[i]->heapIndex = NOT_SCHEDULED;
+  if (--heapCount == i)
+    return;
+  // the last task takes the place, and moves to where it belongs
+  Active *last = heap[heapCount];
+  Place(last, i);
+  SiftDown(i);
+  if (last->heapIndex == i)
+    SiftUp(i);
+}
+
+void Active::ScheduleAt(unsigned long time) {
+  NextTime = time;
+  if (heapIndex == NOT_SCHEDULED) {
+    if (heapCount == MAX_TASKS)
+      return;  // MAX_TASKS too small, the task never runs again
+    Place(this, heapCount++);
+    SiftUp(heapIndex);
+  }
+  else {
+    SiftUp(heapIndex);
+    SiftDown(heapIndex);
+  }
+}
+
+void Active::ScheduleBefore(unsigned long time) {
+  if (heapIndex == NOT_SCHEDULED || Before(time, NextTime))
+    ScheduleAt(time);
+}
+
+void Active::Suspend() {
+  if (heapIndex != NOT_SCHEDULED)
+    Remove(heapIndex);
+}
+
+void Active::Start() {
+  State = Init;
+  Schedule(0);
+}
+
+void Active::RunDue() {
+  // take the due tasks out first: a task rescheduled for now runs on the next call,
+  // so it cannot hold the loop
+  Active *due[MAX_TASKS];
+  byte count = 0;
+  while (heapCount > 0 && Due(heap[0]->NextTime)) {
+    due[count++] = heap[0];
+    Remove(0);
+  }
+  for (byte i = 0; i < count; i++)
+    due[i]->Run();
+}
+
+unsigned long Active::TimeToNext() {
+  if (heapCount == 0)
+    return FOREVER;
+  long left = heap[0]->NextTime - millis();
+  return left > 0 ? left : 0;
+}
+
 /////////////////////////////
 // RadioActive
 /////////////////////////////
-void RadioActive::SendData(const uint8_t node, const void* data, const uint8_t length) {
+#ifdef COMPACT_PAYLOAD
+static byte putVarint(byte *p, unsigned long v) {
+  byte n = 0;
+  while (v >= 0x80) {
+    p[n++] = (v & 0x7F) | 0x80;
+    v >>= 7;
+  }
+  p[n++] = v;
+  return n;
+}
+
+static unsigned long zigzag(long v) {
+  return ((unsigned long)v << 1) ^ (unsigned long)(v >> 31);
+}
+
+// one reading, as absolute values or as deltas from the last one acknowledged
+static byte compactEncode(byte *p, CompactSensor *s, byte sensorID, byte fields, unsigned long var1, float var2, float var3) {
+  s->next1 = var1;
+  s->next2 = lround(var2 * COMPACT_SCALE);
+  s->next3 = lround(var3 * COMPACT_SCALE);
+  s->seq++;
+  boolean key = !s->synced || ++s->sinceKey >= COMPACT_KEY_INTERVAL;
+  if (key)
+    s->sinceKey = 0;
+
+  byte n = 0;
+  p[n++] = sensorID;
+  p[n++] = fields | (key ? COMPACT_KEY : 0);
+  p[n++] = s->seq;
+  if (fields & COMPACT_VAR1)
+    n += putVarint(p + n, key ? s->next1 : zigzag(s->next1 - s->var1));
+  if (fields & COMPACT_VAR2)
+    n += putVarint(p + n, zigzag(key ? s->next2 : s->next2 - s->var2));
+  if (fields & COMPACT_VAR3)
+    n += putVarint(p + n, zigzag(key ? s->next3 : s->next3 - s->var3));
+  return n;
+}
+
+// a logged reading, with its own sequence, apart from the live readings of the sensor
+static byte compactEncodeBackfill(byte *p, byte sensorID, byte fields, byte seq, unsigned long age, unsigned long var1, float var2, float var3) {
+  byte n = 0;
+  p[n++] = sensorID;
+  p[n++] = fields | COMPACT_KEY | COMPACT_AGE;
+  p[n++] = seq;
+  if (fields & COMPACT_VAR1)
+    n += putVarint(p + n, var1);
+  if (fields & COMPACT_VAR2)
+    n += putVarint(p + n, zigzag(lround(var2 * COMPACT_SCALE)));
+  if (fields & COMPACT_VAR3)
+    n += putVarint(p + n, zigzag(lround(var3 * COMPACT_SCALE)));
+  n += putVarint(p + n, age);
+  return n;
+}
+
+// the gateway only knows the readings it acknowledged
+static void compactAcked(CompactSensor *s, boolean acked) {
+  s->synced = acked;
+  if (acked) {
+    s->var1 = s->next1;
+    s->var2 = s->next2;
+    s->var3 = s->next3;
+  }
+}
+#endif
+
+// send the queued readings, in one frame and one radio wake-up when compact
+void RadioActive::SendQueued() {
+#ifdef COMPACT_PAYLOAD
+  byte frame[RF69_MAX_DATA_LEN];
+  byte len = 0;
+  frame[len++] = COMPACT_MARKER;
+  for (byte i = 0; i < queuedCount; i++) {
+    QueuedReading *q = &queued[i];
+    len += compactEncode(frame + len, q->sensor, q->deviceID, q->fields, q->var1, q->var2, q->var3);
+  }
+  boolean acked = SendData(GATEWAYID, frame, len);
+  for (byte i = 0; i < queuedCount; i++) {
+    compactAcked(queued[i].sensor, acked);
+    if (!acked)
+      flashLog.Append(&queued[i]);
+  }
+#else
+  // the Arduino gateway only knows the Payload struct, one frame per reading
+  boolean acked = true;
+  for (byte i = 0; i < queuedCount; i++) {
+    theData.deviceID = queued[i].deviceID;
+    theData.var1_usl = queued[i].var1;
+    theData.var2_float = queued[i].var2;
+    theData.var3_float = queued[i].var3;
+    if (!SendData(GATEWAYID, (const void*)(&theData), sizeof(theData))) {
+      flashLog.Append(&queued[i]);
+      acked = false;
+    }
+  }
+#endif
+  queuedCount = 0;
+
+  // the logged readings follow once the gateway answers again
+  if (acked && !linkUp)
+    backfillTime = millis() + BACKFILL_INTERVAL;
+  linkUp = acked;
+}
+
+// send the oldest logged readings, as absolute values with their age
+void RadioActive::SendBackfill() {
+  LogRecord records[BACKFILL_READINGS];
+  byte count = flashLog.Peek(records, BACKFILL_READINGS);
+  if (count == 0)
+    return;
+#ifdef COMPACT_PAYLOAD
+  byte frame[RF69_MAX_DATA_LEN];
+  byte len = 0;
+  frame[len++] = COMPACT_MARKER;
+  for (byte i = 0; i < count; i++) {
+    // the time of the readings from before a reset is unknown, told by an age of 0
+    unsigned long age = flashLog.Previous(i) ? 0 : max((millis() - records[i].time) / 1000, 1UL);
+    len += compactEncodeBackfill(frame + len, records[i].deviceID, records[i].fields, flashLog.Sequence(i), age,
+      records[i].var1, records[i].var2, records[i].var3);
+  }
+  linkUp = SendData(GATEWAYID, frame, len);
+#else
+  theData.deviceID = records[0].deviceID;
+  theData.var1_usl = records[0].var1;
+  theData.var2_float = records[0].var2;
+  theData.var3_float = records[0].var3;
+  count = 1;
+  linkUp = SendData(GATEWAYID, (const void*)(&theData), sizeof(theData));
+#endif
+  if (linkUp)
+    flashLog.Consume(count);
+  backfillTime = millis() + BACKFILL_INTERVAL;
+}
+
+// queue a reading for at most maxDelay ms, to share the frame of the readings due meanwhile
+// a newer reading of the same sensor replaces it
+void RadioActive::QueueReading(CompactSensor *sensor, byte deviceID, byte fields, unsigned long var1, float var2, float var3, unsigned long maxDelay) {
+  byte i;
+  for (i = 0; i < queuedCount && queued[i].sensor != sensor; i++)
+    ;
+  if (i == FRAME_READINGS) {
+    SendQueued();
+    i = 0;
+  }
+  if (i == queuedCount) {
+    if (queuedCount == 0 || Before(millis() + maxDelay, sendTime))
+      sendTime = millis() + maxDelay;
+    queuedCount++;
+  }
+  ScheduleBefore(sendTime);
+  queued[i].sensor = sensor;
+  queued[i].deviceID = deviceID;
+  queued[i].fields = fields;
+  queued[i].var1 = var1;
+  queued[i].var2 = var2;
+  queued[i].var3 = var3;
+  queued[i].time = millis();
+}
+
+boolean RadioActive::SendData(const uint8_t node, const void* data, const uint8_t length) {
   DEBUG1("Send Data ");
   DEBUG1(node);
   DEBUG1(" ");
   DEBUG1(length);
-  int i;
-  unsigned char *p = (unsigned char *)data;
-  if (radio.sendWithRetry(node, (const void*)(data), length/*, 2, 100*/)) {
+  boolean acked = radio.sendWithRetry(node, (const void*)(data), length/*, 2, 100*/);
+  if (acked) {
     // ackReceived++;
     DEBUGLN1(" ACK received");
   }
@@ -342,21 +1171,28 @@ void RadioActive::SendData(const uint8_t node, const void* data, const uint8_t l
   State = Transmit;
 
 #if defined (DEVICE_CLASS_A)
-  NextTime = millis();
+  offTime = millis();
 #elif defined (DEVICE_CLASS_B)
-  NextTime = millis() + CLASS_B_DELAY;
+  offTime = millis() + CLASS_B_DELAY;
 #elif defined (DEVICE_CLASS_C)
-  NextTime = FOREVER;
 #else
 #error "No radio Class Defined"
 #endif
   led.RequestBlink(1);
+  return acked;
 }
 
 int RadioActive::ReceiveData() {
   //check for any received packets
   if (radio.receiveDone()) {
-    // CheckForWirelessHEX(radio, flash);
+    // a firmware update comes in many frames without ACK, kept apart
+    byte data[RF69_MAX_DATA_LEN];
+    byte length = radio.DATALEN;
+    memcpy(data, (const void *)radio.DATA, length);
+    if (radio.SENDERID == GATEWAYID && fota.Receive(data, length)) {
+      radio.receiveDone();  // back to receive for the next block
+      return 0;
+    }
 
     DEBUG1('[');
     DEBUG2(radio.SENDERID, DEC);
@@ -383,32 +1219,47 @@ int RadioActive::ReceiveData() {
   }
 }
 
-unsigned long RadioActive::Run() {
+void RadioActive::Run() {
+#if defined (DEVICE_CLASS_A) || defined (DEVICE_CLASS_B)
+  if (State == Init) {
+    State = Standby;  // setup() put the radio to sleep until the first transmission
+  }
+#endif
   // do not check radio when it is in standby state. This in order to save battery, as any call to radio, when asleep, will power it back again
   if (State != Standby) {
     ReceiveData();
   }
 
-  if (millis() < NextTime) {
-    // we haven't yet reached a time where we have some state transition to happen, return imediately
-    return NextTime;
+  if (queuedCount > 0 && Due(sendTime)) {
+    SendQueued();
   }
 
-  switch (State) {
-  case Transmit:
+  if (linkUp && !flashLog.Empty() && Due(backfillTime)) {
+    SendBackfill();
+  }
 
 #if defined (DEVICE_CLASS_A) || defined (DEVICE_CLASS_B)
+  // the radio stays on during a firmware update
+  if (State == Transmit && Due(offTime) && !fota.Busy()) {
     DEBUGLN1("Switch off radio");
-    NextTime = FOREVER;
     radio.sleep();
+    State = Standby;
+  }
 #elif defined(DEVICE_CLASS_C)
 #else
 #error "No radio Class Defined"
 #endif
-    State = Standby;
-    break;
+
+  // while the radio is on, it is checked on every watchdog period, or at once during an update
+  if (State != Standby) {
+    ScheduleBefore(millis() + (fota.Busy() ? 0 : RADIO_POLL));
+  }
+  if (queuedCount > 0) {
+    ScheduleBefore(sendTime);
+  }
+  if (linkUp && !flashLog.Empty()) {
+    ScheduleBefore(backfillTime);
   }
-  return NextTime;
 }
 
 /////////////////////////////
@@ -417,30 +1268,25 @@ unsigned long RadioActive::Run() {
 void Led::RequestBlink(int blinkRequested) {
   remainingBlink = blinkRequested;
   State = PowerOn;
-  NextTime = millis() + 1;
+  Schedule(1);
 }
 
-unsigned long Led::Run() {
-  if (millis() < NextTime) {
-    // we haven't yet reached a time where we have some state transition to happen, return imediately
-    return NextTime;
-  }
+void Led::Run() {
   switch (State) {
   case Init:
     pinMode(LED, OUTPUT);
-    NextTime = FOREVER;
+    State = Standby;
     break;
   case Standby:
-    NextTime = FOREVER;
     break;
   case PowerOn:
     digitalWrite(LED, 1);
-    NextTime = millis() + blinkPeriod;
+    Schedule(blinkPeriod);
     State = PowerOff;
     break;
   case PowerOff:
     digitalWrite(LED, 0);
-    NextTime = millis() + blinkPeriod;
+    Schedule(blinkPeriod);
     if (--remainingBlink) {
       State = PowerOn;
     }
@@ -449,24 +1295,20 @@ unsigned long Led::Run() {
     }
     break;
   }
-  return NextTime;
 }
 
 /////////////////////////////
 // TEMP Sensor
 /////////////////////////////
-unsigned long DHT::Run() {
-  if (millis() < NextTime) {
-    // we haven't yet reached a time where we have some state transition to happen, return imediately
-    return NextTime;
-  }
+void DHT::Run() {
   switch (State) {
   case Init:
-    NextTime = millis() + TEMP_READ_DELAY;
+    Schedule(TEMP_READ_DELAY);
     State = Standby;
     break;
   case Standby:
     State = PowerOn;
+    Schedule(0);
     break;
   case PowerOn:
     DEBUGLN1("Power on DHT");
@@ -474,12 +1316,13 @@ unsigned long DHT::Run() {
     pinMode(DHTPOWERPIN, OUTPUT);
     digitalWrite(DHTPOWERPIN, 1);
     State = Stabilize;
-    NextTime = millis() + TEMP_STABILIZE_DELAY;
+    Schedule(TEMP_STABILIZE_DELAY);
     break;
   case Stabilize:
     //      if (millis() > temperatureTime) {
     State = Read;
     //      }
+    Schedule(0);
     break;
   case Read:
     chk = DHT.read21(DHTPIN);
@@ -520,6 +1363,7 @@ unsigned long DHT::Run() {
     h = DHT.humidity;
     // Read temperature as Celsius
     t = DHT.temperature;
+    Schedule(0);
 
     DEBUG1("Humidity=");
     DEBUG1(h);
@@ -530,21 +1374,17 @@ unsigned long DHT::Run() {
     break;
   case Transmit:
     //send data
-    theData.deviceID = 6;
-    theData.var1_usl = millis();
-    theData.var2_float = t;
-    theData.var3_float = h;
     //      frameSent++;
-    radioSend.SendData(GATEWAYID, (const void*)(&theData), sizeof(theData));
+    radioSend.QueueReading(&compact, 6, COMPACT_VAR1 | COMPACT_VAR2 | COMPACT_VAR3, millis(), t, h, FRAME_WINDOW);
 
     State = PowerOff;
+    Schedule(0);
     break;
   case PowerOff:
     State = Standby;
-    NextTime = millis() + TEMP_READ_DELAY;
+    Schedule(TEMP_READ_DELAY);
     break;
   }
-  return NextTime;
 }
 
 /////////////////////////
@@ -558,23 +1398,21 @@ static const float R2 = 989;  // 989K for a 1M - from GND to point of measure
 static const float resistorFactor = 255 / (R2 / (R1 + R2));
 static const int batteryPin = A0; // where battery is connected
 
-unsigned long Battery::Run() {
-  if (millis() < NextTime) {
-    // we haven't yet reached a time where we have some state transition to happen, return imediately
-    return NextTime;
-  }
+void Battery::Run() {
   int val;
   switch (State) {
   case Init:
     pinMode(BATTPIN, INPUT);
-    NextTime = millis();    // immediate read
+    Schedule(0);    // immediate read
     State = Standby;
     break;
   case Standby:
     State = Stabilize;
+    Schedule(0);
     break;
   case Stabilize:
     State = Read;
+    Schedule(0);
     power_adc_enable(); 
     analogRead(0);  // consume first read
     break;
@@ -583,22 +1421,20 @@ unsigned long Battery::Run() {
     power_adc_disable(); 
     DEBUGLN1(volts);
     State = Transmit;
+    Schedule(0);
     break;
   case Transmit:
     //send data
-    theData.deviceID = 7;
-    theData.var1_usl = millis();
-    theData.var2_float = volts;
-    theData.var3_float = 0;
-    radioSend.SendData(GATEWAYID, (const void*)(&theData), sizeof(theData));
+    // no var3, always 0. Not urgent, it goes along with the next temperature
+    radioSend.QueueReading(&compact, 7, COMPACT_VAR1 | COMPACT_VAR2, millis(), volts, 0, TEMP_READ_DELAY + FIVESECONDS);
     State = PowerOff;
+    Schedule(0);
     break;
   case PowerOff:
     State = Standby;
-    NextTime = millis() + BATT_READ_DELAY;
+    Schedule(BATT_READ_DELAY);
     break;
   }
-  return NextTime;
 }
 
 void setup() {
@@ -621,12 +1457,13 @@ void setup() {
   // disable the LED
   digitalWrite(LED, 0);
 
-  // configure RTC chip
-  pinMode(RTC_INT, INPUT);
+  // configure RTC chip, its MFP output is open drain
+  pinMode(RTC_INT, INPUT_PULLUP);
 
   pRTC = new MCP7940RTC();
   pRTC->set(1387798395);
   pRTC->setTimeRTC(1388534400); // 2014-01-01 00:00:00
+  RtcSleep::Begin();
 
   // configure Flash memory chip
   // put flash memory to sleep
@@ -635,6 +1472,10 @@ void setup() {
   //  SPIFlash flash(5); // flash(SPI_CS, MANUFACTURER_ID)
   if (flash.initialize()) {
     DEBUGLN1("Flash Init OK!");
+    // readings left unsent by the previous run go once the gateway answers
+    if (flashLog.Begin()) {
+      DEBUGLN1("Flash log not empty");
+    }
     flash.sleep();          // put flash (if it exists) into low power mode
     DEBUGLN1("Flash sleep");
   }
@@ -655,17 +1496,22 @@ void setup() {
   //  radio.promiscuous(true);
   radio.promiscuous(false);
   radio.sleep();
+
+  led.Start();
+  dht.Start();
+  battery.Start();
+  radioSend.Start();
 }
 
 void loop() {
-  uint32_t nextRun = FOREVER;
-  nextRun = min(nextRun, led.Run());
-  nextRun = min(nextRun, dht.Run());
-  nextRun = min(nextRun, battery.Run());
-  nextRun = min(nextRun, radioSend.Run());
-
-  long suspend = nextRun - millis();
-  if (suspend > 0 ) {
+  Active::RunDue();
+
+  // sleep until the next deadline: a single wake-up by the RTC for the long ones
+  unsigned long suspend = Active::TimeToNext();
+  if (suspend >= RTC_MIN_SLEEP) {
+    RtcSleep::Sleep(suspend);
+  }
+  else if (suspend > 0) {
     Sleepy::loseSomeTime(suspend);
   }
 }
\ No newline at end of file
@@ -9,34 +9,26 @@ File: Gateway.c
 This sketch receives RFM wireless data and forwards it to Mosquitto relay
 
 The messages are published with the format RFM/<network number>/<node_id>/up/<sensor_id><var>
-It also subscripe to Mosquitto Topics starting with RFM/<network_number>/<node_id>/down/<sensor_id>
+It also subscribes to the Mosquitto Topics RFM/<network_number>/<node_id>/down/<sensor_id>
 
 The message is parsed and put back to the same payload structure as the one received from the nodes
 
+Several brokers can be given, either as failover by priority or all mirrored.
+The connections are made in the background, so the radio is never left waiting
+
 
 Adjust network configuration to your setup in the file networkconfig.h
 */
 
 //general --------------------------------
 #define SERIAL_BAUD   115200
-#ifdef DAEMON
-#define LOG(...) do { syslog(LOG_INFO, __VA_ARGS__); } while (0)
-#define LOG_E(...) do { syslog(LOG_ERR, __VA_ARGS__); } while (0)
-#else
-#ifdef DEBUG
-#define DEBUG1(expression)  fprintf(stderr, expression)
-#define DEBUG2(expression, arg)  fprintf(stderr, expression, arg)
-#define DEBUGLN1(expression)  
-#define LOG(...) do { printf(__VA_ARGS__); } while (0)
-#define LOG_E(...) do { printf(__VA_ARGS__); } while (0)
-#else
-#define DEBUG1(expression)
-#define DEBUG2(expression, arg)
-#define DEBUGLN1(expression)
-#define LOG(...)
-#define LOG_E(...)
-#endif
-#endif
+// recorded in the main loop, formatted and written by the logger thread
+#include "logger.h"
+#define LOG(...) LOGGER(LOGGER_INFO, LOGGER_MAIN, __VA_ARGS__)
+#define LOG_E(...) LOGGER(LOGGER_ERROR, LOGGER_MAIN, __VA_ARGS__)
+#define LOG_FRAME(...) LOGGER(LOGGER_DEBUG, LOGGER_FRAME, __VA_ARGS__)
+#define LOG_BROKER(...) LOGGER(LOGGER_INFO, LOGGER_BROKER, __VA_ARGS__)
+#define LOG_DOWNLINK(...) LOGGER(LOGGER_INFO, LOGGER_DOWNLINK, __VA_ARGS__)
 
 //RFM69  ----------------------------------
 #include "rfm69.h"
@@ -54,10 +46,37 @@ Adjust network configuration to your setup in the file networkconfig.h
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
-
+#include <signal.h>
+#include <math.h>
+
+#include "ratelimit.h"
+#include "frame.h"
+#include "capture.h"
+#include "localbus.h"
+#include "peers.h"
+#include "compact.h"
+#include "fota.h"
+#include "router.h"
+#include "group.h"
+#include "relay.h"
+#include "serialrfm69.h"
+
+#define NWC_POLICY_DROP 0
+#define NWC_POLICY_MERGE 1
+#define NWC_BROKER_FAILOVER 0
+#define NWC_BROKER_MIRROR 1
 #include "networkconfig.h"
 
 RFM69 *rfm69;
+SerialRFM69 *modem = NULL;	// the radio, when on a serial modem
+FILE *captureFile = NULL;
+LocalBus localBus;
+Peers peers;
+CompactNode compactNodes[256];
+Fota fota;
+Groups groups;
+Relays relays;
+Router router;	// downlink topics to the radio of their network
 
 typedef struct {		
 	unsigned long messageWatchdog;
@@ -69,6 +88,34 @@ typedef struct {
 	unsigned long ackMissed;
 	
 	unsigned long ackCount;
+
+	unsigned long readingPublished;	// readings forwarded to the broker
+	unsigned long readingDropped;	// readings discarded by the rate limiter
+	unsigned long readingMerged;	// readings replaced by a newer one of the same sensor while waiting
+	unsigned long messageQueued;	// messages handed over to mosquitto
+	unsigned long messagePublished;	// messages written to the broker
+
+	unsigned long inFlightMax;		// highest number of messages waiting for the broker acknowledge
+	unsigned long inFlightExpired;	// messages never acknowledged
+	unsigned long inFlightResent;	// messages sent again after a reconnection
+	unsigned long inFlightOverflow;	// messages published when the window was already full
+	long publishLatencyTotal;		// time between publication and acknowledge, in ms
+	unsigned long publishLatencyCount;
+	long publishLatencyMax;
+	unsigned long disconnect;
+	unsigned long brokerFailures;	// connection attempts failed, and connections lost
+	unsigned long mirrorSkipped;	// messages not mirrored to a broker not connected
+	unsigned long downlinkCopies;	// downlink messages already received from another broker
+	unsigned long ackNotOwned;		// ACK left to the gateway owning the node
+	unsigned long ackByRelay;		// ACK left to the relay serving the node
+	unsigned long downlinkNotOwned;	// downlink messages left to the gateway owning the node
+	unsigned long compactFrames;	// compact frames received
+	unsigned long compactReadings;	// readings decoded from them
+	unsigned long compactBytes;		// size of these frames
+	unsigned long compactDuplicate;	// compact readings received again after a lost ACK
+	unsigned long compactUnsynced;	// compact deltas whose base was missed
+	unsigned long compactBackfill;	// readings logged by the nodes, received late
+	unsigned long freqCorrected;	// frames sent on the frequency of a node
 } 
 Stats;
 Stats theStats;
@@ -82,6 +129,44 @@ typedef struct {
 	bool isRFM69HW;
 	bool promiscuousMode;
 	unsigned long messageWatchdogDelay; // maximum time between two message before restarting radio module
+	float nodeRate;	// readings per second allowed for each node, 0 for no limit
+	float nodeBurst;
+	float globalRate;	// readings per second allowed for the whole gateway, 0 for no limit
+	float globalBurst;
+	unsigned long queueHighWater; // mosquitto outgoing queue depth above which readings are held back
+	uint8_t limitPolicy; // NWC_POLICY_DROP or NWC_POLICY_MERGE
+	unsigned long statsInterval; // time between two publications of the statistics
+	uint8_t qosReading; // QoS of the sensor variables
+	uint8_t qosRssi; // QoS of the RSSI
+	uint8_t qosStats; // QoS of the gateway statistics
+	int inFlightWindow; // maximum number of QoS 1 and 2 messages waiting for the acknowledge of each broker
+	unsigned long inFlightTimeout; // time after which an unacknowledged message leaves the window
+	const char *localShm; // shared memory ring of the readings, empty to disable
+	int localSlots; // number of readings in the ring
+	const char *localSocket; // Unix socket to subscribe to the readings, empty to disable
+	const char *brokers; // "host:port" list, by priority
+	uint8_t brokerMode; // NWC_BROKER_FAILOVER or NWC_BROKER_MIRROR
+	unsigned long reconnectMin; // first delay before connecting again to a broker
+	unsigned long reconnectMax; // longest delay, reached by doubling on each failure
+	uint8_t gatewayId; // identifies this gateway among the gateways of the network
+	const char *peers; // "host:port" list of the other gateways, empty when alone
+	int peerPort; // UDP port of the digest exchange
+	long electionWindow; // time a frame is held while the other gateways report it, in ms
+	const char *fotaDir; // directory of the firmware images for the nodes, empty to only take them from MQTT
+	uint8_t fotaWindow; // blocks sent before asking the node for its status
+	const char *groups; // groups of nodes, as "<group>:<node>,<node>;..."
+	uint8_t groupRounds; // frames sent for a group command, 0 for no answers
+	const char *relays; // node IDs of the relays, separated by commas
+	const char *serialDevice; // serial port of an Arduino radio modem, empty for the RFM69 on the SPI bus
+	long serialBaud;
+	int logLevel; // LOGGER_ERROR, LOGGER_INFO or LOGGER_DEBUG
+	const char *logFile; // file the log lines are appended to, empty for syslog as a daemon and stdout otherwise
+	float logRate; // lines per second of the frame, dump and downlink categories, 0 for no limit
+	float logBurst;
+	bool afc; // measure the frequency offset of the nodes
+	bool afcCorrection; // send to the nodes on their own frequency
+	unsigned long afcMinFrames; // frames measured before the offset of a node is used
+	long afcMinOffset; // smallest offset corrected, in Hz
 	}
 Config;
 Config theConfig;
@@ -92,15 +177,11 @@ Config theConfig;
 /* How many seconds the broker should wait between sending out
 * keep-alive messages. */
 #define KEEPALIVE_SECONDS 60
-/* Hostname and port for the MQTT broker. */
-#define BROKER_HOSTNAME "localhost"
+/* Port of the brokers given without one. */
 #define BROKER_PORT 1883
 
 #define MQTT_ROOT "RFM"
 #define MQTT_CLIENT_ID "arduinoClient"
-#define MQTT_RETRY 500
-
-int sendMQTT = 0;
 
 typedef struct {		
 	short           nodeID; 
@@ -119,37 +200,290 @@ typedef struct {
 	float           var2_float;
 	float			var3_float;		//
 	int             var4_int;
+	time_t          backfill;	// original time of a reading logged by the node, 0 for a live one
 }
 SensorNode;
 SensorNode sensorNode;
 
+// Publish stage ----------
+// Number of sensors of a node which can have a reading waiting for a token
+#define PENDING_SLOTS 4
+
+typedef struct {
+	bool used;
+	SensorNode reading;
+}
+PendingReading;
+
+typedef struct {
+	TokenBucket bucket;
+	PendingReading pending[PENDING_SLOTS];
+	uint8_t pendingCount;
+}
+NodeLimiter;
+NodeLimiter nodeLimiter[256];
+TokenBucket globalBucket;
+int pendingTotal = 0;
+
+// Frequency offset of the nodes, from the AFC
+#define FREQ_WEIGHT 0.1	// of a new frame in the mean
+
+typedef struct {
+	unsigned long frames;	// frames measured
+	unsigned long reported;	// frames at the last statistics
+	float offset;			// mean offset, in RF69_FSTEP
+	int16_t min, max;		// since the last statistics
+}
+NodeFrequency;
+NodeFrequency nodeFrequency[256];
+
+// messages of each node at the last statistics of its link, see RFM69::link()
+unsigned long linkReported[256];
+
+// Messages published with QoS 1 or 2, waiting for the broker acknowledge
+#define MAX_INFLIGHT 256	// for each broker
+#define MAX_BROKERS 4
+
+typedef struct {
+	int mid;	// mosquitto message id, unique for a broker
+	uint8_t broker;	// index in brokers
+	long sent;	// publication time
+}
+InFlight;
+InFlight inFlight[MAX_INFLIGHT * MAX_BROKERS];
+int inFlightCount = 0;		// all brokers
+
+// Broker connections -----
+
+typedef enum {
+	BROKER_IDLE,		// waiting for retryAt
+	BROKER_CONNECTING,	// attempt thread resolving and connecting, the connection is not touched
+	BROKER_HANDSHAKE,	// connected, waiting for the broker CONNACK
+	BROKER_CONNECTED
+}
+BrokerState;
+
+typedef struct {
+	char host[64];
+	int port;
+	struct mosquitto *mosq;
+	BrokerState state;
+	long since;				// time of the last state change
+	long retryAt;			// time of the next connection attempt
+	int failures;			// consecutive failures, for the backoff
+	bool started;			// first attempt done, the next ones reconnect
+	pthread_t attempt;
+	int attemptResult;		// written by the attempt thread
+	bool attemptDone;		// set by the attempt thread once attemptResult is written
+	unsigned long queued;	// messages handed over to this connection
+	unsigned long published;	// messages written to this broker
+	unsigned long resend;	// QoS 1 and 2 messages mosquitto sends again once reconnected
+}
+Broker;
+Broker brokers[MAX_BROKERS];
+int brokerCount = 0;
+
+// the downlink messages received lately, against their copies coming from the other brokers
+#define DOWNLINK_RECENT 16
+#define DOWNLINK_COPY_WINDOW 2000	// ms
+
+typedef struct {
+	uint32_t hash;		// of the topic and the payload
+	int broker;
+	long received;		// 0 when free
+}
+RecentDownlink;
+RecentDownlink recentDownlinks[DOWNLINK_RECENT];
+int recentDownlinkNext = 0;
+
 static void die(const char *msg);
 static long millis(void);
-static void hexDump (char *desc, void *addr, int len, int bloc);
+static void hexDump (const char *desc, const void *addr, int len);
 
 static int initRfm(RFM69 *rfm);
+static void processFrame(Frame *frame);
+static void followFrame(Frame *frame);
 
 static bool set_callbacks(struct mosquitto *m);
-static bool connect(struct mosquitto *m);
-static int run_loop(struct mosquitto *m);
+static bool brokersOpen(void);
+static void brokersLoop(int timeout);
+static bool brokersWait(long timeout);
+static int brokersConnected(void);
+static unsigned long brokersQueueDepth(void);
+static void brokersClose(void);
+static int run_loop(void);
+static int replay_loop(FILE *f, double speed);
+
+static bool MQTTPublish(const char *topic, const char *message, int qos);
+static void MQTTSendInt(int node, int sensor, int var, int val, int qos);
+static void MQTTSendULong(int node, int sensor, int var, unsigned long val, int qos);
+static void MQTTSendFloat(int node, int sensor, int var, float val, int qos);
+static void MQTTSendStat(const char *name, unsigned long val);
+static void MQTTSendBackfill(int node, int sensor, int var, const char *val, time_t time, int qos);
+static void MQTTSendFotaStatus(uint8_t node, const char *status);
+static void fotaRadioSend(uint8_t node, const uint8_t *data, uint8_t len);
+static void groupRadioSend(const uint8_t *data, uint8_t len);
+static bool relayRadioSend(uint8_t node, const void *data, uint8_t len);
+static bool unwrapRelayed(Frame *frame);
+static void MQTTSendGroupStatus(uint8_t group, const char *status);
+
+static void submitReading(SensorNode *reading);
+static void flushPending(void);
+static void inFlightExpire(long now);
+static void publishReading(SensorNode *reading);
+static void publishStats(void);
+static void nodeHeard(uint8_t node, int16_t offset);
+static void tuneToNode(uint8_t node);
+static void setupRoutes(void);
+
+/* Load the configuration from networkconfig.h and reset the rate limiters */
+static void setupConfig(void) {
+	theConfig.networkId = NWC_NETWORK_ID;
+	theConfig.nodeId = NWC_NODE_ID;
+	theConfig.frequency = NWC_FREQUENCY;
+	theConfig.keyLength = NWC_KEY_LENGTH;
+	memcpy(theConfig.key, NWC_KEY, NWC_KEY_LENGTH);
+	theConfig.isRFM69HW = NWC_RFM69H;
+	theConfig.promiscuousMode = NWC_PROMISCUOUS_MODE;
+	theConfig.messageWatchdogDelay = NWC_WATCHDOG_DELAY; // 1800 seconds (30 minutes) between two messages 
+	theConfig.nodeRate = NWC_NODE_RATE;
+	theConfig.nodeBurst = NWC_NODE_BURST;
+	theConfig.globalRate = NWC_GLOBAL_RATE;
+	theConfig.globalBurst = NWC_GLOBAL_BURST;
+	theConfig.queueHighWater = NWC_QUEUE_HIGH_WATER;
+	theConfig.limitPolicy = NWC_LIMIT_POLICY;
+	theConfig.statsInterval = NWC_STATS_INTERVAL;
+	theConfig.qosReading = NWC_QOS_READING;
+	theConfig.qosRssi = NWC_QOS_RSSI;
+	theConfig.qosStats = NWC_QOS_STATS;
+	theConfig.inFlightWindow = NWC_INFLIGHT_WINDOW > MAX_INFLIGHT ? MAX_INFLIGHT : NWC_INFLIGHT_WINDOW;
+	theConfig.inFlightTimeout = NWC_INFLIGHT_TIMEOUT;
+	theConfig.localShm = NWC_LOCAL_SHM;
+	theConfig.localSlots = NWC_LOCAL_SLOTS;
+	theConfig.localSocket = NWC_LOCAL_SOCKET;
+	theConfig.brokers = NWC_BROKERS;
+	theConfig.brokerMode = NWC_BROKER_MODE;
+	theConfig.reconnectMin = NWC_RECONNECT_MIN;
+	theConfig.reconnectMax = NWC_RECONNECT_MAX;
+	theConfig.gatewayId = NWC_GATEWAY_ID;
+	theConfig.peers = NWC_PEERS;
+	theConfig.peerPort = NWC_PEER_PORT;
+	theConfig.electionWindow = NWC_ELECTION_WINDOW;
+	theConfig.fotaDir = NWC_FOTA_DIR;
+	theConfig.fotaWindow = NWC_FOTA_WINDOW;
+	theConfig.groups = NWC_GROUPS;
+	theConfig.groupRounds = NWC_GROUP_ROUNDS;
+	theConfig.relays = NWC_RELAYS;
+	theConfig.serialDevice = NWC_SERIAL_DEVICE;
+	theConfig.serialBaud = NWC_SERIAL_BAUD;
+#ifdef DEBUG
+	theConfig.logLevel = LOGGER_DEBUG;
+#else
+	theConfig.logLevel = NWC_LOG_LEVEL;
+#endif
+	theConfig.logFile = NWC_LOG_FILE;
+	theConfig.logRate = NWC_LOG_RATE;
+	theConfig.logBurst = NWC_LOG_BURST;
+	theConfig.afc = NWC_AFC;
+	theConfig.afcCorrection = NWC_AFC_CORRECTION;
+	theConfig.afcMinFrames = NWC_AFC_MIN_FRAMES;
+	theConfig.afcMinOffset = NWC_AFC_MIN_OFFSET;
+
+	long now = millis();
+	for (int i = 0; i < 256; i++)
+		tokenBucketInit(&nodeLimiter[i].bucket, theConfig.nodeRate, theConfig.nodeBurst, now);
+	tokenBucketInit(&globalBucket, theConfig.globalRate, theConfig.globalBurst, now);
+}
 
-static void MQTTSendInt(struct mosquitto * _client, int node, int sensor, int var, int val);
-static void MQTTSendULong(struct mosquitto* _client, int node, int sensor, int var, unsigned long val);
-static void MQTTSendFloat(struct mosquitto* _client, int node, int sensor, int var, float val);
+/* The downlink topics of the network, all to the radio; the subscriptions are made on each connection */
+static void setupRoutes(void) {
+	routerInit(&router, MQTT_ROOT);
+	// the downlinks at most once, a late message being useless; the firmware images surely
+	routerAddNetwork(&router, theConfig.networkId, 0, 0, 1);
+	if (theConfig.groups[0])
+		routerAddGroups(&router, theConfig.networkId, 0);
+}
 
+// The benchmarks include this file with GATEWAY_NO_MAIN, to drive the pipeline directly
+#ifndef GATEWAY_NO_MAIN
 static void uso(void) {
-	fprintf(stderr, "Use:\n Simply use it without args :D\n");
+	fprintf(stderr, "Use:\n Simply use it without args :D\n"
+		" -c <file>  capture every received frame to a pcap file\n"
+		" -r <file>  replay a capture through the pipeline instead of listening to the radio\n"
+		" -s <speed> replay speed, 1 for the recorded pace, 0 for as fast as possible (default 1)\n"
+		" -m <port>  use an Arduino running Gateway.ino in SERIAL_MODEM mode as the radio\n"
+		" -l <file>  append the log to a file\n"
+		" -v         log more, every frame with -v; the log level is also changed with SIGUSR1 and SIGUSR2\n"
+		" -q         log less, only the errors\n");
 	exit(1);
 }
 
+/* SIGUSR1 and SIGUSR2 change the log level while running */
+static void logLouder(int sig) {
+	loggerSetLevel(loggerLevel + 1);
+}
+
+static void logQuieter(int sig) {
+	loggerSetLevel(loggerLevel - 1);
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 1) uso();
+	const char *replayPath = NULL;
+	const char *serialDevice = NULL;
+	char logPath[256] = "";
+	int verbosity = 0;
+	FILE *replayFile = NULL;
+	double replaySpeed = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:r:s:m:l:vq")) != -1) {
+		switch (opt) {
+		case 'c':
+			// opened before becoming a daemon, so relative paths are still valid
+			captureFile = captureOpen(optarg);
+			if (captureFile == NULL) { die("unable to create capture file\n"); }
+			break;
+		case 'r':
+			replayPath = optarg;
+			break;
+		case 's':
+			replaySpeed = atof(optarg);
+			break;
+		case 'm':
+			serialDevice = optarg;
+			break;
+		case 'l':
+			// made absolute before becoming a daemon
+			if (optarg[0] == '/' || getcwd(logPath, sizeof(logPath) - 1) == NULL)
+				logPath[0] = '\0';
+			else
+				strcat(logPath, "/");
+			strncat(logPath, optarg, sizeof(logPath) - strlen(logPath) - 1);
+			break;
+		case 'v':
+			verbosity++;
+			break;
+		case 'q':
+			verbosity--;
+			break;
+		default:
+			uso();
+		}
+	}
+	if (optind != argc) uso();
+
+	if (replayPath != NULL) {
+		replayFile = replayOpen(replayPath);
+		if (replayFile == NULL) { die("unable to read capture file\n"); }
+	}
 
 #ifdef DAEMON
 	//Adapted from http://www.netzmafia.de/skripten/unix/linux-daemon-howto.html
 	pid_t pid, sid;
 
 	openlog("Gatewayd", LOG_PID, LOG_USER);
+	// until the logger is open, stdout being closed soon
+	loggerSetDirect(NULL);
 
 	pid = fork();
 	if (pid < 0) {
@@ -185,43 +519,89 @@ int main(int argc, char* argv[]) {
 	close(STDERR_FILENO);
 #endif //DAEMON
 
+	//RFM69 ---------------------------
+	setupConfig();
+	if (serialDevice != NULL)
+		theConfig.serialDevice = serialDevice;
+
+	// Logging ------------------------
+	// the thread is started after the fork, which it would not survive
+	if (logPath[0])
+		theConfig.logFile = logPath;
+	loggerSetRate(LOGGER_FRAME, theConfig.logRate, theConfig.logBurst);
+	loggerSetRate(LOGGER_DUMP, theConfig.logRate, theConfig.logBurst);
+	loggerSetRate(LOGGER_DOWNLINK, theConfig.logRate, theConfig.logBurst);
+	const char *logTo = theConfig.logFile;
+#ifdef DAEMON
+	if (!logTo[0])
+		logTo = NULL;
+#endif
+	if (!loggerOpen(logTo, theConfig.logLevel + verbosity)) { die("unable to open the log\n"); }
+	signal(SIGUSR1, logLouder);
+	signal(SIGUSR2, logQuieter);
+
 	// Mosquitto ----------------------
-	struct mosquitto *m = mosquitto_new(MQTT_CLIENT_ID, true, null);
-	if (m == NULL) { die("init() failure\n"); }
+	setupRoutes();
+	// connected in the background by run_loop, readings are held back meanwhile
+	if (!brokersOpen()) { die("init() failure\n"); }
+
+	// Local consumers --------------
+	if (!localBusOpen(&localBus, theConfig.localShm, theConfig.localSlots, theConfig.localSocket)) {
+		// the broker, and the consumers of the other transport, still get the readings
+		if (localBus.ringError)
+			LOG_E("Local shared memory %s unavailable: %s\n", theConfig.localShm, strerror(localBus.ringError));
+		if (localBus.socketError)
+			LOG_E("Local socket %s unavailable: %s\n", theConfig.localSocket, strerror(localBus.socketError));
+	}
 
-	if (!set_callbacks(m)) { die("set_callbacks() failure\n"); }
-	if (!connect(m)) { die("connect() failure\n"); }
+	// Other gateways ---------------
+	if (!peersOpen(&peers, theConfig.gatewayId, theConfig.peerPort, theConfig.peers, theConfig.electionWindow)) {
+		// alone, every frame is published: duplicates, but no loss
+		LOG_E("Gateway cooperation unavailable: %s\n", strerror(errno));
+	}
 
-	//RFM69 ---------------------------
-	theConfig.networkId = NWC_NETWORK_ID;
-	theConfig.nodeId = NWC_NODE_ID;
-	theConfig.frequency = NWC_FREQUENCY;
-	theConfig.keyLength = NWC_KEY_LENGTH;
-	memcpy(theConfig.key, NWC_KEY, NWC_KEY_LENGTH);
-	theConfig.isRFM69HW = NWC_RFM69H;
-	theConfig.promiscuousMode = NWC_PROMISCUOUS_MODE;
-	theConfig.messageWatchdogDelay = NWC_WATCHDOG_DELAY; // 1800 seconds (30 minutes) between two messages 
+	// Relays -----------------------
+	// before the replay too, which unwraps the relayed frames captured
+	if (!relaysOpen(&relays, theConfig.nodeId, theConfig.relays, relayRadioSend))
+		LOG_E("Invalid relays \"%s\", nodes not relayed\n", theConfig.relays);
+
+	if (replayFile != NULL) {
+		LOG("Replaying %s\n", replayPath);
+		if (!brokersWait(KEEPALIVE_SECONDS * 1000L)) { die("connect() failure\n"); }
+		return replay_loop(replayFile, replaySpeed);
+	}
 
-	rfm69 = new RFM69();
-	rfm69->initialize(theConfig.frequency,theConfig.nodeId,theConfig.networkId);
+	if (theConfig.serialDevice[0]) {
+		modem = new SerialRFM69(theConfig.serialDevice, theConfig.serialBaud);
+		// alone and without relays, every ACK is answered: the modem does it, without the round trip through the host
+		modem->setAutoAck(!peers.active && !relays.active);
+		rfm69 = modem;
+	}
+	else
+		rfm69 = new RFM69();
+	if (!rfm69->initialize(theConfig.frequency,theConfig.nodeId,theConfig.networkId) && modem != NULL) {
+		// opened again in the background
+		LOG_E("Radio modem not answering on %s\n", theConfig.serialDevice);
+	}
 	initRfm(rfm69);
 
-	// Mosquitto subscription ---------
-	char subsciptionMask[128];
-	sprintf(subsciptionMask, "%s/%03d/#/down", MQTT_ROOT, theConfig.networkId);
-	LOG("Subscribe to Mosquitto topic: %s\n", subsciptionMask);
-	mosquitto_subscribe(m, NULL, subsciptionMask, 0);
-	
+	// Firmware updates -------------
+	fotaOpen(&fota, theConfig.fotaDir, theConfig.fotaWindow, fotaRadioSend, MQTTSendFotaStatus);
+	if (!groupsOpen(&groups, theConfig.groups, theConfig.groupRounds, groupRadioSend, MQTTSendGroupStatus))
+		LOG_E("Invalid groups \"%s\", group commands not sent\n", theConfig.groups);
+
 	LOG("setup complete\n");
-	return run_loop(m);
+	return run_loop();
 }  // end of setup
+#endif // GATEWAY_NO_MAIN
 
 /* Loop until it is explicitly halted or the network is lost, then clean up. */
-static int run_loop(struct mosquitto *m) {
-	int res;
+static int run_loop(void) {
 	long lastMess; 
+	long lastStats = millis();
 	for (;;) {
-		res = mosquitto_loop(m, 10, 1);
+		// also connects the brokers again, without waiting; not at all while the modem has frames queued
+		brokersLoop(modem != NULL && modem->pending() ? 0 : 10);
 
 		// No messages have been received withing MESSAGE_WATCHDOG interval
 		if (millis() > lastMess + theConfig.messageWatchdogDelay) {
@@ -240,20 +620,36 @@ static int run_loop(struct mosquitto *m) {
 			
 			// store the received data localy, so they can be overwited
 			// This will allow to send ACK immediately after
-			uint8_t data[RF69_MAX_DATA_LEN]; // recv/xmit buf, including header & crc bytes
-			uint8_t dataLength = rfm69->DATALEN;
-			memcpy(data, (void *)rfm69->DATA, dataLength);
-			uint8_t theNodeID = rfm69->SENDERID;
-			uint8_t targetID = rfm69->TARGETID; // should match _address
-			uint8_t PAYLOADLEN = rfm69->PAYLOADLEN;
-			uint8_t ACK_REQUESTED = rfm69->ACK_REQUESTED;
-			uint8_t ACK_RECEIVED = rfm69->ACK_RECEIVED; // should be polled immediately after sending a packet with ACK request
-			int16_t RSSI = rfm69->RSSI; // most accurate RSSI during reception (closest to the reception)
-
-			if (ACK_REQUESTED  && targetID == theConfig.nodeId) {
+			Frame frame;
+			if (modem != NULL)
+				frame.timestamp = modem->receivedAt();
+			else
+				gettimeofday(&frame.timestamp, NULL);
+			frame.dataLength = rfm69->DATALEN;
+			memcpy(frame.data, (void *)rfm69->DATA, frame.dataLength);
+			frame.senderID = rfm69->SENDERID;
+			frame.targetID = rfm69->TARGETID; // should match _address
+			frame.ctl = (rfm69->ACK_RECEIVED ? RFM69_CTL_SENDACK : 0) | (rfm69->ACK_REQUESTED ? RFM69_CTL_REQACK : 0);
+			frame.rssi = rfm69->RSSI; // most accurate RSSI during reception (closest to the reception)
+			if (theConfig.afc && modem == NULL)
+				nodeHeard(frame.senderID, rfm69->FREQOFFSET);
+
+			// the RSSI of the sender, for the routes, and the copies of the frames already come through a relay
+			bool firstCopy = relayHeard(&relays, &frame, lastMess);
+
+			if ((frame.ctl & RFM69_CTL_REQACK) && frame.targetID == theConfig.nodeId && relayServes(&relays, frame.senderID)) {
+				// the relay of the node has answered, at once
+				theStats.ackByRelay++;
+			}
+			else if ((frame.ctl & RFM69_CTL_REQACK) && frame.targetID == theConfig.nodeId && !peersOwnsNode(&peers, frame.senderID, lastMess)) {
+				// another gateway hears the node better, and answers it
+				theStats.ackNotOwned++;
+			}
+			else if ((frame.ctl & RFM69_CTL_REQACK) && frame.targetID == theConfig.nodeId) {
 				// When a node requests an ACK, respond to the ACK
 				// but only if the Node ID is correct
 				theStats.ackRequested++;
+				tuneToNode(frame.senderID);
 				rfm69->sendACK();
 				
 				if (theStats.ackCount++%3==0) {
@@ -262,74 +658,335 @@ static int run_loop(struct mosquitto *m) {
 
 					usleep(3000);  //need this when sending right after reception .. ?
 					theStats.messageSent++;
-					if (rfm69->sendWithRetry(theNodeID, "ACK TEST", 8)) { // 3 retry, over 200ms delay each
+					if (rfm69->sendAdaptive(frame.senderID, "ACK TEST", 8)) { // ACK wait and retries learnt for the node
 						theStats.ackReceived++;
-						LOG("Pinging node %d - ACK - ok!", theNodeID);
+						LOG_FRAME("Pinging node %d - ACK - ok!", frame.senderID);
 					}
 					else {
 						theStats.ackMissed++;
-						LOG("Pinging node %d - ACK - nothing!", theNodeID);
+						LOG_FRAME("Pinging node %d - ACK - nothing!", frame.senderID);
 					}
 				}
+				rfm69->setFrequencyOffset(0);
 			}//end if radio.ACK_REQESTED
-	
-			LOG("[%d] to [%d] ", theNodeID, targetID);
-
-			if (dataLength != sizeof(Payload)) {
-				LOG("Invalid payload received, not matching Payload struct! %d - %d\r\n", dataLength, sizeof(Payload));
-				hexDump(NULL, data, dataLength, 16);		
-			} else {
-				theData = *(Payload*)data; //assume radio.DATA actually contains our struct and not something else
-
-				//save it for mosquitto:
-				sensorNode.nodeID = theData.nodeID;
-				sensorNode.sensorID = theData.sensorID;
-				sensorNode.var1_usl = theData.var1_usl;
-				sensorNode.var2_float = theData.var2_float;
-				sensorNode.var3_float = theData.var3_float;
-				sensorNode.var4_int = RSSI;
-
-				LOG("Received Node ID = %d Device ID = %d Time = %d  RSSI = %d var2 = %f var3 = %f\n",
-					sensorNode.nodeID,
-					sensorNode.sensorID,
-					sensorNode.var1_usl,
-					sensorNode.var4_int,
-					sensorNode.var2_float,
-					sensorNode.var3_float
-				);
-				if (sensorNode.nodeID == theNodeID)
-					sendMQTT = 1;
-				else {
-					hexDump(NULL, data, dataLength, 16);
-				}
-			}  
-		} //end if radio.receive
 
-		if (sendMQTT == 1) {
-			//send var1_usl
-			MQTTSendULong(m, sensorNode.nodeID, sensorNode.sensorID, 1, sensorNode.var1_usl);
+			if (captureFile != NULL && !captureWrite(captureFile, &frame)) {
+				LOG_E("Capture write failed, capture stopped\n");
+				fclose(captureFile);
+				captureFile = NULL;
+			}
 
-			//send var2_float
-			MQTTSendFloat(m, sensorNode.nodeID, sensorNode.sensorID, 2, sensorNode.var2_float);
+			if (frame.dataLength > 0 && frame.data[0] == FOTA_MARKER) {
+				// the answers of a node being updated, never published
+				if (frame.targetID == theConfig.nodeId)
+					fotaReceive(&fota, frame.senderID, frame.data, frame.dataLength, millis());
+			}
+			else if (frame.dataLength > 0 && frame.data[0] == GROUP_MARKER) {
+				// the answers to a group command, never published
+				if (frame.targetID == theConfig.nodeId)
+					groupReceive(&groups, frame.senderID, frame.data, frame.dataLength);
+			}
+			else if (frame.dataLength > 0 && frame.data[0] == RELAY_MARKER) {
+				if (unwrapRelayed(&frame) && (!peers.active || !peersSubmit(&peers, &frame, millis())))
+					processFrame(&frame);
+			}
+			// with other gateways, only the one hearing the frame best publishes it
+			else if (firstCopy && (!peers.active || !peersSubmit(&peers, &frame, millis())))
+				processFrame(&frame);
 
-			//send var3_float
-			MQTTSendFloat(m, sensorNode.nodeID, sensorNode.sensorID, 3, sensorNode.var3_float);
+			// the node just sent, its radio is on: time to start a waiting update; not through a relay
+			if (peersOwnsNode(&peers, frame.senderID, millis()) && !relayServes(&relays, frame.senderID))
+				fotaHeard(&fota, frame.senderID, millis());
+		} //end if radio.receive
 
-			//send var4_int, RSSI
-			MQTTSendInt(m, sensorNode.nodeID, sensorNode.sensorID, 4, sensorNode.var4_int);
+		peersPoll(&peers, millis());
+		Frame decided;
+		bool won;
+		while (peersNextDecided(&peers, millis(), &decided, &won)) {
+			if (won)
+				processFrame(&decided);
+			else
+				followFrame(&decided);
+		}
 
-			sendMQTT = 0;
-		}//end if sendMQTT
+		// send the readings held back by the rate limiter, as soon as tokens are available
+		// and room is made in the window
+		inFlightExpire(millis());
+		flushPending();
+		localBusPoll(&localBus);
+		// at most one block of a firmware update per turn
+		fotaPoll(&fota, millis());
+		// the rounds of a group command, once its answer slots are over
+		groupPoll(&groups, millis());
+		// the routes through the relays, and their tables
+		relayPoll(&relays, millis());
+
+		if (theConfig.statsInterval && millis() - lastStats > theConfig.statsInterval) {
+			publishStats();
+			lastStats = millis();
+		}
 	}
 
-	mosquitto_destroy(m);
+	fotaClose(&fota);
+	localBusClose(&localBus);
+	brokersClose();
 	(void)mosquitto_lib_cleanup();
+	loggerClose();
+	return 0;
+}
 
-	if (res == MOSQ_ERR_SUCCESS) {
-		return 0;
+/* Send a frame of a firmware update, without radio ACK: the transfer has its own */
+static void fotaRadioSend(uint8_t node, const uint8_t *data, uint8_t len) {
+	theStats.messageSent++;
+	tuneToNode(node);
+	rfm69->send(node, data, len, false);
+	rfm69->setFrequencyOffset(0);
+	// back to receive at once, the node answers the status requests right away;
+	// the modem always listens, and there receiveDone() would take a frame
+	if (modem == NULL)
+		rfm69->receiveDone();
+}
+
+/* Send a group command, to every node at once */
+static void groupRadioSend(const uint8_t *data, uint8_t len) {
+	theStats.messageSent++;
+	rfm69->send(RF69_BROADCAST_ADDR, data, len, false);
+	// back to receive at once, the first answer comes GROUP_SLOT ms after the command
+	if (modem == NULL)
+		rfm69->receiveDone();
+}
+
+/* A frame forwarded by a relay, processed as the node sent it; false when nothing is left to process */
+static bool unwrapRelayed(Frame *frame) {
+	if (frame->dataLength == 0 || frame->data[0] != RELAY_MARKER)
+		return true;
+	return frame->targetID == theConfig.nodeId && relayReceive(&relays, frame, millis());
+}
+
+/* Send to a node in range, a relay or a node direct, on its frequency */
+static bool relayRadioSend(uint8_t node, const void *data, uint8_t len) {
+	tuneToNode(node);
+	bool acked = rfm69->sendAdaptive(node, data, len);
+	rfm69->setFrequencyOffset(0);
+	return acked;
+}
+
+/* Follow the frequency offset of a node, measured by the AFC on each of its frames */
+static void nodeHeard(uint8_t node, int16_t offset) {
+	NodeFrequency *nf = &nodeFrequency[node];
+	if (nf->frames == 0)
+		nf->offset = offset;
+	else
+		nf->offset += (offset - nf->offset) * FREQ_WEIGHT;
+	if (nf->frames == nf->reported || offset < nf->min)
+		nf->min = offset;
+	if (nf->frames == nf->reported || offset > nf->max)
+		nf->max = offset;
+	nf->frames++;
+}
+
+/* Send on the frequency of the node, once its offset is known and worth it,
+   so a node with a drifting crystal gets the frame in the middle of its receiver bandwidth.
+   Back with setFrequencyOffset(0) before listening to the other nodes */
+static void tuneToNode(uint8_t node) {
+	NodeFrequency *nf = &nodeFrequency[node];
+	int16_t offset = 0;
+	if (theConfig.afcCorrection && node != RF69_BROADCAST_ADDR && nf->frames >= theConfig.afcMinFrames
+			&& fabsf(nf->offset) * RF69_FSTEP >= theConfig.afcMinOffset) {
+		offset = lroundf(nf->offset);
+		theStats.freqCorrected++;
+	}
+	rfm69->setFrequencyOffset(offset);
+}
+
+/* Forward a reading to the local consumers and the broker */
+static void forwardReading(Frame *frame, SensorNode *reading) {
+	if (localBus.active) {
+		// the local consumers get every reading, the limits only protect the broker
+		LocalReading local;
+		if (reading->backfill)
+			local.timestamp = reading->backfill * 1000000LL;
+		else
+			local.timestamp = frame->timestamp.tv_sec * 1000000LL + frame->timestamp.tv_usec;
+		local.networkID = theConfig.networkId;
+		local.nodeID = reading->nodeID;
+		local.sensorID = reading->sensorID;
+		local.gatewayID = theConfig.gatewayId;
+		local.rssi = frame->rssi;
+		local.reserved2 = 0;
+		local.var1 = reading->var1_usl;
+		local.var2 = reading->var2_float;
+		local.var3 = reading->var3_float;
+		localBusPublish(&localBus, &local);
+	}
+	submitReading(reading);
+}
+
+/* Decode a compact frame against the previous readings of the node, see compact.h
+   Each reading of the frame is forwarded on its own, when publish is set */
+static void processCompact(Frame *frame, bool publish) {
+	CompactReading reading;
+	const uint8_t *next = frame->data + 1;
+	const uint8_t *end = frame->data + frame->dataLength;
+	theStats.compactFrames++;
+	theStats.compactBytes += frame->dataLength;
+	while (next < end) {
+		switch (compactDecode(&compactNodes[frame->senderID], &next, end, &reading)) {
+		case COMPACT_OK:
+			theStats.compactReadings++;
+			if (!publish)
+				break;
+			sensorNode.nodeID = frame->senderID;
+			sensorNode.sensorID = reading.sensorID;
+			sensorNode.var1_usl = reading.var1;
+			sensorNode.var2_float = reading.var2;
+			sensorNode.var3_float = reading.var3;
+			sensorNode.var4_int = frame->rssi;
+			sensorNode.backfill = 0;
+			if (reading.backfill) {
+				// an unknown age is taken as now
+				sensorNode.backfill = frame->timestamp.tv_sec - reading.age;
+				theStats.compactBackfill++;
+				LOG_FRAME("[%d] to [%d] Backfilled reading, %u s old\n", frame->senderID, frame->targetID, reading.age);
+			}
+			LOG_FRAME("[%d] to [%d] Received compact Node ID = %d Device ID = %d Time = %lu  RSSI = %d var2 = %f var3 = %f\n",
+				frame->senderID,
+				frame->targetID,
+				sensorNode.nodeID,
+				sensorNode.sensorID,
+				sensorNode.var1_usl,
+				sensorNode.var4_int,
+				sensorNode.var2_float,
+				sensorNode.var3_float
+			);
+			forwardReading(frame, &sensorNode);
+			break;
+		case COMPACT_DUPLICATE:
+			theStats.compactDuplicate++;
+			LOG_FRAME("[%d] to [%d] Compact reading received again\n", frame->senderID, frame->targetID);
+			break;
+		case COMPACT_UNSYNCED:
+			theStats.compactUnsynced++;
+			LOG_FRAME("[%d] to [%d] Compact delta without its base, waiting for a key reading\n", frame->senderID, frame->targetID);
+			break;
+		case COMPACT_INVALID:
+			// the readings before are kept, the rest of the frame cannot be split
+			LOG_FRAME("[%d] to [%d] Invalid compact payload received\n", frame->senderID, frame->targetID);
+			hexDump(NULL, frame->data, frame->dataLength);
+			return;
+		}
+	}
+}
+
+/* Decode a frame received from a node, and forward its readings */
+static void processFrame(Frame *frame) {
+	if (frame->dataLength > 0 && frame->data[0] == COMPACT_MARKER) {
+		processCompact(frame, true);
+	} else if (frame->dataLength != sizeof(Payload)) {
+		LOG_FRAME("[%d] to [%d] Invalid payload received, not matching Payload struct! %d - %d\r\n", frame->senderID, frame->targetID, frame->dataLength, (int)sizeof(Payload));
+		hexDump(NULL, frame->data, frame->dataLength);		
 	} else {
-		return 1;
+		theData = *(Payload*)frame->data; //assume radio.DATA actually contains our struct and not something else
+
+		//save it for mosquitto:
+		sensorNode.nodeID = theData.nodeID;
+		sensorNode.sensorID = theData.sensorID;
+		sensorNode.var1_usl = theData.var1_usl;
+		sensorNode.var2_float = theData.var2_float;
+		sensorNode.var3_float = theData.var3_float;
+		sensorNode.var4_int = frame->rssi;
+		sensorNode.backfill = 0;
+
+		LOG_FRAME("[%d] to [%d] Received Node ID = %d Device ID = %d Time = %lu  RSSI = %d var2 = %f var3 = %f\n",
+			frame->senderID,
+			frame->targetID,
+			sensorNode.nodeID,
+			sensorNode.sensorID,
+			sensorNode.var1_usl,
+			sensorNode.var4_int,
+			sensorNode.var2_float,
+			sensorNode.var3_float
+		);
+		if (sensorNode.nodeID == frame->senderID) {
+			forwardReading(frame, &sensorNode);
+		}
+		else {
+			hexDump(NULL, frame->data, frame->dataLength);
+		}
+	}  
+}
+
+/* A frame published by another gateway: the compact decoding state still follows it,
+   the next delta of the node may be won here */
+static void followFrame(Frame *frame) {
+	if (frame->dataLength > 0 && frame->data[0] == COMPACT_MARKER)
+		processCompact(frame, false);
+}
+
+static long elapsedMicros(struct timeval *from, struct timeval *to) {
+	return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_usec - from->tv_usec);
+}
+
+/* Feed a capture through the decode and publish pipeline, instead of the radio.
+ * Frames are played at the recorded pace divided by speed, or as fast as possible when speed is 0 */
+static int replay_loop(FILE *f, double speed) {
+	Frame frame;
+	struct timeval firstFrame, start, now;
+	unsigned long frames = 0;
+
+	gettimeofday(&start, NULL);
+	while (replayRead(f, &frame)) {
+		if (frames == 0)
+			firstFrame = frame.timestamp;
+
+		if (speed > 0) {
+			long due = elapsedMicros(&firstFrame, &frame.timestamp) / speed;
+			for (;;) {
+				gettimeofday(&now, NULL);
+				long wait = due - elapsedMicros(&start, &now);
+				if (wait <= 0)
+					break;
+				// keep the broker connection serviced while waiting for the frame time
+				brokersLoop(wait > 10000 ? 10 : wait / 1000);
+				flushPending();
+				localBusPoll(&localBus);
+			}
+		}
+		else {
+			brokersLoop(0);
+			localBusPoll(&localBus);
+		}
+
+		frames++;
+		theStats.messageReceived++;
+		// captured as received, wrapped by the relay
+		if (unwrapRelayed(&frame))
+			processFrame(&frame);
+		flushPending();
 	}
+	fclose(f);
+
+	// let the rate limiter and the outgoing queues drain
+	while (pendingTotal > 0 || brokersQueueDepth() > 0) {
+		brokersLoop(10);
+		if (!brokersConnected())
+			break;
+		flushPending();
+	}
+	int res = brokersConnected() ? 0 : 1;
+	gettimeofday(&now, NULL);
+
+	long duration = elapsedMicros(&start, &now);
+	fprintf(stderr, "Replayed %lu frames in %.3f s (%.1f frames/s), %lu readings published, %lu dropped, %lu merged\n",
+		frames, duration / 1e6, duration > 0 ? frames * 1e6 / duration : 0.0,
+		theStats.readingPublished, theStats.readingDropped, theStats.readingMerged);
+
+	localBusClose(&localBus);
+	brokersClose();
+	(void)mosquitto_lib_cleanup();
+	loggerClose();
+
+	return res;
 }
 
 static int initRfm(RFM69 *rfm) {
@@ -339,6 +996,7 @@ static int initRfm(RFM69 *rfm) {
 	if (theConfig.keyLength)
 		rfm->encrypt(theConfig.key);
 	rfm->promiscuous(theConfig.promiscuousMode);
+	rfm->setAfc(theConfig.afc);
 	LOG("Listening at %d Mhz...\n", theConfig.frequency==RF69_433MHZ ? 433 : theConfig.frequency==RF69_868MHZ ? 868 : 915);
 }
 
@@ -357,93 +1015,424 @@ static long millis(void) {
 	}
 
 	
-/* Binary Dump utility function */
-#define MAX_BLOC 16
-const unsigned char hex_asc[] = "0123456789abcdef";
-static void hexDump (char *desc, void *addr, int len, int bloc) {
-    int i, lx, la, l, line;
-	long offset = 0;
-    unsigned char hexbuf[MAX_BLOC * 3 + 1];	// Hex part of the data (2 char + 1 space)
-	unsigned char ascbuf[MAX_BLOC + 1];	// ASCII part of the data
-    unsigned char *pc = (unsigned char*)addr;
-	unsigned char ch;
-	
-	// nothing to output
-	if (!len)
+/* Binary Dump utility function, the lines are formatted by the logger thread */
+static void hexDump (const char *desc, const void *addr, int len) {
+	loggerDump(LOGGER_DEBUG, LOGGER_DUMP, desc, addr, len);
+}
+
+/* Messages of the broker waiting for its acknowledge */
+static int inFlightOf(int broker) {
+	int count = 0;
+	for (int i = 0; i < inFlightCount; i++)
+		count += inFlight[i].broker == broker;
+	return count;
+}
+
+/* Track the QoS 1 and 2 messages until the broker acknowledges them */
+static void inFlightAdd(int broker, int mid) {
+	if (inFlightCount >= MAX_INFLIGHT * MAX_BROKERS) {
+		// should not happen, as readings are held back when the window is full
+		theStats.inFlightOverflow++;
 		return;
+	}
+	inFlight[inFlightCount].mid = mid;
+	inFlight[inFlightCount].broker = broker;
+	inFlight[inFlightCount].sent = millis();
+	inFlightCount++;
+	if (inFlightCount > theStats.inFlightMax)
+		theStats.inFlightMax = inFlightCount;
+}
 
-	// Limit the line length to MAX_BLOC
-	if (bloc > MAX_BLOC) 
-		bloc = MAX_BLOC;
-		
-	// Output description if given.
-    if (desc != NULL)
-		LOG("%s:\n", desc);
-	
-	line = 0;
-	do
-		{
-		l = len - (line * bloc);
-		if (l > bloc)
-			l = bloc;
-	
-		for (i=0, lx = 0, la = 0; i < l; i++) {
-			ch = pc[i];
-			hexbuf[lx++] = hex_asc[((ch) & 0xF0) >> 4];
-			hexbuf[lx++] = hex_asc[((ch) & 0xF)];
-			hexbuf[lx++] = ' ';
-		
-			ascbuf[la++]  = (ch > 0x20 && ch < 0x7F) ? ch : '.';
-			}
-	
-		for (; i < bloc; i++) {
-			hexbuf[lx++] = ' ';
-			hexbuf[lx++] = ' ';
-			hexbuf[lx++] = ' ';
-		}	
-		// nul terminate both buffer
-		hexbuf[lx++] = 0;
-		ascbuf[la++] = 0;
-	
-		// output buffers
-		LOG("%04x %s %s\n", line * bloc, hexbuf, ascbuf);
-		
-		line++;
-		pc += bloc;
+static bool inFlightRemove(int broker, int mid) {
+	for (int i = 0; i < inFlightCount; i++) {
+		if (inFlight[i].mid == mid && inFlight[i].broker == broker) {
+			long latency = millis() - inFlight[i].sent;
+			theStats.publishLatencyTotal += latency;
+			theStats.publishLatencyCount++;
+			if (latency > theStats.publishLatencyMax)
+				theStats.publishLatencyMax = latency;
+			inFlight[i] = inFlight[--inFlightCount];
+			return true;
 		}
-	while (line * bloc < len);
+	}
+	return false;
+}
+
+/* Release the messages never acknowledged, so a lost broker reply cannot stall the window */
+static void inFlightExpire(long now) {
+	for (int i = 0; i < inFlightCount; ) {
+		if (now - inFlight[i].sent > (long)theConfig.inFlightTimeout) {
+			theStats.inFlightExpired++;
+			inFlight[i] = inFlight[--inFlightCount];
+		}
+		else
+			i++;
+	}
 }
 
-static void MQTTSendInt(struct mosquitto * _client, int node, int sensor, int var, int val) {
+/* Release the window of a lost connection, mosquitto keeps the messages to send them again */
+static void inFlightRelease(int broker) {
+	for (int i = 0; i < inFlightCount; ) {
+		if (inFlight[i].broker == broker) {
+			brokers[broker].resend++;
+			theStats.inFlightResent++;
+			inFlight[i] = inFlight[--inFlightCount];
+		}
+		else
+			i++;
+	}
+}
+
+static bool brokerPublish(Broker *b, const char *topic, const char *message, int qos) {
+	int mid;
+	if (mosquitto_publish(b->mosq, &mid, topic, strlen(message), message, qos, false) != MOSQ_ERR_SUCCESS)
+		return false;
+	b->queued++;
+	theStats.messageQueued++;
+	if (qos > 0)
+		inFlightAdd(b - brokers, mid);
+	return true;
+}
+
+/* Publish to the first connected broker by priority, or to all of them when mirroring */
+static bool MQTTPublish(const char *topic, const char *message, int qos) {
+	bool sent = false;
+	for (int i = 0; i < brokerCount; i++) {
+		Broker *b = &brokers[i];
+		if (b->state != BROKER_CONNECTED) {
+			if (theConfig.brokerMode == NWC_BROKER_MIRROR)
+				theStats.mirrorSkipped++;
+			continue;
+		}
+		if (brokerPublish(b, topic, message, qos)) {
+			sent = true;
+			if (theConfig.brokerMode == NWC_BROKER_FAILOVER)
+				break;
+		}
+	}
+	return sent;
+}
+
+static void MQTTSendInt(int node, int sensor, int var, int val, int qos) {
 	char buff_topic[128];
 	char buff_message[128];
 
 	sprintf(buff_topic, "%s/%03d/%02d/up/%01d%01d", MQTT_ROOT, theConfig.networkId, node, sensor, var);
 	sprintf(buff_message, "%04d%", val);
 //	LOG("%s %s", buff_topic, buff_message);
-	mosquitto_publish(_client, 0, &buff_topic[0], strlen(buff_message), buff_message, 0, false);
+	MQTTPublish(buff_topic, buff_message, qos);
 }
 
-static void MQTTSendULong(struct mosquitto* _client, int node, int sensor, int var, unsigned long val) {
+static void MQTTSendULong(int node, int sensor, int var, unsigned long val, int qos) {
 	char buff_topic[128];
 	char buff_message[128];
 
 	sprintf(buff_topic, "%s/%03d/%02d/up/%01d%01d", MQTT_ROOT, theConfig.networkId, node, sensor, var);
 	sprintf(buff_message, "%u", val);
 //	LOG("%s %s", buff_topic, buff_message);
-	mosquitto_publish(_client, 0, &buff_topic[0], strlen(buff_message), buff_message, 0, false);
+	MQTTPublish(buff_topic, buff_message, qos);
 	}
 
-static void MQTTSendFloat(struct mosquitto* _client, int node, int sensor, int var, float val) {
+static void MQTTSendFloat(int node, int sensor, int var, float val, int qos) {
 	char buff_topic[128];
 	char buff_message[128];
 
 	sprintf(buff_topic, "%s/%03d/%02d/up/%01d%01d", MQTT_ROOT, theConfig.networkId, node, sensor, var);
 	snprintf(buff_message, 12, "%f", val);
 //	LOG("%s %s", buff_topic, buff_message);
-	mosquitto_publish(_client, 0, buff_topic, strlen(buff_message), buff_message, 0, false);
+	MQTTPublish(buff_topic, buff_message, qos);
+
+	}
+
+/* A variable of a reading logged by the node, with its original time in seconds since the epoch */
+static void MQTTSendBackfill(int node, int sensor, int var, const char *val, time_t time, int qos) {
+	char buff_topic[128];
+	char buff_message[128];
+
+	sprintf(buff_topic, "%s/%03d/%02d/backfill/%01d%01d", MQTT_ROOT, theConfig.networkId, node, sensor, var);
+	snprintf(buff_message, sizeof(buff_message), "%s %ld", val, (long)time);
+	MQTTPublish(buff_topic, buff_message, qos);
+}
+
+static void MQTTSendFotaStatus(uint8_t node, const char *status) {
+	char buff_topic[64];
+	sprintf(buff_topic, "%s/%03d/%02d/fota/status", MQTT_ROOT, theConfig.networkId, node);
+	LOG("Firmware update of node %d: %s\n", node, status);
+	MQTTPublish(buff_topic, status, 1);
+}
+
+/* Frequency offset of a node, in Hz: mean, then min and max and frames since the previous statistics */
+static void MQTTSendFrequency(uint8_t node, NodeFrequency *nf) {
+	char buff_topic[64];
+	char buff_message[64];
+
+	sprintf(buff_topic, "%s/%03d/%02d/frequency", MQTT_ROOT, theConfig.networkId, node);
+	sprintf(buff_message, "%ld %ld %ld %lu", lround(nf->offset * RF69_FSTEP), lround(nf->min * RF69_FSTEP),
+		lround(nf->max * RF69_FSTEP), nf->frames - nf->reported);
+	MQTTPublish(buff_topic, buff_message, theConfig.qosStats);
+}
+
+/* ACK times of a node, as learnt by the driver: SRTT and RTTVAR in ms, ACK wait in ms and retries
+ * of its next message, then the messages sent, delivered, and the attempts lost, since the start */
+static void MQTTSendLink(uint8_t node, const RFM69Link *link) {
+	char buff_topic[64];
+	char buff_message[96];
+
+	sprintf(buff_topic, "%s/%03d/%02d/link", MQTT_ROOT, theConfig.networkId, node);
+	sprintf(buff_message, "%.1f %.1f %u %u %lu %lu %lu", link->srtt, link->rttvar, rfm69->ackTimeout(node),
+		rfm69->retryBudget(node), link->messages, link->delivered, link->timeouts);
+	MQTTPublish(buff_topic, buff_message, theConfig.qosStats);
+}
+
+static void MQTTSendGroupStatus(uint8_t group, const char *status) {
+	char buff_topic[64];
+	sprintf(buff_topic, "%s/%03d/group/%d/status", MQTT_ROOT, theConfig.networkId, group);
+	LOG_DOWNLINK("Command to group %d: %s\n", group, status);
+	MQTTPublish(buff_topic, status, 1);
+}
+
+static void MQTTSendStat(const char *name, unsigned long val) {
+	char buff_topic[128];
+	char buff_message[128];
+
+	sprintf(buff_topic, "%s/%03d/gateway/%s", MQTT_ROOT, theConfig.networkId, name);
+	sprintf(buff_message, "%lu", val);
+	MQTTPublish(buff_topic, buff_message, theConfig.qosStats);
+}
+
+/* Send all the variables of a reading to the broker
+ * The variables are published with the QoS of the readings, the RSSI with its own
+ * The readings logged by the nodes go under backfill, with their time and without RSSI */
+static void publishReading(SensorNode *reading) {
+	if (reading->backfill) {
+		char val[16];
+		sprintf(val, "%lu", reading->var1_usl);
+		MQTTSendBackfill(reading->nodeID, reading->sensorID, 1, val, reading->backfill, theConfig.qosReading);
+		snprintf(val, 12, "%f", reading->var2_float);
+		MQTTSendBackfill(reading->nodeID, reading->sensorID, 2, val, reading->backfill, theConfig.qosReading);
+		snprintf(val, 12, "%f", reading->var3_float);
+		MQTTSendBackfill(reading->nodeID, reading->sensorID, 3, val, reading->backfill, theConfig.qosReading);
+		theStats.readingPublished++;
+		return;
+	}
+
+	//send var1_usl
+	MQTTSendULong(reading->nodeID, reading->sensorID, 1, reading->var1_usl, theConfig.qosReading);
+
+	//send var2_float
+	MQTTSendFloat(reading->nodeID, reading->sensorID, 2, reading->var2_float, theConfig.qosReading);
+
+	//send var3_float
+	MQTTSendFloat(reading->nodeID, reading->sensorID, 3, reading->var3_float, theConfig.qosReading);
+
+	//send var4_int, RSSI
+	MQTTSendInt(reading->nodeID, reading->sensorID, 4, reading->var4_int, theConfig.qosRssi);
+
+	theStats.readingPublished++;
+}
+
+/* A reading may go when the broker keeps up with the outgoing queue,
+ * and both the node and the gateway buckets have a token left */
+static bool admitReading(uint8_t node, long now) {
+	if (!brokersConnected())
+		return false;
+	if (theConfig.queueHighWater && brokersQueueDepth() >= theConfig.queueHighWater)
+		return false;
+	// a reading is published as up to 4 messages, they must all fit in the window of each broker
+	// it goes to: the first connected, or every connected one when mirroring
+	if (theConfig.qosReading + theConfig.qosRssi > 0) {
+		for (int i = 0; i < brokerCount; i++) {
+			if (brokers[i].state != BROKER_CONNECTED)
+				continue;
+			if (inFlightOf(i) + 4 > theConfig.inFlightWindow)
+				return false;
+			if (theConfig.brokerMode == NWC_BROKER_FAILOVER)
+				break;
+		}
+	}
+	if (theConfig.nodeRate > 0 && !tokenBucketReady(&nodeLimiter[node].bucket, now))
+		return false;
+	if (theConfig.globalRate > 0 && !tokenBucketReady(&globalBucket, now))
+		return false;
+
+	if (theConfig.nodeRate > 0)
+		tokenBucketTake(&nodeLimiter[node].bucket, now);
+	if (theConfig.globalRate > 0)
+		tokenBucketTake(&globalBucket, now);
+	return true;
+}
+
+/* Keep a reading until a token is available, replacing an older one of the same sensor */
+static bool mergeReading(NodeLimiter *nl, SensorNode *reading) {
+	int freeSlot = -1;
+	for (int i = 0; i < PENDING_SLOTS; i++) {
+		if (!nl->pending[i].used) {
+			if (freeSlot < 0)
+				freeSlot = i;
+		}
+		// a logged reading is never replaced, nor replaces another
+		else if (nl->pending[i].reading.sensorID == reading->sensorID && !nl->pending[i].reading.backfill && !reading->backfill) {
+			nl->pending[i].reading = *reading;
+			theStats.readingMerged++;
+			return true;
+		}
+	}
+	if (freeSlot < 0)
+		return false;
+
+	nl->pending[freeSlot].reading = *reading;
+	nl->pending[freeSlot].used = true;
+	nl->pendingCount++;
+	pendingTotal++;
+	return true;
+}
+
+/* Forward a reading to the broker, or apply the limiting policy when it is over its rate */
+static void submitReading(SensorNode *reading) {
+	uint8_t node = reading->nodeID;
+	NodeLimiter *nl = &nodeLimiter[node];
+
+	// readings already waiting for this node go first
+	if (nl->pendingCount == 0 && admitReading(node, millis())) {
+		publishReading(reading);
+		return;
+	}
+
+	if (theConfig.limitPolicy == NWC_POLICY_MERGE && mergeReading(nl, reading))
+		return;
+
+	theStats.readingDropped++;
+	LOG_FRAME("Reading from node %d sensor %d dropped by rate limiter\n", reading->nodeID, reading->sensorID);
+}
+
+/* Send the readings held back, as tokens become available */
+static void flushPending(void) {
+	// start from a different node every time, so a busy node does not starve the others
+	static int nextNode = 0;
+
+	if (pendingTotal == 0)
+		return;
+
+	long now = millis();
+	for (int n = 0; n < 256 && pendingTotal; n++) {
+		int node = (nextNode + n) % 256;
+		NodeLimiter *nl = &nodeLimiter[node];
+		for (int i = 0; i < PENDING_SLOTS && nl->pendingCount; i++) {
+			if (!nl->pending[i].used)
+				continue;
+			if (!admitReading(node, now))
+				break;
+			publishReading(&nl->pending[i].reading);
+			nl->pending[i].used = false;
+			nl->pendingCount--;
+			pendingTotal--;
+		}
+	}
+	nextNode = (nextNode + 1) % 256;
+}
 
+/* Publish the gateway statistics, bypassing the rate limiter */
+static void publishStats(void) {
+	MQTTSendStat("watchdog", theStats.messageWatchdog);
+	MQTTSendStat("received", theStats.messageReceived);
+	MQTTSendStat("sent", theStats.messageSent);
+	MQTTSendStat("ackRequested", theStats.ackRequested);
+	MQTTSendStat("ackReceived", theStats.ackReceived);
+	MQTTSendStat("ackMissed", theStats.ackMissed);
+	MQTTSendStat("published", theStats.readingPublished);
+	MQTTSendStat("dropped", theStats.readingDropped);
+	MQTTSendStat("merged", theStats.readingMerged);
+	MQTTSendStat("pending", pendingTotal);
+	MQTTSendStat("queueDepth", brokersQueueDepth());
+	MQTTSendStat("inFlight", inFlightCount);
+	MQTTSendStat("inFlightMax", theStats.inFlightMax);
+	MQTTSendStat("inFlightExpired", theStats.inFlightExpired);
+	// latencies of the QoS 1 and 2 messages acknowledged since the previous statistics
+	MQTTSendStat("publishLatencyAvg", theStats.publishLatencyCount ? theStats.publishLatencyTotal / theStats.publishLatencyCount : 0);
+	MQTTSendStat("publishLatencyMax", theStats.publishLatencyMax);
+	theStats.publishLatencyTotal = 0;
+	theStats.publishLatencyCount = 0;
+	theStats.publishLatencyMax = 0;
+	theStats.inFlightMax = inFlightCount;
+	MQTTSendStat("brokersConnected", brokersConnected());
+	MQTTSendStat("brokerFailures", theStats.brokerFailures);
+	if (theConfig.brokerMode == NWC_BROKER_MIRROR)
+		MQTTSendStat("mirrorSkipped", theStats.mirrorSkipped);
+	if (theStats.downlinkCopies)
+		MQTTSendStat("downlinkCopies", theStats.downlinkCopies);
+	if (peers.active) {
+		MQTTSendStat("peerDigestSent", peers.digestSent);
+		MQTTSendStat("peerDigestReceived", peers.digestReceived);
+		MQTTSendStat("electionWon", peers.won);
+		MQTTSendStat("electionLost", peers.lost);
+		MQTTSendStat("electionOverflow", peers.overflow);
+		MQTTSendStat("ackNotOwned", theStats.ackNotOwned);
+		MQTTSendStat("downlinkNotOwned", theStats.downlinkNotOwned);
+	}
+	if (theStats.compactFrames) {
+		MQTTSendStat("compactFrames", theStats.compactFrames);
+		MQTTSendStat("compactReadings", theStats.compactReadings);
+		// average size of the compact frames per reading, against 16 bytes for a Payload
+		MQTTSendStat("compactBytesAvg", theStats.compactReadings ? theStats.compactBytes / theStats.compactReadings : 0);
+		MQTTSendStat("compactDuplicate", theStats.compactDuplicate);
+		MQTTSendStat("compactUnsynced", theStats.compactUnsynced);
+		MQTTSendStat("compactBackfill", theStats.compactBackfill);
+	}
+	if (fota.blocksSent) {
+		MQTTSendStat("fotaBlocksSent", fota.blocksSent);
+		MQTTSendStat("fotaBlocksResent", fota.blocksResent);
+		MQTTSendStat("fotaDone", fota.done);
+		MQTTSendStat("fotaFailed", fota.failed);
+	}
+	if (relays.active) {
+		MQTTSendStat("ackByRelay", theStats.ackByRelay);
+		MQTTSendStat("relayUplinks", relays.uplinks);
+		MQTTSendStat("relayDuplicates", relays.duplicates);
+		MQTTSendStat("relayDownlinks", relays.downlinks);
+		MQTTSendStat("relayReports", relays.reports);
+		MQTTSendStat("relayRouteChanges", relays.routeChanges);
+		MQTTSendStat("relayTablesSent", relays.tablesSent);
+	}
+	if (groups.commands) {
+		MQTTSendStat("groupCommands", groups.commands);
+		MQTTSendStat("groupFramesSent", groups.framesSent);
+		MQTTSendStat("groupDelivered", groups.delivered);
+		MQTTSendStat("groupMissed", groups.missed);
+	}
+	if (modem != NULL) {
+		MQTTSendStat("modemFramesLost", modem->framesLost);
+		MQTTSendStat("modemQueueLost", modem->queueLost);
+		MQTTSendStat("modemBadPackets", modem->badPackets);
+		MQTTSendStat("modemCommandsLost", modem->commandsLost);
+		MQTTSendStat("modemResets", modem->resets);
+		// frames per batch, over 1 when the modem is busy
+		MQTTSendStat("modemBatchFramesAvg", modem->batches ? modem->batchFrames / modem->batches : 0);
+	}
+	if (theConfig.afcCorrection)
+		MQTTSendStat("freqCorrected", theStats.freqCorrected);
+	for (int i = 0; i < 256; i++) {
+		if (nodeFrequency[i].frames > nodeFrequency[i].reported) {
+			MQTTSendFrequency(i, &nodeFrequency[i]);
+			nodeFrequency[i].reported = nodeFrequency[i].frames;
+		}
+		// only the nodes sent a message since the previous statistics
+		if (rfm69->link(i)->messages > linkReported[i]) {
+			MQTTSendLink(i, rfm69->link(i));
+			linkReported[i] = rfm69->link(i)->messages;
+		}
 	}
+	if (router.unroutable)
+		MQTTSendStat("downlinkUnroutable", router.unroutable);
+	if (loggerDropped() || loggerRateLimited()) {
+		MQTTSendStat("logDropped", loggerDropped());
+		MQTTSendStat("logRateLimited", loggerRateLimited());
+	}
+	if (localBus.active) {
+		MQTTSendStat("localClients", localBus.clientCount);
+		MQTTSendStat("localDelivered", localBus.delivered);
+		MQTTSendStat("localDropped", localBus.dropped);
+	}
+}
 
 // Handing of Mosquitto messages
 void callback(char* topic, uint8_t* payload, unsigned int length) {
@@ -452,70 +1441,322 @@ void callback(char* topic, uint8_t* payload, unsigned int length) {
 }
 
 
-/* Connect to the network. */
-static bool connect(struct mosquitto *m) {
-	int res = mosquitto_connect(m, BROKER_HOSTNAME, BROKER_PORT, KEEPALIVE_SECONDS);
-	LOG("Connect return %d\n", res);
-	return res == MOSQ_ERR_SUCCESS;
+/* Create a connection for each broker of the "host:port,host:port" list. */
+static bool brokersOpen(void) {
+	char list[256];
+	strncpy(list, theConfig.brokers, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	srandom(getpid() ^ time(NULL));
+
+	brokerCount = 0;
+	for (char *item = strtok(list, ", "); item != NULL && brokerCount < MAX_BROKERS; item = strtok(NULL, ", ")) {
+		Broker *b = &brokers[brokerCount];
+		memset(b, 0, sizeof(*b));
+		char *port = strrchr(item, ':');
+		if (port != NULL)
+			*port++ = '\0';
+		strncpy(b->host, item, sizeof(b->host) - 1);
+		b->port = port != NULL ? atoi(port) : BROKER_PORT;
+
+		// each connection needs its own client id, in case two brokers are bridged
+		char clientId[32];
+		if (brokerCount == 0)
+			strcpy(clientId, MQTT_CLIENT_ID);
+		else
+			sprintf(clientId, "%s-%d", MQTT_CLIENT_ID, brokerCount);
+		b->mosq = mosquitto_new(clientId, true, b);
+		if (b->mosq == NULL || !set_callbacks(b->mosq))
+			return false;
+		// let mosquitto hold the messages over the window instead of sending them
+		mosquitto_max_inflight_messages_set(b->mosq, theConfig.inFlightWindow);
+		b->state = BROKER_IDLE;
+		b->retryAt = millis();
+		brokerCount++;
+	}
+	return brokerCount > 0;
+}
+
+/* Resolve and connect, the blocking part of a connection, out of the radio loop. */
+static void *brokerAttempt(void *arg) {
+	Broker *b = (Broker *)arg;
+	int res;
+	if (b->started)
+		res = mosquitto_reconnect(b->mosq);
+	else
+		res = mosquitto_connect(b->mosq, b->host, b->port, KEEPALIVE_SECONDS);
+	b->attemptResult = res;
+	__atomic_store_n(&b->attemptDone, true, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* Schedule the next attempt, with an exponential backoff spread at random,
+ * so gateways restarted together do not all retry together. */
+static void brokerFailed(Broker *b, const char *why) {
+	LOGGER(LOGGER_ERROR, LOGGER_BROKER, "Broker %s:%d %s\n", b->host, b->port, why);
+	theStats.brokerFailures++;
+	if (b->state == BROKER_CONNECTED)
+		inFlightRelease(b - brokers);
+	b->failures++;
+
+	long delay = theConfig.reconnectMin;
+	for (int i = 1; i < b->failures && delay < (long)theConfig.reconnectMax; i++)
+		delay *= 2;
+	if (delay > (long)theConfig.reconnectMax)
+		delay = theConfig.reconnectMax;
+	delay = delay / 2 + random() % (delay / 2 + 1);
+
+	b->state = BROKER_IDLE;
+	b->since = millis();
+	b->retryAt = b->since + delay;
+}
+
+/* Service every broker connection: start the attempts when due, collect their result,
+ * and run the network loop of the connected ones. Waits up to timeout ms for network activity. */
+static void brokersLoop(int timeout) {
+	long now = millis();
+	bool waited = false;
+
+	for (int i = 0; i < brokerCount; i++) {
+		Broker *b = &brokers[i];
+		switch (b->state) {
+		case BROKER_IDLE:
+			if (now - b->retryAt < 0)
+				break;
+			b->attemptDone = false;
+			if (pthread_create(&b->attempt, NULL, brokerAttempt, b) != 0) {
+				brokerFailed(b, "attempt not started");
+				break;
+			}
+			b->state = BROKER_CONNECTING;
+			b->since = now;
+			break;
+
+		case BROKER_CONNECTING:
+			if (!__atomic_load_n(&b->attemptDone, __ATOMIC_ACQUIRE))
+				break;
+			pthread_join(b->attempt, NULL);
+			b->started = true;
+			if (b->attemptResult != MOSQ_ERR_SUCCESS) {
+				brokerFailed(b, "unreachable");
+				break;
+			}
+			b->state = BROKER_HANDSHAKE;
+			b->since = now;
+			break;
+
+		case BROKER_HANDSHAKE:
+			if (now - b->since > KEEPALIVE_SECONDS * 1000L) {
+				brokerFailed(b, "not answering");
+				break;
+			}
+			// fall through
+		case BROKER_CONNECTED: {
+			int res = mosquitto_loop(b->mosq, waited ? 0 : timeout, 1);
+			waited = true;
+			// on_connect and on_disconnect may already have changed the state
+			if (res != MOSQ_ERR_SUCCESS && b->state != BROKER_IDLE)
+				brokerFailed(b, "connection lost");
+			break;
+		}
+		}
+	}
+	if (!waited && timeout > 0)
+		usleep(timeout * 1000);
+}
+
+/* Service the connections until one of them is up, for the tools needing a broker from the start. */
+static bool brokersWait(long timeout) {
+	long start = millis();
+	while (!brokersConnected()) {
+		if (millis() - start > timeout)
+			return false;
+		brokersLoop(10);
+	}
+	return true;
+}
+
+static int brokersConnected(void) {
+	int count = 0;
+	for (int i = 0; i < brokerCount; i++)
+		if (brokers[i].state == BROKER_CONNECTED)
+			count++;
+	return count;
+}
+
+/* Messages waiting in the outgoing queues of the connected brokers */
+static unsigned long brokersQueueDepth(void) {
+	unsigned long depth = 0;
+	for (int i = 0; i < brokerCount; i++)
+		// messages expired from the window may still be acknowledged after a reconnection
+		if (brokers[i].state == BROKER_CONNECTED && brokers[i].queued > brokers[i].published)
+			depth += brokers[i].queued - brokers[i].published;
+	return depth;
+}
+
+static void brokersClose(void) {
+	for (int i = 0; i < brokerCount; i++) {
+		Broker *b = &brokers[i];
+		if (b->state == BROKER_CONNECTING)
+			pthread_join(b->attempt, NULL);
+		if (b->state == BROKER_CONNECTED)
+			mosquitto_disconnect(b->mosq);
+		mosquitto_destroy(b->mosq);
+	}
+	brokerCount = 0;
 }
 
 /* Callback for successful connection: add subscriptions. */
 static void on_connect(struct mosquitto *m, void *udata, int res) {
+	Broker *b = (Broker *)udata;
 	if (res == 0) {   /* success */
-		LOG("Connect succeed\n");
+		LOG_BROKER("Connected to %s:%d\n", b->host, b->port);
+		b->state = BROKER_CONNECTED;
+		b->since = millis();
+		b->failures = 0;
+		// QoS 0 messages still queued are discarded on (re)connection,
+		// while the QoS 1 and 2 messages are sent again by mosquitto
+		b->published = b->queued - b->resend;
+		if (b->resend) {
+			LOG_BROKER("%lu messages sent again\n", b->resend);
+			b->resend = 0;
+		}
+
+		// a clean session, the subscriptions are made again on each connection
+		for (int i = 0; i < router.subscriptionCount; i++) {
+			LOG_BROKER("Subscribe to Mosquitto topic: %s\n", router.subscriptions[i].filter);
+			mosquitto_subscribe(m, NULL, router.subscriptions[i].filter, router.subscriptions[i].qos);
+		}
 	} else {
-		die("connection refused\n");
+		brokerFailed(b, "refused the connection");
 	}
 }
 
+/* True for the copy of a message received from another broker, bridged or mirrored, within
+ * DOWNLINK_COPY_WINDOW ms. The same message twice from one broker is sent twice. */
+static bool downlinkCopy(Broker *b, const struct mosquitto_message *msg) {
+	uint32_t hash = 2166136261u;
+	for (const char *c = msg->topic; *c; c++)
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	for (int i = 0; i < msg->payloadlen; i++)
+		hash = (hash ^ ((const uint8_t *)msg->payload)[i]) * 16777619u;
+
+	long now = millis();
+	for (int i = 0; i < DOWNLINK_RECENT; i++) {
+		RecentDownlink *r = &recentDownlinks[i];
+		if (r->received != 0 && r->hash == hash && r->broker != b - brokers && now - r->received <= DOWNLINK_COPY_WINDOW) {
+			// the next copy, if any, comes from yet another broker
+			r->broker = b - brokers;
+			return true;
+		}
+	}
+	recentDownlinks[recentDownlinkNext].hash = hash;
+	recentDownlinks[recentDownlinkNext].broker = b - brokers;
+	recentDownlinks[recentDownlinkNext].received = now;
+	recentDownlinkNext = (recentDownlinkNext + 1) % DOWNLINK_RECENT;
+	return false;
+}
+
 /* Handle a message that just arrived via one of the subscriptions. */
 static void on_message(struct mosquitto *m, void *udata,
 const struct mosquitto_message *msg) {
 	if (msg == NULL) { return; }
-	LOG("-- got message @ %s: (%d, QoS %d, %s) '%s'\n",
+	// every connection is subscribed, so a broker of higher priority takes over at once
+	if (brokerCount > 1 && downlinkCopy((Broker *)udata, msg)) {
+		LOG_DOWNLINK("Copy of %s from %s:%d dropped\n", msg->topic, ((Broker *)udata)->host, ((Broker *)udata)->port);
+		theStats.downlinkCopies++;
+		return;
+	}
+
+	Route route;
+	if (!routerMatch(&router, msg->topic, &route)) {
+		LOG_DOWNLINK("No route for topic %s\n", msg->topic);
+		return;
+	}
+	if (route.kind == ROUTE_GROUP) {
+		unsigned long var1 = 0;
+		float var2 = 0, var3 = 0;
+		sscanf((const char *)msg->payload, "%lu,%f,%f", &var1, &var2, &var3);
+		LOG_DOWNLINK("Received message for Group = %d Device ID = %d Time = %lu  var2 = %f var3 = %f\n",
+			route.node, route.sensor, var1, var2, var3);
+		if (!peersLeads(&peers, millis())) {
+			// one broadcast and one round of answers for every gateway, the leader sends it
+			LOG_DOWNLINK("Group %d left to the leading gateway\n", route.node);
+			theStats.downlinkNotOwned++;
+			return;
+		}
+		if (!groupCommand(&groups, route.node, route.sensor, var1, var2, var3, millis()))
+			LOG_DOWNLINK("Unknown group %d\n", route.node);
+		return;
+	}
+
+	if (route.kind == ROUTE_FOTA) {
+		// a binary firmware image, not to be printed
+		// the reserved IDs, from the lowest marker, are never nodes
+		if (route.node == 0 || route.node >= RELAY_MARKER)
+			return;
+		// a retained image would update the node again on every connection
+		if (msg->retain) {
+			LOG_DOWNLINK("Retained firmware image for node %d ignored\n", route.node);
+			return;
+		}
+		if (!fotaLoad(&fota, route.node, (const uint8_t *)msg->payload, msg->payloadlen))
+			MQTTSendFotaStatus(route.node, "invalid image");
+		return;
+	}
+
+	LOG_DOWNLINK("-- got message @ %s: (%d, QoS %d, %s) '%s'\n",
 		msg->topic, msg->payloadlen, msg->qos, msg->retain ? "R" : "!r",
-		msg->payload);
-		
-	if (strlen((const char *)msg->topic) < strlen(MQTT_ROOT) + 2 + 3 + 1) {return; }	// message is smaller than "RFM/xxx/x" so likey invalid
+		(const char *)msg->payload);
 
 	Payload data;
-	uint8_t network;
-
-	sscanf(msg->topic, "RFM/%d/%d/%d", &network, &data.nodeID, &data.sensorID);
-	if (strncmp(msg->topic, MQTT_ROOT, strlen(MQTT_ROOT)) == 0 && network == theConfig.networkId) {
-		
-		// extract the target network and the target node from the topic
-		sscanf(msg->topic, "RFM/%d/%d/%d", &network, &data.nodeID, &data.sensorID);
-		
-		if (network == theConfig.networkId) {
-			// only process the messages to our network
-		
-			sscanf((const char *)msg->payload, "%ld,%f,%f", &data.var1_usl, &data.var2_float, &data.var3_float);
-			
-			LOG("Received message for Node ID = %d Device ID = %d Time = %d  var2 = %f var3 = %f\n",
-				data.nodeID,
-				data.sensorID,
-				data.var1_usl,
-				data.var2_float,
-				data.var3_float
-			);
+	data.nodeID = route.node;
+	data.sensorID = route.sensor;
+	sscanf((const char *)msg->payload, "%lu,%f,%f", &data.var1_usl, &data.var2_float, &data.var3_float);
+
+	LOG_DOWNLINK("Received message for Node ID = %d Device ID = %d Time = %lu  var2 = %f var3 = %f\n",
+		data.nodeID,
+		data.sensorID,
+		data.var1_usl,
+		data.var2_float,
+		data.var3_float
+	);
+
+	if (!peersOwnsNode(&peers, data.nodeID, millis())) {
+		// another gateway hears the node better, and sends it the message
+		LOG_DOWNLINK("Node %d owned by another gateway\n", data.nodeID);
+		theStats.downlinkNotOwned++;
+		return;
+	}
 
-			theStats.messageSent++;
-			if (rfm69->sendWithRetry(data.nodeID,(const void*)(&data),sizeof(data))) {
-				LOG("Message sent to node %d ACK", data.nodeID);
-				theStats.ackReceived++;
-				}
-			else {
-				LOG("Message sent to node %d NAK", data.nodeID);
-				theStats.ackMissed++;
-			}
-		}
+	theStats.messageSent++;
+	// direct, or through the relays of the node; the ACK is the one of the first hop
+	if (relaySend(&relays, data.nodeID, (const void*)(&data), sizeof(data))) {
+		LOG_DOWNLINK("Message sent to node %d ACK", data.nodeID);
+		theStats.ackReceived++;
+	}
+	else {
+		LOG_DOWNLINK("Message sent to node %d NAK", data.nodeID);
+		theStats.ackMissed++;
 	}
 }
 
+/* The connection with the broker is lost, or closed. */
+static void on_disconnect(struct mosquitto *m, void *udata, int res) {
+	Broker *b = (Broker *)udata;
+	LOG_BROKER("Disconnected from %s:%d (%d)\n", b->host, b->port, res);
+	theStats.disconnect++;
+	if (b->state != BROKER_IDLE)
+		brokerFailed(b, "disconnected");
+}
+
 /* A message was successfully published. */
 static void on_publish(struct mosquitto *m, void *udata, int m_id) {
 //	LOG(" -- published successfully\n");
+	// called when QoS 0 messages are written, and when QoS 1 and 2 are acknowledged
+	Broker *b = (Broker *)udata;
+	b->published++;
+	theStats.messagePublished++;
+	inFlightRemove(b - brokers, m_id);
 }
 
 /* Successful subscription hook. */
@@ -527,6 +1768,7 @@ static void on_subscribe(struct mosquitto *m, void *udata, int mid,
 /* Register the callbacks that the mosquitto connection will use. */
 static bool set_callbacks(struct mosquitto *m) {
 	mosquitto_connect_callback_set(m, on_connect);
+	mosquitto_disconnect_callback_set(m, on_disconnect);
 	mosquitto_publish_callback_set(m, on_publish);
 	mosquitto_subscribe_callback_set(m, on_subscribe);
 	mosquitto_message_callback_set(m, on_message);
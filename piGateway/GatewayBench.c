@@ -0,0 +1,341 @@
+/*
+RFM69 Gateway throughput and latency benchmark
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: GatewayBench.c
+
+Drive the gateway decoding and publishing path with synthetic Payload frames,
+against a local mosquitto broker, at increasing rates until it saturates.
+
+For each rate step, the frames are injected at a steady pace, spread over the
+requested number of nodes. A second MQTT client subscribes to the readings and
+matches them back to the injected frames, using var1_usl as sequence number.
+
+Reported per step:
+ - offered, processed and delivered frames per second
+ - publish latency percentiles, from injection to delivery by the broker
+ - CPU time of the gateway thread per frame
+ - frames lost, dropped or merged by the rate limiter
+The saturation point is the highest delivered rate, reached before delivery
+falls under 95% of the offered rate.
+
+Results are written as JSON, so runs can be compared to spot regressions.
+*/
+
+#define GATEWAY_NO_MAIN
+#include "Gateway.c"
+
+#include <sys/resource.h>
+#include <math.h>
+
+#define BENCH_CLIENT_ID "GatewayBenchSub"
+#define BENCH_SENSOR 6
+#define BENCH_DRAIN_MS 2000
+#define BENCH_SATURATION 0.95
+
+typedef struct {
+	double offered;		// frames per second requested
+	unsigned long frames;
+	unsigned long delivered;
+	double processedRate;	// frames per second going through the pipeline
+	double deliveredRate;	// frames per second received back from the broker
+	double cpuPerFrame;		// us of gateway thread CPU per frame
+	long p50, p90, p99, p999, max;	// publish latency, in us
+	unsigned long dropped;
+	unsigned long merged;
+	bool saturated;
+}
+Step;
+
+static struct timeval benchStart;
+
+// latency of the frames of the current step, indexed by sequence - stepBase
+// written by the subscriber thread
+static long *stepSent;
+static long *stepLatency;
+static unsigned long stepBase;
+static unsigned long stepFrames;
+static unsigned long stepDelivered;
+static long lastDelivery;
+// held by the subscriber while it matches a delivery, so a step can end safely
+static pthread_mutex_t stepLock = PTHREAD_MUTEX_INITIALIZER;
+
+static long nowMicros(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return elapsedMicros(&benchStart, &tv);
+}
+
+static long cpuMicros(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+	return usage.ru_utime.tv_sec * 1000000L + usage.ru_utime.tv_usec
+		+ usage.ru_stime.tv_sec * 1000000L + usage.ru_stime.tv_usec;
+}
+
+/* Reading delivered by the broker: match var1 back to its frame */
+static void bench_on_message(struct mosquitto *m, void *udata, const struct mosquitto_message *msg) {
+	long now = nowMicros();
+	int len = strlen(msg->topic);
+
+	// only the var1 topic ".../up/<sensor>1" carries the sequence number
+	if (strstr(msg->topic, "/up/") == NULL || msg->topic[len - 1] != '1' || msg->payloadlen == 0)
+		return;
+
+	char value[32];
+	int n = msg->payloadlen < (int)sizeof(value) - 1 ? msg->payloadlen : sizeof(value) - 1;
+	memcpy(value, msg->payload, n);
+	value[n] = 0;
+	unsigned long seq = strtoul(value, NULL, 10);
+
+	pthread_mutex_lock(&stepLock);
+	unsigned long base = __atomic_load_n(&stepBase, __ATOMIC_ACQUIRE);
+	unsigned long frames = __atomic_load_n(&stepFrames, __ATOMIC_ACQUIRE);
+	// ignore late deliveries from a previous step
+	if (seq >= base && seq - base < frames) {
+		long *latency = &stepLatency[seq - base];
+		long sent = __atomic_load_n(&stepSent[seq - base], __ATOMIC_ACQUIRE);
+		if (*latency < 0 && sent >= 0) {
+			*latency = now - sent;
+			__atomic_add_fetch(&stepDelivered, 1, __ATOMIC_ACQ_REL);
+			__atomic_store_n(&lastDelivery, now, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&stepLock);
+}
+
+static int compareLong(const void *a, const void *b) {
+	long la = *(const long *)a, lb = *(const long *)b;
+	return la < lb ? -1 : la > lb;
+}
+
+static long percentile(long *sorted, unsigned long count, double p) {
+	if (count == 0)
+		return -1;
+	unsigned long i = (unsigned long)ceil(p * count);
+	return sorted[i == 0 ? 0 : i - 1];
+}
+
+/* Inject frames at the given rate for duration seconds, and measure how the pipeline follows */
+static void runStep(double rate, int nodes, int duration, Step *step) {
+	static unsigned long nextSeq = 0;
+	unsigned long frames = rate * duration;
+	if (frames == 0)
+		frames = 1;
+
+	stepSent = (long *)malloc(frames * sizeof(long));
+	stepLatency = (long *)malloc(frames * sizeof(long));
+	for (unsigned long i = 0; i < frames; i++) {
+		stepSent[i] = -1;
+		stepLatency[i] = -1;
+	}
+	__atomic_store_n(&stepDelivered, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stepFrames, frames, __ATOMIC_RELEASE);
+	__atomic_store_n(&stepBase, nextSeq, __ATOMIC_RELEASE);
+
+	unsigned long dropped = theStats.readingDropped;
+	unsigned long merged = theStats.readingMerged;
+
+	Frame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.targetID = theConfig.nodeId;
+	frame.rssi = -60;
+	frame.dataLength = sizeof(Payload);
+	Payload *payload = (Payload *)frame.data;
+
+	long cpuStart = cpuMicros();
+	long start = nowMicros();
+	for (unsigned long i = 0; i < frames; i++) {
+		long due = start + (long)(i * 1e6 / rate);
+		long now;
+		while ((now = nowMicros()) < due) {
+			brokersLoop(due - now > 2000 ? 1 : 0);
+			flushPending();
+		}
+
+		// spread the frames over the nodes, starting at 2 to skip the gateway
+		payload->nodeID = 2 + i % nodes;
+		payload->sensorID = BENCH_SENSOR;
+		payload->var1_usl = nextSeq + i;
+		payload->var2_float = 21.5;
+		payload->var3_float = 45.0;
+		frame.senderID = payload->nodeID;
+		gettimeofday(&frame.timestamp, NULL);
+
+		__atomic_store_n(&stepSent[i], nowMicros(), __ATOMIC_RELEASE);
+		processFrame(&frame);
+		flushPending();
+		brokersLoop(0);
+	}
+	long end = nowMicros();
+	long cpu = cpuMicros() - cpuStart;
+
+	// give the broker time to deliver the tail of the step
+	long drainStart = nowMicros();
+	while (__atomic_load_n(&stepDelivered, __ATOMIC_ACQUIRE) < frames && nowMicros() - drainStart < BENCH_DRAIN_MS * 1000L) {
+		brokersLoop(10);
+		flushPending();
+	}
+
+	// stop matching deliveries before the buffers are reused
+	pthread_mutex_lock(&stepLock);
+	__atomic_store_n(&stepFrames, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&stepLock);
+	nextSeq += frames;
+
+	unsigned long delivered = 0;
+	for (unsigned long i = 0; i < frames; i++) {
+		if (stepLatency[i] >= 0)
+			stepLatency[delivered++] = stepLatency[i];
+	}
+	qsort(stepLatency, delivered, sizeof(long), compareLong);
+
+	long last = __atomic_load_n(&lastDelivery, __ATOMIC_ACQUIRE);
+	step->offered = rate;
+	step->frames = frames;
+	step->delivered = delivered;
+	step->processedRate = end > start ? frames * 1e6 / (end - start) : 0;
+	step->deliveredRate = delivered && last > start ? delivered * 1e6 / (last - start) : 0;
+	step->cpuPerFrame = (double)cpu / frames;
+	step->p50 = percentile(stepLatency, delivered, 0.50);
+	step->p90 = percentile(stepLatency, delivered, 0.90);
+	step->p99 = percentile(stepLatency, delivered, 0.99);
+	step->p999 = percentile(stepLatency, delivered, 0.999);
+	step->max = delivered ? stepLatency[delivered - 1] : -1;
+	step->dropped = theStats.readingDropped - dropped;
+	step->merged = theStats.readingMerged - merged;
+	step->saturated = delivered < frames * BENCH_SATURATION || step->deliveredRate < rate * BENCH_SATURATION;
+
+	free(stepSent);
+	free(stepLatency);
+}
+
+static void writeResults(FILE *out, int nodes, int duration, bool limiter, Step *steps, int count) {
+	double saturation = 0;
+	for (int i = 0; i < count && !steps[i].saturated; i++)
+		if (steps[i].deliveredRate > saturation)
+			saturation = steps[i].deliveredRate;
+
+	fprintf(out, "{\n  \"benchmark\": \"gateway\",\n  \"timestamp\": %ld,\n", (long)time(NULL));
+	fprintf(out, "  \"nodes\": %d,\n  \"step_duration_s\": %d,\n  \"rate_limiter\": %s,\n", nodes, duration, limiter ? "true" : "false");
+	fprintf(out, "  \"saturation_fps\": %.1f,\n  \"steps\": [\n", saturation);
+	for (int i = 0; i < count; i++) {
+		Step *s = &steps[i];
+		fprintf(out, "    {\"offered_fps\": %.1f, \"frames\": %lu, \"delivered\": %lu, "
+			"\"processed_fps\": %.1f, \"delivered_fps\": %.1f, \"cpu_us_per_frame\": %.2f, "
+			"\"latency_us\": {\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"p999\": %ld, \"max\": %ld}, "
+			"\"dropped\": %lu, \"merged\": %lu, \"saturated\": %s}%s\n",
+			s->offered, s->frames, s->delivered, s->processedRate, s->deliveredRate, s->cpuPerFrame,
+			s->p50, s->p90, s->p99, s->p999, s->max, s->dropped, s->merged,
+			s->saturated ? "true" : "false", i < count - 1 ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+static void usage(void) {
+	fprintf(stderr, "Use:\n"
+		" -n <nodes>     number of simulated nodes (default 10)\n"
+		" -r <r1,r2,..>  frame rates to test, in frames per second (default ramp from 50 to 20000)\n"
+		" -d <seconds>   duration of each rate step (default 5)\n"
+		" -o <file>      write the JSON results to file instead of stdout\n"
+		" -a             run all the steps, even after saturation\n"
+		" -l             keep the rate limiter configured in networkconfig.h\n");
+	exit(1);
+}
+
+#define MAX_STEPS 32
+
+int main(int argc, char* argv[]) {
+	double rates[MAX_STEPS] = { 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000 };
+	int rateCount = 9;
+	int nodes = 10;
+	int duration = 5;
+	bool allSteps = false;
+	bool limiter = false;
+	FILE *out = stdout;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:d:o:al")) != -1) {
+		switch (opt) {
+		case 'n':
+			nodes = atoi(optarg);
+			break;
+		case 'r': {
+			rateCount = 0;
+			for (char *r = strtok(optarg, ","); r != NULL && rateCount < MAX_STEPS; r = strtok(NULL, ","))
+				rates[rateCount++] = atof(r);
+			break;
+		}
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL) { die("unable to create the result file\n"); }
+			break;
+		case 'a':
+			allSteps = true;
+			break;
+		case 'l':
+			limiter = true;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || nodes < 1 || nodes > 250 || duration < 1 || rateCount == 0) usage();
+
+	gettimeofday(&benchStart, NULL);
+	mosquitto_lib_init();
+
+	setupConfig();
+	// as in the gateway, the log is written by its own thread; to stderr, stdout may be the results
+	if (!loggerOpen("/dev/stderr", theConfig.logLevel)) { die("unable to start the logger\n"); }
+	if (!limiter) {
+		// measure the pipeline, not the configured limits
+		theConfig.nodeRate = 0;
+		theConfig.globalRate = 0;
+	}
+
+	// the gateway side, driven from this thread as in run_loop()
+	if (!brokersOpen()) { die("init() failure\n"); }
+	if (!brokersWait(KEEPALIVE_SECONDS * 1000L)) { die("connect() failure\n"); }
+
+	// the consumer side, in its own thread
+	struct mosquitto *sub = mosquitto_new(BENCH_CLIENT_ID, true, null);
+	if (sub == NULL) { die("init() failure\n"); }
+	mosquitto_message_callback_set(sub, bench_on_message);
+	if (mosquitto_connect(sub, brokers[0].host, brokers[0].port, KEEPALIVE_SECONDS) != MOSQ_ERR_SUCCESS) { die("subscriber connect() failure\n"); }
+	char subscriptionMask[128];
+	sprintf(subscriptionMask, "%s/%03d/+/up/+", MQTT_ROOT, theConfig.networkId);
+	mosquitto_subscribe(sub, NULL, subscriptionMask, 0);
+	if (mosquitto_loop_start(sub) != MOSQ_ERR_SUCCESS) { die("subscriber loop failure\n"); }
+
+	// let both connections settle
+	for (int i = 0; i < 50; i++)
+		brokersLoop(10);
+
+	Step steps[MAX_STEPS];
+	int count = 0;
+	for (int i = 0; i < rateCount; i++) {
+		runStep(rates[i], nodes, duration, &steps[count]);
+		Step *s = &steps[count++];
+		fprintf(stderr, "%8.0f fps offered: %8.1f processed %8.1f delivered, latency p50 %ld us p99 %ld us, %.2f us CPU/frame%s\n",
+			s->offered, s->processedRate, s->deliveredRate, s->p50, s->p99, s->cpuPerFrame,
+			s->saturated ? " - saturated" : "");
+		if (s->saturated && !allSteps)
+			break;
+	}
+
+	writeResults(out, nodes, duration, limiter, steps, count);
+	if (out != stdout)
+		fclose(out);
+
+	mosquitto_loop_stop(sub, true);
+	mosquitto_destroy(sub);
+	brokersClose();
+	(void)mosquitto_lib_cleanup();
+	loggerClose();
+	return 0;
+}
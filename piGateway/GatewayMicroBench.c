@@ -0,0 +1,292 @@
+/*
+RFM69 Gateway microbenchmarks
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: GatewayMicroBench.c
+
+Measure the code run for every frame, in isolation:
+ - hexDump() of a short and of a full frame, and a frame line of the log
+ - MQTTSendInt / MQTTSendULong / MQTTSendFloat formatting
+ - on_message() topic and payload parsing
+ - millis()
+ - RFM69 frame packing in sendFrame() and unpacking in interruptHandler()
+ - processFrame(), the whole decoding and publishing of a frame
+
+SPI and mosquitto are replaced by the stubs of benchstubs.c, so only the
+gateway code is measured. Built with DEBUG, every frame is logged, to /dev/null.
+The logger runs without its thread: after each run, the records are dropped, so
+a benchmark measures what the main loop pays, the recording. The hexDump and
+logFrame benchmarks write their lines too, the recording and the formatting of
+the thread; their _record variants measure the recording alone.
+
+Each function is run long enough to get a stable time, and the result is given
+in ns/op and allocations/op (calls to malloc, calloc and realloc).
+*/
+
+#define GATEWAY_NO_MAIN
+#include "Gateway.c"
+#include "benchstubs.h"
+
+#define BENCH_MIN_NS 200000000L	// run each function at least 0.2s
+
+// Allocation counting ----------------
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void __libc_free(void *ptr);
+}
+
+static unsigned long allocations;
+
+extern "C" void *malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) {
+	allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+extern "C" void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+// Radio access -----------------------
+/* Give access to the frame packing and unpacking, and answer downlinks immediately */
+class BenchRFM69 : public RFM69 {
+public:
+	void pack(uint8_t toAddress, const void* buffer, uint8_t size) {
+		sendFrame(toAddress, buffer, size, true, false);
+	}
+	void unpack() {
+		setMode(RF69_MODE_RX);
+		interruptHandler();
+	}
+	bool sendWithRetry(uint8_t toAddress, const void* buffer, uint8_t bufferSize, uint8_t retries=2, uint8_t retryWaitTime=40) {
+		return true;
+	}
+};
+BenchRFM69 *benchRadio;
+
+// Benchmarks -------------------------
+static struct mosquitto *benchClient;
+static uint8_t benchFrame[RF69_MAX_DATA_LEN];
+static Payload benchPayload = { 14, 6, 123456, 21.5, 45.25 };
+static volatile long sink;
+
+static void benchHexDumpShort(void) {
+	hexDump(NULL, &benchPayload, sizeof(benchPayload));
+	loggerPoll();
+}
+
+static void benchHexDumpFull(void) {
+	hexDump(NULL, benchFrame, RF69_MAX_DATA_LEN);
+	loggerPoll();
+}
+
+static void benchHexDumpFullRecord(void) {
+	hexDump(NULL, benchFrame, RF69_MAX_DATA_LEN);
+}
+
+static void benchLogFrameRecord(void) {
+	LOG_FRAME("[%d] to [%d] Received Node ID = %d Device ID = %d Time = %lu  RSSI = %d var2 = %f var3 = %f\n",
+		14, NWC_NODE_ID, benchPayload.nodeID, benchPayload.sensorID, benchPayload.var1_usl, -60,
+		benchPayload.var2_float, benchPayload.var3_float);
+}
+
+static void benchLogFrame(void) {
+	benchLogFrameRecord();
+	loggerPoll();
+}
+
+static void benchSendInt(void) {
+	MQTTSendInt(14, 6, 4, -60, 0);
+}
+
+static void benchSendULong(void) {
+	MQTTSendULong(14, 6, 1, 123456789UL, 0);
+}
+
+static void benchSendFloat(void) {
+	MQTTSendFloat(14, 6, 2, 21.5, 0);
+}
+
+static void benchOnMessage(void) {
+	static char topic[] = "RFM/101/14/down/7";
+	static char payload[] = "0,1,0";
+	static struct mosquitto_message msg = { 1, topic, payload, sizeof(payload) - 1, 0, false };
+	on_message(benchClient, &brokers[0], &msg);
+}
+
+static void benchMillis(void) {
+	sink += millis();
+}
+
+static void benchSendFrame(void) {
+	benchRadio->pack(14, &benchPayload, sizeof(benchPayload));
+}
+
+static void benchInterruptHandler(void) {
+	benchRadioLoadFrame(NWC_NODE_ID, 14, RFM69_CTL_REQACK, &benchPayload, sizeof(benchPayload));
+	benchRadio->unpack();
+}
+
+static void benchProcessFrame(void) {
+	static Frame frame;
+	if (frame.dataLength == 0) {
+		frame.targetID = NWC_NODE_ID;
+		frame.senderID = benchPayload.nodeID;
+		frame.rssi = -60;
+		frame.dataLength = sizeof(benchPayload);
+		memcpy(frame.data, &benchPayload, sizeof(benchPayload));
+	}
+	processFrame(&frame);
+}
+
+typedef struct {
+	const char *name;
+	void (*run)(void);
+}
+Bench;
+
+static const Bench benches[] = {
+	{ "hexDump_16", benchHexDumpShort },
+	{ "hexDump_61", benchHexDumpFull },
+	{ "hexDump_61_record", benchHexDumpFullRecord },
+	{ "logFrame", benchLogFrame },
+	{ "logFrame_record", benchLogFrameRecord },
+	{ "MQTTSendInt", benchSendInt },
+	{ "MQTTSendULong", benchSendULong },
+	{ "MQTTSendFloat", benchSendFloat },
+	{ "on_message", benchOnMessage },
+	{ "millis", benchMillis },
+	{ "sendFrame", benchSendFrame },
+	{ "interruptHandler", benchInterruptHandler },
+	{ "processFrame", benchProcessFrame },
+};
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+typedef struct {
+	unsigned long iterations;
+	double nsPerOp;
+	double allocsPerOp;
+}
+Result;
+
+static long nowNanos(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Double the iterations until the run is long enough, and measure the last run */
+static void runBench(const Bench *bench, Result *result) {
+	unsigned long iterations = 1;
+	long elapsed;
+	unsigned long allocated;
+
+	bench->run();	// warm up caches and lazy initialisations
+	for (;;) {
+		allocated = allocations;
+		long start = nowNanos();
+		for (unsigned long i = 0; i < iterations; i++) {
+			bench->run();
+			// the ring never fills, a record is never only dropped
+			loggerSkip();
+		}
+		elapsed = nowNanos() - start;
+		allocated = allocations - allocated;
+		if (elapsed >= BENCH_MIN_NS)
+			break;
+		iterations *= 2;
+	}
+	result->iterations = iterations;
+	result->nsPerOp = (double)elapsed / iterations;
+	result->allocsPerOp = (double)allocated / iterations;
+}
+
+static void usage(void) {
+	fprintf(stderr, "Use:\n"
+		" -o <file>  write the JSON results to file instead of stdout\n"
+		" <name>...  only run the named benchmarks\n");
+	exit(1);
+}
+
+int main(int argc, char* argv[]) {
+	const char *output = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "o:")) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+
+	setupConfig();
+	// measure the formatting, not the limits
+	theConfig.nodeRate = 0;
+	theConfig.globalRate = 0;
+	theConfig.queueHighWater = 0;
+	// the stubs never acknowledge, keep the window empty
+	theConfig.qosReading = 0;
+	theConfig.qosRssi = 0;
+
+	setupRoutes();
+	// a broker always connected, without the connection thread
+	if (!brokersOpen()) { die("init() failure\n"); }
+	brokers[0].state = BROKER_CONNECTED;
+	benchClient = brokers[0].mosq;
+	benchRadio = new BenchRFM69();
+	benchRadio->initialize(theConfig.frequency, theConfig.nodeId, theConfig.networkId);
+	benchRadio->promiscuous(true);
+	rfm69 = benchRadio;
+	relaysOpen(&relays, theConfig.nodeId, theConfig.relays, relayRadioSend);
+	for (int i = 0; i < RF69_MAX_DATA_LEN; i++)
+		benchFrame[i] = i * 7;
+
+	// keep the results, and send the log away
+	if (!loggerOpenPolled("/dev/null", theConfig.logLevel)) { die("unable to start the logger\n"); }
+	fflush(stdout);
+	FILE *out = output != NULL ? fopen(output, "w") : fdopen(dup(STDOUT_FILENO), "w");
+	if (out == NULL) { die("unable to create the result file\n"); }
+	int devnull = open("/dev/null", O_WRONLY);
+	dup2(devnull, STDOUT_FILENO);
+	close(devnull);
+
+	fprintf(out, "{\n  \"benchmark\": \"gateway-micro\",\n  \"timestamp\": %ld,\n  \"results\": [\n", (long)time(NULL));
+	bool first = true;
+	for (unsigned int i = 0; i < BENCH_COUNT; i++) {
+		if (optind < argc) {
+			bool selected = false;
+			for (int a = optind; a < argc; a++)
+				selected |= strcmp(argv[a], benches[i].name) == 0;
+			if (!selected)
+				continue;
+		}
+
+		Result result;
+		runBench(&benches[i], &result);
+		fflush(stdout);
+		fprintf(stderr, "%-18s %12.1f ns/op %8.2f allocs/op %12lu runs\n",
+			benches[i].name, result.nsPerOp, result.allocsPerOp, result.iterations);
+		fprintf(out, "%s    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, \"iterations\": %lu}",
+			first ? "" : ",\n", benches[i].name, result.nsPerOp, result.allocsPerOp, result.iterations);
+		first = false;
+	}
+	fprintf(out, "\n  ]\n}\n");
+	fclose(out);
+	loggerClose();
+	return 0;
+}
@@ -0,0 +1,115 @@
+/*
+RFM69 Gateway local readings dump
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: LocalBusDump.c
+
+Print the readings of a running gateway, as a consumer of the local distribution:
+ - from the shared memory ring, polled without any system call while readings flow
+ - or from the Unix socket, with topic filters
+
+Each reading is printed as one line:
+<seq> <timestamp us> <topic> <rssi> <var1> <var2> <var3> <latency us>
+*/
+
+#include "localbus.h"
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "networkconfig.h"
+
+static void usage(void) {
+	fprintf(stderr, "Use:\n"
+		" -m <name>   read the shared memory ring (default " NWC_LOCAL_SHM ")\n"
+		" -s <path>   read from the socket instead (default " NWC_LOCAL_SOCKET ")\n"
+		" -f <filter> topic filter for the socket, may be repeated (default RFM/#)\n");
+	exit(1);
+}
+
+static void printReading(const LocalReading *r) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	long long latency = now.tv_sec * 1000000LL + now.tv_usec - r->timestamp;
+	printf("%llu %lld RFM/%03d/%02d/up/%d %d %u %f %f %lld\n",
+		(unsigned long long)r->seq, (long long)r->timestamp,
+		r->networkID, r->nodeID, r->sensorID, r->rssi, r->var1, r->var2, r->var3, latency);
+	fflush(stdout);
+}
+
+static int dumpRing(const char *shmName) {
+	LocalRingReader reader;
+	if (!localRingAttach(&reader, shmName)) {
+		fprintf(stderr, "unable to attach %s\n", shmName);
+		return 1;
+	}
+
+	LocalReading r;
+	unsigned long lost = 0;
+	for (;;) {
+		if (!localRingNext(&reader, &r)) {
+			// readings come a few per second at most, do not spin
+			usleep(1000);
+			continue;
+		}
+		if (reader.lost != lost) {
+			fprintf(stderr, "%lu readings lost\n", reader.lost - lost);
+			lost = reader.lost;
+		}
+		printReading(&r);
+	}
+	return 0;
+}
+
+static int dumpSocket(const char *socketPath, const char **filters, int filterCount) {
+	int fd = localBusSubscribe(socketPath, filters[0]);
+	if (fd < 0) {
+		fprintf(stderr, "unable to subscribe to %s\n", socketPath);
+		return 1;
+	}
+	for (int i = 1; i < filterCount; i++)
+		send(fd, filters[i], strlen(filters[i]), MSG_NOSIGNAL);
+
+	LocalReading r;
+	while (recv(fd, &r, sizeof(r), 0) == sizeof(r))
+		printReading(&r);
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	const char *shmName = NWC_LOCAL_SHM;
+	const char *socketPath = NULL;
+	const char *filters[LOCALBUS_MAX_FILTERS] = { "RFM/#" };
+	int filterCount = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:s:f:")) != -1) {
+		switch (opt) {
+		case 'm':
+			shmName = optarg;
+			break;
+		case 's':
+			socketPath = optarg;
+			break;
+		case 'f':
+			if (filterCount >= LOCALBUS_MAX_FILTERS)
+				usage();
+			filters[filterCount++] = optarg;
+			if (socketPath == NULL)
+				socketPath = NWC_LOCAL_SOCKET;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc) usage();
+
+	if (socketPath != NULL)
+		return dumpSocket(socketPath, filters, filterCount > 0 ? filterCount : 1);
+	return dumpRing(shmName);
+}
@@ -0,0 +1,295 @@
+/*
+RFM69 channel survey
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: Scanner.c
+
+Sweep a frequency range with the RFM69 receiver, and sample the RSSI on each
+channel, to measure the interference at a site before choosing its frequency.
+
+The radio stays in RX mode for the whole survey, in continuous mode without
+packet engine, so no frame is received and no interrupt is raised. Changing
+channel is a single burst write of the three FRF registers, followed by a RX
+restart to lock the PLL again; a RSSI sample is a trigger and a burst read of
+RSSICONFIG and RSSIVALUE. The channels are swept several times, so a burst of
+traffic on a channel shows as occupancy rather than as its noise floor.
+
+The RSSI is measured over the receiver bandwidth set by initialize(), the one
+the gateway sees when checking the channel before sending.
+
+Reported per channel, from a histogram of the samples, 0.5 dB each:
+ - noise floor, the 10th percentile, median, 90th and 99th percentiles, max
+ - occupancy, the share of samples over the site noise floor + SCAN_BUSY_MARGIN
+and the cleanest channel, with a CSMA_LIMIT for it. The results are written as
+CSV and JSON, the JSON including the histograms, in 1 dB bins: bin i counts the
+samples from -i dBm down to -i - 1 dBm.
+*/
+
+//general --------------------------------
+#define LOG(...) do { printf(__VA_ARGS__); fflush(stdout); } while (0)
+
+/* CONFIGURATION, please adapt */
+#include "networkconfig.h"
+
+//RFM69  ----------------------------------
+#include "rfm69.h"
+#include "rfm69registers.h"
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+
+#define SCAN_STEP 100000		// Hz between two channels by default
+#define SCAN_SAMPLES 20			// RSSI samples per channel and per pass
+#define SCAN_PASSES 20
+#define SCAN_SETTLE_US 2000		// max wait for the receiver to be ready on a new channel
+#define SCAN_BUSY_MARGIN 10		// dB over the site noise floor for a sample to count as busy
+#define SCAN_CSMA_MARGIN 6		// dB over the 99th percentile of the channel for CSMA_LIMIT
+#define SCAN_LEVELS 256			// values of RSSIVALUE, -value / 2 dBm
+
+typedef struct {
+	uint32_t frf;			// in RF69_FSTEP
+	unsigned long samples;
+	unsigned long busy;
+	unsigned long histogram[SCAN_LEVELS];	// by RSSIVALUE
+	double floor, p50, p90, p99, max;		// dBm
+	double occupancy;
+}
+Channel;
+
+RFM69 *rfm69;
+static uint8_t packetConfig2;
+
+static long micros(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* Fail with an error message. */
+static void die(const char *msg) {
+	fprintf(stderr, "%s", msg);
+	exit(1);
+}
+
+static void uso(void) {
+	fprintf(stderr, "Use:\n"
+		" -f <MHz>    first frequency (default, the start of the band of NWC_FREQUENCY)\n"
+		" -t <MHz>    last frequency (default, the end of the band)\n"
+		" -s <kHz>    step between channels, rounded to %.0f Hz (default %d)\n"
+		" -n <count>  RSSI samples per channel and per pass (default %d)\n"
+		" -p <count>  passes over the range (default %d)\n"
+		" -o <file>   write the channels as CSV\n"
+		" -j <file>   write the channels and their histograms as JSON\n",
+		RF69_FSTEP, SCAN_STEP / 1000, SCAN_SAMPLES, SCAN_PASSES);
+	exit(1);
+}
+
+/* Stay in RX, without packet engine: no frame, no interrupt, the RSSI only */
+static void scanBegin() {
+	rfm69->writeReg(REG_DATAMODUL, RF_DATAMODUL_DATAMODE_CONTINUOUSNOBSYNC | RF_DATAMODUL_MODULATIONTYPE_FSK | RF_DATAMODUL_MODULATIONSHAPING_00);
+	rfm69->receiveDone();	// enters RX
+	packetConfig2 = rfm69->readReg(REG_PACKETCONFIG2) & 0xFB;
+}
+
+static void tune(uint32_t frf) {
+	uint8_t regs[3] = { (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)frf };
+	uint8_t flags;
+
+	rfm69->writeRegs(REG_FRFMSB, regs, 3);
+	rfm69->writeReg(REG_PACKETCONFIG2, packetConfig2 | RF_PACKET2_RXRESTART);
+	long start = micros();
+	do rfm69->readRegs(REG_IRQFLAGS1, &flags, 1);
+	while ((flags & RF_IRQFLAGS1_RXREADY) == 0 && micros() - start < SCAN_SETTLE_US);
+}
+
+static uint8_t sampleRssi() {
+	uint8_t regs[2];	// RSSICONFIG, RSSIVALUE
+
+	rfm69->writeReg(REG_RSSICONFIG, RF_RSSI_START);
+	do rfm69->readRegs(REG_RSSICONFIG, regs, 2);
+	while ((regs[0] & RF_RSSI_DONE) == 0);
+	return regs[1];
+}
+
+static double levelDbm(int level) {
+	return -level / 2.0;
+}
+
+/* The RSSI under which a share p of the samples is, the strongest levels being the lowest RSSIVALUE */
+static double percentile(Channel *c, double p) {
+	unsigned long target = (unsigned long)ceil(p * c->samples);
+	unsigned long count = 0;
+	if (target == 0)
+		target = 1;
+	for (int level = SCAN_LEVELS - 1; level >= 0; level--) {
+		count += c->histogram[level];
+		if (count >= target)
+			return levelDbm(level);
+	}
+	return levelDbm(0);
+}
+
+static int compareDouble(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+	return da < db ? -1 : da > db;
+}
+
+static void writeCsv(FILE *out, Channel *channels, int count) {
+	fprintf(out, "frequency_hz,samples,floor_dbm,p50_dbm,p90_dbm,p99_dbm,max_dbm,occupancy\n");
+	for (int i = 0; i < count; i++) {
+		Channel *c = &channels[i];
+		fprintf(out, "%.0f,%lu,%.1f,%.1f,%.1f,%.1f,%.1f,%.4f\n",
+			c->frf * RF69_FSTEP, c->samples, c->floor, c->p50, c->p90, c->p99, c->max, c->occupancy);
+	}
+}
+
+static void writeJson(FILE *out, Channel *channels, int count, double siteFloor, Channel *best, int csmaLimit, int passes, int samples) {
+	fprintf(out, "{\n  \"survey\": \"rssi\",\n  \"timestamp\": %ld,\n", (long)time(NULL));
+	fprintf(out, "  \"passes\": %d,\n  \"samples_per_pass\": %d,\n  \"site_floor_dbm\": %.1f,\n  \"busy_margin_db\": %d,\n",
+		passes, samples, siteFloor, SCAN_BUSY_MARGIN);
+	fprintf(out, "  \"recommended_hz\": %.0f,\n  \"csma_limit_dbm\": %d,\n", best->frf * RF69_FSTEP, csmaLimit);
+	fprintf(out, "  \"histogram_bin_db\": 1,\n  \"channels\": [\n");
+	for (int i = 0; i < count; i++) {
+		Channel *c = &channels[i];
+		fprintf(out, "    {\"frequency_hz\": %.0f, \"samples\": %lu, \"floor_dbm\": %.1f, \"p50_dbm\": %.1f, \"p90_dbm\": %.1f, "
+			"\"p99_dbm\": %.1f, \"max_dbm\": %.1f, \"occupancy\": %.4f, \"histogram\": [",
+			c->frf * RF69_FSTEP, c->samples, c->floor, c->p50, c->p90, c->p99, c->max, c->occupancy);
+		// bin i counts the samples from -i dBm down to -i - 1 dBm
+		for (int bin = 0; bin < SCAN_LEVELS / 2; bin++)
+			fprintf(out, "%s%lu", bin ? "," : "", c->histogram[2 * bin] + c->histogram[2 * bin + 1]);
+		fprintf(out, "]}%s\n", i < count - 1 ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[]) {
+	double first = 0, last = 0;
+	double step = SCAN_STEP;
+	int samples = SCAN_SAMPLES;
+	int passes = SCAN_PASSES;
+	FILE *csv = NULL;
+	FILE *json = NULL;
+	int opt;
+
+	switch (NWC_FREQUENCY) {
+	case RF69_315MHZ: first = 314e6; last = 316e6; break;
+	case RF69_433MHZ: first = 433.05e6; last = 434.79e6; break;
+	case RF69_868MHZ: first = 863e6; last = 870e6; break;
+	default: first = 902e6; last = 928e6; break;
+	}
+
+	while ((opt = getopt(argc, argv, "f:t:s:n:p:o:j:")) != -1) {
+		switch (opt) {
+		case 'f':
+			first = atof(optarg) * 1e6;
+			break;
+		case 't':
+			last = atof(optarg) * 1e6;
+			break;
+		case 's':
+			step = atof(optarg) * 1e3;
+			break;
+		case 'n':
+			samples = atoi(optarg);
+			break;
+		case 'p':
+			passes = atoi(optarg);
+			break;
+		case 'o':
+			csv = fopen(optarg, "w");
+			if (csv == NULL) { die("unable to create the CSV file\n"); }
+			break;
+		case 'j':
+			json = fopen(optarg, "w");
+			if (json == NULL) { die("unable to create the JSON file\n"); }
+			break;
+		default:
+			uso();
+		}
+	}
+	if (optind != argc || first <= 0 || last < first || step < RF69_FSTEP || samples < 1 || passes < 1) uso();
+
+	// the channels, in whole FRF steps
+	uint32_t frfFirst = lround(first / RF69_FSTEP);
+	uint32_t frfStep = lround(step / RF69_FSTEP);
+	int count = (lround(last / RF69_FSTEP) - frfFirst) / frfStep + 1;
+	Channel *channels = (Channel *)calloc(count, sizeof(Channel));
+	if (channels == NULL) { die("out of memory\n"); }
+	for (int i = 0; i < count; i++)
+		channels[i].frf = frfFirst + i * frfStep;
+
+	rfm69 = new RFM69();
+	if (!rfm69->initialize(NWC_FREQUENCY, NWC_NODE_ID, NWC_NETWORK_ID)) { die("RFM69 not found\n"); }
+	scanBegin();
+	LOG("Scanning %d channels from %.3f to %.3f MHz, %.1f kHz apart\n",
+		count, channels[0].frf * RF69_FSTEP / 1e6, channels[count - 1].frf * RF69_FSTEP / 1e6, frfStep * RF69_FSTEP / 1e3);
+
+	long start = micros();
+	for (int pass = 0; pass < passes; pass++) {
+		for (int i = 0; i < count; i++) {
+			Channel *c = &channels[i];
+			tune(c->frf);
+			for (int s = 0; s < samples; s++)
+				c->histogram[sampleRssi()]++;
+			c->samples += samples;
+		}
+		LOG("Pass %d/%d\n", pass + 1, passes);
+	}
+	double seconds = (micros() - start) / 1e6;
+	LOG("%lu samples in %.1f s, %.0f samples/s, %.0f channels/s\n",
+		(unsigned long)count * samples * passes, seconds, count * samples * passes / seconds, count * passes / seconds);
+
+	// the site noise floor is the median of the channel floors, so a few busy channels do not raise it
+	double *floors = (double *)malloc(count * sizeof(double));
+	if (floors == NULL) { die("out of memory\n"); }
+	for (int i = 0; i < count; i++) {
+		Channel *c = &channels[i];
+		c->floor = percentile(c, 0.10);
+		c->p50 = percentile(c, 0.50);
+		c->p90 = percentile(c, 0.90);
+		c->p99 = percentile(c, 0.99);
+		c->max = percentile(c, 1.0);
+		floors[i] = c->floor;
+	}
+	qsort(floors, count, sizeof(double), compareDouble);
+	double siteFloor = floors[count / 2];
+	free(floors);
+
+	// the cleanest channel is the least busy, then the quietest
+	Channel *best = &channels[0];
+	for (int i = 0; i < count; i++) {
+		Channel *c = &channels[i];
+		for (int level = 0; level < SCAN_LEVELS && levelDbm(level) > siteFloor + SCAN_BUSY_MARGIN; level++)
+			c->busy += c->histogram[level];
+		c->occupancy = (double)c->busy / c->samples;
+		if (c->occupancy < best->occupancy || (c->occupancy == best->occupancy && (c->p90 < best->p90 || (c->p90 == best->p90 && c->p50 < best->p50))))
+			best = c;
+		LOG("%9.3f MHz  floor %6.1f  p50 %6.1f  p90 %6.1f  max %6.1f  busy %5.1f%%  %.*s\n",
+			c->frf * RF69_FSTEP / 1e6, c->floor, c->p50, c->p90, c->max, c->occupancy * 100,
+			(int)(c->occupancy * 50 + 0.5), "##################################################");
+	}
+
+	// over the noise of the channel, so the gateway does not wait for nothing, under the nodes heard
+	int csmaLimit = (int)ceil(best->p99) + SCAN_CSMA_MARGIN;
+	LOG("Site noise floor %.1f dBm\n", siteFloor);
+	LOG("Cleanest channel %.3f MHz: floor %.1f dBm, busy %.1f%%, radio.setFrequency(%.0f)\n",
+		best->frf * RF69_FSTEP / 1e6, best->floor, best->occupancy * 100, best->frf * RF69_FSTEP);
+	LOG("CSMA_LIMIT %d dBm, for %d now\n", csmaLimit, CSMA_LIMIT);
+
+	if (csv) {
+		writeCsv(csv, channels, count);
+		fclose(csv);
+	}
+	if (json) {
+		writeJson(json, channels, count, siteFloor, best, csmaLimit, passes, samples);
+		fclose(json);
+	}
+	free(channels);
+	return 0;
+}
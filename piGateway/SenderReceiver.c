@@ -7,11 +7,30 @@ License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
 Date:  2015-12-03
 File: SenderReciever.c
 
-Define the RFM Frequency of the chip used, your network id (pick one) and the encryption key 
+Define the RFM Frequency of the chip used, your network id (pick one) and the encryption key
+
+Link characterisation: the sender sweeps the bitrate profile, the power level,
+the payload size and the retry settings, and sends a run of test frames for each
+combination. The receiver answers every test frame with an ACK carrying the RSSI
+it measured, and its count of frames received.
+
+Every step starts with a setup frame, sent at the default bitrate and full power,
+which tells the receiver the bitrate of the step; a end frame, at the bitrate of
+the step, brings it back. A receiver hearing nothing for LINK_IDLE ms goes back
+to the default bitrate by itself, so a step lost entirely does not stop the sweep.
+Only the sender changes its power level, the ACKs are sent at the default power.
+
+Measured per step:
+ - frame error rate, the attempts without ACK, and the messages delivered within the retries
+ - frames heard by the receiver, and duplicates, the ACK being lost
+ - goodput, the payload bits delivered per second
+ - ACK round trip percentiles, from the send to the ACK
+ - RSSI distribution at the receiver, and median RSSI of the ACKs at the sender
+The results are written as CSV and JSON, to choose the settings of a site.
 */
 
 //general --------------------------------
-#define LOG(...) do { printf(__VA_ARGS__); } while (0)
+#define LOG(...) do { printf(__VA_ARGS__); fflush(stdout); } while (0)
 
 /* CONFIGURATION, please adapt */
 #include "networkconfig.h"
@@ -19,6 +38,7 @@ Define the RFM Frequency of the chip used, your network id (pick one) and the en
 
 //RFM69  ----------------------------------
 #include "rfm69.h"
+#include "rfm69registers.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -33,6 +53,7 @@ Define the RFM Frequency of the chip used, your network id (pick one) and the en
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <math.h>
 
 
 
@@ -50,24 +71,82 @@ typedef struct {
 Config;
 Config theConfig;
 
-typedef struct {		
-	short           nodeID; 
+typedef struct {
+	short           nodeID;
 	short			sensorID;
-	unsigned long   var1_usl; 
-	float           var2_float; 
-	float			var3_float;	
-} 
+	unsigned long   var1_usl;
+	float           var2_float;
+	float			var3_float;
+}
 Payload;
 Payload theData;
 
+// Link test frames, the first byte is the type
+#define LINK_SETUP 0xE1		// step, profile: switch to the bitrate of the step once ACKed
+#define LINK_TEST 0xE2		// step, seq (2 bytes), padding up to the size tested
+#define LINK_END 0xE3		// step: back to the default bitrate once ACKed
+#define LINK_ACK 0xE4		// in the ACKs: step, seq (2 bytes), RSSI, received (2 bytes), duplicates (2 bytes)
+
+#define LINK_TEST_HEADER 4
+#define LINK_ACK_SIZE 9
+#define LINK_IDLE 3000			// ms without frame before the receiver goes back to the default bitrate
+#define LINK_SETUP_RETRIES 5
+#define LINK_SETUP_WAIT 100		// ms for the ACK of a setup or end frame
+#define LINK_MAX_MESSAGES 65535	// test frames per step
+#define LINK_MAX_VALUES 16		// values of each swept setting
+
+typedef struct {
+	long bitrate;		// bps
+	uint8_t bitrateMsb, bitrateLsb;
+	uint8_t fdevMsb, fdevLsb;
+	uint8_t rxBw;		// single side bandwidth >= FDEV + bitrate / 2
+}
+Profile;
+
+static const Profile profiles[] = {
+	{ 4800, RF_BITRATEMSB_4800, RF_BITRATELSB_4800, RF_FDEVMSB_5000, RF_FDEVLSB_5000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_24 | RF_RXBW_EXP_5 },		// 10.4 kHz
+	{ 9600, RF_BITRATEMSB_9600, RF_BITRATELSB_9600, RF_FDEVMSB_10000, RF_FDEVLSB_10000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_24 | RF_RXBW_EXP_4 },	// 20.8 kHz
+	{ 19200, RF_BITRATEMSB_19200, RF_BITRATELSB_19200, RF_FDEVMSB_20000, RF_FDEVLSB_20000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_24 | RF_RXBW_EXP_3 },	// 41.7 kHz
+	{ 38400, RF_BITRATEMSB_38400, RF_BITRATELSB_38400, RF_FDEVMSB_40000, RF_FDEVLSB_40000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_16 | RF_RXBW_EXP_3 },	// 62.5 kHz
+	{ 55555, RF_BITRATEMSB_55555, RF_BITRATELSB_55555, RF_FDEVMSB_50000, RF_FDEVLSB_50000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_16 | RF_RXBW_EXP_2 },	// 125 kHz, as set by initialize()
+	{ 100000, RF_BITRATEMSB_100000, RF_BITRATELSB_100000, RF_FDEVMSB_100000, RF_FDEVLSB_100000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_16 | RF_RXBW_EXP_1 },	// 250 kHz
+	{ 200000, RF_BITRATEMSB_200000, RF_BITRATELSB_200000, RF_FDEVMSB_100000, RF_FDEVLSB_100000, RF_RXBW_DCCFREQ_010 | RF_RXBW_MANT_16 | RF_RXBW_EXP_1 },	// 250 kHz
+};
+#define PROFILE_COUNT ((int)(sizeof(profiles) / sizeof(profiles[0])))
+#define PROFILE_DEFAULT 4
+
+typedef struct {
+	long bitrate;
+	int power;
+	int size;
+	int retries;
+	int wait;			// ms for the ACK of an attempt
+	bool setupFailed;	// the receiver did not take the step
+	unsigned long messages;
+	unsigned long delivered;	// ACKed within the retries
+	unsigned long attempts;
+	unsigned long acked;
+	unsigned long received;		// as counted by the receiver
+	unsigned long duplicates;
+	double seconds;
+	double frameErrorRate;
+	double goodput;		// payload bps delivered
+	long rttP50, rttP90, rttP99, rttMax;	// us
+	long rssiMin, rssiP10, rssiP50, rssiP90, rssiMax;	// dBm at the receiver
+	long ackRssiP50;	// dBm at the sender
+}
+Step;
+
 
 static void die(const char *msg);
 static long millis(void);
+static long micros(void);
 static void hexDump (char *desc, void *addr, int len, int bloc);
 
 static int initRfm(RFM69 *rfm);
-static void send_message();
+static void setProfile(int profile);
 static int run_loop();
+static int sweep(FILE *csv, FILE *json);
 
 static int RECEIVER_ID = 10;
 static int SENDER_ID = 11;
@@ -77,17 +156,64 @@ static int GATEWAY_ID;
 enum Mode {
   sender,
   receiver
-}; 
+};
 enum Mode mode;
 
+// sweep settings, and the test frames of each step
+static int bitrates[LINK_MAX_VALUES] = { 55555 };
+static int bitrateCount = 1;
+static int powers[LINK_MAX_VALUES] = { 31, 20, 10 };
+static int powerCount = 3;
+static int sizes[LINK_MAX_VALUES] = { 8, 16, 32, 61 };
+static int sizeCount = 4;
+static int retries[LINK_MAX_VALUES] = { 0, 2 };
+static int retryCount = 2;
+static int waits[LINK_MAX_VALUES] = { 40 };
+static int waitCount = 1;
+static int messages = 100;
+static int interval = 10;
+
 
 static void uso(void) {
-	fprintf(stderr, "Use:\n -s for sender, -r for receiver \n");
+	fprintf(stderr, "Use:\n -s for sender, -r for receiver \n"
+		"Sender options, the lists are separated by commas:\n"
+		" -b <bitrates>  bitrate profiles, in bps, among 4800 9600 19200 38400 55555 100000 200000 (default 55555)\n"
+		" -p <levels>    power levels, 0 to 31 (default 31,20,10)\n"
+		" -z <sizes>     payload sizes, %d to %d bytes (default 8,16,32,61)\n"
+		" -t <retries>   retries of a message (default 0,2)\n"
+		" -w <ms>        wait for the ACK of each attempt (default 40)\n"
+		" -n <count>     messages per step (default 100)\n"
+		" -i <ms>        interval between two messages (default 10)\n"
+		" -o <file>      write the results as CSV\n"
+		" -j <file>      write the results as JSON\n", LINK_TEST_HEADER, RF69_MAX_DATA_LEN);
 	exit(1);
 }
 
+static int parseList(char *arg, int *values, int min, int max) {
+	int count = 0;
+	for (char *v = strtok(arg, ","); v != NULL; v = strtok(NULL, ",")) {
+		if (count == LINK_MAX_VALUES) uso();
+		values[count] = atoi(v);
+		if (values[count] < min || values[count] > max) uso();
+		count++;
+	}
+	if (count == 0) uso();
+	return count;
+}
+
+static int findProfile(long bitrate) {
+	for (int i = 0; i < PROFILE_COUNT; i++)
+		if (profiles[i].bitrate == bitrate)
+			return i;
+	return -1;
+}
+
 int main(int argc, char* argv[]) {
-	if (argc != 2) uso();
+	FILE *csv = NULL;
+	FILE *json = NULL;
+	int opt;
+
+	if (argc < 2) uso();
   if (strcmp(argv[1], "-r") == 0 ) {
     mode = receiver;
     NODE_ID = RECEIVER_ID;
@@ -101,6 +227,48 @@ int main(int argc, char* argv[]) {
     uso();
   }
 
+	optind = 2;
+	while ((opt = getopt(argc, argv, "b:p:z:t:w:n:i:o:j:")) != -1) {
+		if (mode != sender) uso();
+		switch (opt) {
+		case 'b':
+			bitrateCount = parseList(optarg, bitrates, 0, 300000);
+			for (int i = 0; i < bitrateCount; i++)
+				if (findProfile(bitrates[i]) < 0) uso();
+			break;
+		case 'p':
+			powerCount = parseList(optarg, powers, 0, 31);
+			break;
+		case 'z':
+			sizeCount = parseList(optarg, sizes, LINK_TEST_HEADER, RF69_MAX_DATA_LEN);
+			break;
+		case 't':
+			retryCount = parseList(optarg, retries, 0, 255);
+			break;
+		case 'w':
+			waitCount = parseList(optarg, waits, 1, 10000);
+			break;
+		case 'n':
+			messages = atoi(optarg);
+			if (messages < 1 || messages > LINK_MAX_MESSAGES) uso();
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval < 0) uso();
+			break;
+		case 'o':
+			csv = fopen(optarg, "w");
+			if (csv == NULL) { die("unable to create the CSV file\n"); }
+			break;
+		case 'j':
+			json = fopen(optarg, "w");
+			if (json == NULL) { die("unable to create the JSON file\n"); }
+			break;
+		default:
+			uso();
+		}
+	}
+	if (optind != argc) uso();
 
 	//RFM69 ---------------------------
 	theConfig.networkId = NWC_NETWORK_ID;
@@ -112,22 +280,29 @@ int main(int argc, char* argv[]) {
 	theConfig.promiscuousMode = NWC_PROMISCUOUS_MODE;
 
 	LOG("NETWORK %d NODE_ID %d FREQUENCY %d\n", theConfig.networkId, theConfig.nodeId, theConfig.frequency);
-	
+
 	rfm69 = new RFM69();
 	rfm69->initialize(theConfig.frequency,theConfig.nodeId,theConfig.networkId);
 	initRfm(rfm69);
-	
+
 	LOG("setup complete\n");
+	if (mode == sender)
+		return sweep(csv, json);
 	return run_loop();
 }
 
-int counter = 0;
-
-/* Loop until it is explicitly halted or the network is lost, then clean up. */
+/* Receiver: answer the test frames, and print any other frame */
 static int run_loop() {
+	static uint8_t seen[LINK_MAX_MESSAGES / 8 + 1];
+	uint8_t step = 0;
+	bool inStep = false;
+	unsigned long received = 0;
+	unsigned long duplicates = 0;
+	long rssiSum = 0;
+	long lastFrame = millis();
+
 	for (;;) {
-		if (mode == receiver && rfm69->receiveDone()) {
-			LOG("Received something...\n");
+		if (rfm69->receiveDone()) {
 			// store the received data localy, so they can be overwited
 			// This will allow to send ACK immediately after
 			uint8_t data[RF69_MAX_DATA_LEN]; // recv/xmit buf, including header & crc bytes
@@ -135,26 +310,74 @@ static int run_loop() {
 			memcpy(data, (void *)rfm69->DATA, dataLength);
 			uint8_t theNodeID = rfm69->SENDERID;
 			uint8_t targetID = rfm69->TARGETID; // should match _address
-			uint8_t PAYLOADLEN = rfm69->PAYLOADLEN;
 			uint8_t ACK_REQUESTED = rfm69->ACK_REQUESTED;
-			uint8_t ACK_RECEIVED = rfm69->ACK_RECEIVED; // should be polled immediately after sending a packet with ACK request
 			int16_t RSSI = rfm69->RSSI; // most accurate RSSI during reception (closest to the reception)
+
+			if (targetID == theConfig.nodeId && dataLength >= 2 && (data[0] == LINK_SETUP || data[0] == LINK_TEST || data[0] == LINK_END)) {
+				uint8_t ack[LINK_ACK_SIZE];
+				lastFrame = millis();
+				if (data[0] == LINK_SETUP && dataLength >= 3) {
+					step = data[1];
+					received = duplicates = 0;
+					rssiSum = 0;
+					memset(seen, 0, sizeof(seen));
+				}
+				else if (data[0] == LINK_TEST && dataLength >= LINK_TEST_HEADER && data[1] == step) {
+					uint16_t seq = data[2] | data[3] << 8;
+					if (seen[seq >> 3] & (1 << (seq & 7)))
+						duplicates++;
+					else {
+						seen[seq >> 3] |= 1 << (seq & 7);
+						received++;
+						rssiSum += RSSI;
+					}
+				}
+				// the ACK first, the sender is waiting for it
+				if (ACK_REQUESTED) {
+					ack[0] = LINK_ACK;
+					ack[1] = data[1];
+					ack[2] = data[0] == LINK_TEST ? data[2] : 0;
+					ack[3] = data[0] == LINK_TEST ? data[3] : 0;
+					ack[4] = (int8_t)RSSI;
+					ack[5] = received;
+					ack[6] = received >> 8;
+					ack[7] = duplicates;
+					ack[8] = duplicates >> 8;
+					rfm69->sendACK(ack, sizeof(ack));
+				}
+				if (data[0] == LINK_SETUP && dataLength >= 3) {
+					int profile = data[2] < PROFILE_COUNT ? data[2] : PROFILE_DEFAULT;
+					setProfile(profile);
+					inStep = profile != PROFILE_DEFAULT;
+					LOG("Step %d at %ld bps\n", step, profiles[profile].bitrate);
+				}
+				else if (data[0] == LINK_END && data[1] == step) {
+					LOG("Step %d: %lu frames received, %lu duplicates, RSSI avg %ld\n",
+						step, received, duplicates, received ? rssiSum / (long)received : 0);
+					if (inStep)
+						setProfile(PROFILE_DEFAULT);
+					inStep = false;
+				}
+				continue;
+			}
+
+			LOG("Received something...\n");
 			LOG("ACK REQUESTED: %d, targetID %d, theConfig.nodeId %d\n", ACK_REQUESTED, targetID, theConfig.nodeId);
 			if (ACK_REQUESTED  && targetID == theConfig.nodeId) {
 				// When a node requests an ACK, respond to the ACK
 				// but only if the Node ID is correct
 				rfm69->sendACK();
 			}//end if radio.ACK_REQESTED
-	
+
 			LOG("[%d] to [%d] ", theNodeID, targetID);
 
 			if (dataLength != sizeof(Payload)) {
-				LOG("Invalid payload received, not matching Payload struct! %d - %d\r\n", dataLength, sizeof(Payload));
-				hexDump(NULL, data, dataLength, 16);		
+				LOG("Invalid payload received, not matching Payload struct! %d - %d\r\n", dataLength, (int)sizeof(Payload));
+				hexDump(NULL, data, dataLength, 16);
 			} else {
 				theData = *(Payload*)data; //assume radio.DATA actually contains our struct and not something else
 
-				LOG("Received Node ID = %d Device ID = %d Time = %d  RSSI = %d var2 = %f var3 = %f\n",
+				LOG("Received Node ID = %d Device ID = %d Time = %lu  RSSI = %d var2 = %f var3 = %f\n",
 					theData.nodeID,
 					theData.sensorID,
 					theData.var1_usl,
@@ -162,19 +385,15 @@ static int run_loop() {
 					theData.var2_float,
 					theData.var3_float
 				);
-			}  
+			}
 		} //end if radio.receive
-		
-    if (mode == sender) {
-  		counter = counter + 1;
-  		if (counter % 20 == 0) {
-  			LOG("Sending test message\n");
-  			send_message();
-  		} else {
-  			usleep(100*1000);
-  		}
-    } 
-		
+
+		// the sender is gone, or could not reach this bitrate
+		if (inStep && millis() - lastFrame > LINK_IDLE) {
+			LOG("Step %d: no frame for %d ms, back to %ld bps\n", step, LINK_IDLE, profiles[PROFILE_DEFAULT].bitrate);
+			setProfile(PROFILE_DEFAULT);
+			inStep = false;
+		}
 	}
 
 }
@@ -187,6 +406,19 @@ static int initRfm(RFM69 *rfm) {
 		rfm->encrypt(theConfig.key);
 	rfm->promiscuous(theConfig.promiscuousMode);
 	LOG("Listening at %d Mhz...\n", theConfig.frequency==RF69_433MHZ ? 433 : theConfig.frequency==RF69_868MHZ ? 868 : 915);
+	return 0;
+}
+
+/* Change the bitrate, with the deviation and receiver bandwidth going with it */
+static void setProfile(int profile) {
+	const Profile *p = &profiles[profile];
+	rfm69->sleep();		// receiveDone() restarts the reception with the new settings
+	rfm69->writeReg(REG_BITRATEMSB, p->bitrateMsb);
+	rfm69->writeReg(REG_BITRATELSB, p->bitrateLsb);
+	rfm69->writeReg(REG_FDEVMSB, p->fdevMsb);
+	rfm69->writeReg(REG_FDEVLSB, p->fdevLsb);
+	rfm69->writeReg(REG_RXBW, p->rxBw);
+	rfm69->receiveDone();
 }
 
 /* Fail with an error message. */
@@ -203,7 +435,14 @@ static long millis(void) {
     return ((tv.tv_sec) * 1000 + tv.tv_usec/1000.0) + 0.5;
 	}
 
-	
+static long micros(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+
 /* Binary Dump utility function */
 #define MAX_BLOC 16
 const unsigned char hex_asc[] = "0123456789abcdef";
@@ -214,47 +453,47 @@ static void hexDump (char *desc, void *addr, int len, int bloc) {
 	unsigned char ascbuf[MAX_BLOC + 1];	// ASCII part of the data
     unsigned char *pc = (unsigned char*)addr;
 	unsigned char ch;
-	
+
 	// nothing to output
 	if (!len)
 		return;
 
 	// Limit the line length to MAX_BLOC
-	if (bloc > MAX_BLOC) 
+	if (bloc > MAX_BLOC)
 		bloc = MAX_BLOC;
-		
+
 	// Output description if given.
     if (desc != NULL)
 		LOG("%s:\n", desc);
-	
+
 	line = 0;
 	do
 		{
 		l = len - (line * bloc);
 		if (l > bloc)
 			l = bloc;
-	
+
 		for (i=0, lx = 0, la = 0; i < l; i++) {
 			ch = pc[i];
 			hexbuf[lx++] = hex_asc[((ch) & 0xF0) >> 4];
 			hexbuf[lx++] = hex_asc[((ch) & 0xF)];
 			hexbuf[lx++] = ' ';
-		
+
 			ascbuf[la++]  = (ch > 0x20 && ch < 0x7F) ? ch : '.';
 			}
-	
+
 		for (; i < bloc; i++) {
 			hexbuf[lx++] = ' ';
 			hexbuf[lx++] = ' ';
 			hexbuf[lx++] = ' ';
-		}	
+		}
 		// nul terminate both buffer
 		hexbuf[lx++] = 0;
 		ascbuf[la++] = 0;
-	
+
 		// output buffers
 		LOG("%04x %s %s\n", line * bloc, hexbuf, ascbuf);
-		
+
 		line++;
 		pc += bloc;
 		}
@@ -262,31 +501,205 @@ static void hexDump (char *desc, void *addr, int len, int bloc) {
 }
 
 
+/* One attempt: send, and wait for the ACK of this very frame, ignoring the late ACKs of the previous ones */
+static bool sendAttempt(const uint8_t *frame, int size, int wait, long *rtt, int16_t *ackRssi, uint8_t *ack) {
+	long start = micros();
+	rfm69->send(GATEWAY_ID, frame, size, true);
+	while (micros() - start < wait * 1000L) {
+		if (rfm69->receiveDone() && rfm69->ACK_RECEIVED && rfm69->SENDERID == GATEWAY_ID
+				&& rfm69->DATALEN >= LINK_ACK_SIZE && rfm69->DATA[0] == LINK_ACK
+				&& rfm69->DATA[1] == frame[1] && (frame[0] != LINK_TEST || (rfm69->DATA[2] == frame[2] && rfm69->DATA[3] == frame[3]))) {
+			*rtt = micros() - start;
+			*ackRssi = rfm69->RSSI;
+			memcpy(ack, (const void *)rfm69->DATA, LINK_ACK_SIZE);
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Setup and end frames go at full power, and are retried */
+static bool sendControl(uint8_t type, uint8_t step, uint8_t profile) {
+	uint8_t frame[3] = { type, step, profile };
+	uint8_t ack[LINK_ACK_SIZE];
+	long rtt;
+	int16_t ackRssi;
+
+	rfm69->setPowerLevel(31);
+	for (int i = 0; i <= LINK_SETUP_RETRIES; i++)
+		if (sendAttempt(frame, sizeof(frame), LINK_SETUP_WAIT, &rtt, &ackRssi, ack))
+			return true;
+	return false;
+}
 
-static void send_message() {
-	uint8_t retries = 0;
-	uint8_t wait_time = 255;
-	Payload data;
-	uint8_t network;
-	data.nodeID = GATEWAY_ID;
-	data.sensorID = 10;
-	data.var1_usl = 1000;
-	data.var2_float = 99.0;
-	data.var3_float = 101.0;
-	
-	LOG("Will Send message to Node ID = %d Device ID = %d Time = %d  var2 = %f var3 = %f\n",
-		data.nodeID,
-		data.sensorID,
-		data.var1_usl,
-		data.var2_float,
-		data.var3_float
-	);
-
-	if (rfm69->sendWithRetry(data.nodeID,(const void*)(&data),sizeof(data), retries, wait_time)) {
-		LOG("\n\nOK: Message sent to node %d ACK\n\n", data.nodeID);
+static int compareLong(const void *a, const void *b) {
+	long la = *(const long *)a, lb = *(const long *)b;
+	return la < lb ? -1 : la > lb;
+}
+
+static long percentile(long *sorted, unsigned long count, double p) {
+	if (count == 0)
+		return 0;
+	unsigned long i = (unsigned long)ceil(p * count);
+	return sorted[i == 0 ? 0 : i - 1];
+}
+
+/* Send the test frames of one step, the receiver being already at its bitrate */
+static void runStep(uint8_t stepId, Step *step, long *rtts, long *rssis, long *ackRssis) {
+	uint8_t frame[RF69_MAX_DATA_LEN];
+	uint8_t ack[LINK_ACK_SIZE];
+	unsigned long rssiCount = 0;
+
+	for (int i = LINK_TEST_HEADER; i < step->size; i++)
+		frame[i] = i;
+	frame[0] = LINK_TEST;
+	frame[1] = stepId;
+
+	rfm69->setPowerLevel(step->power);
+	long start = micros();
+	for (unsigned long seq = 0; seq < step->messages; seq++) {
+		frame[2] = seq;
+		frame[3] = seq >> 8;
+		for (int attempt = 0; attempt <= step->retries; attempt++) {
+			long rtt;
+			int16_t ackRssi;
+			step->attempts++;
+			if (sendAttempt(frame, step->size, step->wait, &rtt, &ackRssi, ack)) {
+				rtts[step->acked] = rtt;
+				ackRssis[step->acked] = ackRssi;
+				step->acked++;
+				step->delivered++;
+				// a duplicate is not a new RSSI sample
+				unsigned long received = ack[5] | ack[6] << 8;
+				if (received > step->received) {
+					rssis[rssiCount++] = (int8_t)ack[4];
+					step->received = received;
+				}
+				step->duplicates = ack[7] | ack[8] << 8;
+				break;
+			}
+		}
+		if (interval)
+			usleep(interval * 1000);
 	}
-	else {
-		LOG("\n\nERROR: essage sent to node %d NAK \n\n", data.nodeID);
+	step->seconds = (micros() - start) / 1e6;
+
+	step->frameErrorRate = step->attempts ? 1.0 - (double)step->acked / step->attempts : 0;
+	step->goodput = step->seconds > 0 ? step->delivered * step->size * 8 / step->seconds : 0;
+	qsort(rtts, step->acked, sizeof(long), compareLong);
+	step->rttP50 = percentile(rtts, step->acked, 0.50);
+	step->rttP90 = percentile(rtts, step->acked, 0.90);
+	step->rttP99 = percentile(rtts, step->acked, 0.99);
+	step->rttMax = percentile(rtts, step->acked, 1.0);
+	qsort(rssis, rssiCount, sizeof(long), compareLong);
+	step->rssiMin = percentile(rssis, rssiCount, 0);
+	step->rssiP10 = percentile(rssis, rssiCount, 0.10);
+	step->rssiP50 = percentile(rssis, rssiCount, 0.50);
+	step->rssiP90 = percentile(rssis, rssiCount, 0.90);
+	step->rssiMax = percentile(rssis, rssiCount, 1.0);
+	qsort(ackRssis, step->acked, sizeof(long), compareLong);
+	step->ackRssiP50 = percentile(ackRssis, step->acked, 0.50);
+}
+
+static void writeCsv(FILE *out, Step *steps, int count) {
+	fprintf(out, "bitrate,power,size,retries,wait_ms,setup_failed,messages,delivered,attempts,acked,received,duplicates,"
+		"frame_error_rate,goodput_bps,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us,"
+		"rssi_min,rssi_p10,rssi_p50,rssi_p90,rssi_max,ack_rssi_p50\n");
+	for (int i = 0; i < count; i++) {
+		Step *s = &steps[i];
+		fprintf(out, "%ld,%d,%d,%d,%d,%d,%lu,%lu,%lu,%lu,%lu,%lu,%.4f,%.0f,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld,%ld\n",
+			s->bitrate, s->power, s->size, s->retries, s->wait, s->setupFailed, s->messages, s->delivered,
+			s->attempts, s->acked, s->received, s->duplicates, s->frameErrorRate, s->goodput,
+			s->rttP50, s->rttP90, s->rttP99, s->rttMax,
+			s->rssiMin, s->rssiP10, s->rssiP50, s->rssiP90, s->rssiMax, s->ackRssiP50);
 	}
 }
 
+static void writeJson(FILE *out, Step *steps, int count) {
+	fprintf(out, "{\n  \"benchmark\": \"link\",\n  \"timestamp\": %ld,\n", (long)time(NULL));
+	fprintf(out, "  \"network\": %d,\n  \"frequency\": %d,\n  \"messages\": %d,\n  \"interval_ms\": %d,\n  \"steps\": [\n",
+		theConfig.networkId, theConfig.frequency, messages, interval);
+	for (int i = 0; i < count; i++) {
+		Step *s = &steps[i];
+		fprintf(out, "    {\"bitrate\": %ld, \"power\": %d, \"size\": %d, \"retries\": %d, \"wait_ms\": %d, \"setup_failed\": %s, "
+			"\"messages\": %lu, \"delivered\": %lu, \"attempts\": %lu, \"acked\": %lu, \"received\": %lu, \"duplicates\": %lu, "
+			"\"frame_error_rate\": %.4f, \"goodput_bps\": %.0f, "
+			"\"rtt_us\": {\"p50\": %ld, \"p90\": %ld, \"p99\": %ld, \"max\": %ld}, "
+			"\"rssi\": {\"min\": %ld, \"p10\": %ld, \"p50\": %ld, \"p90\": %ld, \"max\": %ld}, \"ack_rssi_p50\": %ld}%s\n",
+			s->bitrate, s->power, s->size, s->retries, s->wait, s->setupFailed ? "true" : "false",
+			s->messages, s->delivered, s->attempts, s->acked, s->received, s->duplicates,
+			s->frameErrorRate, s->goodput,
+			s->rttP50, s->rttP90, s->rttP99, s->rttMax,
+			s->rssiMin, s->rssiP10, s->rssiP50, s->rssiP90, s->rssiMax, s->ackRssiP50,
+			i < count - 1 ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+/* Sender: run every combination of the settings, the bitrate changing the least often */
+static int sweep(FILE *csv, FILE *json) {
+	int count = bitrateCount * powerCount * sizeCount * retryCount * waitCount;
+	int maxRetries = 0;
+	for (int i = 0; i < retryCount; i++)
+		if (retries[i] > maxRetries)
+			maxRetries = retries[i];
+	unsigned long maxAttempts = (unsigned long)messages * (maxRetries + 1);
+
+	Step *steps = (Step *)calloc(count, sizeof(Step));
+	long *rtts = (long *)malloc(maxAttempts * sizeof(long));
+	long *rssis = (long *)malloc(maxAttempts * sizeof(long));
+	long *ackRssis = (long *)malloc(maxAttempts * sizeof(long));
+	if (steps == NULL || rtts == NULL || rssis == NULL || ackRssis == NULL) { die("out of memory\n"); }
+
+	int n = 0;
+	for (int b = 0; b < bitrateCount; b++)
+	for (int p = 0; p < powerCount; p++)
+	for (int z = 0; z < sizeCount; z++)
+	for (int t = 0; t < retryCount; t++)
+	for (int w = 0; w < waitCount; w++) {
+		Step *step = &steps[n];
+		int profile = findProfile(bitrates[b]);
+		uint8_t stepId = n++;
+		step->bitrate = bitrates[b];
+		step->power = powers[p];
+		step->size = sizes[z];
+		step->retries = retries[t];
+		step->wait = waits[w];
+		step->messages = messages;
+
+		// the receiver may still be at the bitrate of a step gone wrong, wait for it to come back
+		long deadline = millis() + 2 * LINK_IDLE;
+		bool ready;
+		while (!(ready = sendControl(LINK_SETUP, stepId, profile)) && millis() < deadline)
+			usleep(100 * 1000);
+		if (!ready) {
+			step->setupFailed = true;
+			LOG("Step %d: the receiver does not answer at %ld bps\n", stepId, profiles[PROFILE_DEFAULT].bitrate);
+			continue;
+		}
+		setProfile(profile);
+		runStep(stepId, step, rtts, rssis, ackRssis);
+		if (!sendControl(LINK_END, stepId, PROFILE_DEFAULT))
+			usleep(LINK_IDLE * 1000L);	// the receiver times out
+		setProfile(PROFILE_DEFAULT);
+
+		LOG("Step %d: %ld bps power %d size %d retries %d wait %d: delivered %lu/%lu FER %.1f%% goodput %.0f bps "
+			"RTT p50 %ld p99 %ld us RSSI p10 %ld p50 %ld p90 %ld\n",
+			stepId, step->bitrate, step->power, step->size, step->retries, step->wait, step->delivered, step->messages,
+			step->frameErrorRate * 100, step->goodput, step->rttP50, step->rttP99, step->rssiP10, step->rssiP50, step->rssiP90);
+	}
+
+	if (csv) {
+		writeCsv(csv, steps, count);
+		fclose(csv);
+	}
+	if (json) {
+		writeJson(json, steps, count);
+		fclose(json);
+	}
+	free(steps);
+	free(rtts);
+	free(rssis);
+	free(ackRssis);
+	return 0;
+}
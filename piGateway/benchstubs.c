@@ -0,0 +1,119 @@
+/*
+RFM69 Gateway benchmark stubs
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: benchstubs.c
+
+Replacement for wiringPi and libmosquitto, see benchstubs.h
+*/
+
+#include "benchstubs.h"
+#include "rfm69registers.h"
+#include <wiringPi.h>
+#include <wiringPiSPI.h>
+#include <mosquitto.h>
+#include <string.h>
+#include <time.h>
+
+// wiringPi --------------------------------
+static uint8_t regs[0x80];
+static uint8_t fifo[66];
+static int fifoLen;
+static int fifoPos;
+
+uint8_t benchRadioTx[66];
+int benchRadioTxLen;
+
+void benchRadioLoadFrame(uint8_t target, uint8_t sender, uint8_t ctl, const void *data, uint8_t len) {
+	fifo[0] = len + 3;
+	fifo[1] = target;
+	fifo[2] = sender;
+	fifo[3] = ctl;
+	memcpy(&fifo[4], data, len);
+	fifoLen = len + 4;
+	fifoPos = 0;
+}
+
+int wiringPiSPIDataRW(int channel, unsigned char *data, int len) {
+	uint8_t addr = data[0] & 0x7F;
+	bool write = data[0] & 0x80;
+
+	if (addr == REG_FIFO) {
+		if (write) {
+			benchRadioTxLen = len - 1;
+			memcpy(benchRadioTx, &data[1], benchRadioTxLen);
+		}
+		else {
+			for (int i = 1; i < len; i++)
+				data[i] = fifoPos < fifoLen ? fifo[fifoPos++] : 0;
+		}
+		return len;
+	}
+
+	for (int i = 1; i < len && addr + i - 1 < 0x80; i++) {
+		uint8_t reg = addr + i - 1;
+		if (write) {
+			regs[reg] = data[i];
+			continue;
+		}
+		switch (reg) {
+		case REG_IRQFLAGS1:
+			data[i] = RF_IRQFLAGS1_MODEREADY;
+			break;
+		case REG_IRQFLAGS2:
+			data[i] = RF_IRQFLAGS2_PAYLOADREADY;
+			break;
+		case REG_RSSICONFIG:
+			data[i] = RF_RSSI_DONE;
+			break;
+		case REG_RSSIVALUE:
+			data[i] = 120;	// -60 dBm
+			break;
+		default:
+			data[i] = regs[reg];
+		}
+	}
+	return len;
+}
+
+int wiringPiSPISetup(int channel, int speed) { return 0; }
+int wiringPiSetup(void) { return 0; }
+int wiringPiISR(int pin, int mode, void (*function)(void)) { return 0; }
+void delayMicroseconds(unsigned int howLong) {}
+void delay(unsigned int howLong) {}
+int digitalRead(int pin) { return HIGH; }	// transmission always done
+void digitalWrite(int pin, int value) {}
+void pinMode(int pin, int mode) {}
+
+unsigned int millis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// libmosquitto ----------------------------
+unsigned long benchPublished;
+
+int mosquitto_lib_init(void) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_lib_cleanup(void) { return MOSQ_ERR_SUCCESS; }
+struct mosquitto *mosquitto_new(const char *id, bool clean_session, void *obj) { return (struct mosquitto *)&benchPublished; }
+void mosquitto_destroy(struct mosquitto *mosq) {}
+int mosquitto_connect(struct mosquitto *mosq, const char *host, int port, int keepalive) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_subscribe(struct mosquitto *mosq, int *mid, const char *sub, int qos) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_loop(struct mosquitto *mosq, int timeout, int max_packets) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_reconnect(struct mosquitto *mosq) { return MOSQ_ERR_SUCCESS; }
+int mosquitto_max_inflight_messages_set(struct mosquitto *mosq, unsigned int max_inflight_messages) { return MOSQ_ERR_SUCCESS; }
+
+int mosquitto_publish(struct mosquitto *mosq, int *mid, const char *topic, int payloadlen, const void *payload, int qos, bool retain) {
+	benchPublished++;
+	if (mid != NULL)
+		*mid = (int)benchPublished;
+	return MOSQ_ERR_SUCCESS;
+}
+
+void mosquitto_connect_callback_set(struct mosquitto *mosq, void (*on_connect)(struct mosquitto *, void *, int)) {}
+void mosquitto_disconnect_callback_set(struct mosquitto *mosq, void (*on_disconnect)(struct mosquitto *, void *, int)) {}
+void mosquitto_publish_callback_set(struct mosquitto *mosq, void (*on_publish)(struct mosquitto *, void *, int)) {}
+void mosquitto_subscribe_callback_set(struct mosquitto *mosq, void (*on_subscribe)(struct mosquitto *, void *, int, int, const int *)) {}
+void mosquitto_message_callback_set(struct mosquitto *mosq, void (*on_message)(struct mosquitto *, void *, const struct mosquitto_message *)) {}
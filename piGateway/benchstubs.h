@@ -0,0 +1,27 @@
+/*
+RFM69 Gateway benchmark stubs
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: benchstubs.h
+
+Replacement for wiringPi and libmosquitto, so the gateway code can be measured
+without radio, without broker, and without the cost of the SPI bus.
+The RFM69 is emulated by a register file, always ready, with a FIFO returning
+the frame loaded by benchRadioLoadFrame().
+*/
+#ifndef BENCHSTUBS_h
+#define BENCHSTUBS_h
+
+#include <stdint.h>
+
+// frame returned by the next reads of the FIFO
+void benchRadioLoadFrame(uint8_t target, uint8_t sender, uint8_t ctl, const void *data, uint8_t len);
+// bytes written to the FIFO by the last transmission
+extern uint8_t benchRadioTx[66];
+extern int benchRadioTxLen;
+
+// number of messages given to mosquitto_publish()
+extern unsigned long benchPublished;
+
+#endif
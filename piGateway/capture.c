@@ -0,0 +1,126 @@
+/*
+RFM69 Gateway frame capture
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: capture.c
+
+Write and read radio frames in pcap format, see capture.h for the packet layout
+*/
+
+#include "capture.h"
+#include <string.h>
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_SWAPPED 0xd4c3b2a1
+#define PCAP_SNAPLEN 65535
+
+typedef struct {
+	uint32_t magic;
+	uint16_t versionMajor;
+	uint16_t versionMinor;
+	int32_t thisZone;
+	uint32_t sigFigs;
+	uint32_t snapLen;
+	uint32_t linkType;
+}
+PcapHeader;
+
+typedef struct {
+	uint32_t tsSec;
+	uint32_t tsUsec;
+	uint32_t inclLen;
+	uint32_t origLen;
+}
+PcapRecord;
+
+// set when the capture has been written on a machine of the other endianness
+static bool swapped;
+
+static uint32_t swap32(uint32_t v) {
+	return swapped ? __builtin_bswap32(v) : v;
+}
+
+FILE *captureOpen(const char *path) {
+	FILE *f = fopen(path, "wb");
+	if (f == NULL)
+		return NULL;
+
+	PcapHeader header = { PCAP_MAGIC, 2, 4, 0, 0, PCAP_SNAPLEN, CAPTURE_LINKTYPE };
+	if (fwrite(&header, sizeof(header), 1, f) != 1) {
+		fclose(f);
+		return NULL;
+	}
+	fflush(f);
+	return f;
+}
+
+bool captureWrite(FILE *f, const Frame *frame) {
+	uint8_t packet[CAPTURE_HEADER_LEN + RF69_MAX_DATA_LEN];
+	uint8_t len = frame->dataLength > RF69_MAX_DATA_LEN ? RF69_MAX_DATA_LEN : frame->dataLength;
+
+	packet[0] = CAPTURE_VERSION;
+	packet[1] = 0;
+	packet[2] = (uint16_t)frame->rssi & 0xFF;
+	packet[3] = (uint16_t)frame->rssi >> 8;
+	packet[4] = len + 3;
+	packet[5] = frame->targetID;
+	packet[6] = frame->senderID;
+	packet[7] = frame->ctl;
+	memcpy(&packet[CAPTURE_HEADER_LEN], frame->data, len);
+
+	PcapRecord record;
+	record.tsSec = frame->timestamp.tv_sec;
+	record.tsUsec = frame->timestamp.tv_usec;
+	record.inclLen = record.origLen = CAPTURE_HEADER_LEN + len;
+
+	if (fwrite(&record, sizeof(record), 1, f) != 1 || fwrite(packet, record.inclLen, 1, f) != 1)
+		return false;
+	// keep the file usable if the gateway dies, this is what captures are for
+	fflush(f);
+	return true;
+}
+
+FILE *replayOpen(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return NULL;
+
+	PcapHeader header;
+	if (fread(&header, sizeof(header), 1, f) != 1
+		|| (header.magic != PCAP_MAGIC && header.magic != PCAP_MAGIC_SWAPPED)) {
+		fclose(f);
+		return NULL;
+	}
+	swapped = header.magic == PCAP_MAGIC_SWAPPED;
+	if (swap32(header.linkType) != CAPTURE_LINKTYPE) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+bool replayRead(FILE *f, Frame *frame) {
+	PcapRecord record;
+	uint8_t packet[CAPTURE_HEADER_LEN + RF69_MAX_DATA_LEN];
+
+	if (fread(&record, sizeof(record), 1, f) != 1)
+		return false;
+	uint32_t len = swap32(record.inclLen);
+	if (len < CAPTURE_HEADER_LEN || len > sizeof(packet))
+		return false;
+	if (fread(packet, len, 1, f) != 1)
+		return false;
+	if (packet[0] != CAPTURE_VERSION)
+		return false;
+
+	frame->timestamp.tv_sec = swap32(record.tsSec);
+	frame->timestamp.tv_usec = swap32(record.tsUsec);
+	frame->rssi = (int16_t)(packet[2] | (packet[3] << 8));
+	frame->targetID = packet[5];
+	frame->senderID = packet[6];
+	frame->ctl = packet[7];
+	frame->dataLength = len - CAPTURE_HEADER_LEN;
+	memcpy(frame->data, &packet[CAPTURE_HEADER_LEN], frame->dataLength);
+	return true;
+}
@@ -0,0 +1,44 @@
+/*
+RFM69 Gateway frame capture
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: capture.h
+
+Radio frames are stored in a standard pcap file, using the link type reserved
+for private use LINKTYPE_USER0 (147). Each packet starts with a pseudo header,
+followed by the frame as seen in the RFM69 FIFO:
+
+  offset size
+  0      1    capture version, CAPTURE_VERSION
+  1      1    reserved, 0
+  2      2    RSSI in dBm, signed, little endian
+  4      1    RFM69 length byte (payload length + 3)
+  5      1    target ID
+  6      1    sender ID
+  7      1    CTL byte
+  8      n    payload
+
+The timestamp of the frame is the one of the pcap record.
+To decode it in Wireshark, map DLT User 0 to a custom dissector.
+*/
+#ifndef CAPTURE_h
+#define CAPTURE_h
+
+#include <stdio.h>
+#include "frame.h"
+
+#define CAPTURE_LINKTYPE 147	// LINKTYPE_USER0
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_LEN 8
+
+// create the file and write the pcap header, NULL on failure
+FILE *captureOpen(const char *path);
+bool captureWrite(FILE *f, const Frame *frame);
+
+// open an existing capture and check its header, NULL on failure
+FILE *replayOpen(const char *path);
+// read the next frame, false at the end of the file or on a malformed record
+bool replayRead(FILE *f, Frame *frame);
+
+#endif
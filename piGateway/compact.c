@@ -0,0 +1,127 @@
+/*
+RFM69 Gateway compact payload decoding
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: compact.c
+
+Decoding of the compact format, see compact.h
+*/
+
+#include "compact.h"
+#include <string.h>
+
+static bool getVarint(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+	uint32_t v = 0;
+	for (int shift = 0; shift < 35; shift += 7) {
+		if (*p >= end)
+			return false;
+		uint8_t b = *(*p)++;
+		v |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*value = v;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int32_t unzigzag(uint32_t v) {
+	return (int32_t)(v >> 1) ^ -(int32_t)(v & 1);
+}
+
+static CompactSensor *findSensor(CompactNode *node, uint8_t sensorID) {
+	for (int i = 0; i < COMPACT_SENSORS; i++)
+		if (node->sensors[i].valid && node->sensors[i].sensorID == sensorID)
+			return &node->sensors[i];
+	return NULL;
+}
+
+static CompactSensor *newSensor(CompactNode *node, uint8_t sensorID) {
+	CompactSensor *s = NULL;
+	for (int i = 0; i < COMPACT_SENSORS && s == NULL; i++)
+		if (!node->sensors[i].valid)
+			s = &node->sensors[i];
+	if (s == NULL) {
+		s = &node->sensors[node->nextSlot];
+		node->nextSlot = (node->nextSlot + 1) % COMPACT_SENSORS;
+	}
+	memset(s, 0, sizeof(*s));
+	s->sensorID = sensorID;
+	return s;
+}
+
+CompactResult compactDecode(CompactNode *node, const uint8_t **next, const uint8_t *end, CompactReading *reading) {
+	const uint8_t *p = *next;
+	if (end - p < 3)
+		return COMPACT_INVALID;
+
+	uint8_t sensorID = *p++;
+	uint8_t flags = *p++;
+	uint8_t seq = *p++;
+	uint32_t fields[3] = { 0, 0, 0 };
+	for (int i = 0; i < 3; i++) {
+		if ((flags & (COMPACT_VAR1 << i)) && !getVarint(&p, end, &fields[i]))
+			return COMPACT_INVALID;
+	}
+	uint32_t age = 0;
+	if ((flags & COMPACT_AGE) && !getVarint(&p, end, &age))
+		return COMPACT_INVALID;
+	// the record is complete, the next one follows whatever its outcome
+	*next = p;
+
+	if (flags & COMPACT_AGE) {
+		if (!(flags & COMPACT_KEY))
+			return COMPACT_INVALID;
+		// the same frame of logged readings sent again after a lost ACK
+		for (int i = 0; i < COMPACT_BACKFILL_RECENT; i++)
+			if (node->backfillRecent[i] == (0x100 | seq))
+				return COMPACT_DUPLICATE;
+		node->backfillRecent[node->backfillNext] = 0x100 | seq;
+		node->backfillNext = (node->backfillNext + 1) % COMPACT_BACKFILL_RECENT;
+
+		reading->sensorID = sensorID;
+		reading->var1 = fields[0];
+		reading->var2 = unzigzag(fields[1]) / COMPACT_SCALE;
+		reading->var3 = unzigzag(fields[2]) / COMPACT_SCALE;
+		reading->backfill = true;
+		reading->age = age;
+		return COMPACT_OK;
+	}
+
+	CompactSensor *s = findSensor(node, sensorID);
+	if (flags & COMPACT_KEY) {
+		// the same key reading sent again
+		if (s != NULL && s->seq == seq && s->var1 == fields[0])
+			return COMPACT_DUPLICATE;
+		if (s == NULL)
+			s = newSensor(node, sensorID);
+		s->var1 = fields[0];
+		s->var2 = unzigzag(fields[1]);
+		s->var3 = unzigzag(fields[2]);
+	}
+	else {
+		if (s == NULL || !s->valid)
+			return COMPACT_UNSYNCED;
+		if (s->seq == seq)
+			return COMPACT_DUPLICATE;
+		if ((uint8_t)(s->seq + 1) != seq) {
+			// the base of this delta was missed, wait for the next key reading
+			s->valid = false;
+			return COMPACT_UNSYNCED;
+		}
+		s->var1 += unzigzag(fields[0]);
+		s->var2 += unzigzag(fields[1]);
+		s->var3 += unzigzag(fields[2]);
+	}
+	s->valid = true;
+	s->seq = seq;
+
+	reading->sensorID = sensorID;
+	reading->var1 = s->var1;
+	reading->var2 = s->var2 / COMPACT_SCALE;
+	reading->var3 = s->var3 / COMPACT_SCALE;
+	reading->backfill = false;
+	reading->age = 0;
+	return COMPACT_OK;
+}
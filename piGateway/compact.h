@@ -0,0 +1,86 @@
+/*
+RFM69 Gateway compact payload decoding
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: compact.h
+
+The nodes may send their readings in a compact format instead of the 16 bytes
+Payload structure:
+
+ 0  COMPACT_MARKER, see frame.h
+ then one record per reading, as many as the frame holds:
+ 0  sensor ID
+ 1  flags: COMPACT_VAR1/2/3 for the fields present, COMPACT_KEY for absolute values,
+    COMPACT_AGE for a reading logged by the node while the gateway was unreachable
+ 2  sequence number of the reading, per sensor, or per node for the logged readings
+ 3  the present fields, as varints (7 bits per byte, low bits first):
+    var1 unsigned in a key reading, zig-zag encoded in a delta,
+    var2 and var3 zig-zag encoded in hundredths
+    with COMPACT_AGE, the age of the reading in seconds, as a varint, 0 when unknown
+
+Without COMPACT_KEY, the fields are deltas from the previous reading of the
+sensor, which the node only sends when that reading was acknowledged. A field
+absent from a delta is unchanged, absent from a key reading it is 0.
+The nodes send a key reading after a missed ACK, and at regular intervals in
+case the gateway lost track anyway.
+The logged readings are always absolute, and leave the deltas of the sensor alone.
+*/
+#ifndef COMPACT_h
+#define COMPACT_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define COMPACT_MARKER 0xFF
+#define COMPACT_VAR1 0x01
+#define COMPACT_VAR2 0x02
+#define COMPACT_VAR3 0x04
+#define COMPACT_AGE 0x08
+#define COMPACT_KEY 0x80
+#define COMPACT_SCALE 100.0
+
+#define COMPACT_SENSORS 8	// sensors followed per node
+#define COMPACT_BACKFILL_RECENT 8	// sequences of the logged readings remembered per node
+
+typedef struct {
+	bool valid;
+	uint8_t sensorID;
+	uint8_t seq;		// sequence of the last reading decoded
+	uint32_t var1;		// last reading decoded, the base of the next delta
+	int32_t var2;		// in hundredths
+	int32_t var3;
+}
+CompactSensor;
+
+typedef struct {
+	CompactSensor sensors[COMPACT_SENSORS];
+	uint8_t nextSlot;	// slot reused when all are taken
+	uint16_t backfillRecent[COMPACT_BACKFILL_RECENT];	// 0x100 | sequence of the last logged readings
+	uint8_t backfillNext;
+}
+CompactNode;
+
+typedef struct {
+	uint8_t sensorID;
+	uint32_t var1;
+	float var2;
+	float var3;
+	bool backfill;		// a logged reading
+	uint32_t age;		// of a logged reading, in s, 0 when unknown
+}
+CompactReading;
+
+typedef enum {
+	COMPACT_OK,
+	COMPACT_INVALID,	// truncated or malformed
+	COMPACT_UNSYNCED,	// a delta without the reading it is based on
+	COMPACT_DUPLICATE	// a reading already decoded, sent again after a lost ACK
+}
+CompactResult;
+
+// decode the record at *next, up to end, and keep its reading as the base of the next delta
+// *next is moved to the following record, unless the record is invalid
+CompactResult compactDecode(CompactNode *node, const uint8_t **next, const uint8_t *end, CompactReading *reading);
+
+#endif
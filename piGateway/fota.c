@@ -0,0 +1,422 @@
+/*
+RFM69 Gateway firmware update of the nodes over the air
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: fota.c
+
+Windowed block transfer of the images, see fota.h
+*/
+
+#include "fota.h"
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_NEW 0
+#define BLOCK_SENT 1
+#define BLOCK_ACKED 2
+
+// Wire format --------------------------
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+// IEEE 802.3, as checked by the node
+uint32_t fotaCrc32(const uint8_t *data, size_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < len; i++) {
+		crc ^= data[i];
+		for (int b = 0; b < 8; b++)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+// Images -------------------------------
+
+static int hexByte(const char *p) {
+	int v = 0;
+	for (int i = 0; i < 2; i++) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else
+			return -1;
+	}
+	return v;
+}
+
+// Intel HEX to a binary image starting at address 0, 0 if invalid or too big
+static size_t parseHex(const char *text, size_t len, uint8_t *image) {
+	size_t size = 0;
+	uint32_t offset = 0;
+	const char *p = text, *end = text + len;
+	while (p < end) {
+		if (*p != ':') {
+			p++;	// line ends
+			continue;
+		}
+		p++;
+		if (end - p < 10)
+			return 0;
+		uint8_t record[5 + 255];
+		int count = hexByte(p);
+		if (count < 0 || end - p < (count + 5) * 2)
+			return 0;
+		uint8_t sum = 0;
+		for (int i = 0; i < count + 5; i++) {
+			int b = hexByte(p + i * 2);
+			if (b < 0)
+				return 0;
+			record[i] = b;
+			sum += b;
+		}
+		if (sum != 0)
+			return 0;
+		p += (count + 5) * 2;
+
+		uint32_t address = offset + ((record[1] << 8) | record[2]);
+		switch (record[3]) {
+		case 0x00:	// data
+			if (address + count > FOTA_MAX_SIZE)
+				return 0;
+			memcpy(image + address, record + 4, count);
+			if (address + count > size)
+				size = address + count;
+			break;
+		case 0x01:	// end of file
+			return size;
+		case 0x02:	// extended segment address
+			offset = ((record[4] << 8) | record[5]) << 4;
+			break;
+		case 0x04:	// extended linear address
+			offset = (uint32_t)((record[4] << 8) | record[5]) << 16;
+			break;
+		default:	// start addresses, meaningless for the AVR
+			break;
+		}
+	}
+	return size;
+}
+
+static void publish(Fota *fota, FotaTransfer *t, const char *status) {
+	if (fota->status != NULL)
+		fota->status(t->node, status);
+}
+
+static void release(Fota *fota, FotaTransfer *t) {
+	if (fota->active == t)
+		fota->active = NULL;
+	free(t->image);
+	free(t->acked);
+	memset(t, 0, sizeof(*t));
+}
+
+bool fotaLoad(Fota *fota, uint8_t node, const uint8_t *data, size_t len) {
+	uint8_t *image = (uint8_t *)malloc(FOTA_MAX_SIZE);
+	if (image == NULL)
+		return false;
+	size_t size;
+	if (len > 0 && data[0] == ':') {
+		// unprogrammed flash
+		memset(image, 0xFF, FOTA_MAX_SIZE);
+		size = parseHex((const char *)data, len, image);
+	}
+	else {
+		size = len <= FOTA_MAX_SIZE ? len : 0;
+		memcpy(image, data, size);
+	}
+	if (size == 0) {
+		free(image);
+		return false;
+	}
+
+	// a new image replaces the previous one, even in the middle of its transfer
+	FotaTransfer *t = NULL;
+	for (int i = 0; i < FOTA_MAX_TRANSFERS && t == NULL; i++)
+		if (fota->transfers[i].state != FOTA_IDLE && fota->transfers[i].node == node)
+			t = &fota->transfers[i];
+	for (int i = 0; i < FOTA_MAX_TRANSFERS && t == NULL; i++)
+		if (fota->transfers[i].state == FOTA_IDLE)
+			t = &fota->transfers[i];
+	if (t == NULL) {
+		free(image);
+		return false;
+	}
+	release(fota, t);
+
+	t->node = node;
+	t->image = image;
+	t->size = size;
+	t->crc = fotaCrc32(image, size);
+	t->blocks = (size + FOTA_BLOCK - 1) / FOTA_BLOCK;
+	t->acked = (uint8_t *)calloc(t->blocks, 1);
+	if (t->acked == NULL) {
+		release(fota, t);
+		return false;
+	}
+	// the node starts afresh on a new transfer ID
+	if (++fota->nextId == 0)
+		fota->nextId = 1;
+	t->id = fota->nextId;
+	t->lastPercent = -1;
+	t->state = FOTA_WAITING;
+	publish(fota, t, "waiting");
+	return true;
+}
+
+// Files named <node>.bin or <node>.hex, renamed once loaded
+static void scan(Fota *fota) {
+	DIR *dir = opendir(fota->dir);
+	if (dir == NULL)
+		return;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		int node, end = 0;
+		char ext[4];
+		if (sscanf(entry->d_name, "%d.%3[a-z]%n", &node, ext, &end) != 2 || entry->d_name[end] != '\0'
+			|| (strcmp(ext, "bin") != 0 && strcmp(ext, "hex") != 0) || node <= 0 || node >= FOTA_MARKER)
+			continue;
+
+		char path[sizeof(fota->dir) + 256 + 8];
+		snprintf(path, sizeof(path), "%s/%s", fota->dir, entry->d_name);
+		FILE *f = fopen(path, "rb");
+		if (f == NULL)
+			continue;
+		// room for the Intel HEX of the largest image
+		size_t max = FOTA_MAX_SIZE * 3;
+		uint8_t *data = (uint8_t *)malloc(max);
+		size_t len = data != NULL ? fread(data, 1, max, f) : 0;
+		fclose(f);
+
+		char done[sizeof(path) + 8];
+		bool loaded = len > 0 && len < max && fotaLoad(fota, node, data, len);
+		snprintf(done, sizeof(done), "%s.%s", path, loaded ? "loaded" : "invalid");
+		rename(path, done);
+		free(data);
+	}
+	closedir(dir);
+}
+
+// Transfer -----------------------------
+
+static void sendStart(Fota *fota, FotaTransfer *t) {
+	uint8_t frame[11] = { FOTA_MARKER, FOTA_START, t->id };
+	put32(frame + 3, t->size);
+	put32(frame + 7, t->crc);
+	fota->send(t->node, frame, sizeof(frame));
+}
+
+static void sendShort(Fota *fota, FotaTransfer *t, uint8_t type) {
+	uint8_t frame[3] = { FOTA_MARKER, type, t->id };
+	fota->send(t->node, frame, sizeof(frame));
+}
+
+// the blocks of the window the node did not acknowledge, the last one asking for the status
+static void startWindow(Fota *fota, FotaTransfer *t) {
+	uint16_t end = t->base + fota->window;
+	if (end > t->blocks || end < t->base)
+		end = t->blocks;
+	t->windowEnd = t->base;
+	for (uint16_t i = t->base; i < end; i++)
+		if (t->acked[i] != BLOCK_ACKED)
+			t->windowEnd = i;
+	t->next = t->base;
+	t->state = FOTA_SENDING;
+}
+
+static void sendBlock(Fota *fota, FotaTransfer *t, long now) {
+	while (t->next < t->windowEnd && t->acked[t->next] == BLOCK_ACKED)
+		t->next++;
+
+	uint16_t block = t->next;
+	uint32_t offset = (uint32_t)block * FOTA_BLOCK;
+	uint8_t len = t->size - offset < FOTA_BLOCK ? t->size - offset : FOTA_BLOCK;
+	uint8_t frame[5 + FOTA_BLOCK] = { FOTA_MARKER, (uint8_t)(block == t->windowEnd ? FOTA_POLL : FOTA_DATA), t->id };
+	put16(frame + 3, block);
+	memcpy(frame + 5, t->image + offset, len);
+
+	if (t->acked[block] == BLOCK_SENT)
+		fota->blocksResent++;
+	fota->blocksSent++;
+	t->acked[block] = BLOCK_SENT;
+	t->next++;
+	if (block == t->windowEnd) {
+		t->state = FOTA_ASKING;
+		t->deadline = now + FOTA_ANSWER_TIMEOUT;
+		t->retries = 0;
+	}
+	fota->send(t->node, frame, 5 + len);
+}
+
+static void finish(Fota *fota, FotaTransfer *t, const char *status, bool ok) {
+	if (ok)
+		fota->done++;
+	else
+		fota->failed++;
+	publish(fota, t, status);
+	release(fota, t);
+}
+
+void fotaOpen(Fota *fota, const char *dir, uint8_t window, FotaSend send, FotaStatus status) {
+	memset(fota, 0, sizeof(*fota));
+	if (dir != NULL) {
+		strncpy(fota->dir, dir, sizeof(fota->dir) - 1);
+		fota->dir[sizeof(fota->dir) - 1] = '\0';
+	}
+	// the node only reports the 32 blocks after the first one it misses
+	fota->window = window < 1 ? 1 : window > 32 ? 32 : window;
+	fota->send = send;
+	fota->status = status;
+}
+
+void fotaClose(Fota *fota) {
+	for (int i = 0; i < FOTA_MAX_TRANSFERS; i++)
+		release(fota, &fota->transfers[i]);
+}
+
+void fotaHeard(Fota *fota, uint8_t node, long now) {
+	if (fota->active != NULL)
+		return;
+	for (int i = 0; i < FOTA_MAX_TRANSFERS; i++) {
+		FotaTransfer *t = &fota->transfers[i];
+		if (t->state == FOTA_WAITING && t->node == node) {
+			// sent at the next poll, after the ACK of the frame heard
+			t->state = FOTA_STARTING;
+			t->deadline = now;
+			t->retries = 0;
+			fota->active = t;
+			return;
+		}
+	}
+}
+
+void fotaReceive(Fota *fota, uint8_t node, const uint8_t *data, uint8_t len, long now) {
+	FotaTransfer *t = fota->active;
+	if (t == NULL || t->node != node || len < 4 || data[2] != t->id)
+		return;
+
+	switch (data[1]) {
+	case FOTA_STATUS:
+		// a late status, the window already started again
+		if (len < 10 || (t->state != FOTA_STARTING && t->state != FOTA_ASKING))
+			return;
+		if (data[3] != FOTA_OK) {
+			finish(fota, t, data[3] == FOTA_TOO_BIG ? "failed too big" : "failed", false);
+			return;
+		}
+		{
+			// the node is the reference, it may have lost a transfer it timed out
+			uint16_t base = get16(data + 4);
+			uint32_t bitmap = get32(data + 6);
+			if (base > t->blocks)
+				return;
+			for (uint16_t i = 0; i < t->blocks; i++) {
+				bool acked = i < base || (i > base && i - base <= 32 && ((bitmap >> (i - base - 1)) & 1));
+				if (acked)
+					t->acked[i] = BLOCK_ACKED;
+				else if (t->acked[i] == BLOCK_ACKED)
+					t->acked[i] = BLOCK_NEW;
+			}
+			t->base = base;
+			t->retries = 0;
+		}
+		{
+			int percent = t->base * 100 / t->blocks / 10 * 10;
+			if (percent != t->lastPercent) {
+				char status[24];
+				sprintf(status, "sending %d%%", percent);
+				publish(fota, t, status);
+				t->lastPercent = percent;
+			}
+		}
+		if (t->base == t->blocks) {
+			t->state = FOTA_ENDING;
+			sendShort(fota, t, FOTA_END);
+			t->deadline = now + FOTA_VERIFY_TIMEOUT;
+		}
+		else
+			startWindow(fota, t);
+		break;
+
+	case FOTA_VERIFIED:
+		if (t->state != FOTA_ENDING)
+			return;
+		// the node resets into the bootloader
+		if (data[3] == FOTA_OK)
+			finish(fota, t, "done", true);
+		else
+			finish(fota, t, "failed crc", false);
+		break;
+	}
+}
+
+void fotaPoll(Fota *fota, long now) {
+	if (fota->dir[0] != '\0' && now - fota->lastScan >= FOTA_SCAN_INTERVAL) {
+		fota->lastScan = now;
+		scan(fota);
+	}
+
+	FotaTransfer *t = fota->active;
+	if (t == NULL)
+		return;
+	if (t->state == FOTA_SENDING) {
+		// one block per poll, the frames of the other nodes are received in between
+		sendBlock(fota, t, now);
+		return;
+	}
+	if (now - t->deadline < 0)
+		return;
+	if (t->retries++ >= FOTA_RETRIES && t->state == FOTA_ENDING) {
+		// the verified answer was lost, and the node already restarted with its new firmware
+		finish(fota, t, "unconfirmed", false);
+		return;
+	}
+	if (t->retries > FOTA_RETRIES) {
+		// the node went back to sleep, or out of range: wait until it is heard again
+		t->state = FOTA_WAITING;
+		fota->active = NULL;
+		publish(fota, t, "waiting");
+		return;
+	}
+	switch (t->state) {
+	case FOTA_STARTING:
+		sendStart(fota, t);
+		// the node erases its flash before answering
+		t->deadline = now + FOTA_VERIFY_TIMEOUT;
+		break;
+	case FOTA_ASKING:
+		sendShort(fota, t, FOTA_QUERY);
+		t->deadline = now + FOTA_ANSWER_TIMEOUT;
+		break;
+	case FOTA_ENDING:
+		sendShort(fota, t, FOTA_END);
+		t->deadline = now + FOTA_VERIFY_TIMEOUT;
+		break;
+	default:
+		break;
+	}
+}
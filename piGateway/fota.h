@@ -0,0 +1,120 @@
+/*
+RFM69 Gateway firmware update of the nodes over the air
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: fota.h
+
+An image, raw binary or Intel HEX, is given for a node through MQTT or a file.
+The transfer starts when the node is next heard, while its radio is on, and
+runs alongside the normal traffic: at most one frame is sent per poll.
+
+The image is cut in FOTA_BLOCK bytes blocks. A window of blocks is sent without
+radio ACK, the last one asking for the status of the node: the first block it
+misses, and a bitmap of the 32 blocks after it. Only the missing blocks are sent
+again. Once the node has every block, it checks the CRC of the image in its
+flash, and resets into the DualOptiboot bootloader which copies it.
+
+Frames, all starting with FOTA_MARKER, the type and the transfer ID:
+ gateway -> node
+  S  start: size, uint32, and CRC-32 of the image, uint32
+  D  data: block number, uint16, and up to FOTA_BLOCK bytes
+  P  data, asking for the status
+  Q  query the status
+  E  end, asking the node to check the image
+ node -> gateway
+  A  status: result, first block missing, uint16, bitmap of the next 32, uint32
+  V  verified: result
+Integers are little endian.
+*/
+#ifndef FOTA_h
+#define FOTA_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define FOTA_MARKER 0xFE	// a reserved node ID, see frame.h
+#define FOTA_START 'S'
+#define FOTA_DATA 'D'
+#define FOTA_POLL 'P'
+#define FOTA_QUERY 'Q'
+#define FOTA_END 'E'
+#define FOTA_STATUS 'A'
+#define FOTA_VERIFIED 'V'
+
+#define FOTA_OK 0
+#define FOTA_TOO_BIG 1
+#define FOTA_BAD_CRC 2
+
+#define FOTA_BLOCK 56			// 5 bytes of header, in a 61 bytes frame
+#define FOTA_MAX_SIZE 31744		// ATmega328 flash, less the bootloader
+#define FOTA_MAX_TRANSFERS 4	// nodes waiting for an image
+#define FOTA_ANSWER_TIMEOUT 300	// ms to wait for a status
+#define FOTA_VERIFY_TIMEOUT 2000	// ms for the node to check the image
+#define FOTA_RETRIES 10			// unanswered frames before waiting for the node to be heard again
+#define FOTA_SCAN_INTERVAL 5000	// ms between two looks at the directory
+
+typedef void (*FotaSend)(uint8_t node, const uint8_t *data, uint8_t len);
+typedef void (*FotaStatus)(uint8_t node, const char *status);
+
+typedef enum {
+	FOTA_IDLE,
+	FOTA_WAITING,	// for the node to be heard
+	FOTA_STARTING,	// for the node to be ready
+	FOTA_SENDING,	// a window of blocks
+	FOTA_ASKING,	// for the status, after a window
+	FOTA_ENDING		// for the node to check the image
+}
+FotaState;
+
+typedef struct {
+	FotaState state;
+	uint8_t node;
+	uint8_t id;
+	uint8_t *image;
+	uint32_t size;
+	uint32_t crc;
+	uint16_t blocks;
+	uint8_t *acked;		// per block, received by the node
+	uint16_t base;		// first block not acknowledged
+	uint16_t next;		// next block of the window to send
+	uint16_t windowEnd;	// last block of the window, sent with FOTA_POLL
+	long deadline;		// for the answer of the node
+	int retries;
+	int lastPercent;	// last progress published
+}
+FotaTransfer;
+
+typedef struct {
+	FotaTransfer transfers[FOTA_MAX_TRANSFERS];
+	FotaTransfer *active;	// one transfer on the air at a time
+	uint8_t window;
+	char dir[128];
+	long lastScan;
+	FotaSend send;
+	FotaStatus status;
+	uint8_t nextId;
+
+	unsigned long blocksSent;
+	unsigned long blocksResent;
+	unsigned long done;
+	unsigned long failed;
+}
+Fota;
+
+// dir may be empty, to only take images from MQTT
+void fotaOpen(Fota *fota, const char *dir, uint8_t window, FotaSend send, FotaStatus status);
+// take an image for a node, raw binary or Intel HEX, replacing any previous one for the node
+bool fotaLoad(Fota *fota, uint8_t node, const uint8_t *data, size_t len);
+// the node was heard, so its radio is on
+void fotaHeard(Fota *fota, uint8_t node, long now);
+// a frame starting with FOTA_MARKER, from a node
+void fotaReceive(Fota *fota, uint8_t node, const uint8_t *data, uint8_t len, long now);
+// send the next frame due, and look for new images; never blocks
+void fotaPoll(Fota *fota, long now);
+void fotaClose(Fota *fota);
+
+uint32_t fotaCrc32(const uint8_t *data, size_t len);
+
+#endif
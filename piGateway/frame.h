@@ -0,0 +1,37 @@
+/*
+RFM69 Gateway raw radio frame
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: frame.h
+
+A frame as received by the radio, copied out of the RFM69 buffers so it can be
+acknowledged, captured, replayed and decoded independently of the radio.
+
+The first byte of a Payload is the node ID, so the IDs from 0xFC up are never
+given to a node: a frame starting with one of them is of another kind, told by
+its marker
+ 0xFF  COMPACT_MARKER, compact.h
+ 0xFE  FOTA_MARKER, fota.h
+ 0xFD  GROUP_MARKER, group.h
+ 0xFC  RELAY_MARKER, relay.h
+*/
+#ifndef FRAME_h
+#define FRAME_h
+
+#include <stdint.h>
+#include <sys/time.h>
+#include "rfm69.h"
+
+typedef struct {
+	struct timeval timestamp;	// reception time
+	uint8_t targetID;			// should match the gateway node ID, unless in promiscuous mode
+	uint8_t senderID;
+	uint8_t ctl;				// RFM69_CTL_SENDACK / RFM69_CTL_REQACK
+	int16_t rssi;				// most accurate RSSI during reception (closest to the reception)
+	uint8_t dataLength;
+	uint8_t data[RF69_MAX_DATA_LEN];
+}
+Frame;
+
+#endif
@@ -0,0 +1,201 @@
+/*
+RFM69 Gateway group downlink commands
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: group.c
+
+Broadcast of the commands, and rounds of answers, see group.h
+*/
+
+#include "group.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Wire format --------------------------
+
+static void put32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void putFloat(uint8_t *p, float v) {
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	put32(p, bits);
+}
+
+// Configuration ------------------------
+
+static Group *find(Groups *groups, uint8_t id) {
+	for (int i = 0; i < groups->count; i++)
+		if (groups->groups[i].id == id)
+			return &groups->groups[i];
+	return NULL;
+}
+
+/* "<group>:<node>,<node>..." */
+static bool parseGroup(Groups *groups, char *item) {
+	char *end;
+	long id = strtol(item, &end, 10);
+	if (end == item || *end != ':' || id < 0 || id > 255 || find(groups, id) != NULL || groups->count >= GROUP_MAX_GROUPS)
+		return false;
+	Group *g = &groups->groups[groups->count++];
+	g->id = id;
+	for (char *node = strtok(end + 1, ", "); node != NULL; node = strtok(NULL, ", ")) {
+		long n = strtol(node, &end, 10);
+		if (end == node || *end != '\0' || n <= 0 || n >= GROUP_MARKER || g->memberCount >= GROUP_MAX_MEMBERS)
+			return false;
+		g->members[g->memberCount++] = n;
+	}
+	return true;
+}
+
+bool groupsOpen(Groups *groups, const char *config, uint8_t rounds, GroupSend send, GroupStatus status) {
+	memset(groups, 0, sizeof(*groups));
+	groups->rounds = rounds;
+	groups->send = send;
+	groups->status = status;
+	if (config == NULL || *config == '\0')
+		return true;
+
+	// the groups split first, strtok() then cuts their members
+	char copy[512];
+	snprintf(copy, sizeof(copy), "%s", config);
+	char *items[GROUP_MAX_GROUPS + 1];
+	int count = 0;
+	for (char *item = strtok(copy, ";"); item != NULL; item = strtok(NULL, ";")) {
+		if (count > GROUP_MAX_GROUPS)
+			return false;
+		items[count++] = item;
+	}
+	for (int i = 0; i < count; i++)
+		if (!parseGroup(groups, items[i]))
+			return false;
+	return true;
+}
+
+// Commands -----------------------------
+
+/* The command, listing the members still to answer */
+static void sendRound(Groups *groups, Group *g, long now) {
+	uint8_t frame[GROUP_HEADER + GROUP_MAX_MEMBERS];
+	memcpy(frame, g->frame, GROUP_HEADER);
+	uint8_t count = 0;
+	if (groups->rounds > 0)
+		for (int i = 0; i < g->memberCount; i++)
+			if (!g->answered[i])
+				frame[GROUP_HEADER + count++] = g->members[i];
+	frame[GROUP_HEADER - 1] = count;
+	groups->send(frame, GROUP_HEADER + count);
+	groups->framesSent++;
+	g->round++;
+	// the last member listed answers in the slot count
+	g->deadline = now + count * GROUP_SLOT + GROUP_MARGIN;
+}
+
+static void finish(Groups *groups, Group *g) {
+	char status[256];
+	g->state = GROUP_IDLE;
+	if (groups->active == g)
+		groups->active = NULL;
+	if (groups->rounds == 0) {
+		groups->status(g->id, "sent");
+		return;
+	}
+
+	int answered = 0;
+	for (int i = 0; i < g->memberCount; i++)
+		answered += g->answered[i];
+	int n = snprintf(status, sizeof(status), "delivered %d/%d", answered, g->memberCount);
+	if (answered < g->memberCount) {
+		n += snprintf(status + n, sizeof(status) - n, " missing");
+		const char *separator = " ";
+		for (int i = 0; i < g->memberCount && n < (int)sizeof(status); i++) {
+			if (g->answered[i])
+				continue;
+			n += snprintf(status + n, sizeof(status) - n, "%s%d", separator, g->members[i]);
+			separator = ",";
+		}
+	}
+	groups->delivered += answered;
+	groups->missed += g->memberCount - answered;
+	groups->status(g->id, status);
+}
+
+bool groupCommand(Groups *groups, uint8_t group, uint8_t sensor, uint32_t var1, float var2, float var3, long now) {
+	Group *g = find(groups, group);
+	if (g == NULL)
+		return false;
+	// the answers to a previous command are not waited for any longer, a command not sent yet is replaced
+	if (g->state == GROUP_WAITING)
+		finish(groups, g);
+
+	g->sequence++;
+	uint8_t *p = g->frame;
+	p[0] = GROUP_MARKER;
+	p[1] = GROUP_COMMAND;
+	p[2] = g->id;
+	p[3] = g->sequence;
+	p[4] = sensor;
+	put32(p + 5, var1);
+	putFloat(p + 9, var2);
+	putFloat(p + 13, var3);
+	memset(g->answered, 0, sizeof(g->answered));
+	g->round = 0;
+	g->state = GROUP_PENDING;
+	groups->commands++;
+	groupPoll(groups, now);
+	return true;
+}
+
+void groupReceive(Groups *groups, uint8_t node, const uint8_t *data, uint8_t len) {
+	if (len < 4 || data[1] != GROUP_ANSWER)
+		return;
+	Group *g = groups->active;
+	// a late answer, to a command already done
+	if (g == NULL || g->id != data[2] || g->sequence != data[3])
+		return;
+	for (int i = 0; i < g->memberCount; i++)
+		if (g->members[i] == node)
+			g->answered[i] = true;
+}
+
+static bool allAnswered(Group *g) {
+	for (int i = 0; i < g->memberCount; i++)
+		if (!g->answered[i])
+			return false;
+	return true;
+}
+
+void groupPoll(Groups *groups, long now) {
+	Group *g = groups->active;
+	if (g != NULL) {
+		if (!allAnswered(g) && now - g->deadline < 0)
+			return;
+		if (!allAnswered(g) && g->round < groups->rounds) {
+			sendRound(groups, g, now);
+			return;
+		}
+		finish(groups, g);
+	}
+
+	// the next command, in the order of the configuration
+	for (int i = 0; i < groups->count; i++) {
+		g = &groups->groups[i];
+		if (g->state != GROUP_PENDING)
+			continue;
+		sendRound(groups, g, now);
+		if (groups->rounds == 0) {
+			// nothing to wait for, the other commands go at once
+			finish(groups, g);
+			continue;
+		}
+		g->state = GROUP_WAITING;
+		groups->active = g;
+		return;
+	}
+}
@@ -0,0 +1,96 @@
+/*
+RFM69 Gateway group downlink commands
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: group.h
+
+A command for a group of nodes goes out as one broadcast frame, to
+RF69_BROADCAST_ADDR and without radio ACK, carrying the group ID. Each node
+knows its groups, and drops the commands of the others. The groups, and their
+members, are configured on the gateway as "1:13,14,20;2:21,22".
+
+With the answers on, the frame also lists the members asked to answer, and each
+answers with a 4 bytes frame in its own slot of GROUP_SLOT ms, in the order of
+the list, so the answers do not collide. Once the slots are over, the members
+not heard from get the same frame again, listing only them, for up to the given
+number of rounds. One command waits for its answers at a time, the commands to
+the other groups are sent after it. A node applies a command once, whatever the
+number of copies received, and answers each of them.
+
+When done, the status is given: "sent" without answers, else the members which
+answered over the members, and the list of the missing ones.
+
+Frames, all starting with GROUP_MARKER, the group ID and the sequence of the command:
+ gateway -> broadcast
+  C  command: sensor, var1, uint32, var2 and var3, floats, count of the
+     members to answer, and their IDs
+ node -> gateway
+  A  answer
+Integers and floats are little endian.
+*/
+#ifndef GROUP_h
+#define GROUP_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GROUP_MARKER 0xFD	// a reserved node ID, see frame.h
+#define GROUP_COMMAND 'C'
+#define GROUP_ANSWER 'A'
+
+#define GROUP_HEADER 18			// up to the count of the members asked to answer
+#define GROUP_MAX_MEMBERS 43	// IDs listed after the header, in a 61 bytes frame
+#define GROUP_MAX_GROUPS 16
+#define GROUP_SLOT 10			// ms for each answer
+#define GROUP_MARGIN 20			// ms waited after the last slot
+
+typedef void (*GroupSend)(const uint8_t *data, uint8_t len);
+typedef void (*GroupStatus)(uint8_t group, const char *status);
+
+typedef enum {
+	GROUP_IDLE,
+	GROUP_PENDING,		// for the command of another group to be done
+	GROUP_WAITING		// for the answers
+}
+GroupState;
+
+typedef struct {
+	uint8_t id;
+	uint8_t members[GROUP_MAX_MEMBERS];
+	uint8_t memberCount;
+	uint8_t sequence;		// of the last command
+	// the last command, until done
+	GroupState state;
+	uint8_t frame[GROUP_HEADER];
+	bool answered[GROUP_MAX_MEMBERS];
+	long deadline;
+	uint8_t round;
+}
+Group;
+
+typedef struct {
+	Group groups[GROUP_MAX_GROUPS];
+	int count;
+	Group *active;		// waiting for its answers
+	uint8_t rounds;		// 0 for no answers
+	GroupSend send;
+	GroupStatus status;
+
+	unsigned long commands;
+	unsigned long framesSent;
+	unsigned long delivered;	// members which answered
+	unsigned long missed;		// members which did not, after every round
+}
+Groups;
+
+// config as "1:13,14,20;2:21,22"; false when it cannot be read
+bool groupsOpen(Groups *groups, const char *config, uint8_t rounds, GroupSend send, GroupStatus status);
+// send a command to the group, replacing one still waiting for answers; false for an unknown group
+bool groupCommand(Groups *groups, uint8_t group, uint8_t sensor, uint32_t var1, float var2, float var3, long now);
+// a frame starting with GROUP_MARKER, from a node
+void groupReceive(Groups *groups, uint8_t node, const uint8_t *data, uint8_t len);
+// send the next round due, and give the status of the commands done; never blocks
+void groupPoll(Groups *groups, long now);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+RFM69 Gateway local distribution of the readings
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: localbus.c
+
+Shared memory ring and Unix socket subscriptions, see localbus.h
+*/
+
+#include "localbus.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+// Topic filters ------------------------
+
+bool localBusTopicMatch(const char *filter, const char *topic) {
+	while (*filter) {
+		if (*filter == '#')
+			return true;	// matches the rest, including nothing
+		if (*filter == '+') {
+			// skip one level of the topic
+			while (*topic && *topic != '/')
+				topic++;
+			filter++;
+			continue;
+		}
+		if (*filter != *topic) {
+			// "a/#" also matches "a"
+			return *topic == '\0' && filter[0] == '/' && filter[1] == '#' && filter[2] == '\0';
+		}
+		filter++;
+		topic++;
+	}
+	return *topic == '\0';
+}
+
+// Gateway side --------------------------
+
+static bool openRing(LocalBus *bus, const char *shmName, int slots) {
+	bus->shmSize = sizeof(LocalRing) + slots * sizeof(LocalSlot);
+	// a new ring: the readers of a previous run keep their mapping instead of faulting on a truncated one
+	shm_unlink(shmName);
+	int fd = shm_open(shmName, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return false;
+	// the creation mode is masked by the umask, readers only need to read
+	fchmod(fd, 0644);
+	if (ftruncate(fd, bus->shmSize) < 0) {
+		close(fd);
+		shm_unlink(shmName);
+		return false;
+	}
+	void *p = mmap(NULL, bus->shmSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(shmName);
+		return false;
+	}
+
+	bus->ring = (LocalRing *)p;
+	bus->ring->version = LOCALBUS_VERSION;
+	bus->ring->slotCount = slots;
+	bus->ring->slotSize = sizeof(LocalSlot);
+	bus->ring->head = 0;
+	// written last, a reader attaching in between sees an invalid ring
+	__atomic_store_n(&bus->ring->magic, LOCALBUS_MAGIC, __ATOMIC_RELEASE);
+	bus->shmName = shmName;
+	return true;
+}
+
+static bool openSocket(LocalBus *bus, const char *socketPath) {
+	struct sockaddr_un addr;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+
+	bus->listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (bus->listenFd < 0)
+		return false;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+	// left over by a previous run
+	unlink(socketPath);
+	if (bind(bus->listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| listen(bus->listenFd, LOCALBUS_MAX_CLIENTS) < 0) {
+		close(bus->listenFd);
+		bus->listenFd = -1;
+		return false;
+	}
+	chmod(socketPath, 0666);
+	bus->socketPath = socketPath;
+	return true;
+}
+
+bool localBusOpen(LocalBus *bus, const char *shmName, int slots, const char *socketPath) {
+	memset(bus, 0, sizeof(*bus));
+	bus->listenFd = -1;
+
+	// each transport on its own, the consumers of the other one still get the readings
+	if (shmName != NULL && *shmName && slots > 0 && !openRing(bus, shmName, slots))
+		bus->ringError = errno;
+	if (socketPath != NULL && *socketPath && !openSocket(bus, socketPath))
+		bus->socketError = errno;
+	bus->active = bus->ring != NULL || bus->listenFd >= 0;
+	return bus->ringError == 0 && bus->socketError == 0;
+}
+
+static void dropClient(LocalBus *bus, int i) {
+	close(bus->clients[i].fd);
+	bus->clients[i] = bus->clients[--bus->clientCount];
+}
+
+void localBusPoll(LocalBus *bus) {
+	if (!bus->active || bus->listenFd < 0)
+		return;
+
+	int fd;
+	while ((fd = accept4(bus->listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		if (bus->clientCount >= LOCALBUS_MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		LocalClient *client = &bus->clients[bus->clientCount++];
+		memset(client, 0, sizeof(*client));
+		client->fd = fd;
+	}
+
+	// a packet is a new filter, end of file is the client leaving
+	for (int i = 0; i < bus->clientCount; ) {
+		LocalClient *client = &bus->clients[i];
+		char filter[LOCALBUS_FILTER_LEN];
+		ssize_t len = recv(client->fd, filter, sizeof(filter) - 1, MSG_DONTWAIT);
+		if (len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			dropClient(bus, i);
+			continue;
+		}
+		if (len > 0) {
+			// strip the line end of clients typing their filters
+			while (len > 0 && (filter[len - 1] == '\n' || filter[len - 1] == '\r'))
+				len--;
+			filter[len] = '\0';
+			if (len > 0 && client->filterCount < LOCALBUS_MAX_FILTERS)
+				strcpy(client->filters[client->filterCount++], filter);
+			continue;	// there may be more filters waiting
+		}
+		i++;
+	}
+}
+
+void localBusPublish(LocalBus *bus, LocalReading *reading) {
+	if (bus->ring != NULL) {
+		LocalRing *ring = bus->ring;
+		reading->seq = ring->head + 1;
+		LocalSlot *slot = &ring->slots[reading->seq % ring->slotCount];
+
+		// seqlock: readers seeing 0, or a seq changing during their copy, discard the slot
+		__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		slot->reading = *reading;
+		__atomic_store_n(&slot->seq, reading->seq, __ATOMIC_RELEASE);
+		__atomic_store_n(&ring->head, reading->seq, __ATOMIC_RELEASE);
+	}
+
+	if (bus->clientCount == 0)
+		return;
+
+	char topic[32];
+	sprintf(topic, "RFM/%03d/%02d/up/%d", reading->networkID, reading->nodeID, reading->sensorID);
+	for (int i = 0; i < bus->clientCount; i++) {
+		LocalClient *client = &bus->clients[i];
+		for (int f = 0; f < client->filterCount; f++) {
+			if (!localBusTopicMatch(client->filters[f], topic))
+				continue;
+			if (send(client->fd, reading, sizeof(*reading), MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(*reading))
+				bus->delivered++;
+			else {
+				// full, or gone: the next poll finds out
+				client->dropped++;
+				bus->dropped++;
+			}
+			break;
+		}
+	}
+}
+
+void localBusClose(LocalBus *bus) {
+	while (bus->clientCount > 0)
+		dropClient(bus, 0);
+	if (bus->listenFd >= 0) {
+		close(bus->listenFd);
+		unlink(bus->socketPath);
+		bus->listenFd = -1;
+	}
+	if (bus->ring != NULL) {
+		munmap(bus->ring, bus->shmSize);
+		shm_unlink(bus->shmName);
+		bus->ring = NULL;
+	}
+	bus->active = false;
+}
+
+// Consumer side -------------------------
+
+bool localRingAttach(LocalRingReader *reader, const char *shmName) {
+	int fd = shm_open(shmName, O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(LocalRing)) {
+		close(fd);
+		return false;
+	}
+	void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+
+	const LocalRing *ring = (const LocalRing *)p;
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != LOCALBUS_MAGIC
+		|| ring->version != LOCALBUS_VERSION
+		|| ring->slotSize != sizeof(LocalSlot)
+		|| sizeof(LocalRing) + (size_t)ring->slotCount * sizeof(LocalSlot) > (size_t)st.st_size) {
+		munmap(p, st.st_size);
+		return false;
+	}
+	reader->ring = ring;
+	reader->next = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) + 1;
+	reader->lost = 0;
+	return true;
+}
+
+bool localRingNext(LocalRingReader *reader, LocalReading *reading) {
+	const LocalRing *ring = reader->ring;
+	for (;;) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (reader->next > head)
+			return false;
+		if (head - reader->next >= ring->slotCount) {
+			// overtaken, jump to the oldest reading still in the ring
+			reader->lost += head - ring->slotCount + 1 - reader->next;
+			reader->next = head - ring->slotCount + 1;
+		}
+
+		const LocalSlot *slot = &ring->slots[reader->next % ring->slotCount];
+		uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		*reading = slot->reading;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		uint64_t after = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (before == reader->next && after == reader->next) {
+			reader->next++;
+			return true;
+		}
+		// rewritten while copying: the writer is a whole ring ahead, skip it
+		reader->lost++;
+		reader->next++;
+	}
+}
+
+int localBusSubscribe(const char *socketPath, const char *filter) {
+	struct sockaddr_un addr;
+	if (strlen(socketPath) >= sizeof(addr.sun_path) || strlen(filter) >= LOCALBUS_FILTER_LEN)
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+		|| send(fd, filter, strlen(filter), MSG_NOSIGNAL) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
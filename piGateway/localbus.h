@@ -0,0 +1,121 @@
+/*
+RFM69 Gateway local distribution of the readings
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: localbus.h
+
+The decoded readings are made available to the consumers running on the gateway
+host, without going through the broker, in two ways:
+
+ - a shared memory ring, written by the gateway only. Each slot carries the
+   sequence number of the reading it holds, so any number of readers follow the
+   ring without lock and without the gateway knowing them. A reader too slow
+   is overtaken, and told how many readings it lost.
+
+ - a Unix domain socket (SOCK_SEQPACKET). A client sends topic filters, one per
+   packet, like "RFM/101/+/up/#", and receives every matching reading as one
+   LocalReading packet. The readings are matched on the topic
+   RFM/<network>/<node>/up/<sensor>, with the MQTT + and # wildcards.
+   A client not reading fast enough loses readings, the gateway never waits.
+
+Both are readings as received, before the rate limiting of the broker publication.
+*/
+#ifndef LOCALBUS_h
+#define LOCALBUS_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define LOCALBUS_MAGIC 0x424d4652	// "RFMB" in memory
+#define LOCALBUS_VERSION 1
+#define LOCALBUS_MAX_CLIENTS 8
+#define LOCALBUS_MAX_FILTERS 4
+#define LOCALBUS_FILTER_LEN 64
+
+typedef struct {
+	uint64_t seq;		// position in the ring, starting at 1
+	int64_t timestamp;	// reception time, in us since the epoch
+	uint8_t networkID;
+	uint8_t nodeID;
+	uint8_t sensorID;
+	uint8_t gatewayID;	// gateway which received the reading
+	int16_t rssi;
+	uint16_t reserved2;
+	uint32_t var1;
+	float var2;
+	float var3;
+}
+LocalReading;
+
+typedef struct {
+	volatile uint64_t seq;	// seq of the reading in the slot, 0 while it is written
+	LocalReading reading;
+}
+LocalSlot;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slotCount;
+	uint32_t slotSize;		// sizeof(LocalSlot), to detect a mismatching reader
+	volatile uint64_t head;	// seq of the last reading written
+	LocalSlot slots[];
+}
+LocalRing;
+
+typedef struct {
+	int fd;
+	int filterCount;
+	char filters[LOCALBUS_MAX_FILTERS][LOCALBUS_FILTER_LEN];
+	unsigned long dropped;	// readings lost because the client socket was full
+}
+LocalClient;
+
+// Gateway side ---------------------------
+typedef struct {
+	bool active;
+	LocalRing *ring;
+	const char *shmName;
+	size_t shmSize;
+	int listenFd;
+	const char *socketPath;
+	int ringError;			// errno of the ring, or of the socket, which could not be opened; 0 otherwise
+	int socketError;
+	LocalClient clients[LOCALBUS_MAX_CLIENTS];
+	int clientCount;
+	unsigned long delivered;	// readings sent to the socket clients
+	unsigned long dropped;		// readings lost by slow socket clients
+}
+LocalBus;
+
+// create the ring and listen on the socket, an empty name or path disables it
+// false when one of them failed, see ringError and socketError; the other one is still open
+bool localBusOpen(LocalBus *bus, const char *shmName, int slots, const char *socketPath);
+// accept the new clients and read their filters, never blocks
+void localBusPoll(LocalBus *bus);
+// add a reading to the ring and send it to the matching clients, never blocks
+void localBusPublish(LocalBus *bus, LocalReading *reading);
+void localBusClose(LocalBus *bus);
+
+// Consumer side --------------------------
+typedef struct {
+	const LocalRing *ring;
+	uint64_t next;		// seq of the next reading to read
+	unsigned long lost;	// readings overwritten before they could be read
+}
+LocalRingReader;
+
+// map the ring read only, and start after the last reading written
+bool localRingAttach(LocalRingReader *reader, const char *shmName);
+// copy the next reading, false if there is none yet
+bool localRingNext(LocalRingReader *reader, LocalReading *reading);
+
+// connect to the gateway socket and send a first filter, return the socket or -1
+int localBusSubscribe(const char *socketPath, const char *filter);
+
+// MQTT style topic filter matching, with + and #
+bool localBusTopicMatch(const char *filter, const char *topic);
+
+#endif
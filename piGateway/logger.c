@@ -0,0 +1,458 @@
+/*
+RFM69 Gateway asynchronous logger
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: logger.c
+
+Recording, and formatting in the background thread, see logger.h
+*/
+
+#include "logger.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define MAX_LINE 512
+#define DUMP_BLOC 16
+
+volatile int loggerLevel = LOGGER_INFO;
+
+static LoggerRecord ring[LOGGER_RING];
+static LoggerRecord immediate;	// written at once, while the thread is not running
+static unsigned long head;		// written by the producer only
+static unsigned long tail;		// written by the thread only
+static bool running;
+static bool polled;				// running without the thread
+static pthread_t thread;
+static FILE *out;				// NULL for syslog
+static bool directSyslog;		// the records written at once go to syslog
+
+static TokenBucket buckets[LOGGER_CATEGORIES];
+static unsigned long dropped;
+static unsigned long rateLimited[LOGGER_CATEGORIES];
+
+static const char *categoryNames[LOGGER_CATEGORIES] = { "main", "frame", "dump", "broker", "downlink" };
+
+static long monotonicMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+// Output, in the thread ------------------
+static void writeLine(int level, const struct timeval *time, char *line) {
+	int len = strlen(line);
+	while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+		line[--len] = '\0';
+
+	if (out == NULL) {
+		syslog(level == LOGGER_ERROR ? LOG_ERR : level == LOGGER_DEBUG ? LOG_DEBUG : LOG_INFO, "%s", line);
+		return;
+	}
+	struct tm tm;
+	char stamp[32];
+	time_t seconds = time->tv_sec;
+	localtime_r(&seconds, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(out, "%s.%03ld %s\n", stamp, (long)time->tv_usec / 1000, line);
+}
+
+/* Format a record the way printf would have, from the arguments recorded */
+static void formatRecord(const LoggerRecord *r, char *line, int size) {
+	int n = 0;
+	int arg = 0;
+	const char *f = r->format;
+	while (*f && n < size - 1) {
+		if (*f != '%') {
+			line[n++] = *f++;
+			continue;
+		}
+		f++;
+		if (*f == '%') {
+			line[n++] = *f++;
+			continue;
+		}
+
+		// flags, width and precision are kept, the length is given by the recording
+		char spec[24];
+		int s = 0;
+		spec[s++] = '%';
+		while (*f && strchr("-+ #0123456789.", *f) && s < 16)
+			spec[s++] = *f++;
+		while (*f && strchr("hlLzjt", *f))
+			f++;
+		char conv = *f;
+		if (conv)
+			f++;
+		if (arg >= r->argCount) {
+			line[n++] = '?';
+			continue;
+		}
+		const LoggerArg *a = &r->args[arg++];
+		int room = size - n;
+		int written = 0;
+		switch (conv) {
+		case 'd': case 'i':
+			spec[s++] = 'l'; spec[s++] = 'l'; spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, a->i);
+			break;
+		case 'u': case 'x': case 'X': case 'o':
+			spec[s++] = 'l'; spec[s++] = 'l'; spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, (unsigned long long)a->i);
+			break;
+		case 'c':
+			spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, (int)a->i);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, a->d);
+			break;
+		case 's':
+			spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, a->i < 0 ? "" : r->text + a->i);
+			break;
+		case 'p':
+			spec[s++] = conv; spec[s] = '\0';
+			written = snprintf(line + n, room, spec, a->p);
+			break;
+		}
+		n += written < room ? written : room - 1;
+	}
+	line[n] = '\0';
+}
+
+static void writeDump(const LoggerRecord *r) {
+	char line[MAX_LINE];
+	const char *desc = (const char *)r->args[0].p;
+	if (desc != NULL) {
+		snprintf(line, sizeof(line), "%s:", desc);
+		writeLine(r->level, &r->time, line);
+	}
+	const uint8_t *data = (const uint8_t *)r->text;
+	for (int offset = 0; offset < r->textLength; offset += DUMP_BLOC) {
+		char hexbuf[DUMP_BLOC * 3 + 1];
+		char ascbuf[DUMP_BLOC + 1];
+		int count = r->textLength - offset < DUMP_BLOC ? r->textLength - offset : DUMP_BLOC;
+		for (int i = 0; i < DUMP_BLOC; i++) {
+			if (i < count) {
+				uint8_t ch = data[offset + i];
+				snprintf(hexbuf + i * 3, 4, "%02x ", ch);
+				ascbuf[i] = ch >= 0x20 && ch < 0x7F ? ch : '.';
+			}
+			else {
+				memcpy(hexbuf + i * 3, "   ", 4);
+				ascbuf[i] = ' ';
+			}
+		}
+		ascbuf[DUMP_BLOC] = '\0';
+		snprintf(line, sizeof(line), "%04x %s %s", offset, hexbuf, ascbuf);
+		writeLine(r->level, &r->time, line);
+	}
+}
+
+static void writeRecord(const LoggerRecord *r) {
+	if (r->format == NULL) {
+		writeDump(r);
+		return;
+	}
+	char line[MAX_LINE];
+	formatRecord(r, line, sizeof(line));
+	writeLine(r->level, &r->time, line);
+}
+
+/* The records dropped since the previous report, so a flood is still visible */
+static void reportDropped(unsigned long *lastDropped, unsigned long *lastLimited) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	char line[MAX_LINE];
+
+	unsigned long d = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+	if (d != *lastDropped) {
+		snprintf(line, sizeof(line), "Logger: %lu records dropped, the ring being full", d - *lastDropped);
+		writeLine(LOGGER_ERROR, &now, line);
+		*lastDropped = d;
+	}
+	for (int c = 0; c < LOGGER_CATEGORIES; c++) {
+		unsigned long l = __atomic_load_n(&rateLimited[c], __ATOMIC_RELAXED);
+		if (l != lastLimited[c]) {
+			snprintf(line, sizeof(line), "Logger: %lu %s records over the rate limit dropped", l - lastLimited[c], categoryNames[c]);
+			writeLine(LOGGER_INFO, &now, line);
+			lastLimited[c] = l;
+		}
+	}
+}
+
+/* Write the records waiting, or only free their slots */
+static void drain(bool write) {
+	unsigned long h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+	unsigned long t = tail;
+	while (t != h) {
+		if (write)
+			writeRecord(&ring[t & (LOGGER_RING - 1)]);
+		t++;
+		// the slot can be used again
+		__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+	}
+}
+
+static void *loggerThread(void *arg) {
+	unsigned long lastDropped = 0;
+	unsigned long lastLimited[LOGGER_CATEGORIES] = { 0 };
+	long lastReport = monotonicMillis();
+
+	for (;;) {
+		// read before draining: what was recorded before the stop is still written
+		bool stop = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+		drain(true);
+
+		long now = monotonicMillis();
+		if (stop || now - lastReport >= LOGGER_REPORT) {
+			reportDropped(&lastDropped, lastLimited);
+			lastReport = now;
+		}
+		if (out != NULL)
+			fflush(out);
+		if (stop)
+			break;
+		usleep(LOGGER_IDLE * 1000);
+	}
+	return NULL;
+}
+
+// Recording, in the main thread ----------
+/* A record to fill, NULL when it is dropped */
+static LoggerRecord *reserve(int level, int category) {
+	if (category < 0 || category >= LOGGER_CATEGORIES)
+		category = LOGGER_MAIN;
+	TokenBucket *b = &buckets[category];
+	// the errors are always recorded
+	if (level > LOGGER_ERROR && b->rate > 0 && !tokenBucketTake(b, monotonicMillis())) {
+		rateLimited[category]++;
+		return NULL;
+	}
+
+	LoggerRecord *r;
+	if (!running)
+		r = &immediate;
+	else if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >= LOGGER_RING) {
+		dropped++;
+		return NULL;
+	}
+	else
+		r = &ring[head & (LOGGER_RING - 1)];
+
+	gettimeofday(&r->time, NULL);
+	r->level = level;
+	r->category = category;
+	r->argCount = 0;
+	r->textLength = 0;
+	return r;
+}
+
+static void commit(LoggerRecord *r) {
+	if (!running) {
+		FILE *saved = out;
+		out = directSyslog ? NULL : stdout;
+		writeRecord(r);
+		out = saved;
+		fflush(stdout);
+		return;
+	}
+	__atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+}
+
+void loggerRecord(int level, int category, const char *format, ...) {
+	LoggerRecord *r = reserve(level, category);
+	if (r == NULL)
+		return;
+	r->format = format;
+
+	// fetch each argument by the type its conversion gives
+	va_list ap;
+	va_start(ap, format);
+	for (const char *f = format; *f && r->argCount < LOGGER_ARGS; f++) {
+		if (*f != '%')
+			continue;
+		f++;
+		if (*f == '%')
+			continue;
+		while (*f && strchr("-+ #0123456789.", *f))
+			f++;
+		int longs = 0;
+		char length = 0;
+		while (*f && strchr("hlLzjt", *f)) {
+			if (*f == 'l')
+				longs++;
+			else
+				length = *f;
+			f++;
+		}
+
+		LoggerArg *a = &r->args[r->argCount];
+		switch (*f) {
+		case 'd': case 'i':
+			if (longs >= 2) a->i = va_arg(ap, long long);
+			else if (longs == 1) a->i = va_arg(ap, long);
+			else if (length == 'z') a->i = va_arg(ap, ssize_t);
+			else if (length == 'j') a->i = va_arg(ap, intmax_t);
+			else if (length == 't') a->i = va_arg(ap, ptrdiff_t);
+			else a->i = va_arg(ap, int);
+			break;
+		case 'u': case 'x': case 'X': case 'o':
+			if (longs >= 2) a->i = va_arg(ap, unsigned long long);
+			else if (longs == 1) a->i = va_arg(ap, unsigned long);
+			else if (length == 'z') a->i = va_arg(ap, size_t);
+			else if (length == 'j') a->i = va_arg(ap, uintmax_t);
+			else if (length == 't') a->i = va_arg(ap, ptrdiff_t);
+			else a->i = va_arg(ap, unsigned int);
+			break;
+		case 'c':
+			a->i = va_arg(ap, int);
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			a->d = length == 'L' ? (double)va_arg(ap, long double) : va_arg(ap, double);
+			break;
+		case 's': {
+			// copied, the string may not outlive the call
+			const char *s = va_arg(ap, const char *);
+			if (s == NULL)
+				s = "(null)";
+			int room = LOGGER_TEXT - r->textLength - 1;
+			if (room < 0) {
+				a->i = -1;
+				break;
+			}
+			int n = strnlen(s, room);
+			a->i = r->textLength;
+			memcpy(r->text + r->textLength, s, n);
+			r->text[r->textLength + n] = '\0';
+			r->textLength += n + 1;
+			break;
+		}
+		case 'p':
+			a->p = va_arg(ap, void *);
+			break;
+		default:
+			// not supported, the arguments after it cannot be found
+			va_end(ap);
+			commit(r);
+			return;
+		}
+		r->argCount++;
+	}
+	va_end(ap);
+	commit(r);
+}
+
+void loggerDump(int level, int category, const char *desc, const void *data, int len) {
+	if (level > loggerLevel || len <= 0)
+		return;
+	LoggerRecord *r = reserve(level, category);
+	if (r == NULL)
+		return;
+	r->format = NULL;
+	r->args[0].p = desc;
+	r->textLength = len < LOGGER_TEXT ? len : LOGGER_TEXT;
+	memcpy(r->text, data, r->textLength);
+	commit(r);
+}
+
+static bool openOutput(const char *path, int level) {
+	if (path == NULL)
+		out = NULL;
+	else if (path[0] == '\0')
+		out = stdout;
+	else if ((out = fopen(path, "a")) == NULL)
+		return false;
+	loggerSetLevel(level);
+	return true;
+}
+
+bool loggerOpen(const char *path, int level) {
+	if (running)
+		return true;
+	if (!openOutput(path, level))
+		return false;
+
+	running = true;
+	if (pthread_create(&thread, NULL, loggerThread, NULL) != 0) {
+		running = false;
+		return false;
+	}
+	return true;
+}
+
+bool loggerOpenPolled(const char *path, int level) {
+	if (running)
+		return true;
+	if (!openOutput(path, level))
+		return false;
+	running = true;
+	polled = true;
+	return true;
+}
+
+void loggerPoll(void) {
+	if (polled)
+		drain(true);
+}
+
+void loggerSkip(void) {
+	if (polled)
+		drain(false);
+}
+
+void loggerSetDirect(const char *path) {
+	directSyslog = path == NULL;
+}
+
+void loggerClose(void) {
+	if (!running)
+		return;
+	if (polled) {
+		drain(true);
+		running = polled = false;
+	}
+	else {
+		__atomic_store_n(&running, false, __ATOMIC_RELEASE);
+		pthread_join(thread, NULL);
+	}
+	if (out != NULL && out != stdout)
+		fclose(out);
+	else if (out != NULL)
+		fflush(out);
+	out = stdout;
+}
+
+void loggerSetLevel(int level) {
+	if (level < LOGGER_ERROR)
+		level = LOGGER_ERROR;
+	if (level > LOGGER_DEBUG)
+		level = LOGGER_DEBUG;
+	loggerLevel = level;
+}
+
+void loggerSetRate(int category, float rate, float burst) {
+	if (category >= 0 && category < LOGGER_CATEGORIES)
+		tokenBucketInit(&buckets[category], rate, burst, monotonicMillis());
+}
+
+unsigned long loggerDropped(void) {
+	return dropped;
+}
+
+unsigned long loggerRateLimited(void) {
+	unsigned long total = 0;
+	for (int c = 0; c < LOGGER_CATEGORIES; c++)
+		total += rateLimited[c];
+	return total;
+}
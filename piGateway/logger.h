@@ -0,0 +1,105 @@
+/*
+RFM69 Gateway asynchronous logger
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: logger.h
+
+The main loop only records what is to be logged: the format, which must be a
+string literal, the raw arguments, and the time. A background thread does the
+formatting, and writes the lines to syslog, a file or stdout. The records go
+through a lock-free ring, with a single producer: the gateway logs from its main
+thread only.
+
+The strings given as arguments are copied, up to LOGGER_TEXT bytes per record,
+and so are the bytes of loggerDump(), which the background thread prints as an
+hex dump. The * width and precision are not supported.
+
+Each category has its own token bucket: the records over its rate are dropped,
+and so are the records coming while the ring is full; both are counted, and the
+counts are logged once a second while they grow. The level is changed at any
+time by loggerSetLevel(), the records above it cost only a comparison.
+
+Before loggerOpen(), and after loggerClose(), the records are written at once,
+to stdout or to syslog as set by loggerSetDirect().
+
+The benchmarks open the logger without its thread, by loggerOpenPolled(): the
+records then wait in the ring until loggerPoll() writes them, or loggerSkip()
+drops them, so the recording and the formatting are measured each on its own.
+*/
+#ifndef LOGGER_h
+#define LOGGER_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include "ratelimit.h"
+
+// levels
+#define LOGGER_ERROR 0
+#define LOGGER_INFO 1
+#define LOGGER_DEBUG 2
+
+// categories
+#define LOGGER_MAIN 0		// start, stop, radio watchdog, firmware updates
+#define LOGGER_FRAME 1		// every frame received
+#define LOGGER_DUMP 2		// hex dumps of the invalid frames
+#define LOGGER_BROKER 3		// connections to the brokers
+#define LOGGER_DOWNLINK 4	// messages from the brokers
+#define LOGGER_CATEGORIES 5
+
+#define LOGGER_RING 1024	// records, a power of 2
+#define LOGGER_ARGS 8		// arguments of a record
+#define LOGGER_TEXT 96		// bytes of strings, or of dump, in a record
+#define LOGGER_IDLE 10		// ms the background thread sleeps when the ring is empty
+#define LOGGER_REPORT 1000	// ms between two reports of the records dropped
+
+typedef union {
+	long long i;
+	double d;
+	const void *p;
+}
+LoggerArg;
+
+typedef struct {
+	const char *format;		// NULL for a dump
+	struct timeval time;
+	uint8_t level;
+	uint8_t category;
+	uint8_t argCount;
+	uint8_t textLength;		// used in text
+	LoggerArg args[LOGGER_ARGS];	// a string is its offset in text
+	char text[LOGGER_TEXT];
+}
+LoggerRecord;
+
+// read without lock by LOGGER(), so a filtered record costs a comparison
+extern volatile int loggerLevel;
+
+#define LOGGER(level, category, ...) do { if ((level) <= loggerLevel) loggerRecord(level, category, __VA_ARGS__); } while (0)
+
+// path NULL for syslog, "" for stdout; starts the background thread
+bool loggerOpen(const char *path, int level);
+// as loggerOpen(), without the thread: the records wait for loggerPoll()
+bool loggerOpenPolled(const char *path, int level);
+// opened by loggerOpenPolled() only: write the records waiting, or drop them
+void loggerPoll(void);
+void loggerSkip(void);
+// where the records go while the logger is not open: NULL for syslog, "" for stdout, the default
+void loggerSetDirect(const char *path);
+// write the records left, and stop the thread
+void loggerClose(void);
+void loggerSetLevel(int level);
+// lines per second, and burst, allowed for a category; 0 for no limit
+void loggerSetRate(int category, float rate, float burst);
+
+void loggerRecord(int level, int category, const char *format, ...) __attribute__((format(printf, 3, 4)));
+// desc may be NULL; the bytes after the first LOGGER_TEXT are not kept
+void loggerDump(int level, int category, const char *desc, const void *data, int len);
+
+// records dropped, the ring being full
+unsigned long loggerDropped(void);
+// records dropped by the rate limits, all categories
+unsigned long loggerRateLimited(void);
+
+#endif
@@ -23,3 +23,91 @@ This file hold the network configuration
 #define NWC_PROMISCUOUS_MODE true
 // Set the delay before reinitializing the RFM69 module if no  message received in the interval
 #define NWC_WATCHDOG_DELAY 1800000
+
+// Rate limiting of the readings forwarded to the broker, as readings per second and burst size
+// A limit of 0 disables the corresponding bucket
+#define NWC_NODE_RATE 1.0
+#define NWC_NODE_BURST 5
+#define NWC_GLOBAL_RATE 50.0
+#define NWC_GLOBAL_BURST 100
+// Number of messages waiting in the mosquitto outgoing queue above which readings are held back
+#define NWC_QUEUE_HIGH_WATER 200
+// What to do with a reading over the limit
+// NWC_POLICY_DROP discard it, NWC_POLICY_MERGE keep the latest reading of each sensor until it can be sent
+#define NWC_LIMIT_POLICY NWC_POLICY_MERGE
+// Interval between two publications of the gateway statistics, 0 to disable
+#define NWC_STATS_INTERVAL 60000
+
+// QoS of the messages published to the broker: sensor variables, RSSI and gateway statistics
+// QoS 1 and 2 messages are kept until acknowledged, and sent again after a reconnection
+#define NWC_QOS_READING 1
+#define NWC_QOS_RSSI 0
+#define NWC_QOS_STATS 0
+// Maximum number of QoS 1 and 2 messages waiting for the broker acknowledge, readings are held back above
+#define NWC_INFLIGHT_WINDOW 20
+// Time after which a message not acknowledged leaves the window
+#define NWC_INFLIGHT_TIMEOUT 30000
+
+// Local distribution of the readings to the consumers running on the gateway, see localbus.h
+// Shared memory ring, opened with shm_open(), and its size in readings. Empty to disable
+#define NWC_LOCAL_SHM "/rfm69gateway"
+#define NWC_LOCAL_SLOTS 1024
+// Unix socket to subscribe with topic filters. Empty to disable
+#define NWC_LOCAL_SOCKET "/var/run/rfm69gateway.sock"
+
+// Brokers, as "host:port" separated by commas, by priority
+#define NWC_BROKERS "localhost:1883"
+// NWC_BROKER_FAILOVER publish to the first broker connected, NWC_BROKER_MIRROR publish to every broker connected
+#define NWC_BROKER_MODE NWC_BROKER_FAILOVER
+// Delay before connecting again to a broker, doubled on each failure up to the max, in ms
+#define NWC_RECONNECT_MIN 500
+#define NWC_RECONNECT_MAX 60000
+
+// Several gateways on the same network, see peers.h
+// ID of this gateway, from 0 to 7, unique among the gateways of the network
+#define NWC_GATEWAY_ID 0
+// Other gateways, as "host:port" separated by commas, or the broadcast address of the local network. Empty when alone
+#define NWC_PEERS ""
+#define NWC_PEER_PORT 46901
+// Time a frame is held while the other gateways report it, in ms
+#define NWC_ELECTION_WINDOW 30
+
+// Firmware updates of the nodes over the air, see fota.h
+// Directory watched for <node>.bin and <node>.hex images. Empty to only take them from RFM/<network>/<node>/fota
+#define NWC_FOTA_DIR "/var/lib/rfm69gateway/fota"
+// Blocks sent before asking the node which ones it received, up to 32
+#define NWC_FOTA_WINDOW 16
+
+// Group commands, sent to several nodes in one broadcast frame, see group.h
+// Groups and their members, as "<group>:<node>,<node>" separated by ';'. Empty for none
+#define NWC_GROUPS ""
+// Frames sent for a command, to the members which did not answer yet; 0 to send it once, without answers
+#define NWC_GROUP_ROUNDS 2
+
+// Relay nodes, serving the nodes out of range of the gateway, see relay.h
+// Node IDs of the relays, separated by commas. Empty for none
+#define NWC_RELAYS ""
+
+// Radio on an Arduino running Gateway.ino in SERIAL_MODEM mode, see serialrfm69.h
+// Serial port of the modem, empty for the RFM69 on the SPI bus. Also given with -m
+#define NWC_SERIAL_DEVICE ""
+// The same as MODEM_BAUD in Gateway.ino
+#define NWC_SERIAL_BAUD 500000
+
+// Logging, see logger.h
+// LOGGER_ERROR, LOGGER_INFO, or LOGGER_DEBUG for every frame. Changed with -v and -q, and while running with SIGUSR1 (more) and SIGUSR2 (less)
+#define NWC_LOG_LEVEL LOGGER_INFO
+// File the log is appended to. Empty for syslog when run as a daemon, stdout otherwise. Also given with -l
+#define NWC_LOG_FILE ""
+// Lines per second allowed for each of the frame, hex dump and downlink categories, and burst; 0 for no limit
+#define NWC_LOG_RATE 20
+#define NWC_LOG_BURST 100
+
+// Frequency correction
+// Measure the frequency offset of each node, from the AFC of the receptions; published on RFM/<network>/<node>/frequency
+#define NWC_AFC true
+// Shift the carrier to the frequency of a node when sending it ACKs, downlink messages and firmware updates
+#define NWC_AFC_CORRECTION false
+// Frames measured before the offset of a node is trusted, and smallest offset corrected, in Hz
+#define NWC_AFC_MIN_FRAMES 4
+#define NWC_AFC_MIN_OFFSET 1000
@@ -0,0 +1,304 @@
+/*
+RFM69 Gateway cooperation between gateways
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: peers.c
+
+Digest exchange, frame election and node ownership, see peers.h
+
+Digest on the wire, 22 bytes, little endian:
+ 0  'R' 'G'
+ 2  version
+ 3  gateway ID
+ 4  sender ID
+ 5  target ID
+ 6  data length
+ 7  reserved
+ 8  RSSI, int16
+ 10 hash, uint32
+ 14 reception time, int64 in us since the epoch
+*/
+
+#include "peers.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define PEERS_VERSION 1
+#define PEERS_DIGEST_LEN 22
+
+// Wire format --------------------------
+
+static void put16(uint8_t *p, uint16_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+	put16(p, v);
+	put16(p + 2, v >> 16);
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+static void encode(const PeerDigest *d, uint8_t *p) {
+	p[0] = 'R';
+	p[1] = 'G';
+	p[2] = PEERS_VERSION;
+	p[3] = d->gatewayID;
+	p[4] = d->senderID;
+	p[5] = d->targetID;
+	p[6] = d->dataLength;
+	p[7] = 0;
+	put16(p + 8, d->rssi);
+	put32(p + 10, d->hash);
+	put32(p + 14, (uint32_t)d->timestamp);
+	put32(p + 18, (uint32_t)((uint64_t)d->timestamp >> 32));
+}
+
+static bool decode(const uint8_t *p, int len, PeerDigest *d) {
+	if (len != PEERS_DIGEST_LEN || p[0] != 'R' || p[1] != 'G' || p[2] != PEERS_VERSION)
+		return false;
+	d->gatewayID = p[3];
+	d->senderID = p[4];
+	d->targetID = p[5];
+	d->dataLength = p[6];
+	d->rssi = (int16_t)get16(p + 8);
+	d->hash = get32(p + 10);
+	d->timestamp = (int64_t)(get32(p + 14) | ((uint64_t)get32(p + 18) << 32));
+	return d->gatewayID < PEERS_MAX_GATEWAYS;
+}
+
+// FNV-1a of the addresses and the data, what every gateway receives identically
+uint32_t peersHash(const Frame *frame) {
+	uint32_t h = 2166136261u;
+	uint8_t header[3] = { frame->senderID, frame->targetID, frame->dataLength };
+	for (int i = 0; i < 3; i++)
+		h = (h ^ header[i]) * 16777619u;
+	for (int i = 0; i < frame->dataLength; i++)
+		h = (h ^ frame->data[i]) * 16777619u;
+	return h;
+}
+
+// Election and ownership ---------------
+
+// the frame is better received by gateway a than by gateway b
+static bool beats(int16_t rssiA, uint8_t gatewayA, int16_t rssiB, uint8_t gatewayB) {
+	return rssiA > rssiB || (rssiA == rssiB && gatewayA < gatewayB);
+}
+
+static void heard(Peers *peers, uint8_t node, uint8_t gateway, int16_t rssi, long now) {
+	PeerNode *n = &peers->nodes[node];
+	if (n->seen & (1 << gateway))
+		n->rssi[gateway] += (rssi - n->rssi[gateway]) * PEERS_RSSI_WEIGHT;
+	else
+		n->rssi[gateway] = rssi;
+	n->heard[gateway] = now;
+	n->seen |= 1 << gateway;
+}
+
+static bool recent(const PeerNode *n, int gateway, long now) {
+	return (n->seen & (1 << gateway)) && now - n->heard[gateway] < PEERS_OWNER_TIMEOUT;
+}
+
+bool peersOwnsNode(Peers *peers, uint8_t node, long now) {
+	if (!peers->active)
+		return true;
+
+	PeerNode *n = &peers->nodes[node];
+	int best = -1;
+	for (int g = 0; g < PEERS_MAX_GATEWAYS; g++) {
+		if (recent(n, g, now) && (best < 0 || n->rssi[g] > n->rssi[best]))
+			best = g;
+	}
+	if (best < 0)
+		return true;	// nobody heard it yet, try anyway
+
+	// only take over from a current owner clearly beaten
+	if (n->owner < 0 || !recent(n, n->owner, now) || n->rssi[best] > n->rssi[n->owner] + PEERS_HYSTERESIS)
+		n->owner = best;
+	return n->owner == peers->gatewayID;
+}
+
+bool peersLeads(Peers *peers, long now) {
+	if (!peers->active)
+		return true;
+	for (int g = 0; g < peers->gatewayID; g++)
+		if (peers->gatewayHeard[g] != 0 && now - peers->gatewayHeard[g] < PEERS_OWNER_TIMEOUT)
+			return false;
+	return true;
+}
+
+// Transport ----------------------------
+
+bool peersOpen(Peers *peers, uint8_t gatewayID, int port, const char *list, long window) {
+	memset(peers, 0, sizeof(*peers));
+	peers->fd = -1;
+	peers->gatewayID = gatewayID;
+	peers->window = window;
+	for (int i = 0; i < 256; i++)
+		peers->nodes[i].owner = -1;
+	if (list == NULL || *list == '\0')
+		return true;
+	if (gatewayID >= PEERS_MAX_GATEWAYS)
+		return false;
+
+	peers->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (peers->fd < 0)
+		return false;
+	int on = 1;
+	setsockopt(peers->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	// the list may be the broadcast address of the network
+	setsockopt(peers->fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(peers->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		peersClose(peers);
+		return false;
+	}
+
+	char copy[256];
+	strncpy(copy, list, sizeof(copy) - 1);
+	copy[sizeof(copy) - 1] = '\0';
+	for (char *item = strtok(copy, ", "); item != NULL && peers->addressCount < PEERS_MAX_ADDRESSES; item = strtok(NULL, ", ")) {
+		char *itemPort = strrchr(item, ':');
+		if (itemPort != NULL)
+			*itemPort++ = '\0';
+
+		struct addrinfo hints, *res;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		if (getaddrinfo(item, NULL, &hints, &res) != 0) {
+			peersClose(peers);
+			return false;
+		}
+		struct sockaddr_in *peer = &peers->addresses[peers->addressCount++];
+		memcpy(peer, res->ai_addr, sizeof(*peer));
+		peer->sin_port = htons(itemPort != NULL ? atoi(itemPort) : port);
+		freeaddrinfo(res);
+	}
+	peers->active = peers->addressCount > 0;
+	return true;
+}
+
+void peersClose(Peers *peers) {
+	if (peers->fd >= 0)
+		close(peers->fd);
+	peers->fd = -1;
+	peers->active = false;
+}
+
+bool peersSubmit(Peers *peers, const Frame *frame, long now) {
+	PeerDigest digest;
+	digest.gatewayID = peers->gatewayID;
+	digest.senderID = frame->senderID;
+	digest.targetID = frame->targetID;
+	digest.dataLength = frame->dataLength;
+	digest.rssi = frame->rssi;
+	digest.hash = peersHash(frame);
+	digest.timestamp = frame->timestamp.tv_sec * 1000000LL + frame->timestamp.tv_usec;
+	heard(peers, frame->senderID, peers->gatewayID, frame->rssi, now);
+
+	uint8_t packet[PEERS_DIGEST_LEN];
+	encode(&digest, packet);
+	for (int i = 0; i < peers->addressCount; i++) {
+		// a lost digest only means a frame published twice
+		if (sendto(peers->fd, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&peers->addresses[i], sizeof(peers->addresses[i])) == sizeof(packet))
+			peers->digestSent++;
+	}
+
+	PendingFrame *p = NULL;
+	for (int i = 0; i < PEERS_PENDING && p == NULL; i++)
+		if (!peers->pending[i].used)
+			p = &peers->pending[i];
+	if (p == NULL) {
+		peers->overflow++;
+		return false;
+	}
+	p->used = true;
+	p->frame = *frame;
+	p->hash = digest.hash;
+	p->received = now;
+	p->beaten = false;
+	peers->pendingCount++;
+
+	// the other gateways may have been faster
+	for (int i = 0; i < PEERS_RECENT; i++) {
+		const RecentDigest *r = &peers->recent[i];
+		if (r->received != 0 && r->digest.hash == p->hash && now - r->received <= peers->window
+			&& beats(r->digest.rssi, r->digest.gatewayID, frame->rssi, peers->gatewayID))
+			p->beaten = true;
+	}
+	return true;
+}
+
+void peersPoll(Peers *peers, long now) {
+	if (!peers->active)
+		return;
+
+	uint8_t packet[64];
+	ssize_t len;
+	while ((len = recv(peers->fd, packet, sizeof(packet), MSG_DONTWAIT)) >= 0) {
+		PeerDigest digest;
+		// our own broadcasts come back
+		if (!decode(packet, len, &digest) || digest.gatewayID == peers->gatewayID)
+			continue;
+		peers->digestReceived++;
+		heard(peers, digest.senderID, digest.gatewayID, digest.rssi, now);
+		peers->gatewayHeard[digest.gatewayID] = now ? now : 1;
+
+		RecentDigest *r = &peers->recent[peers->recentNext];
+		peers->recentNext = (peers->recentNext + 1) % PEERS_RECENT;
+		r->digest = digest;
+		r->received = now ? now : 1;
+
+		for (int i = 0; i < PEERS_PENDING; i++) {
+			PendingFrame *p = &peers->pending[i];
+			if (p->used && !p->beaten && p->hash == digest.hash
+				&& beats(digest.rssi, digest.gatewayID, p->frame.rssi, peers->gatewayID))
+				p->beaten = true;
+		}
+	}
+}
+
+bool peersNextDecided(Peers *peers, long now, Frame *frame, bool *won) {
+	if (peers->pendingCount == 0)
+		return false;
+
+	// the oldest frame whose window is over, to keep the reception order
+	PendingFrame *oldest = NULL;
+	for (int i = 0; i < PEERS_PENDING; i++) {
+		PendingFrame *p = &peers->pending[i];
+		if (p->used && now - p->received >= peers->window && (oldest == NULL || p->received - oldest->received < 0))
+			oldest = p;
+	}
+	if (oldest == NULL)
+		return false;
+
+	oldest->used = false;
+	peers->pendingCount--;
+	if (oldest->beaten)
+		peers->lost++;
+	else
+		peers->won++;
+	*won = !oldest->beaten;
+	*frame = oldest->frame;
+	return true;
+}
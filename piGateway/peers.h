@@ -0,0 +1,119 @@
+/*
+RFM69 Gateway cooperation between gateways
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: peers.h
+
+Several gateways listening to the same network hear most frames more than once.
+Each gateway sends a short digest of every frame it receives to the others, over
+UDP on the local network: its gateway ID, the reception time, the RSSI and a hash
+of the frame.
+
+ - election: a received frame is held for the election window, while the digests
+   of the other gateways come in. Only the gateway with the best RSSI publishes it,
+   the lowest gateway ID winning a tie. A lost digest can only lead to a frame
+   published twice, never to a frame not published.
+
+ - ownership: each gateway follows the average RSSI of every node at every gateway.
+   The gateway hearing a node best owns it: it alone sends the ACKs and the
+   downlink messages to the node. The owner only changes when another gateway
+   hears the node better by PEERS_HYSTERESIS dB, or stops hearing it.
+
+ - leader: the broadcasts to several nodes, the group commands, are sent by one
+   gateway only, the lowest gateway ID heard from in PEERS_OWNER_TIMEOUT.
+
+A gateway without peer, or not hearing from them, publishes and owns everything.
+*/
+#ifndef PEERS_h
+#define PEERS_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "frame.h"
+
+#define PEERS_MAX_GATEWAYS 8	// gateway IDs from 0 to 7
+#define PEERS_MAX_ADDRESSES 8
+#define PEERS_PENDING 32		// frames waiting for their election
+#define PEERS_RECENT 64			// digests of the other gateways kept for the matching
+#define PEERS_HYSTERESIS 3.0	// dB
+#define PEERS_OWNER_TIMEOUT 600000L	// a gateway not hearing a node for 10 min cannot own it
+#define PEERS_RSSI_WEIGHT 0.2	// weight of a new RSSI in the average
+
+typedef struct {
+	uint8_t gatewayID;
+	uint8_t senderID;
+	uint8_t targetID;
+	uint8_t dataLength;
+	int16_t rssi;
+	uint32_t hash;
+	int64_t timestamp;	// reception time at the gateway, in us since the epoch
+}
+PeerDigest;
+
+typedef struct {
+	bool used;
+	Frame frame;
+	uint32_t hash;
+	long received;		// local time, in ms
+	bool beaten;		// a digest with a better RSSI came in
+}
+PendingFrame;
+
+typedef struct {
+	PeerDigest digest;
+	long received;		// local time of arrival, in ms
+}
+RecentDigest;
+
+typedef struct {
+	float rssi[PEERS_MAX_GATEWAYS];	// average RSSI at each gateway
+	long heard[PEERS_MAX_GATEWAYS];	// local time of the last frame heard by each gateway
+	uint8_t seen;					// bit set for the gateways which ever heard the node
+	int8_t owner;					// -1 until heard
+}
+PeerNode;
+
+typedef struct {
+	bool active;
+	int fd;
+	uint8_t gatewayID;
+	long window;		// election window, in ms
+	struct sockaddr_in addresses[PEERS_MAX_ADDRESSES];
+	int addressCount;
+	PendingFrame pending[PEERS_PENDING];
+	int pendingCount;
+	RecentDigest recent[PEERS_RECENT];
+	int recentNext;
+	PeerNode nodes[256];
+	long gatewayHeard[PEERS_MAX_GATEWAYS];	// local time of the last digest of each gateway, 0 when never
+
+	unsigned long digestSent;
+	unsigned long digestReceived;
+	unsigned long won;		// frames published after an election
+	unsigned long lost;		// frames left to a gateway hearing them better
+	unsigned long overflow;	// frames published without election, the pending table being full
+}
+Peers;
+
+// bind the UDP port and resolve the "host:port" list of the other gateways, or a broadcast address
+// an empty list disables the cooperation
+bool peersOpen(Peers *peers, uint8_t gatewayID, int port, const char *list, long window);
+// hold a received frame for its election, and tell the other gateways
+// false if the frame could not be held, and must be published now
+bool peersSubmit(Peers *peers, const Frame *frame, long now);
+// read the digests of the other gateways, never blocks
+void peersPoll(Peers *peers, long now);
+// next frame whose election is over, false if there is none
+// won tells whether this gateway publishes it, the others only follow the state of the node
+bool peersNextDecided(Peers *peers, long now, Frame *frame, bool *won);
+// true if this gateway should send the ACKs and downlink messages of the node
+bool peersOwnsNode(Peers *peers, uint8_t node, long now);
+// true if this gateway should send the messages to several nodes
+bool peersLeads(Peers *peers, long now);
+void peersClose(Peers *peers);
+
+uint32_t peersHash(const Frame *frame);
+
+#endif
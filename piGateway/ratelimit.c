@@ -0,0 +1,38 @@
+/*
+RFM69 Gateway token bucket rate limiter
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: ratelimit.c
+*/
+
+#include "ratelimit.h"
+
+void tokenBucketInit(TokenBucket *tb, float rate, float burst, long now) {
+	tb->rate = rate;
+	tb->burst = burst;
+	tb->tokens = burst;	// start full, so a node can report right after a restart
+	tb->last = now;
+}
+
+static void refill(TokenBucket *tb, long now) {
+	long elapsed = now - tb->last;
+	if (elapsed <= 0)
+		return;
+	tb->tokens += elapsed * tb->rate / 1000.0;
+	if (tb->tokens > tb->burst)
+		tb->tokens = tb->burst;
+	tb->last = now;
+}
+
+bool tokenBucketReady(TokenBucket *tb, long now) {
+	refill(tb, now);
+	return tb->tokens >= 1.0;
+}
+
+bool tokenBucketTake(TokenBucket *tb, long now) {
+	if (!tokenBucketReady(tb, now))
+		return false;
+	tb->tokens -= 1.0;
+	return true;
+}
@@ -0,0 +1,29 @@
+/*
+RFM69 Gateway token bucket rate limiter
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: ratelimit.h
+
+A bucket holds up to "burst" tokens and is refilled at "rate" tokens per second.
+Each admitted event consumes one token. Time is given by the caller in ms, so the
+same bucket can be driven by millis() live or by recorded timestamps.
+*/
+#ifndef RATELIMIT_h
+#define RATELIMIT_h
+
+typedef struct {
+	float tokens;	// tokens currently available
+	float rate;		// refill rate, in tokens per second
+	float burst;	// maximum number of tokens the bucket can hold
+	long last;		// time of the last refill, in ms
+}
+TokenBucket;
+
+void tokenBucketInit(TokenBucket *tb, float rate, float burst, long now);
+// true if at least one token is available, without consuming it
+bool tokenBucketReady(TokenBucket *tb, long now);
+// consume one token if available, return false otherwise
+bool tokenBucketTake(TokenBucket *tb, long now);
+
+#endif
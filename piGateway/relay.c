@@ -0,0 +1,290 @@
+/*
+RFM69 Gateway routes through relay nodes
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: relay.c
+
+Unwrapping of the forwarded frames, route computation and tables, see relay.h
+*/
+
+#include "relay.h"
+#include "peers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NO_ROUTE -1000.0	// quality of a route not heard
+
+bool relaysOpen(Relays *relays, uint8_t gatewayID, const char *list, RelaySend send) {
+	memset(relays, 0, sizeof(*relays));
+	relays->gatewayID = gatewayID;
+	relays->send = send;
+	for (int i = 0; i < 256; i++)
+		relays->route[i] = relays->last[i] = i;
+	if (list == NULL || *list == '\0')
+		return true;
+
+	char copy[256];
+	snprintf(copy, sizeof(copy), "%s", list);
+	for (char *item = strtok(copy, ", "); item != NULL; item = strtok(NULL, ", ")) {
+		char *end;
+		long node = strtol(item, &end, 10);
+		if (end == item || *end != '\0' || node <= 0 || node >= RELAY_MARKER || node == gatewayID
+				|| relays->count >= RELAY_MAX_RELAYS)
+			return false;
+		relays->parent[relays->count] = gatewayID;
+		// a relay starts without table, and has nothing to be sent yet
+		relays->tableSent[relays->count] = true;
+		relays->relays[relays->count++] = node;
+	}
+	relays->active = true;
+	return true;
+}
+
+static int relayIndex(Relays *relays, uint8_t node) {
+	for (int i = 0; i < relays->count; i++)
+		if (relays->relays[i] == node)
+			return i;
+	return -1;
+}
+
+static bool fresh(const RelayLink *link, long now) {
+	return link->heard != 0 && now - link->heard <= RELAY_STALE;
+}
+
+/* False for a copy of a frame seen in the last RELAY_DUPLICATE ms */
+static bool firstCopy(Relays *relays, const Frame *frame, long now) {
+	uint32_t hash = peersHash(frame);
+	for (int i = 0; i < RELAY_RECENT; i++) {
+		RelayRecent *r = &relays->recent[i];
+		if (r->received != 0 && r->hash == hash && now - r->received <= RELAY_DUPLICATE) {
+			relays->duplicates++;
+			return false;
+		}
+	}
+	relays->recent[relays->recentNext].hash = hash;
+	relays->recent[relays->recentNext].received = now;
+	relays->recentNext = (relays->recentNext + 1) % RELAY_RECENT;
+	return true;
+}
+
+bool relayHeard(Relays *relays, const Frame *frame, long now) {
+	if (!relays->active)
+		return true;
+	// a relay handing a message to a node, in the name of the gateway
+	if (frame->senderID == relays->gatewayID)
+		return false;
+	RelayLink *link = &relays->direct[frame->senderID];
+	if (link->heard == 0)
+		link->rssi = frame->rssi;
+	else
+		link->rssi += (frame->rssi - link->rssi) * RELAY_RSSI_WEIGHT;
+	link->heard = now;
+	if (frame->dataLength > 0 && frame->data[0] == RELAY_MARKER)
+		return true;
+	// the frames between the nodes and their relays are only heard
+	if (frame->targetID != relays->gatewayID)
+		return true;
+	return firstCopy(relays, frame, now);
+}
+
+/* [count of the relay table] [count] then ID and RSSI of each node heard */
+static void report(Relays *relays, uint8_t relay, const uint8_t *data, uint8_t len, long now) {
+	int r = relayIndex(relays, relay);
+	if (r < 0 || len < 4 || len < 4 + 2 * data[3])
+		return;
+	relays->reports++;
+	for (int i = 0; i < data[3]; i++) {
+		RelayLink *link = &relays->heard[r][data[4 + 2 * i]];
+		link->rssi = (int8_t)data[5 + 2 * i];
+		link->heard = now;
+	}
+	// a relay started again has lost its table
+	int entries = 0;
+	for (int n = 0; n < 256; n++)
+		for (uint8_t h = relays->last[n], child = n; h != child; child = h, h = relays->last[h])
+			if (h == relay)
+				entries++;
+	if (data[2] != (entries > RELAY_TABLE_MAX ? RELAY_TABLE_MAX : entries))
+		relays->tableSent[r] = false;
+}
+
+bool relayReceive(Relays *relays, Frame *frame, long now) {
+	// unwrapped even without relays configured, a capture replayed may hold some
+	if (frame->dataLength < 2)
+		return false;
+
+	if (frame->data[1] == RELAY_REPORT) {
+		// from a relay in range of the gateway
+		if (firstCopy(relays, frame, now))
+			report(relays, frame->senderID, frame->data, frame->dataLength, now);
+		return false;
+	}
+	if (frame->data[1] != RELAY_UPLINK || frame->dataLength < RELAY_UPLINK_HEADER)
+		return false;
+
+	// the frame as the node sent it, its ACK answered by the relay
+	relays->uplinks++;
+	frame->senderID = frame->data[2];
+	frame->targetID = relays->gatewayID;
+	frame->ctl = 0;
+	frame->rssi = (int8_t)frame->data[4];
+	frame->dataLength -= RELAY_UPLINK_HEADER;
+	memmove(frame->data, frame->data + RELAY_UPLINK_HEADER, frame->dataLength);
+	if (!firstCopy(relays, frame, now))
+		return false;
+	if (frame->dataLength > 0 && frame->data[0] == RELAY_MARKER) {
+		// the report of a relay out of range
+		if (frame->dataLength >= 2 && frame->data[1] == RELAY_REPORT)
+			report(relays, frame->senderID, frame->data, frame->dataLength, now);
+		return false;
+	}
+	return true;
+}
+
+bool relayServes(Relays *relays, uint8_t node) {
+	return relays->active && relays->last[node] != node;
+}
+
+bool relaySend(Relays *relays, uint8_t node, const void *data, uint8_t len) {
+	uint8_t first = relays->route[node];
+	if (!relays->active || first == node)
+		return relays->send(node, data, len);
+	if (len + RELAY_DOWNLINK_HEADER > RF69_MAX_DATA_LEN)
+		return false;
+	uint8_t frame[RF69_MAX_DATA_LEN] = { RELAY_MARKER, RELAY_DOWNLINK, node, 0 };
+	memcpy(frame + RELAY_DOWNLINK_HEADER, data, len);
+	relays->downlinks++;
+	return relays->send(first, frame, len + RELAY_DOWNLINK_HEADER);
+}
+
+// Routes -------------------------------
+
+/* Quality of the route of a node, its weakest link: through the relay r, or direct when r is -1 */
+static float quality(Relays *relays, const float *relayQuality, int r, uint8_t node, long now) {
+	if (r < 0) {
+		RelayLink *link = &relays->direct[node];
+		return fresh(link, now) ? link->rssi : NO_ROUTE;
+	}
+	RelayLink *link = &relays->heard[r][node];
+	if (!fresh(link, now) || relayQuality[r] <= NO_ROUTE)
+		return NO_ROUTE;
+	return link->rssi < relayQuality[r] ? link->rssi : relayQuality[r];
+}
+
+/* Hops from the gateway to the node, -1 on a loop */
+static int hops(Relays *relays, const uint8_t *last, uint8_t node) {
+	int n = 0;
+	for (uint8_t h = node; last[h] != h; h = last[h])
+		if (++n > RELAY_MAX_HOPS)
+			return -1;
+	return n;
+}
+
+static void computeRoutes(Relays *relays, long now) {
+	uint8_t last[256];
+	memcpy(last, relays->last, sizeof(last));
+	float relayQuality[RELAY_MAX_RELAYS];
+	for (int r = 0; r < RELAY_MAX_RELAYS; r++)
+		relayQuality[r] = NO_ROUTE;
+
+	// one more hop on each round, from the qualities of the relays at the round before
+	for (int round = 0; round < RELAY_MAX_HOPS; round++) {
+		for (int r = 0; r < relays->count; r++) {
+			uint8_t l = last[relays->relays[r]];
+			relayQuality[r] = quality(relays, relayQuality, l == relays->relays[r] ? -1 : relayIndex(relays, l),
+				relays->relays[r], now);
+		}
+		float previous[RELAY_MAX_RELAYS];
+		memcpy(previous, relayQuality, sizeof(previous));
+
+		for (int n = 0; n < 256; n++) {
+			if (n == relays->gatewayID)
+				continue;
+			float direct = quality(relays, previous, -1, n, now);
+			int chosen = last[n] == n ? -1 : relayIndex(relays, last[n]);
+			float best = quality(relays, previous, chosen, n, now);
+			// the relay of the node does not hear it any more
+			if (best <= NO_ROUTE) {
+				chosen = -1;
+				best = direct;
+			}
+			if (direct >= RELAY_DIRECT_RSSI) {
+				chosen = -1;
+			}
+			else {
+				for (int r = 0; r < relays->count; r++) {
+					if (relays->relays[r] == n)
+						continue;
+					float q = quality(relays, previous, r, n, now);
+					if (q > best + RELAY_HYSTERESIS || (best <= NO_ROUTE && q > NO_ROUTE)) {
+						best = q;
+						chosen = r;
+					}
+				}
+			}
+			last[n] = chosen < 0 ? n : relays->relays[chosen];
+		}
+	}
+
+	for (int n = 0; n < 256; n++) {
+		if (hops(relays, last, n) < 0)
+			last[n] = n;
+		if (last[n] != relays->last[n])
+			relays->routeChanges++;
+	}
+	for (int n = 0; n < 256; n++) {
+		uint8_t h = n;
+		while (last[h] != h)
+			h = last[h];
+		relays->route[n] = h;
+	}
+
+	// the relays whose table changed
+	for (int r = 0; r < relays->count; r++) {
+		uint8_t relay = relays->relays[r];
+		for (int n = 0; n < 256 && relays->tableSent[r]; n++) {
+			bool was = false, is = false;
+			for (uint8_t h = relays->last[n], child = n; h != child; child = h, h = relays->last[h])
+				was |= h == relay;
+			for (uint8_t h = last[n], child = n; h != child; child = h, h = last[h])
+				is |= h == relay;
+			if (was != is)
+				relays->tableSent[r] = false;
+		}
+		relays->parent[r] = last[relay] == relay ? relays->gatewayID : last[relay];
+	}
+	memcpy(relays->last, last, sizeof(last));
+}
+
+/* Every node whose route goes through the relay, with the next hop */
+static bool sendTable(Relays *relays, uint8_t relay) {
+	uint8_t frame[RF69_MAX_DATA_LEN] = { RELAY_MARKER, RELAY_TABLE, 0 };
+	uint8_t count = 0;
+	for (int n = 0; n < 256 && count < RELAY_TABLE_MAX; n++) {
+		for (uint8_t h = relays->last[n], child = n; h != child; child = h, h = relays->last[h]) {
+			if (h == relay) {
+				frame[3 + 2 * count] = n;
+				frame[4 + 2 * count] = child;
+				count++;
+				break;
+			}
+		}
+	}
+	frame[2] = count;
+	relays->tablesSent++;
+	return relaySend(relays, relay, frame, 3 + 2 * count);
+}
+
+void relayPoll(Relays *relays, long now) {
+	if (!relays->active || now - relays->lastRoutes < RELAY_ROUTE_INTERVAL)
+		return;
+	relays->lastRoutes = now;
+	computeRoutes(relays, now);
+	// the relays nearest to the gateway first, the others are reached through them
+	for (int depth = 0; depth <= RELAY_MAX_HOPS; depth++)
+		for (int r = 0; r < relays->count; r++)
+			if (!relays->tableSent[r] && hops(relays, relays->last, relays->relays[r]) == depth)
+				relays->tableSent[r] = sendTable(relays, relays->relays[r]);
+}
@@ -0,0 +1,127 @@
+/*
+RFM69 Gateway routes through relay nodes
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: relay.h
+
+A node out of range of the gateway is served by a relay: a mains powered
+SensorNode built with RELAY_NODE, always listening, in promiscuous mode.
+
+ - uplink: the node sends to the gateway as usual. The relay serving it queues
+   the frame, answers the ACK in the name of the gateway, at once, and forwards
+   the frame to the gateway, wrapped with the ID of the node, the hop count and
+   the RSSI it heard the node with. A relay served by another relay is a node like
+   the others: its frames, forwarded ones included, go up the same way, the hop
+   count growing.
+   The ACK of the node cannot wait for the gateway, which is a round trip or more
+   away, so a frame the relay then fails to forward, after its retries, is lost:
+   the node takes it as delivered. With its queue full, the relay does not answer,
+   and the node sends again or keeps the reading.
+
+ - downlink: the gateway sends the message, wrapped with the ID of the node, to
+   the first relay of the route, which hands it to the next one, until the last
+   sends it to the node in the name of the gateway. Each hop has its own ACK.
+
+ - routes: every relay reports, every RELAY_REPORT_INTERVAL, the average RSSI of
+   the nodes it hears, and the gateway measures its own. A node heard by the
+   gateway at RELAY_DIRECT_RSSI or better stays direct; otherwise it goes through
+   the relay whose route is the best, the quality of a route being its weakest
+   link. A route only changes for one better by RELAY_HYSTERESIS dB. Each relay
+   gets the table of the nodes whose route goes through it, with the next hop.
+
+A frame is forwarded once by each relay, and processed once by the gateway,
+however many copies come, directly or through several relays. The firmware
+updates and the group commands are not relayed.
+
+Frames, all starting with RELAY_MARKER and the type:
+ relay -> gateway
+  U  uplink: node, hops, RSSI at the first relay, int8, then the frame of the node
+  R  report, as a frame of the relay: count, and for each node heard its ID
+     and average RSSI, int8
+ gateway -> relay
+  D  downlink: node, hops, then the frame for the node
+  T  table: count, and for each node served its ID and the next hop, the node
+     itself when the relay sends it the frames
+*/
+#ifndef RELAY_h
+#define RELAY_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "frame.h"
+
+#define RELAY_MARKER 0xFC	// a reserved node ID, see frame.h
+#define RELAY_UPLINK 'U'
+#define RELAY_REPORT 'R'
+#define RELAY_DOWNLINK 'D'
+#define RELAY_TABLE 'T'
+
+#define RELAY_UPLINK_HEADER 5	// up to the frame of the node
+#define RELAY_DOWNLINK_HEADER 4
+#define RELAY_MAX_RELAYS 8
+#define RELAY_MAX_HOPS 3
+#define RELAY_TABLE_MAX 29		// nodes in a table frame
+#define RELAY_DIRECT_RSSI -90	// dBm, a node heard better by the gateway is not relayed
+#define RELAY_HYSTERESIS 6		// dB
+#define RELAY_STALE 180000L		// ms after which a link not heard is ignored, 3 reports of RELAY_REPORT_INTERVAL
+#define RELAY_RSSI_WEIGHT 0.2	// of a new RSSI in the average of the gateway
+#define RELAY_RECENT 64			// frames remembered against the copies
+#define RELAY_DUPLICATE 2000	// ms during which a copy is dropped
+#define RELAY_ROUTE_INTERVAL 10000	// ms between two computations of the routes
+
+// send to a node in range, with ACK; true when acknowledged
+typedef bool (*RelaySend)(uint8_t node, const void *data, uint8_t len);
+
+typedef struct {
+	float rssi;		// average, in dBm
+	long heard;		// local time, in ms; 0 when never
+}
+RelayLink;
+
+typedef struct {
+	uint32_t hash;
+	long received;
+}
+RelayRecent;
+
+typedef struct {
+	uint8_t relays[RELAY_MAX_RELAYS];
+	int count;
+	bool active;
+	uint8_t gatewayID;
+	RelaySend send;
+
+	RelayLink direct[256];						// nodes heard by the gateway
+	RelayLink heard[RELAY_MAX_RELAYS][256];		// nodes heard by each relay, as reported
+	uint8_t route[256];		// relay the gateway reaches the node through, the node itself when direct
+	uint8_t last[256];		// relay sending to the node, the node itself when direct
+	uint8_t parent[RELAY_MAX_RELAYS];	// relay before each relay, the gateway ID when direct
+	bool tableSent[RELAY_MAX_RELAYS];	// the relay has its current table
+	long lastRoutes;
+	RelayRecent recent[RELAY_RECENT];
+	int recentNext;
+
+	unsigned long uplinks;		// frames forwarded by the relays
+	unsigned long duplicates;	// copies dropped
+	unsigned long downlinks;	// messages sent through a relay
+	unsigned long reports;
+	unsigned long routeChanges;
+	unsigned long tablesSent;
+}
+Relays;
+
+// the relays, as node IDs separated by commas; an empty list disables the relaying
+bool relaysOpen(Relays *relays, uint8_t gatewayID, const char *list, RelaySend send);
+// every frame received: the RSSI of its sender. False for a copy of a frame already processed
+bool relayHeard(Relays *relays, const Frame *frame, long now);
+// a frame starting with RELAY_MARKER: true when it holds, unwrapped, a frame of a node to process
+bool relayReceive(Relays *relays, Frame *frame, long now);
+// true when a relay answers the ACKs of the node, and the gateway must not
+bool relayServes(Relays *relays, uint8_t node);
+// send to the node, through its relays when it has some; true when the first hop acknowledged
+bool relaySend(Relays *relays, uint8_t node, const void *data, uint8_t len);
+// compute the routes again, and send the tables changed; blocks while sending them
+void relayPoll(Relays *relays, long now);
+
+#endif
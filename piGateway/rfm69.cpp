@@ -37,6 +37,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <string.h>
+#include <math.h>
 
 #include <unistd.h>	//usleep
 #define MICROSLEEP_LENGTH 15
@@ -54,6 +56,7 @@ volatile uint8_t RFM69::PAYLOADLEN;
 volatile uint8_t RFM69::ACK_REQUESTED;
 volatile uint8_t RFM69::ACK_RECEIVED; // should be polled immediately after sending a packet with ACK request
 volatile int16_t RFM69::RSSI;          // most accurate RSSI during reception (closest to the reception)
+volatile int16_t RFM69::FREQOFFSET;    // AFC correction read with the frame, in RF69_FSTEP
 RFM69* RFM69::selfPointer;
 
 uint16_t intCount = 0;
@@ -125,6 +128,8 @@ bool RFM69::initialize(uint8_t freqBand, uint8_t nodeID, uint8_t networkID)
   // Encryption is persistent between resets and can trip you up during debugging.
   // Disable it during initialization so we always start from a known state.
   encrypt(0);
+  readFrf();
+  _afc = false;
 
   setHighPower(_isRFM69HW); // called regardless if it's a RFM69W or RFM69HW
   setMode(RF69_MODE_STANDBY);
@@ -196,6 +201,8 @@ bool RFM69::restart(uint8_t freqBand, uint8_t nodeID, uint8_t networkID) {
   // Encryption is persistent between resets and can trip you up during debugging.
   // Disable it during initialization so we always start from a known state.
   encrypt(0);
+  readFrf();
+  _afc = false;
 
   setHighPower(_isRFM69HW); // called regardless if it's a RFM69W or RFM69HW
   setMode(RF69_MODE_STANDBY);
@@ -214,21 +221,54 @@ uint32_t RFM69::getFrequency()
 
 // set the frequency (in Hz)
 void RFM69::setFrequency(uint32_t freqHz)
+{
+  _frf = freqHz / RF69_FSTEP; // divide down by FSTEP to get FRF
+  _frfOffset = 0;
+  writeFrf(_frf);
+}
+
+// offset in RF69_FSTEP, as FREQOFFSET; nothing is written when it does not change
+void RFM69::setFrequencyOffset(int16_t offset)
+{
+  if (offset == _frfOffset)
+    return;
+  _frfOffset = offset;
+  writeFrf(_frf + offset);
+}
+
+// internal function
+void RFM69::writeFrf(uint32_t frf)
 {
   uint8_t oldMode = _mode;
   if (oldMode == RF69_MODE_TX) {
     setMode(RF69_MODE_RX);
   }
-  freqHz /= RF69_FSTEP; // divide down by FSTEP to get FRF
-  writeReg(REG_FRFMSB, freqHz >> 16);
-  writeReg(REG_FRFMID, freqHz >> 8);
-  writeReg(REG_FRFLSB, freqHz);
+  uint8_t regs[3] = { (uint8_t)(frf >> 16), (uint8_t)(frf >> 8), (uint8_t)frf };
+  writeRegs(REG_FRFMSB, regs, 3); // the new frequency is taken when FRFLSB is written
   if (oldMode == RF69_MODE_RX) {
     setMode(RF69_MODE_SYNTH);
   }
   setMode(oldMode);
 }
 
+// internal function, the frequency set by the configuration
+void RFM69::readFrf()
+{
+  uint8_t regs[3];
+  readRegs(REG_FRFMSB, regs, 3);
+  _frf = ((uint32_t)regs[0] << 16) | ((uint16_t)regs[1] << 8) | regs[2];
+  _frfOffset = 0;
+}
+
+// The AFC bandwidth is wider than RXBW, so the offset of a node is caught before the reception starts.
+// The correction is cleared at each new reception, and read with the frame into FREQOFFSET
+void RFM69::setAfc(bool onOff)
+{
+  _afc = onOff;
+  writeReg(REG_AFCBW, RF_AFCBW_DCCFREQAFC_100 | RF_AFCBW_MANTAFC_20 | (onOff ? RF_AFCBW_EXPAFC_1 : RF_AFCBW_EXPAFC_3)); // 200KHz, 50KHz the reset value
+  writeReg(REG_AFCFEI, onOff ? RF_AFCFEI_AFCAUTO_ON | RF_AFCFEI_AFCAUTOCLEAR_ON : RF_AFCFEI_AFCAUTO_OFF | RF_AFCFEI_AFCAUTOCLEAR_OFF);
+}
+
 void RFM69::setMode(uint8_t newMode)
 {
   if (newMode == _mode)
@@ -331,14 +371,97 @@ bool RFM69::sendWithRetry(uint8_t toAddress, const void* buffer, uint8_t bufferS
       if (ACKReceived(toAddress))
       {
         //Serial.print(" ~ms:"); Serial.print(millis() - sentTime);
+        linkAck(toAddress, i, millis() - sentTime);
+        linkDone(toAddress, true);
         return true;
       }
     }
+    linkTimeout(toAddress);
     //Serial.print(" RETRY#"); Serial.println(i + 1);
   }
+  linkDone(toAddress, false);
   return false;
 }
 
+// the ACK wait follows the ACK times of the node, and the retries its losses:
+// a near node gets a short wait, a far or busy one more retries
+bool RFM69::sendAdaptive(uint8_t toAddress, const void* buffer, uint8_t bufferSize) {
+  return sendWithRetry(toAddress, buffer, bufferSize, retryBudget(toAddress), ackTimeout(toAddress));
+}
+
+// RTO = SRTT + max(G, 4 * RTTVAR), doubled for each attempt lost in a row
+uint8_t RFM69::ackTimeout(uint8_t toAddress) {
+  RFM69Link *l = &_links[toAddress];
+  float rto = RF69_RTO_INITIAL;
+  if (l->srtt > 0)
+    rto = l->srtt + (4 * l->rttvar > RF69_RTO_GRANULARITY ? 4 * l->rttvar : RF69_RTO_GRANULARITY);
+  rto *= 1 << l->backoff;
+  if (rto < RF69_RTO_MIN) rto = RF69_RTO_MIN;
+  if (rto > RF69_RTO_MAX) rto = RF69_RTO_MAX;
+  return (uint8_t)(rto + 0.5);
+}
+
+// the fewest retries delivering RF69_DELIVERY_TARGET of the messages, the attempts being lost at the rate seen;
+// a node not answering at all is only probed
+uint8_t RFM69::retryBudget(uint8_t toAddress) {
+  RFM69Link *l = &_links[toAddress];
+  if (l->attempts == 0)
+    return RF69_RETRY_INITIAL;
+  if (l->lostInRow >= RF69_RETRY_PROBE)
+    return RF69_RETRY_MIN;
+  if (l->success >= RF69_DELIVERY_TARGET)
+    return RF69_RETRY_MIN;
+  if (l->success <= 0)
+    return RF69_RETRY_MAX;
+  float attempts = ceil(log(1 - RF69_DELIVERY_TARGET) / log(1 - l->success));
+  if (attempts - 1 < RF69_RETRY_MIN) return RF69_RETRY_MIN;
+  if (attempts - 1 > RF69_RETRY_MAX) return RF69_RETRY_MAX;
+  return (uint8_t)attempts - 1;
+}
+
+// SRTT and RTTVAR as RFC 6298, alpha 1/8 and beta 1/4
+void RFM69::linkAck(uint8_t nodeID, uint8_t attempt, unsigned long rtt) {
+  RFM69Link *l = &_links[nodeID];
+  if (l->attempts == 0)
+    l->success = 1;
+  l->attempts++;
+  l->success += (1 - l->success) / 8;
+  l->backoff = 0;
+  if (attempt > 0)
+    return;
+  if (l->srtt == 0) {
+    l->srtt = rtt;
+    l->rttvar = rtt / 2.0;
+  }
+  else {
+    float delta = l->srtt > rtt ? l->srtt - rtt : rtt - l->srtt;
+    l->rttvar += (delta - l->rttvar) / 4;
+    l->srtt += (rtt - l->srtt) / 8;
+  }
+}
+
+void RFM69::linkTimeout(uint8_t nodeID) {
+  RFM69Link *l = &_links[nodeID];
+  if (l->attempts == 0)
+    l->success = 1; // a new node is taken as reliable until it loses attempts
+  l->attempts++;
+  l->timeouts++;
+  l->success -= l->success / 8;
+  if (l->backoff < 3)
+    l->backoff++;
+}
+
+void RFM69::linkDone(uint8_t nodeID, bool delivered) {
+  RFM69Link *l = &_links[nodeID];
+  l->messages++;
+  if (delivered) {
+    l->delivered++;
+    l->lostInRow = 0;
+  }
+  else if (l->lostInRow < 255)
+    l->lostInRow++;
+}
+
 // should be polled immediately after sending a packet with ACK request
 bool RFM69::ACKReceived(uint8_t fromNodeID) {
   if (receiveDone())
@@ -493,6 +616,12 @@ void RFM69::interruptHandler() {
 #endif
     if (DATALEN < RF69_MAX_DATA_LEN) DATA[DATALEN] = 0; // add null at end of string
     unselect();
+    if (_afc) {
+      // still the correction of this frame, cleared when the receiver starts again
+      uint8_t afc[2];
+      readRegs(REG_AFCMSB, afc, 2);
+      FREQOFFSET = (int16_t)((afc[0] << 8) | afc[1]);
+    }
     setMode(RF69_MODE_RX);
   }
   RSSI = readRSSI();
@@ -521,6 +650,7 @@ void RFM69::receiveBegin() {
   ACK_REQUESTED = 0;
   ACK_RECEIVED = 0;
   RSSI = 0;
+  FREQOFFSET = 0;
   if (readReg(REG_IRQFLAGS2) & RF_IRQFLAGS2_PAYLOADREADY)
     writeReg(REG_PACKETCONFIG2, (readReg(REG_PACKETCONFIG2) & 0xFB) | RF_PACKET2_RXRESTART); // avoid RX deadlocks
   writeReg(REG_DIOMAPPING1, RF_DIOMAPPING1_DIO0_01); // set DIO0 to "PAYLOADREADY" in receive mode
@@ -638,6 +768,46 @@ void RFM69::writeReg(uint8_t addr, uint8_t value)
 #endif
 }
 
+// the address is incremented by the chip after each byte, up to len <= 64
+void RFM69::readRegs(uint8_t addr, uint8_t *values, uint8_t len)
+{
+#ifdef RASPBERRY
+  unsigned char thedata[65];
+  if (len > 64) len = 64;
+  thedata[0] = addr & 0x7F;
+  memset(thedata + 1, 0, len);
+
+  wiringPiSPIDataRW(SPI_DEVICE, thedata, len + 1);
+  delayMicroseconds(MICROSLEEP_LENGTH);
+  memcpy(values, thedata + 1, len);
+#else
+  select();
+  SPI.transfer(addr & 0x7F);
+  for (uint8_t i = 0; i < len; i++)
+    values[i] = SPI.transfer(0);
+  unselect();
+#endif
+}
+
+void RFM69::writeRegs(uint8_t addr, const uint8_t *values, uint8_t len)
+{
+#ifdef RASPBERRY
+  unsigned char thedata[65];
+  if (len > 64) len = 64;
+  thedata[0] = addr | 0x80;
+  memcpy(thedata + 1, values, len);
+
+  wiringPiSPIDataRW(SPI_DEVICE, thedata, len + 1);
+  delayMicroseconds(MICROSLEEP_LENGTH);
+#else
+  select();
+  SPI.transfer(addr | 0x80);
+  for (uint8_t i = 0; i < len; i++)
+    SPI.transfer(values[i]);
+  unselect();
+#endif
+}
+
 // select the RFM69 transceiver (save SPI settings, set CS low)
 void RFM69::select() {
 //  printf(" diable Int ");
@@ -33,6 +33,7 @@
 #define RFM69_h
 #ifdef RASPBERRY
 #include <stdint.h>
+#include <string.h>
 
 #define RF69_MAX_DATA_LEN     61 // to take advantage of the built in AES/CRC we want to limit the frame size to the internal FIFO size (66 bytes - 3 bytes overhead - 2 bytes crc)
 
@@ -88,6 +89,30 @@
 #define RFM69_CTL_SENDACK   0x80
 #define RFM69_CTL_REQACK    0x40
 
+// sendAdaptive(): ACK wait and retries for each destination, from its ACK times (as the TCP RTO, RFC 6298)
+#define RF69_RTO_INITIAL    40   // ms of ACK wait before an ACK time of the node is known, as sendWithRetry()
+#define RF69_RTO_MIN        10   // ms
+#define RF69_RTO_MAX        250  // ms, retryWaitTime being 8 bits
+#define RF69_RTO_GRANULARITY 2   // ms, least margin over the smoothed ACK time
+#define RF69_RETRY_INITIAL  2
+#define RF69_RETRY_MIN      1
+#define RF69_RETRY_MAX      6
+#define RF69_RETRY_PROBE    3    // messages lost in a row, after which only RF69_RETRY_MIN retries are spent on the node
+#define RF69_DELIVERY_TARGET 0.99 // share of the messages to deliver, for the retry budget
+
+typedef struct {
+  float srtt;               // smoothed ACK time, in ms, 0 until the first one
+  float rttvar;             // its mean deviation
+  float success;            // share of the attempts acknowledged, smoothed
+  uint8_t backoff;          // ACK wait doubled for each attempt lost in a row, up to 3
+  uint8_t lostInRow;        // messages lost in a row
+  unsigned long messages;   // sent with sendWithRetry() or sendAdaptive()
+  unsigned long delivered;
+  unsigned long attempts;
+  unsigned long timeouts;   // attempts without ACK in time
+}
+RFM69Link;
+
 class RFM69 {
   public:
     static volatile uint8_t DATA[RF69_MAX_DATA_LEN]; // recv/xmit buf, including header & crc bytes
@@ -98,6 +123,7 @@ class RFM69 {
     static volatile uint8_t ACK_REQUESTED;
     static volatile uint8_t ACK_RECEIVED; // should be polled immediately after sending a packet with ACK request
     static volatile int16_t RSSI; // most accurate RSSI during reception (closest to the reception)
+    static volatile int16_t FREQOFFSET; // frequency of the sender above ours, in RF69_FSTEP, from the AFC of the reception; 0 without AFC
     static volatile uint8_t _mode; // should be protected?
 
     RFM69(uint8_t slaveSelectPin=RF69_SPI_CS, uint8_t interruptPin=RF69_IRQ_PIN, bool isRFM69HW=false, uint8_t interruptNum=RF69_IRQ_NUM) {
@@ -108,25 +134,38 @@ class RFM69 {
       _promiscuousMode = false;
       _powerLevel = 31;
       _isRFM69HW = isRFM69HW;
+      _frf = 0;
+      _frfOffset = 0;
+      _afc = false;
+      memset(_links, 0, sizeof(_links));
     }
 
-    bool initialize(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
-    bool restart(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
+    virtual bool initialize(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
+    virtual bool restart(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
     void setAddress(uint8_t addr);
     void setNetwork(uint8_t networkID);
     bool canSend();
     virtual void send(uint8_t toAddress, const void* buffer, uint8_t bufferSize, bool requestACK=false);
     virtual bool sendWithRetry(uint8_t toAddress, const void* buffer, uint8_t bufferSize, uint8_t retries=2, uint8_t retryWaitTime=40); // 40ms roundtrip req for 61byte packets
+    // sendWithRetry(), with the ACK wait and the retries learnt for the destination
+    bool sendAdaptive(uint8_t toAddress, const void* buffer, uint8_t bufferSize);
+    uint8_t ackTimeout(uint8_t toAddress);
+    uint8_t retryBudget(uint8_t toAddress);
+    const RFM69Link *link(uint8_t nodeID) { return &_links[nodeID]; }
     virtual bool receiveDone();
     bool ACKReceived(uint8_t fromNodeID);
     bool ACKRequested();
     virtual void sendACK(const void* buffer = "", uint8_t bufferSize=0);
     uint32_t getFrequency();
     void setFrequency(uint32_t freqHz);
-    void encrypt(const char* key);
+    // shift the carrier from the frequency set, to meet a node whose crystal drifts; 0 to come back
+    virtual void setFrequencyOffset(int16_t offset);
+    // automatic frequency correction at the start of each reception, measuring FREQOFFSET
+    virtual void setAfc(bool onOff);
+    virtual void encrypt(const char* key);
     void setCS(uint8_t newSPISlaveSelect);
     int16_t readRSSI(bool forceTrigger=false);
-    void promiscuous(bool onOff=true);
+    virtual void promiscuous(bool onOff=true);
     virtual void setHighPower(bool onOFF=true); // has to be called after initialize() for RFM69HW
     virtual void setPowerLevel(uint8_t level); // reduce/increase transmit power level
     void sleep();
@@ -136,6 +175,9 @@ class RFM69 {
     // allow hacking registers by making these public
     uint8_t readReg(uint8_t addr);
     void writeReg(uint8_t addr, uint8_t val);
+    // burst access to len consecutive registers, in a single SPI transaction
+    void readRegs(uint8_t addr, uint8_t *values, uint8_t len);
+    void writeRegs(uint8_t addr, const uint8_t *values, uint8_t len);
     void readAllRegs();
 
   protected:
@@ -152,10 +194,20 @@ class RFM69 {
     bool _promiscuousMode;
     uint8_t _powerLevel;
     bool _isRFM69HW;
+    RFM69Link _links[256];  // by destination
+    uint32_t _frf;          // frequency set, in RF69_FSTEP
+    int16_t _frfOffset;     // shift of the carrier from _frf
+    bool _afc;
     uint8_t _SPCR;
     uint8_t _SPSR;
 
     virtual void receiveBegin();
+    void writeFrf(uint32_t frf);
+    // ACK times and losses, from sendWithRetry(); only the first attempt gives an ACK time, a late ACK can answer an earlier one
+    void linkAck(uint8_t nodeID, uint8_t attempt, unsigned long rtt);
+    void linkTimeout(uint8_t nodeID);
+    void linkDone(uint8_t nodeID, bool delivered);
+    void readFrf();
     virtual void setMode(uint8_t mode);
     virtual void setHighPowerRegs(bool onOff);
     virtual void select();
@@ -0,0 +1,118 @@
+/*
+RFM69 Gateway downlink topic router
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: router.c
+
+Subscriptions and topic matching, see router.h
+*/
+
+#include "router.h"
+#include <stdio.h>
+#include <string.h>
+
+bool routerInit(Router *r, const char *root) {
+	memset(r, 0, sizeof(*r));
+	memset(r->radios, ROUTER_NO_RADIO, sizeof(r->radios));
+	size_t length = strlen(root);
+	if (length >= ROUTER_ROOT)
+		return false;
+	memcpy(r->root, root, length + 1);
+	r->rootLength = length;
+	return true;
+}
+
+static void addSubscription(Router *r, uint8_t network, const char *rest, int qos) {
+	RouterSubscription *s = &r->subscriptions[r->subscriptionCount++];
+	memcpy(s->filter, r->root, r->rootLength);
+	snprintf(s->filter + r->rootLength, sizeof(s->filter) - r->rootLength, "/%03d/%s", network, rest);
+	s->qos = qos;
+}
+
+bool routerAddNetwork(Router *r, uint8_t network, uint8_t radio, int qosDown, int qosFota) {
+	if (r->radios[network] != ROUTER_NO_RADIO || r->subscriptionCount + 2 > ROUTER_SUBSCRIPTIONS)
+		return false;
+	r->radios[network] = radio;
+	addSubscription(r, network, "+/down/+", qosDown);
+	addSubscription(r, network, "+/fota", qosFota);
+	return true;
+}
+
+bool routerAddGroups(Router *r, uint8_t network, int qos) {
+	if (r->radios[network] == ROUTER_NO_RADIO || r->subscriptionCount + 1 > ROUTER_SUBSCRIPTIONS)
+		return false;
+	addSubscription(r, network, "group/+/down/+", qos);
+	return true;
+}
+
+/* A number from 0 to 255, ending the topic or followed by '/'; p is left on the byte after it */
+static bool readNumber(const char **p, uint8_t *value) {
+	const char *c = *p;
+	unsigned int n = 0;
+	int digits = 0;
+	while (*c >= '0' && *c <= '9') {
+		n = n * 10 + (*c++ - '0');
+		if (++digits > 3)
+			return false;
+	}
+	if (digits == 0 || n > 255 || (*c != '/' && *c != '\0'))
+		return false;
+	*value = n;
+	*p = c;
+	return true;
+}
+
+bool routerMatch(Router *r, const char *topic, Route *route) {
+	const char *p = topic + r->rootLength;
+	// the root and its '/'; strncmp stops at the end of a shorter topic
+	if (strncmp(topic, r->root, r->rootLength) != 0 || *p++ != '/')
+		goto unroutable;
+	if (!readNumber(&p, &route->network) || *p++ != '/')
+		goto unroutable;
+	route->radio = r->radios[route->network];
+	if (route->radio == ROUTER_NO_RADIO)
+		goto unroutable;
+
+	if (*p == 'g') {
+		if (strncmp(p, "group/", 6) != 0)
+			goto unroutable;
+		p += 6;
+		if (!readNumber(&p, &route->node) || strncmp(p, "/down/", 6) != 0)
+			goto unroutable;
+		p += 6;
+		if (!readNumber(&p, &route->sensor) || *p != '\0')
+			goto unroutable;
+		route->kind = ROUTE_GROUP;
+		r->routed++;
+		return true;
+	}
+
+	if (!readNumber(&p, &route->node) || *p++ != '/')
+		goto unroutable;
+
+	switch (*p) {
+	case 'd':
+		if (strncmp(p, "down/", 5) != 0)
+			goto unroutable;
+		p += 5;
+		if (!readNumber(&p, &route->sensor) || *p != '\0')
+			goto unroutable;
+		route->kind = ROUTE_DOWN;
+		break;
+	case 'f':
+		if (strcmp(p, "fota") != 0)
+			goto unroutable;
+		route->sensor = 0;
+		route->kind = ROUTE_FOTA;
+		break;
+	default:
+		goto unroutable;
+	}
+	r->routed++;
+	return true;
+
+unroutable:
+	r->unroutable++;
+	return false;
+}
@@ -0,0 +1,74 @@
+/*
+RFM69 Gateway downlink topic router
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: router.h
+
+The gateway serves one or more networks, each on one of its radios. For each
+network, it subscribes to
+	<root>/<network>/+/down/+	messages for a sensor of a node
+	<root>/<network>/+/fota		firmware images for a node
+and, when it has groups of nodes,
+	<root>/<network>/group/+/down/+	commands for a sensor of every node of a group
+
+A topic received is matched in a single pass: the root is compared at once, the
+numbers are read as they come, and the network gives its radio from a flat table
+of 256 entries; "down" and "fota" are told apart by their first byte, and a
+group by the "g" in place of the node. Nothing is allocated, and a topic which
+does not match is rejected at its first wrong byte.
+
+The numbers are decimal, from 0 to 255, with or without leading zeros.
+*/
+#ifndef ROUTER_h
+#define ROUTER_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ROUTER_ROOT 16			// bytes of the root, with its final 0
+#define ROUTER_SUBSCRIPTIONS 16	// 2 per network, and 1 for its groups
+#define ROUTER_FILTER 48		// bytes of a subscription filter
+#define ROUTER_NO_RADIO 0xFF
+
+// what the payload is, and so how it is decoded
+#define ROUTE_DOWN 1	// "<var1>,<var2>,<var3>" for a sensor, sent as a Payload
+#define ROUTE_FOTA 2	// binary firmware image
+#define ROUTE_GROUP 3	// as ROUTE_DOWN, for a group of nodes, see group.h
+
+typedef struct {
+	uint8_t kind;		// ROUTE_DOWN, ROUTE_FOTA or ROUTE_GROUP
+	uint8_t radio;		// index of the radio serving the network
+	uint8_t network;
+	uint8_t node;		// the group for ROUTE_GROUP
+	uint8_t sensor;		// ROUTE_DOWN and ROUTE_GROUP only
+}
+Route;
+
+typedef struct {
+	char filter[ROUTER_FILTER];
+	int qos;
+}
+RouterSubscription;
+
+typedef struct {
+	char root[ROUTER_ROOT];
+	uint8_t rootLength;
+	uint8_t radios[256];	// by network, ROUTER_NO_RADIO when not served
+	RouterSubscription subscriptions[ROUTER_SUBSCRIPTIONS];
+	int subscriptionCount;
+	unsigned long routed;		// topics matched
+	unsigned long unroutable;	// topics received, but not matching any network served
+}
+Router;
+
+// root without the trailing '/'
+bool routerInit(Router *r, const char *root);
+// the subscriptions of the network are added; false when they are full, or when the network is already served
+bool routerAddNetwork(Router *r, uint8_t network, uint8_t radio, int qosDown, int qosFota);
+// the subscription to the group commands of a network already added
+bool routerAddGroups(Router *r, uint8_t network, int qos);
+// false, and unroutable counted, when the topic does not match a network served
+bool routerMatch(Router *r, const char *topic, Route *route);
+
+#endif
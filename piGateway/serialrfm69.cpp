@@ -0,0 +1,496 @@
+/*
+RFM69 Gateway radio on a serial modem
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: serialrfm69.cpp
+
+The serial transport, see serialrfm69.h
+*/
+
+#include "serialrfm69.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <poll.h>
+#include <errno.h>
+#include <time.h>
+
+static long nowMillis(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static speed_t baudConstant(long baud) {
+	switch (baud) {
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	case 500000: return B500000;
+	case 921600: return B921600;
+	case 1000000: return B1000000;
+	default: return B0;
+	}
+}
+
+static uint16_t get16(const uint8_t *p) {
+	return p[0] | (uint16_t)p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* Same as _crc_ccitt_update of avr-libc, used by the modem */
+uint16_t modemCrc(uint16_t crc, uint8_t data) {
+	data ^= crc & 0xFF;
+	data ^= data << 4;
+	return (((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3);
+}
+
+int cobsEncode(const uint8_t *in, int len, uint8_t *out) {
+	int o = 1;
+	int codeAt = 0;
+	uint8_t code = 1;
+	for (int i = 0; i < len; i++) {
+		if (in[i] == 0) {
+			out[codeAt] = code;
+			codeAt = o++;
+			code = 1;
+			continue;
+		}
+		out[o++] = in[i];
+		if (++code == 0xFF) {
+			out[codeAt] = code;
+			codeAt = o++;
+			code = 1;
+		}
+	}
+	out[codeAt] = code;
+	return o;
+}
+
+int cobsDecode(uint8_t *buf, int len) {
+	int i = 0;
+	int o = 0;
+	while (i < len) {
+		uint8_t code = buf[i++];
+		if (code == 0 || i + code - 1 > len)
+			return -1;
+		for (int k = 1; k < code; k++)
+			buf[o++] = buf[i++];
+		// a zero between two blocks, none after the last one or a full block
+		if (code < 0xFF && i < len)
+			buf[o++] = 0;
+	}
+	return o;
+}
+
+SerialRFM69::SerialRFM69(const char *device, long baud) {
+	strncpy(_device, device, sizeof(_device) - 1);
+	_device[sizeof(_device) - 1] = '\0';
+	_baud = baud;
+	_fd = -1;
+	_reopenAt = 0;
+	_hello = false;
+	_configured = false;
+	_configDirty = true;
+	_freqBand = RF69_433MHZ;
+	_networkID = 1;
+	_address = 1;
+	_highPower = false;
+	_autoAck = false;
+	_encrypt = false;
+	memset(_key, 0, sizeof(_key));
+	_sent = _done = 0;
+	_sentAt = 0;
+	_lost = 0;
+	_rxLen = 0;
+	_rxOverflow = false;
+	_queueHead = _queueCount = 0;
+	memset(&_current, 0, sizeof(_current));
+	framesLost = queueLost = badPackets = commandsLost = resets = batches = batchFrames = 0;
+}
+
+bool SerialRFM69::openPort() {
+	speed_t speed = baudConstant(_baud);
+	if (speed == B0) {
+		errno = EINVAL;
+		return false;
+	}
+	_fd = open(_device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if (_fd < 0)
+		return false;
+
+	struct termios tio;
+	if (tcgetattr(_fd, &tio) != 0) {
+		closePort();
+		return false;
+	}
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cflag &= ~CRTSCTS;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	cfsetispeed(&tio, speed);
+	cfsetospeed(&tio, speed);
+	if (tcsetattr(_fd, TCSANOW, &tio) != 0) {
+		closePort();
+		return false;
+	}
+	tcflush(_fd, TCIOFLUSH);
+
+	// opening the port usually resets the Arduino, wait for its hello
+	_rxLen = 0;
+	_rxOverflow = false;
+	_hello = false;
+	_configured = false;
+	_configDirty = true;
+	_sent = _done = 0;
+	return true;
+}
+
+void SerialRFM69::closePort() {
+	if (_fd >= 0)
+		close(_fd);
+	_fd = -1;
+	_hello = false;
+	_configured = false;
+}
+
+bool SerialRFM69::initialize(uint8_t freqBand, uint8_t nodeID, uint8_t networkID) {
+	_freqBand = freqBand;
+	_address = nodeID;
+	_networkID = networkID;
+	_configDirty = true;
+	if (_fd < 0 && !openPort())
+		return false;
+
+	long start = nowMillis();
+	while (!_hello && _fd >= 0 && nowMillis() - start < MODEM_HELLO_TIMEOUT)
+		poll(50);
+	return _hello;
+}
+
+bool SerialRFM69::restart(uint8_t freqBand, uint8_t nodeID, uint8_t networkID) {
+	_freqBand = freqBand;
+	_address = nodeID;
+	_networkID = networkID;
+	// the modem initializes its radio again with the configuration
+	_configDirty = true;
+	poll(0);
+	return _fd >= 0;
+}
+
+void SerialRFM69::encrypt(const char* key) {
+	_encrypt = key != 0;
+	if (_encrypt)
+		memcpy(_key, key, sizeof(_key));
+	_configDirty = true;
+}
+
+void SerialRFM69::promiscuous(bool onOff) {
+	_promiscuousMode = onOff;
+	_configDirty = true;
+}
+
+void SerialRFM69::setHighPower(bool onOff) {
+	_highPower = onOff;
+	_configDirty = true;
+}
+
+void SerialRFM69::setAutoAck(bool onOff) {
+	_autoAck = onOff;
+	_configDirty = true;
+}
+
+/* Read what the modem sent, waiting at most timeout ms for it, and send the configuration when due */
+void SerialRFM69::poll(int timeout) {
+	long now = nowMillis();
+	if (_fd < 0) {
+		// unplugged, or not there yet
+		if (now - _reopenAt < 0 || !openPort()) {
+			if (now - _reopenAt >= 0)
+				_reopenAt = now + MODEM_REOPEN_INTERVAL;
+			if (timeout > 0)
+				usleep(timeout * 1000);
+			return;
+		}
+		resets++;
+	}
+
+	struct pollfd pfd = { _fd, POLLIN, 0 };
+	::poll(&pfd, 1, timeout);
+	bool hangup = pfd.revents & (POLLHUP | POLLERR | POLLNVAL);
+
+	uint8_t buf[512];
+	for (;;) {
+		// with VMIN and VTIME at 0, a tty reads 0 bytes when there is nothing to read
+		ssize_t n = read(_fd, buf, sizeof(buf));
+		if (n == 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
+			break;
+		if (n < 0) {
+			hangup = true;
+			break;
+		}
+		for (ssize_t i = 0; i < n; i++) {
+			if (buf[i] != 0) {
+				if (_rxLen < (int)sizeof(_rx))
+					_rx[_rxLen++] = buf[i];
+				else
+					_rxOverflow = true;
+				continue;
+			}
+			// end of a packet
+			int len = _rxOverflow ? -1 : cobsDecode(_rx, _rxLen);
+			if (len >= 3) {
+				uint16_t crc = 0xFFFF;
+				for (int k = 0; k < len - 2; k++)
+					crc = modemCrc(crc, _rx[k]);
+				if (crc == get16(_rx + len - 2))
+					packet(_rx, len - 2);
+				else
+					badPackets++;
+			}
+			else if (_rxLen > 0)
+				badPackets++;
+			_rxLen = 0;
+			_rxOverflow = false;
+		}
+	}
+	if (hangup) {
+		// unplugged
+		closePort();
+		_reopenAt = now + MODEM_REOPEN_INTERVAL;
+		return;
+	}
+
+	now = nowMillis();
+	if (_sent != _done && now - _sentAt > MODEM_COMMAND_TIMEOUT) {
+		// lost on the line, the modem never counts it
+		commandsLost += (uint8_t)(_sent - _done);
+		_sent = _done;
+	}
+	if (_configDirty && _hello && _sent == _done)
+		configure();
+}
+
+void SerialRFM69::packet(const uint8_t *p, int len) {
+	struct timeval arrival;
+	gettimeofday(&arrival, NULL);
+
+	if (p[0] == MODEM_HELLO && len >= 2) {
+		// the modem just started: nothing done, nothing lost, and no configuration
+		if (_configured)
+			resets++;
+		_hello = true;
+		_configured = false;
+		_configDirty = true;
+		_sent = _done = 0;
+		_lost = 0;
+		return;
+	}
+	if (p[0] != MODEM_FRAMES || len < MODEM_FRAMES_HEADER) {
+		badPackets++;
+		return;
+	}
+
+	_hello = true;
+	_configured = true;
+	_done = p[1];
+	// a command taken as lost, done at last
+	if ((uint8_t)(_done - _sent) < 128)
+		_sent = _done;
+	uint16_t lost = get16(p + 2);
+	framesLost += (uint16_t)(lost - _lost);
+	_lost = lost;
+	uint32_t modemNow = get32(p + 4);
+	batches++;
+
+	int off = MODEM_FRAMES_HEADER;
+	while (off < len) {
+		uint8_t dataLength = p[off];
+		if (dataLength > RF69_MAX_DATA_LEN || off + MODEM_RECORD_HEADER + dataLength > len) {
+			badPackets++;
+			break;
+		}
+		ModemFrame frame;
+		frame.dataLength = dataLength;
+		frame.senderID = p[off + 1];
+		frame.targetID = p[off + 2];
+		frame.ctl = p[off + 3];
+		frame.rssi = (int8_t)p[off + 4];
+		// the age of the frame on the modem clock, taken from the arrival of the batch
+		long age = (uint32_t)(modemNow - get32(p + off + 5));
+		long usec = arrival.tv_usec - age;
+		frame.timestamp.tv_sec = arrival.tv_sec + usec / 1000000;
+		usec %= 1000000;
+		if (usec < 0) {
+			usec += 1000000;
+			frame.timestamp.tv_sec--;
+		}
+		frame.timestamp.tv_usec = usec;
+		memcpy(frame.data, p + off + MODEM_RECORD_HEADER, dataLength);
+		push(&frame);
+		batchFrames++;
+		off += MODEM_RECORD_HEADER + dataLength;
+	}
+}
+
+void SerialRFM69::push(const ModemFrame *frame) {
+	if (_queueCount == MODEM_QUEUE) {
+		queueLost++;
+		return;
+	}
+	_queue[(_queueHead + _queueCount) % MODEM_QUEUE] = *frame;
+	_queueCount++;
+}
+
+/* Send a command, when the previous one is done */
+bool SerialRFM69::command(const uint8_t *body, int len) {
+	if (_fd < 0 || _sent != _done)
+		return false;
+
+	uint8_t raw[MODEM_MAX_PACKET];
+	uint8_t out[MODEM_MAX_PACKET + MODEM_MAX_PACKET / 254 + 2];
+	uint16_t crc = 0xFFFF;
+	for (int i = 0; i < len; i++)
+		crc = modemCrc(crc, body[i]);
+	memcpy(raw, body, len);
+	raw[len] = crc & 0xFF;
+	raw[len + 1] = crc >> 8;
+	int outLen = cobsEncode(raw, len + 2, out);
+	out[outLen++] = 0;
+
+	int written = 0;
+	while (written < outLen) {
+		ssize_t n = write(_fd, out + written, outLen - written);
+		if (n > 0) {
+			written += n;
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			closePort();
+			_reopenAt = nowMillis() + MODEM_REOPEN_INTERVAL;
+			return false;
+		}
+		struct pollfd pfd = { _fd, POLLOUT, 0 };
+		if (::poll(&pfd, 1, MODEM_COMMAND_TIMEOUT) <= 0)
+			return false;
+	}
+	_sent++;
+	_sentAt = nowMillis();
+	return true;
+}
+
+/* Wait for the modem to be done with the commands sent */
+bool SerialRFM69::waitCommand(long timeout) {
+	long start = nowMillis();
+	while (_fd >= 0 && _sent != _done) {
+		if (nowMillis() - start > timeout)
+			return false;
+		poll(5);
+	}
+	return _fd >= 0;
+}
+
+void SerialRFM69::configure() {
+	uint8_t body[5 + sizeof(_key)];
+	body[0] = MODEM_CONFIGURE;
+	body[1] = _freqBand;
+	body[2] = _address;
+	body[3] = _networkID;
+	body[4] = (_highPower ? MODEM_FLAG_HIGH_POWER : 0) | (_promiscuousMode ? MODEM_FLAG_PROMISCUOUS : 0)
+		| (_autoAck ? MODEM_FLAG_AUTO_ACK : 0) | (_encrypt ? MODEM_FLAG_ENCRYPT : 0);
+	memcpy(body + 5, _key, sizeof(_key));
+	if (command(body, sizeof(body)))
+		_configDirty = false;
+}
+
+bool SerialRFM69::transmit(uint8_t toAddress, uint8_t ctl, const void* buffer, uint8_t bufferSize) {
+	if (bufferSize > RF69_MAX_DATA_LEN)
+		bufferSize = RF69_MAX_DATA_LEN;
+	// one command at a time, the configuration first when due
+	poll(0);
+	if (!waitCommand(MODEM_COMMAND_TIMEOUT))
+		return false;
+	if (_configDirty) {
+		poll(0);
+		if (!waitCommand(MODEM_COMMAND_TIMEOUT))
+			return false;
+	}
+
+	uint8_t body[3 + RF69_MAX_DATA_LEN];
+	body[0] = MODEM_TRANSMIT;
+	body[1] = toAddress;
+	body[2] = ctl;
+	memcpy(body + 3, buffer, bufferSize);
+	return command(body, 3 + bufferSize);
+}
+
+void SerialRFM69::send(uint8_t toAddress, const void* buffer, uint8_t bufferSize, bool requestACK) {
+	transmit(toAddress, requestACK ? RFM69_CTL_REQACK : 0, buffer, bufferSize);
+}
+
+/* The ACKs come up with the other frames, which are kept for receiveDone() */
+bool SerialRFM69::sendWithRetry(uint8_t toAddress, const void* buffer, uint8_t bufferSize, uint8_t retries, uint8_t retryWaitTime) {
+	for (uint8_t i = 0; i <= retries; i++) {
+		if (!transmit(toAddress, RFM69_CTL_REQACK, buffer, bufferSize) || !waitCommand(MODEM_COMMAND_TIMEOUT))
+			return false;
+		// from the end of the transmission
+		long sentAt = nowMillis();
+		do {
+			if (takeAck(toAddress)) {
+				linkAck(toAddress, i, nowMillis() - sentAt);
+				linkDone(toAddress, true);
+				return true;
+			}
+			poll(1);
+		} while (nowMillis() - sentAt < retryWaitTime);
+		linkTimeout(toAddress);
+	}
+	linkDone(toAddress, false);
+	return false;
+}
+
+bool SerialRFM69::takeAck(uint8_t fromNodeID) {
+	for (int i = 0; i < _queueCount; i++) {
+		ModemFrame *f = &_queue[(_queueHead + i) % MODEM_QUEUE];
+		if (f->senderID != fromNodeID || !(f->ctl & RFM69_CTL_SENDACK) || f->targetID != _address)
+			continue;
+		for (int k = i + 1; k < _queueCount; k++)
+			_queue[(_queueHead + k - 1) % MODEM_QUEUE] = _queue[(_queueHead + k) % MODEM_QUEUE];
+		_queueCount--;
+		return true;
+	}
+	return false;
+}
+
+bool SerialRFM69::receiveDone() {
+	poll(0);
+	if (_queueCount == 0)
+		return false;
+	_current = _queue[_queueHead];
+	_queueHead = (_queueHead + 1) % MODEM_QUEUE;
+	_queueCount--;
+
+	memcpy((void *)DATA, _current.data, _current.dataLength);
+	DATALEN = _current.dataLength;
+	PAYLOADLEN = _current.dataLength + 3;
+	SENDERID = _current.senderID;
+	TARGETID = _current.targetID;
+	ACK_RECEIVED = (_current.ctl & RFM69_CTL_SENDACK) ? 1 : 0;
+	ACK_REQUESTED = (_current.ctl & RFM69_CTL_REQACK) ? 1 : 0;
+	RSSI = _current.rssi;
+	return true;
+}
+
+void SerialRFM69::sendACK(const void* buffer, uint8_t bufferSize) {
+	// already answered by the modem, right after the reception
+	if (_autoAck && bufferSize == 0)
+		return;
+	transmit(SENDERID, RFM69_CTL_SENDACK, buffer, bufferSize);
+}
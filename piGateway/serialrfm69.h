@@ -0,0 +1,151 @@
+/*
+RFM69 Gateway radio on a serial modem
+
+License:  CC-BY-SA, https://creativecommons.org/licenses/by-sa/2.0/
+Date:  2026/10/19
+File: serialrfm69.h
+
+An Arduino running Gateway.ino in SERIAL_MODEM mode is the radio, on a USB serial
+port, in place of the RFM69 on the SPI bus. SerialRFM69 gives the same interface
+as RFM69, so the gateway pipeline runs unchanged on top of it.
+
+The modem is a plain radio: it queues the frames received, and sends them to the
+host in batches, with their RSSI and reception time. The host sends the frames to
+transmit, and the configuration of the radio. Only the ACKs may be answered by the
+modem itself, the round trip through the host being long for a node waiting.
+
+Packets, both ways: type, body, CRC-16 (CCITT, as _crc_ccitt_update of avr-libc,
+from 0xFFFF) over type and body. Each is COBS encoded, and ends with a 0x00 byte.
+Integers are little endian.
+ modem -> host
+  H  hello, at boot and every second until configured: version
+  F  frames: commands done, uint8, frames lost, uint16, modem time, uint32 in us,
+     then for each frame: length, sender, target, CTL byte, RSSI, int8,
+     reception time, uint32 in us, and the data
+ host -> modem
+  C  configure the radio: frequency band, node ID, network ID, flags, key[16]
+  T  transmit: target, CTL byte (RFM69_CTL_REQACK or RFM69_CTL_SENDACK), data
+Flow control: the modem reads one command at a time, so the host waits for the
+count of commands done to catch up before sending the next one. A batch, possibly
+without frame, is sent as soon as a command is done.
+*/
+#ifndef SERIALRFM69_h
+#define SERIALRFM69_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include "rfm69.h"
+
+#define MODEM_VERSION 1
+#define MODEM_HELLO 'H'
+#define MODEM_FRAMES 'F'
+#define MODEM_CONFIGURE 'C'
+#define MODEM_TRANSMIT 'T'
+
+#define MODEM_FLAG_HIGH_POWER 0x01
+#define MODEM_FLAG_PROMISCUOUS 0x02
+#define MODEM_FLAG_AUTO_ACK 0x04
+#define MODEM_FLAG_ENCRYPT 0x08
+
+#define MODEM_FRAMES_HEADER 8	// type, done, lost, time
+#define MODEM_RECORD_HEADER 9	// length, sender, target, CTL, RSSI, time
+#define MODEM_MAX_PACKET 256	// decoded, CRC included
+#define MODEM_QUEUE 64			// frames received, waiting for receiveDone()
+#define MODEM_COMMAND_TIMEOUT 500	// ms for a command to be done, before it is taken as lost
+#define MODEM_HELLO_TIMEOUT 3000	// ms for the modem to answer at start
+#define MODEM_REOPEN_INTERVAL 1000	// ms between two attempts to open the port again
+
+typedef struct {
+	uint8_t dataLength;
+	uint8_t senderID;
+	uint8_t targetID;
+	uint8_t ctl;
+	int16_t rssi;
+	struct timeval timestamp;	// reception, on the host clock
+	uint8_t data[RF69_MAX_DATA_LEN];
+}
+ModemFrame;
+
+class SerialRFM69 : public RFM69 {
+  public:
+    SerialRFM69(const char *device, long baud);
+
+    bool initialize(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
+    bool restart(uint8_t freqBand, uint8_t ID, uint8_t networkID=1);
+    void encrypt(const char* key);
+    void promiscuous(bool onOff=true);
+    void setHighPower(bool onOff=true);
+    // the modem answers the ACK requests itself, sendACK() without data is then a no-op
+    void setAutoAck(bool onOff);
+    // no frequency correction on the modem, FREQOFFSET stays 0
+    void setAfc(bool onOff) {}
+    void setFrequencyOffset(int16_t offset) {}
+
+    void send(uint8_t toAddress, const void* buffer, uint8_t bufferSize, bool requestACK=false);
+    bool sendWithRetry(uint8_t toAddress, const void* buffer, uint8_t bufferSize, uint8_t retries=2, uint8_t retryWaitTime=40);
+    bool receiveDone();
+    void sendACK(const void* buffer = "", uint8_t bufferSize=0);
+
+    // reception time of the frame returned by the last receiveDone()
+    struct timeval receivedAt() { return _current.timestamp; }
+    // frames already received, waiting for receiveDone()
+    bool pending() { return _queueCount > 0; }
+
+    unsigned long framesLost;	// dropped by the modem, its queue being full
+    unsigned long queueLost;	// dropped by the host, receiveDone() not called often enough
+    unsigned long badPackets;	// CRC or framing errors on the serial line
+    unsigned long commandsLost;	// commands never done by the modem
+    unsigned long resets;		// modem restarted, or port opened again
+    unsigned long batches;		// F packets received
+    unsigned long batchFrames;	// frames in them
+
+  private:
+    bool openPort();
+    void closePort();
+    void poll(int timeout);
+    void packet(const uint8_t *p, int len);
+    bool command(const uint8_t *body, int len);
+    bool waitCommand(long timeout);
+    void configure();
+    bool transmit(uint8_t toAddress, uint8_t ctl, const void* buffer, uint8_t bufferSize);
+    bool takeAck(uint8_t fromNodeID);
+    void push(const ModemFrame *frame);
+
+    char _device[64];
+    long _baud;
+    int _fd;
+    long _reopenAt;
+    bool _hello;			// modem heard since the port was opened
+    bool _configured;		// frames received since its hello
+    bool _configDirty;		// configuration to send again
+
+    uint8_t _freqBand;
+    uint8_t _networkID;
+    bool _highPower;
+    bool _autoAck;
+    bool _encrypt;
+    char _key[16];
+
+    uint8_t _sent;			// commands sent
+    uint8_t _done;			// commands done, as told by the modem
+    long _sentAt;			// time of the last command sent
+    uint16_t _lost;			// last lost count of the modem
+
+    uint8_t _rx[MODEM_MAX_PACKET + 8];	// COBS encoded packet being received
+    int _rxLen;
+    bool _rxOverflow;
+
+    ModemFrame _queue[MODEM_QUEUE];
+    int _queueHead;
+    int _queueCount;
+    ModemFrame _current;
+};
+
+// COBS encoding of len bytes, out must hold len + len / 254 + 1 bytes; returns the encoded length, without the 0x00 delimiter
+int cobsEncode(const uint8_t *in, int len, uint8_t *out);
+// decoding in place, returns the decoded length, or -1 for an invalid packet
+int cobsDecode(uint8_t *buf, int len);
+uint16_t modemCrc(uint16_t crc, uint8_t data);
+
+#endif